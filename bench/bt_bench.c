@@ -0,0 +1,1489 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <stdint.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "bluetooth_sbc.h"
+#include "bluetooth_hfp.h"
+#include "bluetooth_common.h"
+#include "bluetooth_adv.h"
+#include "bluetooth_timerwheel.h"
+#include "bluetooth_telemetry.h"
+
+/*
+* Benchmarks for the hot paths of dbus_bt, no bluetooth hardware needed.
+*
+*   bt_bench sbc [frames]     SBC decode speed of every available kernel set
+*   bt_bench sbc-verify       check the decoder against a floating point
+*                             reference and every kernel set against the
+*                             scalar one, exits non-zero on a mismatch
+*   bt_bench hfp [links] [s]  AT commands/s, engine alone and AG/HF pairs
+*                             talking over socketpairs
+*   bt_bench hfp-verify       scripted AG/HF session over a socketpair,
+*                             exits non-zero on a mismatch
+*   bt_bench uuid [rounds]    matching a device's UUIDs against a wanted
+*                             set, strcmp loop against t_bt_uuid_set
+*   bt_bench uuid-verify      uuid parse/format/set checks, exits non-zero
+*                             on a mismatch
+*   bt_bench adv [rounds]     advertisements/s through decode_variant and
+*                             the payload parsers
+*   bt_bench adv-verify       iBeacon/Eddystone/vendor decoding checks, exits
+*                             non-zero on a mismatch
+*   bt_bench wheel [timers]   timer wheel add/move/expire cost as presence
+*                             uses it, 1k to 100k timers by default
+*   bt_bench wheel-verify     random timers against a brute force model,
+*                             exits non-zero on a mismatch
+*   bt_bench telemetry [n]    RSSI smoothing and nearest-K per tick, one
+*                             struct per device against the telemetry
+*                             arrays, 10k and 100k devices by default
+*   bt_bench telemetry-verify SIMD kernels against the scalar ones, exits
+*                             non-zero on a mismatch
+*/
+
+static const char *sbc_impls[] = { "scalar", "sse4.1", "avx2", "neon" };
+#define NUM_SBC_IMPLS (sizeof(sbc_impls) / sizeof(sbc_impls[0]))
+
+typedef struct {
+    int freq;       /* header field values */
+    int blocks;
+    int mode;
+    int allocation;
+    int subbands8;
+    int bitpool;
+} tSbcVector;
+
+/* seeded, so the streams never change */
+static const tSbcVector sbc_vectors[] = {
+    { 2, 3, SBC_MODE_JOINT_STEREO, SBC_ALLOCATION_LOUDNESS, 1, 53 },
+    { 3, 3, SBC_MODE_JOINT_STEREO, SBC_ALLOCATION_LOUDNESS, 1, 51 },
+    { 2, 3, SBC_MODE_STEREO,       SBC_ALLOCATION_SNR,      1, 35 },
+    { 2, 1, SBC_MODE_DUAL_CHANNEL, SBC_ALLOCATION_LOUDNESS, 0, 16 },
+    { 0, 0, SBC_MODE_MONO,         SBC_ALLOCATION_SNR,      0,  8 },
+    { 1, 2, SBC_MODE_MONO,         SBC_ALLOCATION_LOUDNESS, 1, 31 },
+    { 3, 3, SBC_MODE_JOINT_STEREO, SBC_ALLOCATION_SNR,      0, 64 },
+};
+#define NUM_SBC_VECTORS (sizeof(sbc_vectors) / sizeof(sbc_vectors[0]))
+static const int sbc_vector_frames = 200;
+/* how far the integer decoder may be off the floating point reference, in LSB */
+#define SBC_REF_MAX_ERROR  2
+#define SBC_REF_MAX_RMS    1.0
+
+static int sbc_impl_available(const char *impl) {
+    if (!strcmp(impl, "sse4.1")) return sbcKernelsSse41() != NULL;
+    if (!strcmp(impl, "avx2")) return sbcKernelsAvx2() != NULL;
+    if (!strcmp(impl, "neon")) return sbcKernelsNeon() != NULL;
+    return 1;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint32_t xorshift32(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static uint8_t crc8(const uint8_t *data, int bits) {
+    uint8_t crc = 0x0f;
+    int i, bit;
+
+    for (i = 0; i < bits; i++) {
+        bit = (data[i >> 3] >> (7 - (i & 7))) & 1;
+        crc = ((crc >> 7) ^ bit) & 1 ? (crc << 1) ^ 0x1d : crc << 1;
+    }
+    return crc;
+}
+
+/*
+* Random payload behind a valid header and crc. Any bit pattern is a legal
+* SBC frame, so this exercises every allocation and joint stereo path.
+*/
+static int make_sbc_frame(const tSbcVector *vec, uint32_t *seed, uint8_t *frame) {
+    tSbcFrameInfo info;
+    uint8_t crc_data[16];
+    int i, crc_bits;
+
+    frame[0] = SBC_SYNCWORD;
+    frame[1] = (vec->freq << 6) | (vec->blocks << 4) | (vec->mode << 2) |
+               (vec->allocation << 1) | vec->subbands8;
+    frame[2] = vec->bitpool;
+    if (sbcParseHeader(frame, 4, &info) < 0)
+        return -1;
+    for (i = 4; i < info.length; i++)
+        frame[i] = xorshift32(seed) >> 24;
+
+    crc_bits = (vec->mode == SBC_MODE_JOINT_STEREO ? info.subbands : 0) +
+               4 * info.subbands * info.channels;
+    crc_data[0] = frame[1];
+    crc_data[1] = frame[2];
+    memcpy(crc_data + 2, frame + 4, (crc_bits + 7) / 8);
+    frame[3] = crc8(crc_data, 16 + crc_bits);
+    return info.length;
+}
+
+/*
+* Floating point SBC decoder written from the A2DP spec, section 12.6 and
+* the decoder flow of appendix B, sharing no code or tables with
+* bluetooth_sbc.c. It is slow and only here to judge the integer decoder.
+*/
+typedef struct {
+    double v[SBC_MAX_CHANNELS][20 * SBC_MAX_SUBBANDS];
+} tSbcRef;
+
+/* first half of the prototype filter, A2DP spec tables 12.22 and 12.23 */
+static const double ref_proto_4[21] = {
+     0.00000000E+00,  5.36548976E-04,  1.49188357E-03,  2.73370904E-03,
+     3.83720193E-03,  3.89205149E-03,  1.86581691E-03, -3.06012286E-03,
+     1.09137620E-02,  2.04385087E-02,  2.88757392E-02,  3.21939290E-02,
+     2.58767811E-02,  6.13245186E-03, -2.88217274E-02, -7.76463494E-02,
+     1.35593274E-01,  1.94987841E-01,  2.46636662E-01,  2.81828203E-01,
+     2.94315332E-01
+};
+static const double ref_proto_8[41] = {
+     0.00000000E+00,  1.56575398E-04,  3.43256425E-04,  5.54620202E-04,
+     8.23919506E-04,  1.13992507E-03,  1.47640169E-03,  1.78371725E-03,
+     2.01182542E-03,  2.10371989E-03,  1.99454554E-03,  1.61656283E-03,
+     9.02154502E-04, -1.78805361E-04, -1.64973098E-03, -3.49717454E-03,
+     5.65949473E-03,  8.02941163E-03,  1.04584443E-02,  1.27472335E-02,
+     1.46525263E-02,  1.59045603E-02,  1.62208471E-02,  1.53184106E-02,
+     1.29371806E-02,  8.85757540E-03,  2.92408442E-03, -4.91578024E-03,
+    -1.46404076E-02, -2.61098752E-02, -3.90751381E-02, -5.31873032E-02,
+     6.79989431E-02,  8.29847578E-02,  9.75753918E-02,  1.11196689E-01,
+     1.23264548E-01,  1.33264415E-01,  1.40753505E-01,  1.45389847E-01,
+     1.46955068E-01
+};
+
+/* tap i of C; the smooth prototype is symmetric, C flips sign every 2M taps */
+static double ref_proto(int m, int i) {
+    const double *half = m == 4 ? ref_proto_4 : ref_proto_8;
+    int len = 10 * m;
+
+    if (i > len / 2)
+        return half[len - i] * (((len - i) / (2 * m)) & 1 ? -1 : 1) *
+               ((i / (2 * m)) & 1 ? -1 : 1);
+    return half[i];
+}
+
+static int ref_bits(const uint8_t *data, int *pos, int n) {
+    int val = 0;
+    while (n--) {
+        val = (val << 1) | ((data[*pos >> 3] >> (7 - (*pos & 7))) & 1);
+        (*pos)++;
+    }
+    return val;
+}
+
+/* appendix B bit allocation for the channels first..first+nch-1 */
+static void ref_allocate(int freq, int m, int allocation, int bitpool, int first, int nch,
+                         int sf[2][8], int bits[2][8]) {
+    static const int offset4[4][4] = {
+        { -1, 0, 0, 0 }, { -2, 0, 0, 1 }, { -2, 0, 0, 1 }, { -2, 0, 0, 1 }
+    };
+    static const int offset8[4][8] = {
+        { -2, 0, 0, 0, 0, 0, 0, 1 }, { -3, 0, 0, 0, 0, 0, 1, 2 },
+        { -4, 0, 0, 0, 0, 0, 1, 2 }, { -4, 0, 0, 0, 0, 0, 1, 2 }
+    };
+    int bitneed[2][8];
+    int ch, sb, loudness, max_bitneed = 0, bitcount = 0, slicecount = 0, bitslice;
+
+    for (ch = first; ch < first + nch; ch++) {
+        for (sb = 0; sb < m; sb++) {
+            if (allocation == SBC_ALLOCATION_SNR) {
+                bitneed[ch][sb] = sf[ch][sb];
+            } else if (sf[ch][sb] == 0) {
+                bitneed[ch][sb] = -5;
+            } else {
+                loudness = sf[ch][sb] - (m == 4 ? offset4[freq][sb] : offset8[freq][sb]);
+                bitneed[ch][sb] = loudness > 0 ? loudness / 2 : loudness;
+            }
+            if (bitneed[ch][sb] > max_bitneed)
+                max_bitneed = bitneed[ch][sb];
+        }
+    }
+    bitslice = max_bitneed + 1;
+    do {
+        bitslice--;
+        bitcount += slicecount;
+        slicecount = 0;
+        for (ch = first; ch < first + nch; ch++)
+            for (sb = 0; sb < m; sb++) {
+                if (bitneed[ch][sb] > bitslice + 1 && bitneed[ch][sb] < bitslice + 16)
+                    slicecount++;
+                else if (bitneed[ch][sb] == bitslice + 1)
+                    slicecount += 2;
+            }
+    } while (bitcount + slicecount < bitpool);
+    if (bitcount + slicecount == bitpool) {
+        bitcount += slicecount;
+        bitslice--;
+    }
+    for (ch = first; ch < first + nch; ch++)
+        for (sb = 0; sb < m; sb++)
+            bits[ch][sb] = bitneed[ch][sb] < bitslice + 2 ? 0 :
+                           bitneed[ch][sb] - bitslice < 16 ? bitneed[ch][sb] - bitslice : 16;
+
+    for (sb = 0; sb < m && bitcount < bitpool; sb++)
+        for (ch = first; ch < first + nch && bitcount < bitpool; ch++) {
+            if (bits[ch][sb] >= 2 && bits[ch][sb] < 16) {
+                bits[ch][sb]++;
+                bitcount++;
+            } else if (bitneed[ch][sb] == bitslice + 1 && bitpool > bitcount + 1) {
+                bits[ch][sb] = 2;
+                bitcount += 2;
+            }
+        }
+    for (sb = 0; sb < m && bitcount < bitpool; sb++)
+        for (ch = first; ch < first + nch && bitcount < bitpool; ch++)
+            if (bits[ch][sb] < 16) {
+                bits[ch][sb]++;
+                bitcount++;
+            }
+}
+
+/* one frame to interleaved PCM, returns the samples, all channels */
+static int ref_decode(tSbcRef *ref, const uint8_t *frame, int16_t *pcm) {
+    double sb_sample[16][2][8], u, w, x;
+    int sf[2][8], bits[2][8];
+    int freq = frame[1] >> 6, blocks = 4 * (((frame[1] >> 4) & 3) + 1);
+    int mode = (frame[1] >> 2) & 3, allocation = (frame[1] >> 1) & 1;
+    int m = frame[1] & 1 ? 8 : 4, bitpool = frame[2];
+    int channels = mode == SBC_MODE_MONO ? 1 : 2;
+    int join[8] = { 0 };
+    int pos = 32, blk, ch, sb, i, k, j, t, levels;
+
+    if (mode == SBC_MODE_JOINT_STEREO) {
+        for (sb = 0; sb < m - 1; sb++)
+            join[sb] = ref_bits(frame, &pos, 1);
+        pos++;
+    }
+    for (ch = 0; ch < channels; ch++)
+        for (sb = 0; sb < m; sb++)
+            sf[ch][sb] = ref_bits(frame, &pos, 4);
+    if (mode == SBC_MODE_STEREO || mode == SBC_MODE_JOINT_STEREO) {
+        ref_allocate(freq, m, allocation, bitpool, 0, 2, sf, bits);
+    } else {
+        for (ch = 0; ch < channels; ch++)
+            ref_allocate(freq, m, allocation, bitpool, ch, 1, sf, bits);
+    }
+
+    /* reconstruction, 12.6.4 */
+    for (blk = 0; blk < blocks; blk++)
+        for (ch = 0; ch < channels; ch++)
+            for (sb = 0; sb < m; sb++) {
+                sb_sample[blk][ch][sb] = 0;
+                if (!bits[ch][sb])
+                    continue;
+                levels = (1 << bits[ch][sb]) - 1;
+                sb_sample[blk][ch][sb] = pow(2.0, sf[ch][sb] + 1) *
+                    ((ref_bits(frame, &pos, bits[ch][sb]) * 2.0 + 1.0) / levels - 1.0);
+            }
+    for (blk = 0; blk < blocks; blk++)
+        for (sb = 0; sb < m; sb++)
+            if (join[sb]) {
+                x = sb_sample[blk][0][sb];
+                sb_sample[blk][0][sb] = x + sb_sample[blk][1][sb];
+                sb_sample[blk][1][sb] = x - sb_sample[blk][1][sb];
+            }
+
+    /* synthesis filterbank, figure 12.3 */
+    for (blk = 0; blk < blocks; blk++) {
+        for (ch = 0; ch < channels; ch++) {
+            double *v = ref->v[ch];
+            memmove(v + 2 * m, v, 18 * m * sizeof(double));
+            for (k = 0; k < 2 * m; k++) {
+                v[k] = 0;
+                for (i = 0; i < m; i++)
+                    v[k] += cos((i + 0.5) * (k + m / 2.0) * M_PI / m) * sb_sample[blk][ch][i];
+            }
+            for (j = 0; j < m; j++) {
+                x = 0;
+                for (t = 0; t < 10; t++) {
+                    /* U from V, then W = U * D with D = -M * C */
+                    i = t * m + j;
+                    u = v[(i / (2 * m)) * 4 * m + (i % (2 * m) < m ? i % (2 * m) :
+                                                   i % (2 * m) + 2 * m)];
+                    w = u * -m * ref_proto(m, i);
+                    x += w;
+                }
+                x = floor(x + 0.5);
+                pcm[(blk * m + j) * channels + ch] = x > 32767 ? 32767 : x < -32768 ? -32768 : x;
+            }
+        }
+    }
+    return blocks * m * channels;
+}
+
+/* decode the vector's stream, returns the samples decoded */
+static int run_vector(const char *impl, const tSbcVector *vec, int16_t *pcm_out) {
+    tSbcDecoder *dec = NULL;
+    tSbcRef *ref = NULL;
+    uint8_t frame[SBC_MAX_FRAME_LENGTH];
+    tSbcFrameInfo info;
+    uint32_t seed = 0x5bc5bc5b;
+    int i, len, total = 0;
+
+    if (impl ? !(dec = createSbcDecoder(impl)) : !(ref = calloc(1, sizeof(*ref))))
+        return -1;
+    for (i = 0; i < sbc_vector_frames; i++) {
+        len = make_sbc_frame(vec, &seed, frame);
+        if (len < 0) {
+            total = -1;
+            break;
+        }
+        if (ref) {
+            total += ref_decode(ref, frame, pcm_out + total);
+            continue;
+        }
+        if (sbcDecodeFrame(dec, frame, len, pcm_out + total, &info) != len) {
+            total = -1;
+            break;
+        }
+        total += info.blocks * info.subbands * info.channels;
+    }
+    if (dec) destroySbcDecoder(dec);
+    free(ref);
+    return total;
+}
+
+static int sbc_verify(void) {
+    static int16_t ref[200 * SBC_MAX_FRAME_SAMPLES], scalar[200 * SBC_MAX_FRAME_SAMPLES],
+                   got[200 * SBC_MAX_FRAME_SAMPLES];
+    double err2;
+    size_t v, i;
+    int failed = 0, samples, n, diff, max_diff;
+
+    for (v = 0; v < NUM_SBC_VECTORS; v++) {
+        samples = run_vector(NULL, &sbc_vectors[v], ref);
+        if (samples < 0 || run_vector("scalar", &sbc_vectors[v], scalar) != samples) {
+            printf("vector %zu: decode failed\n", v);
+            failed++;
+            continue;
+        }
+        for (n = 0, max_diff = 0, err2 = 0; n < samples; n++) {
+            diff = abs(scalar[n] - ref[n]);
+            if (diff > max_diff) max_diff = diff;
+            err2 += (double)diff * diff;
+        }
+        if (max_diff > SBC_REF_MAX_ERROR || sqrt(err2 / samples) > SBC_REF_MAX_RMS) {
+            printf("vector %zu: scalar off the reference\n", v);
+            failed++;
+        }
+        /* the kernels have to match the scalar code bit for bit */
+        for (i = 1; i < NUM_SBC_IMPLS; i++) {
+            if (!sbc_impl_available(sbc_impls[i]))
+                continue;
+            if (run_vector(sbc_impls[i], &sbc_vectors[v], got) != samples ||
+                memcmp(scalar, got, samples * sizeof(int16_t))) {
+                printf("vector %zu: %s differs from scalar\n", v, sbc_impls[i]);
+                failed++;
+            }
+        }
+        printf("vector %zu: max error %d, rms %.3f LSB\n", v, max_diff,
+               sqrt(err2 / samples));
+    }
+    printf("sbc-verify: %s\n", failed ? "FAILED" : "ok");
+    return failed ? 1 : 0;
+}
+
+static int sbc_bench(int frames) {
+    /* the common A2DP configuration: 44.1kHz joint stereo, 16 blocks, 8 subbands */
+    const tSbcVector *vec = &sbc_vectors[0];
+    uint8_t *stream;
+    int16_t pcm[SBC_MAX_FRAME_SAMPLES];
+    tSbcFrameInfo info;
+    tSbcDecoder *dec;
+    uint32_t seed = 1;
+    uint64_t start, ns;
+    double fps, realtime;
+    int i, len = 0, off;
+    size_t n;
+
+    stream = malloc((size_t)frames * SBC_MAX_FRAME_LENGTH);
+    if (!stream) return 1;
+    for (i = 0, off = 0; i < frames; i++) {
+        len = make_sbc_frame(vec, &seed, stream + off);
+        off += len;
+    }
+
+    for (n = 0; n < NUM_SBC_IMPLS; n++) {
+        if (!sbc_impl_available(sbc_impls[n]) ||
+            !(dec = createSbcDecoder(sbc_impls[n])))
+            continue;
+        start = now_ns();
+        for (i = 0, off = 0; i < frames; i++)
+            off += sbcDecodeFrame(dec, stream + off, len, pcm, &info);
+        ns = now_ns() - start;
+        destroySbcDecoder(dec);
+
+        fps = frames * 1e9 / ns;
+        realtime = (double)info.frequency / (info.blocks * info.subbands);
+        printf("%-8s %8.0f ns/frame %10.0f frames/s  %6.1f streams/core\n",
+               sbc_impls[n], (double)ns / frames, fps, fps / realtime);
+    }
+    free(stream);
+    return 0;
+}
+
+/************************************* hfp **************************************/
+typedef struct {
+    tHfp hfp;
+    int fd;
+    int events[HFP_EVENT_DTMF + 1];
+    tHfpEvent last;         /* number not kept */
+    char number[HFP_NUMBER_SIZE];
+    int next_volume;        /* bench: keeps one command in flight */
+    int bench;
+} tHfpPeer;
+
+static int peer_send(void *user, const char *data, size_t len) {
+    tHfpPeer *p = user;
+    ssize_t n;
+
+    while (len) {
+        n = write(p->fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void peer_event(void *user, const tHfpEvent *ev) {
+    tHfpPeer *p = user;
+
+    p->events[ev->type]++;
+    p->last = *ev;
+    if (ev->number)
+        snprintf(p->number, sizeof(p->number), "%s", ev->number);
+    if (p->bench && ev->type == HFP_EVENT_RESULT) {
+        p->next_volume = (p->next_volume + 1) % (HFP_VOLUME_MAX + 1);
+        hfpSetVolume(&p->hfp, HFP_VOLUME_SPEAKER, p->next_volume);
+    }
+}
+
+static const tHfpCallbacks peer_callbacks = { peer_send, peer_event };
+
+/* feed whatever is waiting on either side until both are quiet */
+static void hfp_pump(tHfpPeer *peers, int count) {
+    char buf[1024];
+    ssize_t n;
+    int i, busy = 1;
+
+    while (busy) {
+        busy = 0;
+        for (i = 0; i < count; i++) {
+            n = read(peers[i].fd, buf, sizeof(buf));
+            if (n > 0) {
+                hfpInput(&peers[i].hfp, buf, n);
+                busy = 1;
+            }
+        }
+    }
+}
+
+static int hfp_pair(tHfpPeer *ag, tHfpPeer *hf) {
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        return -1;
+    memset(ag, 0, sizeof(*ag));
+    memset(hf, 0, sizeof(*hf));
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    fcntl(sv[1], F_SETFL, O_NONBLOCK);
+    ag->fd = sv[0];
+    hf->fd = sv[1];
+    initHfp(&ag->hfp, HFP_ROLE_AG, 0, &peer_callbacks, ag);
+    initHfp(&hf->hfp, HFP_ROLE_HF, 0, &peer_callbacks, hf);
+    return 0;
+}
+
+#define HFP_CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("hfp-verify: line %d: %s\n", __LINE__, #cond); \
+            failed++; \
+        } \
+    } while (0)
+
+static int hfp_verify(void) {
+    tHfpPeer peers[2];
+    tHfpPeer *ag = &peers[0], *hf = &peers[1];
+    char long_line[HFP_MAX_LINE + 64];
+    int failed = 0;
+
+    if (hfp_pair(ag, hf) < 0)
+        return 1;
+
+    /* service level connection */
+    HFP_CHECK(hfpStartSlc(&hf->hfp) == 0);
+    hfp_pump(peers, 2);
+    HFP_CHECK(ag->hfp.slc == HFP_SLC_CONNECTED && hf->hfp.slc == HFP_SLC_CONNECTED);
+    HFP_CHECK(ag->events[HFP_EVENT_SLC_CONNECTED] == 1);
+    HFP_CHECK(hf->hfp.ind_count == HFP_IND_MAX);
+    HFP_CHECK(hf->hfp.ind[HFP_IND_SERVICE] == 1 && hf->hfp.ind[HFP_IND_BATTCHG] == 5);
+    HFP_CHECK(hf->hfp.remote_features == HFP_AG_DEFAULT_FEATURES);
+    HFP_CHECK(ag->hfp.clip == 1);
+
+    /* incoming call, answered by the HF */
+    HFP_CHECK(hfpIncomingCall(&ag->hfp, "5551234") == 0);
+    hfp_pump(peers, 2);
+    HFP_CHECK(hf->events[HFP_EVENT_RING] == 1);
+    HFP_CHECK(!strcmp(hf->number, "5551234"));
+    HFP_CHECK(hf->hfp.ind[HFP_IND_CALLSETUP] == HFP_CALLSETUP_INCOMING);
+    HFP_CHECK(hfpAnswer(&hf->hfp) == 0);
+    hfp_pump(peers, 2);
+    HFP_CHECK(ag->events[HFP_EVENT_ANSWER] == 1);
+    HFP_CHECK(hf->hfp.ind[HFP_IND_CALL] == 1 && hf->hfp.ind[HFP_IND_CALLSETUP] == 0);
+
+    /* volume both ways */
+    HFP_CHECK(hfpSetVolume(&ag->hfp, HFP_VOLUME_SPEAKER, 11) == 0);
+    hfp_pump(peers, 2);
+    HFP_CHECK(hf->hfp.volume[HFP_VOLUME_SPEAKER] == 11);
+    HFP_CHECK(hfpSetVolume(&hf->hfp, HFP_VOLUME_MIC, 4) == 0);
+    hfp_pump(peers, 2);
+    HFP_CHECK(ag->hfp.volume[HFP_VOLUME_MIC] == 4 && ag->last.type == HFP_EVENT_VOLUME);
+
+    /* hang up from the HF */
+    HFP_CHECK(hfpHangup(&hf->hfp) == 0);
+    hfp_pump(peers, 2);
+    HFP_CHECK(ag->events[HFP_EVENT_HANGUP] == 1);
+    HFP_CHECK(hf->hfp.ind[HFP_IND_CALL] == 0);
+
+    /* outgoing call through its setup states */
+    HFP_CHECK(hfpDial(&hf->hfp, "0800") == 0);
+    hfp_pump(peers, 2);
+    HFP_CHECK(ag->events[HFP_EVENT_DIAL] == 1 && !strcmp(ag->number, "0800"));
+    HFP_CHECK(hf->hfp.ind[HFP_IND_CALLSETUP] == HFP_CALLSETUP_OUTGOING);
+    HFP_CHECK(hfpCallAlerting(&ag->hfp) == 0);
+    hfp_pump(peers, 2);
+    HFP_CHECK(hf->hfp.ind[HFP_IND_CALLSETUP] == HFP_CALLSETUP_ALERTING);
+    HFP_CHECK(hfpCallActive(&ag->hfp) == 0);
+    hfp_pump(peers, 2);
+    HFP_CHECK(hf->hfp.ind[HFP_IND_CALL] == 1 && hf->hfp.ind[HFP_IND_CALLSETUP] == 0);
+    HFP_CHECK(hfpCallEnded(&ag->hfp) == 0);
+    hfp_pump(peers, 2);
+    HFP_CHECK(hf->hfp.ind[HFP_IND_CALL] == 0);
+    HFP_CHECK(hfpDial(&hf->hfp, NULL) == 0);
+    hfp_pump(peers, 2);
+    HFP_CHECK(ag->events[HFP_EVENT_DIAL] == 2 && !strcmp(ag->number, "0800"));
+    HFP_CHECK(hfpCallEnded(&ag->hfp) == 0);
+    hfp_pump(peers, 2);
+
+    /* indicators the HF has switched off stay quiet, call ones never do */
+    hfpInput(&ag->hfp, "AT+BIA=,,,,0\r", 13);
+    hfp_pump(peers, 2);
+    HFP_CHECK(hfpSetIndicator(&ag->hfp, HFP_IND_SIGNAL, 2) == 0);
+    HFP_CHECK(hfpSetIndicator(&ag->hfp, HFP_IND_BATTCHG, 1) == 0);
+    hfp_pump(peers, 2);
+    HFP_CHECK(hf->hfp.ind[HFP_IND_SIGNAL] == 5 && hf->hfp.ind[HFP_IND_BATTCHG] == 1);
+
+    /* commands split anywhere, unknown ones and overlong lines */
+    hf->events[HFP_EVENT_RESULT] = 0;
+    hfpInput(&ag->hfp, "AT+V", 4);
+    hfpInput(&ag->hfp, "GS=", 3);
+    hfpInput(&ag->hfp, "3\r", 2);
+    HFP_CHECK(ag->hfp.volume[HFP_VOLUME_SPEAKER] == 3);
+    memset(long_line, 'A', sizeof(long_line));
+    long_line[sizeof(long_line) - 1] = '\r';
+    hfpInput(&ag->hfp, long_line, sizeof(long_line));
+    HFP_CHECK(ag->hfp.stats.overflows == 1);
+    hfpInput(&ag->hfp, "at+xyz\r", 7);
+    hfpInput(&ag->hfp, "ATA\r", 4);
+    HFP_CHECK(ag->hfp.stats.errors == 2);
+    hfp_pump(peers, 2);
+    /* the HF wasn't waiting, but it still counts what it got */
+    HFP_CHECK(hf->events[HFP_EVENT_RESULT] == 3);
+
+    close(ag->fd);
+    close(hf->fd);
+    printf("hfp-verify: %s\n", failed ? "FAILED" : "ok");
+    return failed ? 1 : 0;
+}
+
+static int discard_send(void *user, const char *data, size_t len) {
+    return 0;
+}
+
+static int hfp_bench(int links, int seconds) {
+    static const char script[] =
+        "AT+VGS=7\rAT+VGM=9\rAT+CLCC\rAT+CIND?\rAT+VTS=5\rAT+COPS?\rAT+NREC=0\rAT+VGS=12\r";
+    static const tHfpCallbacks discard = { discard_send, NULL };
+    struct pollfd *fds;
+    tHfpPeer *peers;
+    tHfp engine;
+    uint64_t start, ns, commands = 0;
+    char buf[4096];
+    ssize_t n;
+    int i, ready, rounds = 200000;
+
+    /* the engine alone, from memory */
+    initHfp(&engine, HFP_ROLE_AG, 0, &discard, NULL);
+    start = now_ns();
+    for (i = 0; i < rounds; i++)
+        hfpInput(&engine, script, sizeof(script) - 1);
+    ns = now_ns() - start;
+    printf("engine   %8.0f ns/command %12.0f commands/s\n",
+           (double)ns / engine.stats.lines, engine.stats.lines * 1e9 / ns);
+
+    /* AG/HF pairs, one command in flight per link like real headsets */
+    peers = calloc(2 * links, sizeof(*peers));
+    fds = calloc(2 * links, sizeof(*fds));
+    if (!peers || !fds) return 1;
+    for (i = 0; i < links; i++) {
+        if (hfp_pair(&peers[2 * i], &peers[2 * i + 1]) < 0) {
+            printf("socketpair: %s\n", strerror(errno));
+            return 1;
+        }
+        peers[2 * i + 1].bench = 1;
+    }
+    for (i = 0; i < 2 * links; i++) {
+        fds[i].fd = peers[i].fd;
+        fds[i].events = POLLIN;
+    }
+    for (i = 0; i < links; i++)
+        hfpStartSlc(&peers[2 * i + 1].hfp);
+
+    start = now_ns();
+    while (now_ns() - start < (uint64_t)seconds * 1000000000ull) {
+        ready = poll(fds, 2 * links, 100);
+        for (i = 0; ready > 0 && i < 2 * links; i++) {
+            if (!fds[i].revents) continue;
+            ready--;
+            n = read(fds[i].fd, buf, sizeof(buf));
+            if (n > 0)
+                hfpInput(&peers[i].hfp, buf, n);
+        }
+    }
+    ns = now_ns() - start;
+    for (i = 0; i < links; i++) {
+        commands += peers[2 * i].hfp.stats.lines;
+        close(peers[2 * i].fd);
+        close(peers[2 * i + 1].fd);
+    }
+    printf("%-4d links %6.0f ns/command %12.0f commands/s  %8.0f per link\n",
+           links, (double)ns / commands, commands * 1e9 / ns, commands * 1e9 / ns / links);
+    free(peers);
+    free(fds);
+    return 0;
+}
+
+/* a headset's UUIDs as bluez reports them, and what a scan looks for */
+static char *uuid_device[] = {
+    "00001108-0000-1000-8000-00805f9b34fb", "0000110b-0000-1000-8000-00805f9b34fb",
+    "0000110c-0000-1000-8000-00805f9b34fb", "0000110e-0000-1000-8000-00805f9b34fb",
+    "0000111e-0000-1000-8000-00805f9b34fb", "00001131-0000-1000-8000-00805f9b34fb",
+    "00001200-0000-1000-8000-00805f9b34fb", "8e771303-3a18-4bca-9a2b-b1d5c4e3e8a2",
+};
+static const char *uuid_wanted[] = {
+    "0000110a-0000-1000-8000-00805f9b34fb", "0000111f-0000-1000-8000-00805f9b34fb",
+    "6e400001-b5a3-f393-e0a9-e50e24dcca9e", "8e771303-3a18-4bca-9a2b-b1d5c4e3e8a2",
+};
+#define NUM_UUID_DEVICE (int)(sizeof(uuid_device) / sizeof(uuid_device[0]))
+#define NUM_UUID_WANTED (int)(sizeof(uuid_wanted) / sizeof(uuid_wanted[0]))
+
+#define UUID_CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("uuid-verify: line %d: %s\n", __LINE__, #cond); \
+            failed++; \
+        } \
+    } while (0)
+
+static int uuid_verify(void) {
+    static t_bt_uuid_set set;
+    char str[BT_UUID_STR_SIZE];
+    t_bt_uuid uuid, other;
+    int i, failed = 0;
+
+    UUID_CHECK(bt_uuid_parse("0000110B-0000-1000-8000-00805F9B34FB", &uuid) == 0);
+    UUID_CHECK(bt_uuid_to16(&uuid) == BT_UUID16_A2DP_SINK);
+    bt_uuid_format(&uuid, str);
+    UUID_CHECK(!strcmp(str, "0000110b-0000-1000-8000-00805f9b34fb"));
+    UUID_CHECK(bt_uuid_parse("110b", &other) == 0 && BT_UUID_EQ(uuid, other));
+    other = bt_uuid_from16(BT_UUID16_A2DP_SINK);
+    UUID_CHECK(BT_UUID_EQ(uuid, other));
+    UUID_CHECK(bt_uuid_parse("6e400001-b5a3-f393-e0a9-e50e24dcca9e", &uuid) == 0);
+    UUID_CHECK(uuid.hi == 0x6e400001b5a3f393ULL && uuid.lo == 0xe0a9e50e24dcca9eULL);
+    UUID_CHECK(bt_uuid_to16(&uuid) == -1);
+    bt_uuid_format(&uuid, str);
+    UUID_CHECK(!strcmp(str, "6e400001-b5a3-f393-e0a9-e50e24dcca9e"));
+    /* 32 bit on the base uuid isn't a 16 bit one */
+    UUID_CHECK(bt_uuid_parse("0001110b", &uuid) == 0 && bt_uuid_to16(&uuid) == -1);
+    UUID_CHECK(bt_uuid_parse("6e400001-b5a3-f393-e0a9-e50e24dcca9", &uuid) < 0);
+    UUID_CHECK(bt_uuid_parse("6e400001xb5a3-f393-e0a9-e50e24dcca9e", &uuid) < 0);
+    UUID_CHECK(bt_uuid_parse("6e400001-b5a3-f393-e0a9-e50e24dcca9g", &uuid) < 0);
+    UUID_CHECK(bt_uuid_parse("110", &uuid) < 0 && bt_uuid_parse(NULL, &uuid) < 0);
+
+    bt_uuid_set_init(&set);
+    for (i = 0; i < NUM_UUID_WANTED; i++) {
+        bt_uuid_parse(uuid_wanted[i], &uuid);
+        UUID_CHECK(bt_uuid_set_add(&set, &uuid) == 0);
+    }
+    UUID_CHECK(set.count == NUM_UUID_WANTED && set.num_full == 2);
+    UUID_CHECK(bt_uuid_set_match(&set, uuid_device, NUM_UUID_DEVICE));
+    UUID_CHECK(!bt_uuid_set_match(&set, uuid_device, NUM_UUID_DEVICE - 1));
+    bt_uuid_parse("0000110b-0000-1000-8000-00805f9b34fb", &uuid);
+    UUID_CHECK(!bt_uuid_set_has(&set, &uuid));
+    /* fill the full uuid part, duplicates don't take room */
+    for (i = set.num_full; i < BT_UUID_SET_FULL; i++) {
+        uuid.hi = 0x1234ULL << 48 | i;
+        uuid.lo = i * 0x9e3779b97f4a7c15ULL;
+        UUID_CHECK(bt_uuid_set_add(&set, &uuid) == 0);
+    }
+    UUID_CHECK(bt_uuid_set_add(&set, &uuid) == 0);
+    uuid.lo++;
+    UUID_CHECK(bt_uuid_set_add(&set, &uuid) == -1 && !bt_uuid_set_has(&set, &uuid));
+    for (i = 2; i < BT_UUID_SET_FULL; i++) {
+        uuid.hi = 0x1234ULL << 48 | i;
+        uuid.lo = i * 0x9e3779b97f4a7c15ULL;
+        UUID_CHECK(bt_uuid_set_has(&set, &uuid));
+    }
+    other = bt_uuid_from16(0xffff);
+    UUID_CHECK(bt_uuid_set_add(&set, &other) == 0 && bt_uuid_set_has(&set, &other));
+
+    printf("uuid-verify: %s\n", failed ? "FAILED" : "ok");
+    return failed ? 1 : 0;
+}
+
+static int uuid_bench(int rounds) {
+    static t_bt_uuid_set set;
+    t_bt_uuid uuid, parsed[NUM_UUID_DEVICE];
+    uint64_t start, ns;
+    int i, j, k, hits = 0;
+
+    bt_uuid_set_init(&set);
+    for (i = 0; i < NUM_UUID_WANTED; i++) {
+        bt_uuid_parse(uuid_wanted[i], &uuid);
+        bt_uuid_set_add(&set, &uuid);
+    }
+
+    /* worst case for the loop: the hit is the last string */
+    start = now_ns();
+    for (i = 0; i < rounds; i++) {
+        for (j = 0; j < NUM_UUID_DEVICE; j++) {
+            for (k = 0; k < NUM_UUID_WANTED; k++) {
+                if (!strcasecmp(uuid_device[j], uuid_wanted[k])) break;
+            }
+            if (k < NUM_UUID_WANTED) break;
+        }
+        hits += j < NUM_UUID_DEVICE;
+        __asm__ volatile("" ::: "memory");
+    }
+    ns = now_ns() - start;
+    printf("strcmp   %8.1f ns/device\n", (double)ns / rounds);
+
+    start = now_ns();
+    for (i = 0; i < rounds; i++) {
+        hits += bt_uuid_set_match(&set, uuid_device, NUM_UUID_DEVICE);
+        __asm__ volatile("" ::: "memory");
+    }
+    ns = now_ns() - start;
+    printf("set      %8.1f ns/device (parse + lookup)\n", (double)ns / rounds);
+
+    for (j = 0; j < NUM_UUID_DEVICE; j++)
+        bt_uuid_parse(uuid_device[j], &parsed[j]);
+    start = now_ns();
+    for (i = 0; i < rounds; i++) {
+        for (j = 0; j < NUM_UUID_DEVICE; j++) {
+            if (bt_uuid_set_has(&set, &parsed[j])) break;
+        }
+        hits += j < NUM_UUID_DEVICE;
+        __asm__ volatile("" ::: "memory");
+    }
+    ns = now_ns() - start;
+    printf("lookup   %8.1f ns/device (parsed)\n", (double)ns / rounds);
+    return hits == 3 * rounds ? 0 : 1;
+}
+
+#define ADV_BENCH_NODES 64
+
+/* payloads as bluez hands them over, without the company id */
+static const uint8_t adv_ibeacon[] = {
+    0x02, 0x15, 0xf7, 0x82, 0x6d, 0xa6, 0x4f, 0xa2, 0x4e, 0x98, 0x80, 0x24,
+    0xbc, 0x5b, 0x71, 0xe0, 0x89, 0x3e, 0x12, 0x34, 0x56, 0x78, 0xc5,
+};
+static const uint8_t adv_vendor[] = { 0x01, 0x0b, 0xb8, 0x64 };
+static const uint8_t adv_eddystone_uid[] = {
+    0x00, 0xee, 0x8b, 0x0c, 0xa7, 0x50, 0xe1, 0x8c, 0xdf, 0x2b, 0x8a, 0x21,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x2a, 0x00, 0x00,
+};
+static const uint8_t adv_eddystone_url[] = {
+    0x10, 0xeb, 0x03, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 0x00, 'b', 'e', 'a', 'c', 'o', 'n',
+};
+static const uint8_t adv_eddystone_tlm[] = {
+    0x20, 0x00, 0x0b, 0xb8, 0x17, 0x80, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00, 0x27, 0x10,
+};
+
+/* a vendor sensor: version, battery mV, humidity % */
+static int parse_vendor(const uint8_t *data, size_t len, tAdvRecord *rec, void *user) {
+    if (len < 4 || data[0] != 0x01)
+        return -1;
+    rec->format = ADV_FORMAT_VENDOR;
+    memcpy(rec->u.raw, data + 1, 3);
+    return 0;
+}
+
+static void append_bytes(DBusMessageIter *dict, int key_type, const void *key,
+                         const uint8_t *data, int len) {
+    DBusMessageIter entry, variant, array;
+
+    dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+    dbus_message_iter_append_basic(&entry, key_type, key);
+    dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, "ay", &variant);
+    dbus_message_iter_open_container(&variant, DBUS_TYPE_ARRAY, "y", &array);
+    dbus_message_iter_append_fixed_array(&array, DBUS_TYPE_BYTE, &data, len);
+    dbus_message_iter_close_container(&variant, &array);
+    dbus_message_iter_close_container(&entry, &variant);
+    dbus_message_iter_close_container(dict, &entry);
+}
+
+/* a{qv} ManufacturerData then a{sv} ServiceData of a busy beacon */
+static DBusMessage * adv_message(void) {
+    static const uint16_t apple = ADV_COMPANY_APPLE, vendor = 0x0999, unknown = 0x0059;
+    static const char *eddystone = "0000feaa-0000-1000-8000-00805f9b34fb";
+    DBusMessage *msg;
+    DBusMessageIter iter, dict;
+
+    msg = dbus_message_new_signal("/org/bluez/hci0/dev_00_11_22_33_44_55",
+                                  DBUS_INTERFACE_PROPERTIES, "PropertiesChanged");
+    dbus_message_iter_init_append(msg, &iter);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{qv}", &dict);
+    append_bytes(&dict, DBUS_TYPE_UINT16, &apple, adv_ibeacon, sizeof(adv_ibeacon));
+    append_bytes(&dict, DBUS_TYPE_UINT16, &vendor, adv_vendor, sizeof(adv_vendor));
+    append_bytes(&dict, DBUS_TYPE_UINT16, &unknown, adv_vendor, sizeof(adv_vendor));
+    dbus_message_iter_close_container(&iter, &dict);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+    append_bytes(&dict, DBUS_TYPE_STRING, &eddystone, adv_eddystone_uid,
+                 sizeof(adv_eddystone_uid));
+    dbus_message_iter_close_container(&iter, &dict);
+    return msg;
+}
+
+/* decode the maps of msg, returns the records */
+static int adv_decode(DBusMessage *msg, t_variant_node *nodes, tAdvRecord *records, int max) {
+    DBusMessageIter iter;
+    int n = 0;
+
+    dbus_message_iter_init(msg, &iter);
+    do {
+        if (decode_variant(&iter, nodes, ADV_BENCH_NODES) < 0)
+            return -1;
+        n += advDecodeMap(nodes, -60, records + n, max - n);
+    } while (dbus_message_iter_next(&iter));
+    return n;
+}
+
+#define ADV_CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("adv-verify: line %d: %s\n", __LINE__, #cond); \
+            failed++; \
+        } \
+    } while (0)
+
+static int adv_verify(void) {
+    static const char *eddystone = "feaa";
+    t_variant_node nodes[ADV_BENCH_NODES];
+    tAdvRecord records[8];
+    tAdvStats stats;
+    DBusMessage *msg;
+    DBusMessageIter iter, dict;
+    uint8_t bad[sizeof(adv_ibeacon)];
+    int n, failed = 0;
+
+    ADV_CHECK(advRegisterCompanyParser(0x0999, parse_vendor, NULL) == 0);
+    msg = adv_message();
+    n = adv_decode(msg, nodes, records, 8);
+    ADV_CHECK(n == 3);
+    ADV_CHECK(records[0].format == ADV_FORMAT_IBEACON && records[0].id == ADV_COMPANY_APPLE);
+    ADV_CHECK(records[0].source == ADV_SOURCE_MANUFACTURER && records[0].rssi == -60);
+    ADV_CHECK(!memcmp(records[0].u.ibeacon.uuid, adv_ibeacon + 2, 16));
+    ADV_CHECK(records[0].u.ibeacon.major == 0x1234 && records[0].u.ibeacon.minor == 0x5678);
+    ADV_CHECK(records[0].tx_power == -59);
+    ADV_CHECK(records[1].format == ADV_FORMAT_VENDOR && records[1].id == 0x0999);
+    ADV_CHECK(records[1].tx_power == ADV_TX_POWER_NONE);
+    ADV_CHECK(records[1].u.raw[0] == 0x0b && records[1].u.raw[2] == 0x64);
+    ADV_CHECK(records[2].format == ADV_FORMAT_EDDYSTONE_UID && records[2].id == 0xfeaa);
+    ADV_CHECK(records[2].source == ADV_SOURCE_SERVICE && records[2].tx_power == -18);
+    ADV_CHECK(records[2].u.eddystone_uid.namespace_id[0] == 0x8b);
+    ADV_CHECK(records[2].u.eddystone_uid.instance_id[5] == 0x2a);
+    dbus_message_unref(msg);
+
+    /* the other Eddystone frames and a broken iBeacon, 16 bit service key */
+    memcpy(bad, adv_ibeacon, sizeof(bad));
+    bad[1] = 0x16;
+    msg = dbus_message_new_signal("/", DBUS_INTERFACE_PROPERTIES, "PropertiesChanged");
+    dbus_message_iter_init_append(msg, &iter);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+    append_bytes(&dict, DBUS_TYPE_STRING, &eddystone, adv_eddystone_url,
+                 sizeof(adv_eddystone_url));
+    append_bytes(&dict, DBUS_TYPE_STRING, &eddystone, adv_eddystone_tlm,
+                 sizeof(adv_eddystone_tlm));
+    append_bytes(&dict, DBUS_TYPE_STRING, &eddystone, adv_eddystone_tlm, 5);
+    dbus_message_iter_close_container(&iter, &dict);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{qv}", &dict);
+    {
+        static const uint16_t apple = ADV_COMPANY_APPLE;
+        append_bytes(&dict, DBUS_TYPE_UINT16, &apple, bad, sizeof(bad));
+    }
+    dbus_message_iter_close_container(&iter, &dict);
+    n = adv_decode(msg, nodes, records, 8);
+    ADV_CHECK(n == 2);
+    ADV_CHECK(records[0].format == ADV_FORMAT_EDDYSTONE_URL);
+    ADV_CHECK(!strcmp(records[0].u.eddystone_url.url, "https://example.com/beacon"));
+    ADV_CHECK(records[1].format == ADV_FORMAT_EDDYSTONE_TLM);
+    ADV_CHECK(records[1].u.eddystone_tlm.battery_mv == 3000);
+    ADV_CHECK(records[1].u.eddystone_tlm.temperature == 0x1780);
+    ADV_CHECK(records[1].u.eddystone_tlm.adv_count == 0x1000);
+    ADV_CHECK(records[1].u.eddystone_tlm.uptime_ds == 10000);
+    dbus_message_unref(msg);
+
+    /* a later registration takes over */
+    ADV_CHECK(advRegisterServiceParser("0000feaa-0000-1000-8000-00805f9b34fb",
+                                       parse_vendor, NULL) == 0);
+    msg = adv_message();
+    n = adv_decode(msg, nodes, records, 8);
+    ADV_CHECK(n == 2 && records[1].format == ADV_FORMAT_VENDOR);
+    dbus_message_unref(msg);
+
+    advStats(&stats);
+    ADV_CHECK(stats.unmatched == 2 && stats.malformed == 3);
+    printf("adv-verify: %s\n", failed ? "FAILED" : "ok");
+    return failed ? 1 : 0;
+}
+
+static int adv_bench(int rounds) {
+    t_variant_node nodes[ADV_BENCH_NODES];
+    tAdvRecord records[8];
+    DBusMessage *msg;
+    DBusMessageIter iter;
+    uint64_t start, ns, total = 0;
+    int i;
+
+    advRegisterCompanyParser(0x0999, parse_vendor, NULL);
+    msg = adv_message();
+
+    /* parsers alone, on maps already decoded */
+    dbus_message_iter_init(msg, &iter);
+    decode_variant(&iter, nodes, ADV_BENCH_NODES);
+    start = now_ns();
+    for (i = 0; i < rounds; i++) {
+        total += advDecodeMap(nodes, -60, records, 8);
+        __asm__ volatile("" ::: "memory");
+    }
+    ns = now_ns() - start;
+    printf("parsers  %8.1f ns/record %12.0f records/s\n",
+           (double)ns / total, total * 1e9 / ns);
+
+    /* what the event loop pays per PropertiesChanged, decode included */
+    total = 0;
+    start = now_ns();
+    for (i = 0; i < rounds; i++)
+        total += adv_decode(msg, nodes, records, 8);
+    ns = now_ns() - start;
+    printf("message  %8.1f ns/update %12.0f updates/s (%d records each)\n",
+           (double)ns / rounds, rounds * 1e9 / ns, (int)(total / rounds));
+    dbus_message_unref(msg);
+    return 0;
+}
+
+#define WHEEL_VERIFY_TIMERS 2000
+
+typedef struct {
+    tTimerNode node;        /* first */
+    uint64_t due;           /* model: 0 when not pending */
+    uint64_t fired_at;
+    int fired;
+} tWheelTimer;
+
+typedef struct {
+    uint64_t from, to;      /* the advance being run */
+    int bad;
+} tWheelRun;
+
+static void wheel_verify_expired(tTimerNode *node, void *user) {
+    tWheelTimer *t = (tWheelTimer *)node;
+    tWheelRun *run = (tWheelRun *)user;
+
+    /* due within this advance, and never before its tick */
+    if (!t->due || t->due > run->to || (t->due >= run->from && node->expires != t->due))
+        run->bad++;
+    t->due = 0;
+    t->fired++;
+}
+
+static int wheel_verify(void) {
+    static tTimerWheel wheel;
+    static tWheelTimer timers[WHEEL_VERIFY_TIMERS];
+    tWheelRun run;
+    uint32_t seed = 0x1234567;
+    uint64_t now = 1000, next, earliest, delay;
+    int i, j, failed = 0, pending, fired, expected;
+
+    timerWheelInit(&wheel, now);
+    memset(timers, 0, sizeof(timers));
+    memset(&run, 0, sizeof(run));
+    for (j = 0; j < 2000; j++) {
+        /* add, move and remove a few */
+        for (i = 0; i < 20; i++) {
+            tWheelTimer *t = &timers[xorshift32(&seed) % WHEEL_VERIFY_TIMERS];
+            switch (xorshift32(&seed) % 4) {
+            case 3:
+                timerWheelRemove(&wheel, &t->node);
+                t->due = 0;
+                break;
+            default:
+                /* every ring, some in the past */
+                delay = xorshift32(&seed) >> (xorshift32(&seed) % 32);
+                if (delay > TIMER_WHEEL_MAX_DELAY)
+                    delay = TIMER_WHEEL_MAX_DELAY;
+                t->due = now + delay - (xorshift32(&seed) % 8 == 0 ? 3 : 0);
+                timerWheelAdd(&wheel, &t->node, t->due);
+                if (t->due < now)
+                    t->due = now;
+                break;
+            }
+        }
+        earliest = UINT64_MAX;
+        pending = expected = 0;
+        for (i = 0; i < WHEEL_VERIFY_TIMERS; i++) {
+            if (!timers[i].due) continue;
+            pending++;
+            if (timers[i].due < earliest) earliest = timers[i].due;
+        }
+        if (pending != wheel.count || timerWheelPending(&timers[0].node) != (timers[0].due != 0)) {
+            printf("wheel-verify: %d pending, wheel has %d\n", pending, wheel.count);
+            failed++;
+        }
+        next = timerWheelNextTick(&wheel);
+        if (next > earliest || (pending && next < now) || (!pending && next != UINT64_MAX)) {
+            printf("wheel-verify: next tick %llu, earliest %llu\n",
+                   (unsigned long long)next, (unsigned long long)earliest);
+            failed++;
+        }
+
+        /* small steps mostly, sometimes far */
+        delay = xorshift32(&seed) % 16 == 0 ? xorshift32(&seed) % 300000 : xorshift32(&seed) % 100;
+        for (i = 0; i < WHEEL_VERIFY_TIMERS; i++)
+            expected += timers[i].due && timers[i].due <= now + delay;
+        run.from = now;
+        run.to = now + delay;
+        fired = timerWheelAdvance(&wheel, now + delay, wheel_verify_expired, &run);
+        if (fired != expected) {
+            printf("wheel-verify: %d fired, %d due up to %llu\n", fired, expected,
+                   (unsigned long long)(now + delay));
+            failed++;
+        }
+        for (i = 0; i < WHEEL_VERIFY_TIMERS; i++) {
+            if (timers[i].due && timers[i].due <= now + delay) {
+                printf("wheel-verify: timer %d due %llu did not fire\n", i,
+                       (unsigned long long)timers[i].due);
+                failed++;
+                break;
+            }
+        }
+        now += delay + 1;
+    }
+    if (run.bad) {
+        printf("wheel-verify: %d timers fired off their tick\n", run.bad);
+        failed++;
+    }
+
+    printf("wheel-verify: %s\n", failed ? "FAILED" : "ok");
+    return failed ? 1 : 0;
+}
+
+typedef struct {
+    uint64_t *last_seen;
+    tTimerWheel *wheel;
+    tWheelTimer *timers;
+    uint64_t now;
+    uint64_t timeout;
+    uint64_t lost;
+} tWheelSim;
+
+static void wheel_bench_expired(tTimerNode *node, void *user) {
+    tWheelSim *sim = (tWheelSim *)user;
+    int i = (tWheelTimer *)node - sim->timers;
+
+    /* lazy: a device seen since goes back at last seen + timeout */
+    if (sim->now - sim->last_seen[i] < sim->timeout) {
+        timerWheelAdd(sim->wheel, node, sim->last_seen[i] + sim->timeout);
+    } else {
+        sim->lost++;
+        sim->last_seen[i] = sim->now;
+        timerWheelAdd(sim->wheel, node, sim->now + sim->timeout);
+    }
+}
+
+/* presence at PRESENCE_TICK_MS: 100 ticks timeout, every device seen about once a second */
+static void wheel_bench_size(int count) {
+    static tTimerWheel wheel;
+    tWheelTimer *timers = malloc(count * sizeof(*timers));
+    uint64_t *last_seen = malloc(count * sizeof(*last_seen));
+    tWheelSim sim = { last_seen, &wheel, timers, 0, 100, 0 };
+    uint32_t seed = 0x9e3779b9;
+    uint64_t start, add_ns, move_ns, tick_ns, sightings = 0;
+    int i, t, ticks = 600;
+
+    /* touched up front, page faults aren't the wheel's */
+    memset(timers, 0, count * sizeof(*timers));
+    memset(last_seen, 0, count * sizeof(*last_seen));
+    timerWheelInit(&wheel, 0);
+    start = now_ns();
+    for (i = 0; i < count; i++)
+        timerWheelAdd(&wheel, &timers[i].node, sim.timeout + (i & 63));
+    add_ns = now_ns() - start;
+
+    start = now_ns();
+    for (i = 0; i < count; i++)
+        timerWheelAdd(&wheel, &timers[i].node, sim.timeout + (xorshift32(&seed) & 1023));
+    move_ns = now_ns() - start;
+
+    /* re-seed the wheel the way presence does */
+    for (i = 0; i < count; i++)
+        timerWheelAdd(&wheel, &timers[i].node, sim.timeout + (i % sim.timeout));
+    start = now_ns();
+    for (t = 0; t < ticks; t++) {
+        sim.now = t;
+        /* a tenth of the devices are heard each tick, one in a hundred not at all */
+        for (i = xorshift32(&seed) % 10; i < count; i += 10) {
+            if (i % 100 == 99) continue;
+            last_seen[i] = t;
+            sightings++;
+        }
+        timerWheelAdvance(&wheel, t, wheel_bench_expired, &sim);
+    }
+    tick_ns = now_ns() - start;
+
+    printf("%7d timers: add %5.1f ns  move %5.1f ns  sighting+expiry %5.1f ns/sighting "
+           "(%llu lost)\n", count, (double)add_ns / count, (double)move_ns / count,
+           (double)tick_ns / sightings, (unsigned long long)sim.lost);
+    free(timers);
+    free(last_seen);
+}
+
+static int wheel_bench(int timers) {
+    int sizes[] = { 1000, 10000, 100000 }, i;
+
+    if (timers > 0) {
+        wheel_bench_size(timers);
+        return 0;
+    }
+    for (i = 0; i < 3; i++)
+        wheel_bench_size(sizes[i]);
+    return 0;
+}
+
+static const tTelemetryKernels * telemetry_kernels(int i) {
+    switch (i) {
+    case 0: return &telemetry_kernels_scalar;
+    case 1: return telemetryKernelsAvx2();
+    case 2: return telemetryKernelsNeon();
+    }
+    return NULL;
+}
+#define NUM_TELEMETRY_KERNELS 3
+
+typedef struct {
+    float *raw, *pending, *ema, *x, *p;
+} tTelemetryArrays;
+
+static int telemetry_alloc(tTelemetryArrays *a, int n) {
+    float **f[] = { &a->raw, &a->pending, &a->ema, &a->x, &a->p };
+    int i;
+
+    for (i = 0; i < 5; i++) {
+        if (posix_memalign((void **)f[i], 32, n * sizeof(float)))
+            return -1;
+    }
+    return 0;
+}
+
+static void telemetry_free(tTelemetryArrays *a) {
+    free(a->raw);
+    free(a->pending);
+    free(a->ema);
+    free(a->x);
+    free(a->p);
+}
+
+static void telemetry_copy(tTelemetryArrays *to, const tTelemetryArrays *from, int n) {
+    memcpy(to->raw, from->raw, n * sizeof(float));
+    memcpy(to->pending, from->pending, n * sizeof(float));
+    memcpy(to->ema, from->ema, n * sizeof(float));
+    memcpy(to->x, from->x, n * sizeof(float));
+    memcpy(to->p, from->p, n * sizeof(float));
+}
+
+/* a sample for about a third of the devices */
+static void telemetry_samples(tTelemetryArrays *a, int n, uint32_t *seed) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (xorshift32(seed) % 3)
+            continue;
+        a->raw[i] = -40.0f - (float)(xorshift32(seed) % 600) / 10.0f;
+        a->pending[i] = 1.0f;
+    }
+}
+
+static void telemetry_init(tTelemetryArrays *a, int n, uint32_t *seed) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+        /* distinct, so the nearest are well defined */
+        a->raw[i] = a->ema[i] = a->x[i] = -40.0f - (float)i * (60.0f / n) -
+                                          (float)(xorshift32(seed) % 1000) * 1e-6f;
+        a->p[i] = TELEMETRY_DEFAULT_R;
+        a->pending[i] = 0.0f;
+    }
+    /* shuffled */
+    for (i = n - 1; i > 0; i--) {
+        int j = xorshift32(seed) % (i + 1);
+        float t = a->x[i];
+        a->x[i] = a->x[j];
+        a->x[j] = t;
+    }
+}
+
+static int telemetry_verify(void) {
+    const tTelemetryParams params = { TELEMETRY_DEFAULT_ALPHA, TELEMETRY_DEFAULT_Q,
+                                      TELEMETRY_DEFAULT_R };
+    const int sizes[] = { 0, 5, 64, 1001, 10007 }, ks[] = { 1, 8, 64 };
+    const tTelemetryKernels *k;
+    tTelemetryArrays ref, got;
+    int ref_out[TELEMETRY_MAX_NEAREST], out[TELEMETRY_MAX_NEAREST];
+    uint32_t seed, seed2;
+    int failed = 0, s, i, j, t, n, c, m;
+    float x, p;
+
+    for (s = 0; s < 5; s++) {
+        n = sizes[s];
+        if (telemetry_alloc(&ref, n + 1) || telemetry_alloc(&got, n + 1))
+            return 1;
+        for (i = 1; i < NUM_TELEMETRY_KERNELS; i++) {
+            if (!(k = telemetry_kernels(i)))
+                continue;
+            seed = 0x2468ace;
+            telemetry_init(&ref, n, &seed);
+            telemetry_copy(&got, &ref, n);
+            for (t = 0; t < 20; t++) {
+                seed2 = seed;
+                telemetry_samples(&ref, n, &seed);
+                telemetry_samples(&got, n, &seed2);
+                telemetry_kernels_scalar.smooth(ref.raw, ref.pending, ref.ema, ref.x, ref.p,
+                                                n, &params);
+                k->smooth(got.raw, got.pending, got.ema, got.x, got.p, n, &params);
+            }
+            for (j = 0; j < n; j++) {
+                if (fabsf(ref.ema[j] - got.ema[j]) > 1e-3f ||
+                    fabsf(ref.x[j] - got.x[j]) > 1e-3f ||
+                    fabsf(ref.p[j] - got.p[j]) > 1e-3f || got.pending[j] != 0.0f) {
+                    printf("telemetry-verify: %s smooth differs at %d/%d\n", k->name, j, n);
+                    failed++;
+                    break;
+                }
+            }
+            for (j = 0; j < 3; j++) {
+                c = telemetry_kernels_scalar.select(ref.x, n, ks[j], ref_out);
+                m = k->select(ref.x, n, ks[j], out);
+                if (c != m || c != (n < ks[j] ? n : ks[j]) ||
+                    memcmp(ref_out, out, c * sizeof(int))) {
+                    printf("telemetry-verify: %s select k=%d differs on %d\n", k->name, ks[j], n);
+                    failed++;
+                }
+            }
+        }
+        /* largest first, and nothing outside beats the last */
+        c = telemetry_kernels_scalar.select(ref.x, n, 8, ref_out);
+        for (j = 1; j < c; j++)
+            failed += ref.x[ref_out[j]] > ref.x[ref_out[j - 1]];
+        for (j = 0; j < n && c == 8; j++) {
+            for (i = 0; i < c && ref_out[i] != j; i++);
+            if (i == c && ref.x[j] > ref.x[ref_out[c - 1]]) {
+                printf("telemetry-verify: select missed %d of %d\n", j, n);
+                failed++;
+                break;
+            }
+        }
+        telemetry_free(&ref);
+        telemetry_free(&got);
+    }
+
+    /* the filter settles on a steady signal under +-3 dB of noise */
+    x = -90.0f;
+    p = TELEMETRY_DEFAULT_R;
+    seed = 7;
+    for (t = 0; t < 200; t++) {
+        float raw = -60.0f + (float)((int)(xorshift32(&seed) % 61) - 30) / 10.0f, one = 1.0f, e = x;
+        telemetry_kernels_scalar.smooth(&raw, &one, &e, &x, &p, 1, &params);
+    }
+    if (fabsf(x + 60.0f) > 1.5f) {
+        printf("telemetry-verify: kalman settled at %.2f\n", x);
+        failed++;
+    }
+
+    printf("telemetry-verify: %s\n", failed ? "FAILED" : "ok");
+    return failed ? 1 : 0;
+}
+
+/* what the table replaces: one allocation per device, reached through pointers */
+typedef struct {
+    char path[64];
+    int16_t rssi;
+    int fresh;
+    float ema, x, p;
+    uint64_t seen_us;
+} tTelemetryDeviceStruct;
+
+static void telemetry_bench_size(int n) {
+    const tTelemetryParams params = { TELEMETRY_DEFAULT_ALPHA, TELEMETRY_DEFAULT_Q,
+                                      TELEMETRY_DEFAULT_R };
+    tTelemetryDeviceStruct **devs = malloc(n * sizeof(*devs)), *d;
+    tTelemetryArrays a;
+    const tTelemetryKernels *k;
+    int out[TELEMETRY_MAX_NEAREST], i, j, t, ticks = 200, best;
+    uint32_t seed = 0x13579bdf;
+    uint64_t start, ns;
+    float pp, g;
+
+    if (!devs || telemetry_alloc(&a, n))
+        return;
+    telemetry_init(&a, n, &seed);
+    /* scattered, the way a hash of mallocs ends up */
+    for (i = 0; i < n; i++) {
+        devs[i] = malloc(sizeof(**devs) + (xorshift32(&seed) % 8) * 64);
+        memset(devs[i], 0, sizeof(**devs));
+        devs[i]->x = devs[i]->ema = a.x[i];
+        devs[i]->p = a.p[i];
+    }
+    for (i = n - 1; i > 0; i--) {
+        j = xorshift32(&seed) % (i + 1);
+        d = devs[i]; devs[i] = devs[j]; devs[j] = d;
+    }
+
+    start = now_ns();
+    for (t = 0; t < ticks; t++) {
+        for (i = 0; i < n; i += 3) {
+            devs[i]->rssi = -40 - (int)(xorshift32(&seed) % 60);
+            devs[i]->fresh = 1;
+        }
+        for (i = 0; i < n; i++) {
+            d = devs[i];
+            pp = d->p + params.q;
+            if (d->fresh) {
+                d->ema += params.alpha * (d->rssi - d->ema);
+                g = pp / (pp + params.r);
+                d->x += g * (d->rssi - d->x);
+                pp -= g * pp;
+                d->fresh = 0;
+            }
+            d->p = pp;
+        }
+        best = 0;
+        for (i = 1; i < n; i++)
+            best = devs[i]->x > devs[best]->x ? i : best;
+        __asm__ volatile("" :: "r"(best) : "memory");
+    }
+    ns = now_ns() - start;
+    printf("%7d devices  structs  %8.1f us/tick (smooth + nearest-1)\n", n, ns / 1e3 / ticks);
+
+    for (j = 0; j < NUM_TELEMETRY_KERNELS; j++) {
+        if (!(k = telemetry_kernels(j)))
+            continue;
+        start = now_ns();
+        for (t = 0; t < ticks; t++) {
+            for (i = 0; i < n; i += 3) {
+                a.raw[i] = -40 - (int)(xorshift32(&seed) % 60);
+                a.pending[i] = 1.0f;
+            }
+            k->smooth(a.raw, a.pending, a.ema, a.x, a.p, n, &params);
+            k->select(a.x, n, 1, out);
+        }
+        ns = now_ns() - start;
+        printf("%7d devices  %-7s  %8.1f us/tick (smooth + nearest-1)", n, k->name,
+               ns / 1e3 / ticks);
+
+        start = now_ns();
+        for (t = 0; t < ticks; t++)
+            k->smooth(a.raw, a.pending, a.ema, a.x, a.p, n, &params);
+        ns = now_ns() - start;
+        printf("  smooth %5.2f ns/device", (double)ns / ticks / n);
+
+        start = now_ns();
+        for (t = 0; t < ticks; t++)
+            k->select(a.x, n, 16, out);
+        ns = now_ns() - start;
+        printf("  nearest-16 %5.2f ns/device\n", (double)ns / ticks / n);
+    }
+
+    for (i = 0; i < n; i++)
+        free(devs[i]);
+    free(devs);
+    telemetry_free(&a);
+}
+
+static int telemetry_bench(int devices) {
+    if (devices > 0) {
+        telemetry_bench_size(devices);
+        return 0;
+    }
+    telemetry_bench_size(10000);
+    telemetry_bench_size(100000);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    printf("usage: %s sbc [frames] | sbc-verify | hfp [links] [seconds] | hfp-verify |\n"
+           "       uuid [rounds] | uuid-verify | adv [rounds] | adv-verify |\n"
+           "       wheel [timers] | wheel-verify | telemetry [devices] | telemetry-verify\n",
+           prog);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (!strcmp(argv[1], "sbc"))
+        return sbc_bench(argc > 2 ? atoi(argv[2]) : 20000);
+    if (!strcmp(argv[1], "sbc-verify"))
+        return sbc_verify();
+    if (!strcmp(argv[1], "hfp"))
+        return hfp_bench(argc > 2 ? atoi(argv[2]) : 64, argc > 3 ? atoi(argv[3]) : 3);
+    if (!strcmp(argv[1], "hfp-verify"))
+        return hfp_verify();
+    if (!strcmp(argv[1], "uuid"))
+        return uuid_bench(argc > 2 ? atoi(argv[2]) : 1000000);
+    if (!strcmp(argv[1], "uuid-verify"))
+        return uuid_verify();
+    if (!strcmp(argv[1], "adv"))
+        return adv_bench(argc > 2 ? atoi(argv[2]) : 1000000);
+    if (!strcmp(argv[1], "adv-verify"))
+        return adv_verify();
+    if (!strcmp(argv[1], "wheel"))
+        return wheel_bench(argc > 2 ? atoi(argv[2]) : 0);
+    if (!strcmp(argv[1], "wheel-verify"))
+        return wheel_verify();
+    if (!strcmp(argv[1], "telemetry"))
+        return telemetry_bench(argc > 2 ? atoi(argv[2]) : 0);
+    if (!strcmp(argv[1], "telemetry-verify"))
+        return telemetry_verify();
+    usage(argv[0]);
+    return 2;
+}
@@ -0,0 +1,769 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/errqueue.h>
+#include <linux/io_uring.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/rfcomm.h>
+#include <bluetooth/l2cap.h>
+
+#include "bluetooth_common.h"
+
+/*
+* Data plane benchmark for profile links, the same numbers for a real
+* RFCOMM/L2CAP connection and for local stand-ins.
+*
+* The client keeps `depth` messages of `size` bytes in flight; the peer
+* echoes them and each message carries its sequence number and send time,
+* so a round trip gives one latency sample. Every I/O method runs on a
+* fresh connection:
+*
+*   rw        read()/write() per message
+*   vec       writev() of everything queued, readv() into a few buffers
+*   zerocopy  sendmsg(MSG_ZEROCOPY), completions reaped from the error queue
+*   uring     io_uring READV/WRITEV, one of each in flight
+*
+*   bt_link [-s size] [-d depth] [-T seconds] [-m method|all] [target]
+*   bt_link -l rfcomm:CHANNEL | l2cap:PSM      echo server for a remote run
+*
+* target is socketpair (default), tcp (loopback), rfcomm:ADDR[:CHANNEL]
+* (channel from SDP for -u uuid16, default SPP) or l2cap:ADDR:PSM. With a
+* local stand-in the echo runs on a thread of this process; cpu/byte only
+* counts the sending thread, work io_uring hands to kernel workers is not
+* in it. A remote profile link (connectProfile/addProfile) is measured by
+* running the echo server on the peer.
+*/
+
+#define LINK_MAX_DEPTH      1024
+#define LINK_RX_BUFS        4
+#define LINK_RX_BUF_SIZE    16384
+#define LINK_DRAIN_NS       2000000000ull
+#define SPP_UUID16          0x1101
+
+#define HIST_SUB            32
+#define HIST_SIZE           (60 * HIST_SUB)
+
+#define METHOD_RW           0
+#define METHOD_VEC          1
+#define METHOD_ZEROCOPY     2
+#define METHOD_URING        3
+#define METHOD_MAX          4
+
+static const char *method_names[METHOD_MAX] = { "rw", "vec", "zerocopy", "uring" };
+
+typedef struct {
+    uint64_t seq;
+    uint64_t sent_ns;
+} tMsgHeader;
+
+typedef struct {
+    const char *target;
+    uint16_t uuid;
+    size_t size;
+    int depth;
+    int seconds;
+} tLinkConfig;
+
+typedef struct {
+    int fd;
+    int local;          /* echo runs in this process */
+    pthread_t echo;
+    int echo_fd;
+    int listen_fd;
+} tLink;
+
+typedef struct {
+    int fd;
+    size_t size;
+    int depth;
+    uint8_t *slots;     /* depth messages, seq % depth */
+    /* tx: seq tx_seq..next_seq-1 are queued, tx_off into the first */
+    uint64_t next_seq;
+    uint64_t tx_seq;
+    size_t tx_off;
+    /* rx: messages complete in order */
+    uint64_t rx_seq;
+    size_t rx_off;
+    tMsgHeader rx_hdr;
+    uint64_t out_of_order;
+    /* zerocopy: 1 + id of the last send touching a slot, completions so far */
+    int method_zc;
+    uint32_t *slot_zc;
+    uint32_t zc_next;
+    uint32_t zc_done;
+    uint64_t zc_copied;
+    uint64_t hist[HIST_SIZE];
+    uint64_t samples;
+} tLinkRun;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* the calling thread only, a local echo thread is not ours to count */
+static uint64_t cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/************************************ histogram *********************************/
+/* log-linear, 32 steps per power of two, about 3% resolution */
+static int hist_index(uint64_t v) {
+    int msb;
+
+    if (v < HIST_SUB) return v;
+    msb = 63 - __builtin_clzll(v);
+    return (msb - 4) * HIST_SUB + ((v >> (msb - 5)) & (HIST_SUB - 1));
+}
+
+static uint64_t hist_value(int index) {
+    int msb = index / HIST_SUB + 4;
+
+    if (index < HIST_SUB) return index;
+    return (uint64_t)(HIST_SUB + index % HIST_SUB) << (msb - 5);
+}
+
+static uint64_t hist_percentile(const tLinkRun *r, double p) {
+    uint64_t want = (uint64_t)(r->samples * p), seen = 0;
+    int i;
+
+    for (i = 0; i < HIST_SIZE; i++) {
+        seen += r->hist[i];
+        if (seen > want) return hist_value(i);
+    }
+    return 0;
+}
+
+/************************************** echo ************************************/
+static int write_all(int fd, const uint8_t *data, size_t len) {
+    ssize_t n;
+
+    while (len) {
+        n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void echo_loop(int fd) {
+    uint8_t buf[65536];
+    ssize_t n;
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        if (write_all(fd, buf, n) < 0) break;
+}
+
+static void *echo_thread(void *arg) {
+    tLink *link = arg;
+
+    if (link->listen_fd >= 0) {
+        link->echo_fd = accept(link->listen_fd, NULL, NULL);
+        if (link->echo_fd < 0) return NULL;
+    }
+    echo_loop(link->echo_fd);
+    return NULL;
+}
+
+/************************************* targets **********************************/
+static int parse_target(const char *spec, const char *kind, bdaddr_t *addr, int *port) {
+    char buf[64];
+    char *colon;
+    size_t len = strlen(kind);
+
+    if (strncmp(spec, kind, len) || spec[len] != ':') return -1;
+    snprintf(buf, sizeof(buf), "%s", spec + len + 1);
+    /* ADDR is 17 chars, an optional :port follows */
+    *port = 0;
+    if (strlen(buf) > 17 && buf[17] == ':') {
+        *port = strtol(buf + 18, NULL, 0);
+        buf[17] = 0;
+    }
+    colon = strchr(buf, ':');
+    if (!colon) return -1;
+    return get_bdaddr(buf, addr);
+}
+
+static int open_local(tLink *link, const char *target) {
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    int sv[2], one = 1;
+
+    link->local = 1;
+    link->listen_fd = -1;
+    if (!strcmp(target, "socketpair")) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) return -1;
+        link->fd = sv[0];
+        link->echo_fd = sv[1];
+    } else {
+        link->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (link->listen_fd < 0 || bind(link->listen_fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+            listen(link->listen_fd, 1) < 0 ||
+            getsockname(link->listen_fd, (struct sockaddr *)&sin, &len) < 0)
+            return -1;
+        link->fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (link->fd < 0 || connect(link->fd, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+            return -1;
+        setsockopt(link->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    if (pthread_create(&link->echo, NULL, echo_thread, link)) return -1;
+    return 0;
+}
+
+static int open_link(tLink *link, const tLinkConfig *cfg) {
+    struct sockaddr_rc rc;
+    struct sockaddr_l2 l2;
+    bdaddr_t addr, any;
+    uint8_t channel;
+    int port;
+
+    memset(link, 0, sizeof(*link));
+    if (!strcmp(cfg->target, "socketpair") || !strcmp(cfg->target, "tcp"))
+        return open_local(link, cfg->target);
+
+    memset(&any, 0, sizeof(any));
+    if (!parse_target(cfg->target, "rfcomm", &addr, &port)) {
+        if (!port) {
+            if (x_sdp_search(&any, &addr, cfg->uuid, &channel) < 0 || !channel) {
+                printf("no rfcomm channel for uuid 0x%04x\n", cfg->uuid);
+                return -1;
+            }
+            port = channel;
+        }
+        memset(&rc, 0, sizeof(rc));
+        rc.rc_family = AF_BLUETOOTH;
+        rc.rc_bdaddr = addr;
+        rc.rc_channel = port;
+        link->fd = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
+        if (link->fd < 0 || connect(link->fd, (struct sockaddr *)&rc, sizeof(rc)) < 0)
+            return -1;
+        return 0;
+    }
+    if (!parse_target(cfg->target, "l2cap", &addr, &port) && port) {
+        memset(&l2, 0, sizeof(l2));
+        l2.l2_family = AF_BLUETOOTH;
+        l2.l2_bdaddr = addr;
+        l2.l2_psm = htobs(port);
+        link->fd = socket(AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
+        if (link->fd < 0 || connect(link->fd, (struct sockaddr *)&l2, sizeof(l2)) < 0)
+            return -1;
+        return 0;
+    }
+    printf("bad target '%s'\n", cfg->target);
+    errno = EINVAL;
+    return -1;
+}
+
+static void close_link(tLink *link) {
+    shutdown(link->fd, SHUT_RDWR);
+    close(link->fd);
+    if (link->local) {
+        pthread_join(link->echo, NULL);
+        if (link->echo_fd >= 0) close(link->echo_fd);
+        if (link->listen_fd >= 0) close(link->listen_fd);
+    }
+}
+
+/* echo server for the other end of an rfcomm:/l2cap: run */
+static int serve(const char *spec) {
+    struct sockaddr_rc rc;
+    struct sockaddr_l2 l2;
+    struct sockaddr *sa;
+    socklen_t len;
+    int fd, client;
+
+    memset(&rc, 0, sizeof(rc));
+    memset(&l2, 0, sizeof(l2));
+    if (!strncmp(spec, "rfcomm:", 7)) {
+        rc.rc_family = AF_BLUETOOTH;
+        rc.rc_channel = atoi(spec + 7);
+        fd = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
+        sa = (struct sockaddr *)&rc;
+        len = sizeof(rc);
+    } else if (!strncmp(spec, "l2cap:", 6)) {
+        l2.l2_family = AF_BLUETOOTH;
+        l2.l2_psm = htobs(strtol(spec + 6, NULL, 0));
+        fd = socket(AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
+        sa = (struct sockaddr *)&l2;
+        len = sizeof(l2);
+    } else {
+        printf("bad listen spec '%s'\n", spec);
+        return 2;
+    }
+    if (fd < 0 || bind(fd, sa, len) < 0 || listen(fd, 1) < 0) {
+        printf("listen %s: %s\n", spec, strerror(errno));
+        return 1;
+    }
+    printf("echoing on %s\n", spec);
+    while ((client = accept(fd, NULL, NULL)) >= 0) {
+        echo_loop(client);
+        close(client);
+    }
+    close(fd);
+    return 0;
+}
+
+/************************************* client ***********************************/
+static uint8_t *slot(tLinkRun *r, uint64_t seq) {
+    return r->slots + (seq % r->depth) * r->size;
+}
+
+static int slot_free(const tLinkRun *r) {
+    if (r->next_seq - r->rx_seq >= (uint64_t)r->depth) return 0;
+    if (!r->method_zc) return 1;
+    /* the kernel may still reference a zerocopy buffer */
+    return (int32_t)(r->slot_zc[r->next_seq % r->depth] - r->zc_done) <= 0;
+}
+
+static void queue_messages(tLinkRun *r, int accept_new) {
+    tMsgHeader hdr;
+
+    while (accept_new && slot_free(r)) {
+        hdr.seq = r->next_seq;
+        hdr.sent_ns = now_ns();
+        memcpy(slot(r, r->next_seq), &hdr, sizeof(hdr));
+        r->next_seq++;
+    }
+}
+
+static int tx_iov(tLinkRun *r, struct iovec *iov) {
+    uint64_t seq;
+    int n = 0;
+
+    for (seq = r->tx_seq; seq < r->next_seq; seq++, n++) {
+        size_t off = seq == r->tx_seq ? r->tx_off : 0;
+
+        iov[n].iov_base = slot(r, seq) + off;
+        iov[n].iov_len = r->size - off;
+    }
+    return n;
+}
+
+static void tx_advance(tLinkRun *r, size_t n) {
+    while (n) {
+        size_t left = r->size - r->tx_off;
+
+        if (r->method_zc) r->slot_zc[r->tx_seq % r->depth] = r->zc_next + 1;
+        if (n < left) {
+            r->tx_off += n;
+            return;
+        }
+        n -= left;
+        r->tx_off = 0;
+        r->tx_seq++;
+    }
+}
+
+static void rx_consume(tLinkRun *r, const uint8_t *data, size_t len) {
+    uint64_t now = 0;
+
+    while (len) {
+        size_t take = r->size - r->rx_off;
+
+        if (take > len) take = len;
+        if (r->rx_off < sizeof(tMsgHeader)) {
+            size_t h = sizeof(tMsgHeader) - r->rx_off;
+
+            memcpy((uint8_t *)&r->rx_hdr + r->rx_off, data, h < take ? h : take);
+        }
+        r->rx_off += take;
+        data += take;
+        len -= take;
+        if (r->rx_off < r->size) break;
+        if (!now) now = now_ns();
+        if (r->rx_hdr.seq != r->rx_seq) r->out_of_order++;
+        r->hist[hist_index(now - r->rx_hdr.sent_ns)]++;
+        r->samples++;
+        r->rx_seq++;
+        r->rx_off = 0;
+    }
+}
+
+static void reap_zerocopy(tLinkRun *r) {
+    char control[128];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *ee;
+
+    for (;;) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(r->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) return;
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            ee = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (ee->ee_errno || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+            /* ranges arrive in order on a single socket */
+            r->zc_done = ee->ee_data + 1;
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                r->zc_copied += ee->ee_data - ee->ee_info + 1;
+        }
+    }
+}
+
+/* one pass of non-blocking I/O, -1 when the link failed */
+static int pump_socket(tLinkRun *r, int method) {
+    static uint8_t rx[LINK_RX_BUFS][LINK_RX_BUF_SIZE];
+    struct iovec iov[LINK_MAX_DEPTH];
+    struct msghdr msg;
+    struct pollfd pfd;
+    ssize_t n;
+    int i, cnt;
+
+    pfd.fd = r->fd;
+    pfd.events = POLLIN | (r->tx_seq < r->next_seq ? POLLOUT : 0);
+    if (poll(&pfd, 1, 100) < 0) return errno == EINTR ? 0 : -1;
+    if (pfd.revents & POLLERR) {
+        if (method != METHOD_ZEROCOPY) return -1;
+        reap_zerocopy(r);
+    }
+
+    if (pfd.revents & POLLOUT) {
+        cnt = tx_iov(r, iov);
+        switch (method) {
+        case METHOD_RW:
+            for (i = 0; i < cnt; i++) {
+                n = write(r->fd, iov[i].iov_base, iov[i].iov_len);
+                if (n <= 0) break;
+                tx_advance(r, n);
+                if ((size_t)n < iov[i].iov_len) i = cnt;
+                n = 0;
+            }
+            break;
+        case METHOD_VEC:
+            n = writev(r->fd, iov, cnt);
+            break;
+        default:
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = cnt;
+            n = sendmsg(r->fd, &msg, MSG_ZEROCOPY);
+            if (n > 0) {
+                tx_advance(r, n);
+                r->zc_next++;
+                n = 0;
+            }
+            break;
+        }
+        if (n > 0) tx_advance(r, n);
+        else if (n < 0 && errno != EAGAIN && errno != ENOBUFS) return -1;
+    }
+
+    if (pfd.revents & (POLLIN | POLLHUP)) {
+        if (method == METHOD_VEC) {
+            for (i = 0; i < LINK_RX_BUFS; i++) {
+                iov[i].iov_base = rx[i];
+                iov[i].iov_len = LINK_RX_BUF_SIZE;
+            }
+            n = readv(r->fd, iov, LINK_RX_BUFS);
+            for (i = 0; n > 0 && i < LINK_RX_BUFS; i++) {
+                size_t len = n < LINK_RX_BUF_SIZE ? (size_t)n : LINK_RX_BUF_SIZE;
+
+                rx_consume(r, rx[i], len);
+                n -= len;
+            }
+        } else {
+            n = read(r->fd, rx[0], LINK_RX_BUF_SIZE);
+            if (n > 0) rx_consume(r, rx[0], n);
+        }
+        if (n == 0 && (pfd.revents & POLLHUP)) return -1;
+        if (n < 0 && errno != EAGAIN) return -1;
+    }
+    return 0;
+}
+
+/************************************* io_uring *********************************/
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_size, cq_size, sqes_size;
+    unsigned queued;
+} tUring;
+
+#define URING_READ    1
+#define URING_WRITE   2
+#define URING_TIMEOUT 3
+
+/* longest io_uring_enter may sleep, so the run can end on a stalled link */
+#define URING_WAIT_NS 100000000ull
+
+static int uring_init(tUring *u, unsigned entries) {
+    struct io_uring_params p;
+
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+    u->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0) return -1;
+    u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sq_ring = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      u->fd, IORING_OFF_SQ_RING);
+    u->cq_ring = mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      u->fd, IORING_OFF_CQ_RING);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   u->fd, IORING_OFF_SQES);
+    if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+        close(u->fd);
+        return -1;
+    }
+    u->sq_head = (unsigned *)((char *)u->sq_ring + p.sq_off.head);
+    u->sq_tail = (unsigned *)((char *)u->sq_ring + p.sq_off.tail);
+    u->sq_mask = (unsigned *)((char *)u->sq_ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)((char *)u->sq_ring + p.sq_off.array);
+    u->cq_head = (unsigned *)((char *)u->cq_ring + p.cq_off.head);
+    u->cq_tail = (unsigned *)((char *)u->cq_ring + p.cq_off.tail);
+    u->cq_mask = (unsigned *)((char *)u->cq_ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)((char *)u->cq_ring + p.cq_off.cqes);
+    return 0;
+}
+
+static void uring_exit(tUring *u) {
+    munmap(u->sqes, u->sqes_size);
+    munmap(u->cq_ring, u->cq_size);
+    munmap(u->sq_ring, u->sq_size);
+    close(u->fd);
+}
+
+static void uring_prep(tUring *u, int op, int fd, const void *addr, unsigned len,
+                       uint64_t user) {
+    unsigned tail = *u->sq_tail, index = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)addr;
+    sqe->len = len;
+    sqe->user_data = user;
+    u->sq_array[index] = index;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->queued++;
+}
+
+static int uring_enter(tUring *u) {
+    int ret = syscall(__NR_io_uring_enter, u->fd, u->queued, 1, IORING_ENTER_GETEVENTS,
+                      NULL, 0);
+
+    if (ret < 0) return errno == EINTR ? 0 : -1;
+    u->queued = 0;
+    return 0;
+}
+
+typedef struct {
+    tUring ring;
+    struct iovec rx_iov[LINK_RX_BUFS];
+    struct iovec tx_iov[LINK_MAX_DEPTH];
+    struct __kernel_timespec wait;
+    int reading;
+    int writing;
+    int waiting;
+} tUringLink;
+
+static int pump_uring(tLinkRun *r, tUringLink *ul) {
+    static uint8_t rx[LINK_RX_BUFS][LINK_RX_BUF_SIZE];
+    struct io_uring_cqe *cqe;
+    unsigned head, tail;
+    int i, cnt;
+
+    if (!ul->reading) {
+        for (i = 0; i < LINK_RX_BUFS; i++) {
+            ul->rx_iov[i].iov_base = rx[i];
+            ul->rx_iov[i].iov_len = LINK_RX_BUF_SIZE;
+        }
+        uring_prep(&ul->ring, IORING_OP_READV, r->fd, ul->rx_iov, LINK_RX_BUFS, URING_READ);
+        ul->reading = 1;
+    }
+    /* one write in flight keeps the stream in order */
+    if (!ul->writing && r->tx_seq < r->next_seq) {
+        cnt = tx_iov(r, ul->tx_iov);
+        uring_prep(&ul->ring, IORING_OP_WRITEV, r->fd, ul->tx_iov, cnt, URING_WRITE);
+        ul->writing = 1;
+    }
+    /* completes with -ETIME when nothing else does, io_uring_enter waits for one */
+    if (!ul->waiting) {
+        ul->wait.tv_sec = URING_WAIT_NS / 1000000000ull;
+        ul->wait.tv_nsec = URING_WAIT_NS % 1000000000ull;
+        uring_prep(&ul->ring, IORING_OP_TIMEOUT, -1, &ul->wait, 1, URING_TIMEOUT);
+        ul->waiting = 1;
+    }
+    if (uring_enter(&ul->ring) < 0) return -1;
+
+    head = *ul->ring.cq_head;
+    tail = __atomic_load_n(ul->ring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        cqe = &ul->ring.cqes[head & *ul->ring.cq_mask];
+        if (cqe->user_data == URING_TIMEOUT) {
+            ul->waiting = 0;
+            continue;
+        }
+        if (cqe->res <= 0 && cqe->res != -EAGAIN && cqe->res != -EINTR) {
+            __atomic_store_n(ul->ring.cq_head, head + 1, __ATOMIC_RELEASE);
+            return -1;
+        }
+        if (cqe->user_data == URING_READ) {
+            size_t n = cqe->res > 0 ? cqe->res : 0;
+
+            for (i = 0; n && i < LINK_RX_BUFS; i++) {
+                size_t len = n < LINK_RX_BUF_SIZE ? n : LINK_RX_BUF_SIZE;
+
+                rx_consume(r, rx[i], len);
+                n -= len;
+            }
+            ul->reading = 0;
+        } else {
+            if (cqe->res > 0) tx_advance(r, cqe->res);
+            ul->writing = 0;
+        }
+    }
+    __atomic_store_n(ul->ring.cq_head, head, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*************************************** run ************************************/
+static int run_method(const tLinkConfig *cfg, int method) {
+    static tLinkRun run;
+    tLinkRun *r = &run;
+    tUringLink ul;
+    tLink link;
+    uint64_t start, cpu, end, ns, bytes;
+    int one = 1, ret = 0;
+
+    if (open_link(&link, cfg) < 0) {
+        printf("%-9s connect %s: %s\n", method_names[method], cfg->target, strerror(errno));
+        return -1;
+    }
+    memset(r, 0, sizeof(*r));
+    r->fd = link.fd;
+    r->size = cfg->size;
+    r->depth = cfg->depth;
+    r->method_zc = method == METHOD_ZEROCOPY;
+    r->slots = calloc(cfg->depth, cfg->size);
+    r->slot_zc = calloc(cfg->depth, sizeof(*r->slot_zc));
+    if (!r->slots || !r->slot_zc) {
+        ret = -1;
+        goto done;
+    }
+    if (method == METHOD_ZEROCOPY &&
+        setsockopt(link.fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+        printf("%-9s not supported on %s: %s\n", method_names[method], cfg->target,
+               strerror(errno));
+        goto done;
+    }
+    if (method == METHOD_URING) {
+        /* blocking fd: io_uring polls it internally instead of failing with EAGAIN */
+        memset(&ul, 0, sizeof(ul));
+        if (uring_init(&ul.ring, 8) < 0) {
+            printf("%-9s not available: %s\n", method_names[method], strerror(errno));
+            goto done;
+        }
+    } else {
+        fcntl(link.fd, F_SETFL, fcntl(link.fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    cpu = cpu_ns();
+    start = now_ns();
+    end = start + (uint64_t)cfg->seconds * 1000000000ull;
+    for (;;) {
+        uint64_t now = now_ns();
+
+        queue_messages(r, now < end);
+        if (now >= end && (r->rx_seq == r->next_seq || now >= end + LINK_DRAIN_NS))
+            break;
+        if ((method == METHOD_URING ? pump_uring(r, &ul) : pump_socket(r, method)) < 0) {
+            printf("%-9s link failed: %s\n", method_names[method], strerror(errno));
+            ret = -1;
+            break;
+        }
+    }
+    ns = now_ns() - start;
+    cpu = cpu_ns() - cpu;
+    bytes = r->rx_seq * r->size;
+    if (method == METHOD_URING) uring_exit(&ul.ring);
+
+    printf("%-9s %9.1f MB/s %10.0f msg/s  p50 %7.1f  p99 %7.1f  p999 %7.1f us  %6.2f cpu ns/byte",
+           method_names[method], bytes * 1e3 / ns, r->rx_seq * 1e9 / ns,
+           hist_percentile(r, 0.50) / 1e3, hist_percentile(r, 0.99) / 1e3,
+           hist_percentile(r, 0.999) / 1e3, bytes ? (double)cpu / bytes : 0.0);
+    if (method == METHOD_ZEROCOPY)
+        printf("  (%llu of %u sends copied)", (unsigned long long)r->zc_copied, r->zc_next);
+    if (r->out_of_order)
+        printf("  %llu out of order", (unsigned long long)r->out_of_order);
+    printf("\n");
+done:
+    free(r->slots);
+    free(r->slot_zc);
+    close_link(&link);
+    return ret;
+}
+
+static void usage(const char *prog) {
+    printf("usage: %s [-s size] [-d depth] [-T seconds] [-m rw|vec|zerocopy|uring|all]\n"
+           "          [-u uuid16] [socketpair | tcp | rfcomm:ADDR[:CHANNEL] | l2cap:ADDR:PSM]\n"
+           "       %s -l rfcomm:CHANNEL | l2cap:PSM\n", prog, prog);
+}
+
+int main(int argc, char *argv[]) {
+    tLinkConfig cfg = { "socketpair", SPP_UUID16, 512, 8, 5 };
+    const char *method = "all";
+    int i, opt, failed = 0;
+
+    while ((opt = getopt(argc, argv, "s:d:T:m:u:l:h")) != -1) {
+        switch (opt) {
+        case 's': cfg.size = strtoul(optarg, NULL, 0); break;
+        case 'd': cfg.depth = atoi(optarg); break;
+        case 'T': cfg.seconds = atoi(optarg); break;
+        case 'm': method = optarg; break;
+        case 'u': cfg.uuid = strtoul(optarg, NULL, 0); break;
+        case 'l': return serve(optarg);
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (optind < argc) cfg.target = argv[optind];
+    if (cfg.size < sizeof(tMsgHeader) || cfg.depth < 1 || cfg.depth > LINK_MAX_DEPTH ||
+        cfg.seconds < 1) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    printf("%s: %zu byte messages, depth %d, %d s%s\n", cfg.target, cfg.size, cfg.depth,
+           cfg.seconds, strcmp(cfg.target, "socketpair") && strcmp(cfg.target, "tcp") ?
+           "" : ", echo in process");
+    for (i = 0; i < METHOD_MAX; i++) {
+        if (strcmp(method, "all") && strcmp(method, method_names[i])) continue;
+        if (run_method(&cfg, i) < 0) failed = 1;
+    }
+    return failed;
+}
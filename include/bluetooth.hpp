@@ -0,0 +1,387 @@
+#ifndef BLUETOOTH_HPP
+#define BLUETOOTH_HPP
+
+/*
+* Header-only C++ layer over bluetooth_common.h and bluetooth_service.h.
+*
+* Error, Message, PendingCall, Connection and PropertyArray own what they
+* wrap and are move-only, so replies, errors and parsed properties are
+* released on every path instead of by hand at each call site. C++17 is
+* enough for those.
+*
+* With C++20 coroutines, call() and the service awaitables suspend the
+* calling coroutine until bluez answers. Replies are dispatched by the event
+* loop, so the coroutine resumes on the event loop thread: steps chain there
+* without parking a thread, and must not block it.
+*
+*   bt::Task play(const char *dev, const char *player) {
+*       if (co_await bt::connectDevice(dev)) co_return;
+*       if (co_await bt::connectProfile(dev, "0000110b-0000-1000-8000-00805f9b34fb"))
+*           co_return;
+*       bt::Message reply = co_await bt::call(bt::Connection::system(),
+*               bt::Message::adopt(bluez_media_player1_play_new(player)));
+*   }
+*/
+
+#include <cstddef>
+#include <cstring>
+#include <exception>
+#include <utility>
+
+#include <dbus/dbus.h>
+
+extern "C" {
+#include "bluetooth_common.h"
+#include "bluetooth_service.h"
+#include "bluetooth_dbus_stubs.h"
+}
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define BT_HAVE_COROUTINES 1
+#endif
+#endif
+
+namespace bt {
+
+class Error {
+public:
+    Error() noexcept { dbus_error_init(&err_); }
+    ~Error() { dbus_error_free(&err_); }
+    Error(Error &&o) noexcept {
+        dbus_error_init(&err_);
+        dbus_move_error(&o.err_, &err_);
+    }
+    Error &operator=(Error &&o) noexcept {
+        if (this != &o) {
+            dbus_error_free(&err_);
+            dbus_move_error(&o.err_, &err_);
+        }
+        return *this;
+    }
+    Error(const Error &) = delete;
+    Error &operator=(const Error &) = delete;
+
+    /* for the C calls that fill a DBusError, reset first if reused */
+    DBusError *get() noexcept { return &err_; }
+    void reset() noexcept { dbus_error_free(&err_); }
+    bool isSet() const noexcept { return dbus_error_is_set(&err_); }
+    explicit operator bool() const noexcept { return isSet(); }
+    const char *name() const noexcept { return isSet() ? err_.name : nullptr; }
+    const char *message() const noexcept { return isSet() ? err_.message : nullptr; }
+    bool hasName(const char *name) const noexcept {
+        return dbus_error_has_name(&err_, name);
+    }
+
+private:
+    DBusError err_;
+};
+
+class Message {
+public:
+    Message() noexcept = default;
+    /* takes over the caller's reference, e.g. from a generated _new() */
+    static Message adopt(DBusMessage *msg) noexcept {
+        Message m;
+        m.msg_ = msg;
+        return m;
+    }
+    /* adds a reference, for messages libdbus keeps owning */
+    static Message ref(DBusMessage *msg) noexcept {
+        return adopt(msg ? dbus_message_ref(msg) : nullptr);
+    }
+    ~Message() { reset(); }
+    Message(Message &&o) noexcept : msg_(o.release()) {}
+    Message &operator=(Message &&o) noexcept {
+        if (this != &o) reset(o.release());
+        return *this;
+    }
+    Message(const Message &) = delete;
+    Message &operator=(const Message &) = delete;
+
+    DBusMessage *get() const noexcept { return msg_; }
+    DBusMessage *release() noexcept {
+        DBusMessage *m = msg_;
+        msg_ = nullptr;
+        return m;
+    }
+    void reset(DBusMessage *msg = nullptr) noexcept {
+        if (msg_) dbus_message_unref(msg_);
+        msg_ = msg;
+    }
+    explicit operator bool() const noexcept { return msg_ != nullptr; }
+
+    bool isError() const noexcept {
+        return msg_ && dbus_message_get_type(msg_) == DBUS_MESSAGE_TYPE_ERROR;
+    }
+    /* true if this is an error reply, err then holds it */
+    bool toError(Error &err) const noexcept {
+        return msg_ && dbus_set_error_from_message(err.get(), msg_);
+    }
+    /* false if there is no message or it has no arguments */
+    bool iter(DBusMessageIter &it) const noexcept {
+        return msg_ && dbus_message_iter_init(msg_, &it);
+    }
+
+private:
+    DBusMessage *msg_ = nullptr;
+};
+
+class Connection {
+public:
+    Connection() noexcept = default;
+    /* the shared system bus connection the service and event loop use */
+    static Connection system() noexcept {
+        Connection c;
+        c.conn_ = dbus_bus_get(DBUS_BUS_SYSTEM, nullptr);
+        return c;
+    }
+    static Connection ref(DBusConnection *conn) noexcept {
+        Connection c;
+        c.conn_ = conn ? dbus_connection_ref(conn) : nullptr;
+        return c;
+    }
+    ~Connection() { if (conn_) dbus_connection_unref(conn_); }
+    Connection(Connection &&o) noexcept : conn_(o.conn_) { o.conn_ = nullptr; }
+    Connection &operator=(Connection &&o) noexcept {
+        if (this != &o) {
+            if (conn_) dbus_connection_unref(conn_);
+            conn_ = o.conn_;
+            o.conn_ = nullptr;
+        }
+        return *this;
+    }
+    Connection(const Connection &) = delete;
+    Connection &operator=(const Connection &) = delete;
+
+    DBusConnection *get() const noexcept { return conn_; }
+    explicit operator bool() const noexcept { return conn_ != nullptr; }
+
+private:
+    DBusConnection *conn_ = nullptr;
+};
+
+/* a call in flight, cancelled if dropped before the reply is taken */
+class PendingCall {
+public:
+    PendingCall() noexcept = default;
+    static PendingCall send(DBusConnection *conn, const Message &msg,
+                            int timeout_ms = -1) noexcept {
+        PendingCall p;
+        if (conn && msg &&
+            !dbus_connection_send_with_reply(conn, msg.get(), &p.call_, timeout_ms))
+            p.call_ = nullptr;
+        return p;
+    }
+    ~PendingCall() { reset(); }
+    PendingCall(PendingCall &&o) noexcept : call_(o.call_) { o.call_ = nullptr; }
+    PendingCall &operator=(PendingCall &&o) noexcept {
+        if (this != &o) {
+            reset();
+            call_ = o.call_;
+            o.call_ = nullptr;
+        }
+        return *this;
+    }
+    PendingCall(const PendingCall &) = delete;
+    PendingCall &operator=(const PendingCall &) = delete;
+
+    explicit operator bool() const noexcept { return call_ != nullptr; }
+    bool done() const noexcept {
+        return call_ && dbus_pending_call_get_completed(call_);
+    }
+    /* the reply once done(), empty before */
+    Message steal() noexcept {
+        return Message::adopt(done() ? dbus_pending_call_steal_reply(call_) : nullptr);
+    }
+    /* blocks, not for the event loop thread */
+    Message wait() noexcept {
+        if (!call_) return Message();
+        dbus_pending_call_block(call_);
+        return steal();
+    }
+    void reset() noexcept {
+        if (!call_) return;
+        dbus_pending_call_cancel(call_);
+        dbus_pending_call_unref(call_);
+        call_ = nullptr;
+    }
+
+private:
+    DBusPendingCall *call_ = nullptr;
+};
+
+/*
+* Parsed properties, freed with free_property_value(). Map properties point
+* into the message they were parsed from, which the array keeps a reference
+* to when built from one.
+*/
+class PropertyArray {
+public:
+    PropertyArray() noexcept = default;
+    ~PropertyArray() { reset(); }
+    PropertyArray(PropertyArray &&o) noexcept
+        : arr_(o.arr_), msg_(std::move(o.msg_)) {
+        o.arr_.head = nullptr;
+        o.arr_.num = 0;
+    }
+    PropertyArray &operator=(PropertyArray &&o) noexcept {
+        if (this != &o) {
+            reset();
+            arr_ = o.arr_;
+            msg_ = std::move(o.msg_);
+            o.arr_.head = nullptr;
+            o.arr_.num = 0;
+        }
+        return *this;
+    }
+    PropertyArray(const PropertyArray &) = delete;
+    PropertyArray &operator=(const PropertyArray &) = delete;
+
+    /* the a{sv} at iter, whose message must outlive the array */
+    int parseDevice(DBusMessageIter *iter) noexcept {
+        reset();
+        return parse_remote_device_properties(iter, &arr_);
+    }
+    int parseAdapter(DBusMessageIter *iter) noexcept {
+        reset();
+        return parse_adapter_properties(iter, &arr_);
+    }
+    /* a single "name, variant" change signal */
+    int parseDeviceChange(const Message &msg) noexcept {
+        reset();
+        msg_ = Message::ref(msg.get());
+        return msg ? parse_remote_device_property_change(msg.get(), &arr_) : -1;
+    }
+    int parseAdapterChange(const Message &msg) noexcept {
+        reset();
+        msg_ = Message::ref(msg.get());
+        return msg ? parse_adapter_property_change(msg.get(), &arr_) : -1;
+    }
+
+    void reset() noexcept {
+        if (arr_.head) free_property_value(&arr_);
+        arr_.head = nullptr;
+        arr_.num = 0;
+        msg_.reset();
+    }
+
+    int size() const noexcept { return arr_.num; }
+    const t_property_value *begin() const noexcept { return arr_.head; }
+    const t_property_value *end() const noexcept { return arr_.head + arr_.num; }
+    const t_property_value *find(const char *name) const noexcept {
+        for (const t_property_value &p : *this)
+            if (!strcmp(p.name, name)) return &p;
+        return nullptr;
+    }
+    t_property_value_array *get() noexcept { return &arr_; }
+
+private:
+    t_property_value_array arr_ = { nullptr, 0 };
+    Message msg_;
+};
+
+#ifdef BT_HAVE_COROUTINES
+
+/* fire-and-forget coroutine, runs until it first suspends and frees itself */
+struct Task {
+    struct promise_type {
+        Task get_return_object() noexcept { return Task(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+/*
+* co_await resumes with the reply: a method return, or an error reply if
+* bluez failed or timed out. Empty if the call could not be sent, in which
+* case the coroutine does not suspend.
+*/
+class CallAwaiter {
+public:
+    CallAwaiter(DBusConnection *conn, Message msg, int timeout_ms) noexcept
+        : conn_(conn), msg_(std::move(msg)), timeout_ms_(timeout_ms) {}
+
+    bool await_ready() const noexcept { return !conn_ || !msg_; }
+    bool await_suspend(std::coroutine_handle<> h) noexcept {
+        handle_ = h;
+        /* the reply may resume h on the event loop before this returns,
+         * so nothing here touches the awaiter once the call is out */
+        return dbus_message_send_async(conn_, msg_.get(), timeout_ms_,
+                                       &CallAwaiter::onReply, this, nullptr);
+    }
+    Message await_resume() noexcept { return std::move(reply_); }
+
+private:
+    static void onReply(DBusMessage *reply, void *user, void *) {
+        CallAwaiter *self = static_cast<CallAwaiter *>(user);
+        self->reply_ = Message::ref(reply);
+        self->handle_.resume();
+    }
+
+    DBusConnection *conn_;
+    Message msg_;
+    int timeout_ms_;
+    Message reply_;
+    std::coroutine_handle<> handle_;
+};
+
+inline CallAwaiter call(DBusConnection *conn, Message msg, int timeout_ms = -1) {
+    return CallAwaiter(conn, std::move(msg), timeout_ms);
+}
+inline CallAwaiter call(const Connection &conn, Message msg, int timeout_ms = -1) {
+    return CallAwaiter(conn.get(), std::move(msg), timeout_ms);
+}
+
+/*
+* Awaits one of the bluetooth_service.h *Async calls: start(cb, user) issues
+* it, and co_await yields the tServiceResultCb result, -1 if it could not be
+* issued.
+*/
+template <typename Start>
+class ServiceAwaiter {
+public:
+    explicit ServiceAwaiter(Start start) : start_(std::move(start)) {}
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> h) {
+        handle_ = h;
+        return start_(&ServiceAwaiter::onResult, this) == 0;
+    }
+    int await_resume() const noexcept { return result_; }
+
+private:
+    static void onResult(int result, void *user) {
+        ServiceAwaiter *self = static_cast<ServiceAwaiter *>(user);
+        self->result_ = result;
+        self->handle_.resume();
+    }
+
+    Start start_;
+    int result_ = -1;
+    std::coroutine_handle<> handle_;
+};
+
+/* the strings only need to live until the co_await expression suspends */
+inline auto connectDevice(const char *device_path) {
+    auto start = [device_path](tServiceResultCb cb, void *user) {
+        return connectDeviceAsync(device_path, cb, user);
+    };
+    return ServiceAwaiter<decltype(start)>(start);
+}
+
+inline auto connectProfile(const char *device_path, const char *profile) {
+    auto start = [device_path, profile](tServiceResultCb cb, void *user) {
+        return connectProfileAsync(device_path, const_cast<char *>(profile), cb, user);
+    };
+    return ServiceAwaiter<decltype(start)>(start);
+}
+
+#endif /* BT_HAVE_COROUTINES */
+
+} // namespace bt
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef BLUETOOTH_ADV_H
+#define BLUETOOTH_ADV_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "bluetooth_common.h"
+
+/*
+* Advertisement payload decoding.
+*
+* ManufacturerData (a{qv}) and ServiceData (a{sv}) of Device1 arrive decoded
+* into t_variant_node, with the byte arrays still pointing into the message.
+* Each entry goes to the parser registered for its company ID or service
+* UUID, which reads the bytes in place and fills a fixed-size record; records
+* go out as BT_EVENT_ADVERTISEMENT. iBeacon and Eddystone (UID, URL, TLM)
+* are built in, vendor formats are added with the register functions.
+*
+* Lookups scan a small append-only table without a lock, newest first, so a
+* later registration for the same key takes over.
+*/
+
+#define ADV_MAX_PARSERS         32
+#define ADV_RECORD_DATA         96
+
+/* tAdvRecord.format, registered parsers pick theirs from ADV_FORMAT_VENDOR */
+#define ADV_FORMAT_IBEACON          1
+#define ADV_FORMAT_EDDYSTONE_UID    2
+#define ADV_FORMAT_EDDYSTONE_URL    3
+#define ADV_FORMAT_EDDYSTONE_TLM    4
+#define ADV_FORMAT_VENDOR           16
+
+/* tAdvRecord.source */
+#define ADV_SOURCE_MANUFACTURER     0
+#define ADV_SOURCE_SERVICE          1
+
+#define ADV_TX_POWER_NONE           127
+#define ADV_RSSI_NONE               127
+
+#define ADV_COMPANY_APPLE           0x004c
+#define ADV_SERVICE_EDDYSTONE       0xfeaa
+
+/* 104 bytes, fits the tBtEvent payload */
+typedef struct {
+    uint16_t format;        /* ADV_FORMAT_xxx */
+    uint8_t source;         /* ADV_SOURCE_xxx */
+    int8_t tx_power;        /* calibrated power in the payload (dBm) */
+    uint16_t id;            /* company id, or 16 bit service uuid (0 if longer) */
+    int16_t rssi;           /* of the same update, ADV_RSSI_NONE if it had none */
+    union {
+        struct {
+            uint8_t uuid[16];
+            uint16_t major;
+            uint16_t minor;
+        } ibeacon;
+        struct {
+            uint8_t namespace_id[10];
+            uint8_t instance_id[6];
+        } eddystone_uid;
+        struct {
+            char url[ADV_RECORD_DATA];  /* expanded, truncated to fit */
+        } eddystone_url;
+        struct {
+            uint16_t battery_mv;        /* 0 if not reported */
+            int16_t temperature;        /* 8.8 fixed point C, -128.0 if not reported */
+            uint32_t adv_count;
+            uint32_t uptime_ds;         /* 0.1 s since power up */
+        } eddystone_tlm;
+        uint8_t raw[ADV_RECORD_DATA];   /* vendor formats */
+    } u;
+} tAdvRecord;
+
+/*
+* data points into the D-Bus message and is only valid until return. rec has
+* source, id and rssi set and tx_power at ADV_TX_POWER_NONE; fill in the rest
+* and return 0, or -1 if the payload isn't in the parser's format.
+*/
+typedef int (*tAdvParser)(const uint8_t *data, size_t len, tAdvRecord *rec, void *user);
+
+typedef struct {
+    uint64_t records;       /* decoded and published */
+    uint64_t malformed;     /* a parser turned the payload down */
+    uint64_t unmatched;     /* no parser for the company/service */
+} tAdvStats;
+
+/*following functions may be called from any thread*/
+int advRegisterCompanyParser(uint16_t company, tAdvParser parser, void *user);
+/* 16 bit ("feaa") or 128 bit service uuid */
+int advRegisterServiceParser(const char *service_uuid, tAdvParser parser, void *user);
+/* records of one ManufacturerData or ServiceData map, returns how many */
+int advDecodeMap(const t_variant_node *map, int16_t rssi, tAdvRecord *records, int max);
+void advStats(tAdvStats *stats);
+
+/*following functions are fed by the event loop*/
+/* BT_EVENT_ADVERTISEMENT per record of a Device1 property set */
+void advPublishProperties(const char *path, t_property_value_array *array);
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef BLUETOOTH_ADVMON_H
+#define BLUETOOTH_ADVMON_H
+
+#include <stdint.h>
+
+#include <dbus/dbus.h>
+
+#include "bluetooth_common.h"
+
+/*
+* Advertisement monitors offloaded to bluetoothd.
+*
+* Every monitor is an org.bluez.AdvertisementMonitor1 object below one
+* application (ADV_MONITOR_APP_PATH) that serves ObjectManager and is
+* registered with the adapter's AdvertisementMonitorManager1. bluez (or the
+* controller) matches the or_patterns, applies the RSSI thresholds and
+* timeouts and only calls back DeviceFound/DeviceLost, so advertisements
+* that don't match never reach us.
+*
+* When bluez has no monitor manager (older or without experimental
+* features) or turns a monitor down, the monitor falls back to matching on
+* the host: patterns against the ManufacturerData/ServiceData of Device1
+* updates, found once at RSSIHighThreshold for RSSIHighTimeout, lost once
+* below RSSILowThreshold for RSSILowTimeout, when nothing was heard from it
+* for RSSILowTimeout (ADV_MONITOR_HOST_LOST_S if 0) or when the device goes
+* away. A timer on the event loop catches what no update does.
+*
+* Monitors are named by int ids that stay invalid once they are removed.
+*/
+
+#define ADV_MONITOR_MAX             16
+#define ADV_MONITOR_MAX_PATTERNS    8
+#define ADV_MONITOR_PATTERN_SIZE    31
+#define ADV_MONITOR_MAX_DEVICES     1024    /* host matching, power of two */
+
+#define ADV_MONITOR_RSSI_UNSET      127
+#define ADV_MONITOR_HOST_LOST_S     10      /* silence, without rssi_low_timeout */
+
+/* AD types for patterns */
+#define ADV_AD_NAME_SHORT           0x08
+#define ADV_AD_NAME_COMPLETE        0x09
+#define ADV_AD_SERVICE_DATA16       0x16
+#define ADV_AD_SERVICE_DATA128      0x21
+#define ADV_AD_MANUFACTURER         0xff
+
+typedef struct {
+    uint8_t start;          /* offset into the AD data */
+    uint8_t ad_type;        /* ADV_AD_xxx */
+    uint8_t len;
+    uint8_t data[ADV_MONITOR_PATTERN_SIZE];
+} tAdvMonitorPattern;
+
+/* thresholds at ADV_MONITOR_RSSI_UNSET and timeouts at 0 leave them to bluez */
+typedef struct {
+    int16_t rssi_low;           /* dBm, lost below it... */
+    int16_t rssi_high;          /* ...found at or above it */
+    uint16_t rssi_low_timeout;  /* s */
+    uint16_t rssi_high_timeout; /* s */
+    uint16_t rssi_sampling;     /* 100 ms units, 0 reports every advertisement */
+    int num_patterns;           /* any of them matches */
+    tAdvMonitorPattern patterns[ADV_MONITOR_MAX_PATTERNS];
+} tAdvMonitorSpec;
+
+/* event loop thread; found is 1 for DeviceFound, 0 for DeviceLost */
+typedef void (*tAdvMonitorCb)(int monitor, const char *device_path, int found, void *user);
+
+typedef struct {
+    int offloaded;          /* 1 activated by bluez, 0 pending, -1 host matching */
+    uint64_t found;
+    uint64_t lost;
+} tAdvMonitorStats;
+
+/*following functions are fed by the event loop*/
+void advMonitorDeviceUpdate(const char *device_path, t_property_value_array *array);
+void advMonitorDeviceRemoved(const char *device_path);
+
+/*following functions may be called from any thread*/
+/* the application is exported and registered with the first monitor */
+int advMonitorAdd(DBusConnection *conn, const tAdvMonitorSpec *spec,
+                  tAdvMonitorCb cb, void *user);
+int advMonitorRemove(int monitor);
+int advMonitorStats(int monitor, tAdvMonitorStats *stats);
+/* 1 while bluez does the matching, 0 before it answered, -1 on the host */
+int advMonitorOffloaded();
+/* drops every monitor and unregisters the application */
+void advMonitorCleanup();
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef BLUETOOTH_AUDIO_H
+#define BLUETOOTH_AUDIO_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <dbus/dbus.h>
+
+#include "bluetooth_jitter.h"
+
+/*
+* A2DP sink streaming.
+*
+* A stream is armed for a device; once its MediaTransport1 goes "pending"
+* the transport is acquired and a dedicated thread reads media packets off
+* the fd in batches (recvmmsg) into a ring of MTU-sized slots allocated up
+* front. The RTP and codec headers are skipped in place and the payloads
+* are handed to the sink as an iovec, so nothing is copied or allocated per
+* packet on the way. Sinks that take PCM get SBC decoded in the same thread
+* into a buffer that is also allocated up front; the PCM then goes through
+* a jitter buffer to a second thread that feeds the sink on a steady clock.
+*/
+
+#define AUDIO_MAX_STREAMS         4
+#define AUDIO_RING_PACKETS        64    /* power of two */
+#define AUDIO_BATCH               16    /* packets per recvmmsg */
+#define AUDIO_THREAD_PRIORITY     10    /* SCHED_FIFO, best effort */
+#define AUDIO_ACQUIRE_TIMEOUT_MS  3000
+/* the SBC media payload header counts frames in 4 bits */
+#define AUDIO_MAX_FRAMES_PER_PACKET 15
+
+/* A2DP codec ids, AUDIO_CODEC_PCM is for sinks fed by a decoder */
+#define AUDIO_CODEC_SBC           0x00
+#define AUDIO_CODEC_MPEG12        0x01
+#define AUDIO_CODEC_MPEG24        0x02
+#define AUDIO_CODEC_VENDOR        0xff
+#define AUDIO_CODEC_PCM           0x100
+
+typedef struct {
+    int codec;      /* AUDIO_CODEC_xxx */
+    int rate;       /* Hz, 0 if unknown */
+    int channels;
+} tAudioFormat;
+
+typedef struct audio_sink tAudioSink;
+
+/*
+* Called from the stream threads only. open returns -EAGAIN when the sink
+* isn't ready yet, eg: a fifo without a reader, and is then tried again.
+*/
+struct audio_sink {
+    int (*open)(tAudioSink *sink, const tAudioFormat *fmt);
+    ssize_t (*write)(tAudioSink *sink, const struct iovec *iov, int iovcnt);
+    void (*close)(tAudioSink *sink);
+    void (*destroy)(tAudioSink *sink);
+    int pcm;        /* wants decoded 16-bit PCM rather than codec frames */
+    void *priv;
+};
+
+/* raw codec frames to a file or fifo, eg: /tmp/a2dp.sbc, or PCM if pcm is set */
+tAudioSink * createFileSink(const char *path, int pcm);
+/* PCM to an ALSA device, NULL when built without HAVE_ALSA */
+tAudioSink * createAlsaSink(const char *device);
+/* "file:<path>", "pcm:<path>", "alsa:<device>" or a plain path */
+tAudioSink * createAudioSink(const char *spec);
+void destroyAudioSink(tAudioSink *sink);
+
+typedef struct {
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t batches;       /* recvmmsg calls that returned data */
+    uint64_t bad_packets;   /* too short for the rtp header */
+    uint64_t decode_errors; /* SBC frames that failed to decode */
+    uint64_t sink_errors;
+    tJitterStats jitter;    /* zero unless the stream decodes */
+} tAudioStats;
+
+/* sink is owned by the stream from now on */
+int audioStreamStart(DBusConnection *conn, const char *device_path, tAudioSink *sink);
+int audioStreamStop(const char *device_path);
+int audioStreamStats(const char *device_path, tAudioStats *stats);
+void audioStreamCleanup();
+
+/*following functions are called by the media cache*/
+void audioTransportState(const char *device_path, const char *transport_path,
+                         const char *state);
+
+#endif
@@ -20,9 +20,17 @@
 #define DEVICE_IFC BLUEZ_DBUS_BASE_IFC ".Device1"
 #define PROFILE_MANAGER_IFC BLUEZ_DBUS_BASE_IFC ".ProfileManager1"
 #define MEDIA_PLAYER_IFC BLUEZ_DBUS_BASE_IFC ".MediaPlayer1"
+#define MEDIA_TRANSPORT_IFC BLUEZ_DBUS_BASE_IFC ".MediaTransport1"
+#define PROFILE_IFC BLUEZ_DBUS_BASE_IFC ".Profile1"
+#define GATT_SERVICE_IFC BLUEZ_DBUS_BASE_IFC ".GattService1"
+#define GATT_CHARACTERISTIC_IFC BLUEZ_DBUS_BASE_IFC ".GattCharacteristic1"
+#define GATT_DESCRIPTOR_IFC BLUEZ_DBUS_BASE_IFC ".GattDescriptor1"
+#define ADV_MONITOR_MANAGER_IFC BLUEZ_DBUS_BASE_IFC ".AdvertisementMonitorManager1"
+#define ADV_MONITOR_IFC BLUEZ_DBUS_BASE_IFC ".AdvertisementMonitor1"
 
 #define REMOTE_AGENT_PATH "/sun/bluetooth/remote_device_agent"
 #define LOCAL_AGENT_PATH "/sun/bluetooth/agent"
+#define ADV_MONITOR_APP_PATH "/sun/bluetooth/advmon"
 
 // It would be nicer to retrieve this from bluez using GetDefaultAdapter,
 // but this is only possible when the adapter is up (and hcid is running).
@@ -42,15 +50,34 @@
         (err)->name, (err)->message); \
         dbus_error_free((err)); }
 
+/* type DBUS_TYPE_DICT_ENTRY is a map property (a{qv}, a{sv}), it is
+ * decoded into t_variant_node and its strings and bytes stay in the message
+ */
 typedef struct _properties{
     char name[32];
     int  type;
 }Properties;
 
+/* one value of a decoded dbus tree, see decode_variant() */
+typedef struct{
+    int type;       /* DBUS_TYPE_xxx */
+    int element;    /* arrays: element type */
+    int count;      /* containers: children, byte arrays: bytes */
+    int next;       /* index just past this node's subtree */
+    union{
+        const char *str;
+        const uint8_t *bytes;   /* byte arrays, points into the message */
+        int64_t i64;
+        uint64_t u64;
+        double dbl;
+    }v;
+}t_variant_node;
+
 typedef union {
     char *str_val;
     int int_val;
     char **array_val;
+    t_variant_node *nodes;  /* DBUS_TYPE_DICT_ENTRY properties, len nodes */
 } u_property_value;
 
 typedef struct{
@@ -76,6 +103,25 @@ dbus_bool_t dbus_func_args_async(DBusConnection *conn,
                                  int first_arg_type,
                                  ...);
 
+/* like dbus_func_args_async for a message built by the caller, who keeps its ref */
+dbus_bool_t dbus_message_send_async(DBusConnection *conn,
+                                    DBusMessage *msg,
+                                    int timeout_ms,
+                                    void (*reply)(DBusMessage *, void *, void *),
+                                    void *user,
+                                    void *nat);
+
+dbus_bool_t dbus_set_property_async(DBusConnection *conn,
+                                    int timeout_ms,
+                                    void (*reply)(DBusMessage *, void *, void *),
+                                    void *user,
+                                    void *nat,
+                                    const char *path,
+                                    const char *ifc,
+                                    const char *name,
+                                    int type,
+                                    void *val);
+
 DBusMessage * dbus_func_args(DBusConnection *conn,
                              const char *path,
                              const char *ifc,
@@ -129,6 +175,40 @@ void free_array_of_strings(char * strArray[], int len);
 void free_array_of_bytes(char * byteArray);
 
 /*following is the parse function for dbus message*/
+#define MEDIA_PLAYER_NUM_PROPERTIES     14
+#define MEDIA_TRANSPORT_NUM_PROPERTIES  8
+extern Properties media_player_properties[MEDIA_PLAYER_NUM_PROPERTIES];
+extern Properties media_transport_properties[MEDIA_TRANSPORT_NUM_PROPERTIES];
+
+/*
+* MediaPlayer1.Track metadata. The strings point into the message the
+* iterator walks and are only valid while that message is referenced.
+*/
+typedef struct{
+    const char *title;
+    const char *artist;
+    const char *album;
+    const char *genre;
+    uint32_t duration;          /* ms */
+    uint32_t track_number;
+    uint32_t number_of_tracks;
+}t_media_track;
+
+/* iter is one "key" + variant dict entry; array values of string type are malloced */
+int get_property(DBusMessageIter iter, Properties *properties,
+                  int max_num_properties, int *prop_index, u_property_value *value, int *len);
+int parse_media_track(DBusMessageIter *iter, t_media_track *track);
+/* decode the value at iter and everything below it in one pass, nodes in
+ * pre-order; returns the nodes used, VARIANT_NO_ROOM if max_nodes is too
+ * small or -1 for a value it can't decode
+ */
+#define VARIANT_NO_ROOM     -2
+int decode_variant(DBusMessageIter *iter, t_variant_node *nodes, int max_nodes);
+/* walk the entries of a decoded map from *pos = 0, variants are unwrapped;
+ * returns 0 until the entries run out
+ */
+int variant_map_next(const t_variant_node *nodes, int *pos,
+                     const t_variant_node **key, const t_variant_node **value);
 int parse_properties(DBusMessageIter *iter, Properties *properties,
                               const int max_num_properties,t_property_value_array *array);
 							  
@@ -146,9 +226,69 @@ u_property_value get_value_by_name(t_property_value_array *array, const char *na
 void append_dict_args(DBusMessage *reply, const char *first_key, ...);
 void append_variant(DBusMessageIter *iter, int type, void *val);
 
+/* one a{sv} entry: value points to a basic type, or for DBUS_TYPE_ARRAY
+ * to count strings (as)
+ */
+typedef struct{
+    const char *key;
+    int type;
+    const void *value;
+    int count;
+}t_dict_entry;
+dbus_bool_t append_dict_entries(DBusMessageIter *iter, const t_dict_entry *entries, int count);
+
 /*translation between bdaddr and string(mac)*/
 int get_bdaddr(const char *str, bdaddr_t *ba);
 void get_bdaddr_as_string(const bdaddr_t *ba, char *str);
+/* rfcomm channel of the dst service with that 16 bit uuid */
+int x_sdp_search(const bdaddr_t *src, const bdaddr_t *dst, uint16_t uuid, uint8_t *channel);
+
+/* 128 bit uuid as two words, hi holds the first 8 bytes in string order */
+typedef struct{
+    uint64_t hi;
+    uint64_t lo;
+}t_bt_uuid;
+
+#define BT_UUID_STR_SIZE      37
+#define BT_UUID_BASE_LO       0x800000805f9b34fbULL  /* -8000-00805f9b34fb */
+#define BT_UUID_EQ(a, b)      ((a).hi == (b).hi && (a).lo == (b).lo)
+#define BT_UUID_IS_NULL(u)    (!(u).hi && !(u).lo)
+
+/* SIG uuids on the base uuid, 16 bit */
+#define BT_UUID16_A2DP_SOURCE     0x110a
+#define BT_UUID16_A2DP_SINK       0x110b
+#define BT_UUID16_AVRCP_TARGET    0x110c
+#define BT_UUID16_AVRCP           0x110e
+#define BT_UUID16_HFP_HF          0x111e
+#define BT_UUID16_HFP_AG          0x111f
+
+/* set membership: SIG short uuids in a bitset, the rest in a small hash */
+#define BT_UUID_SET_FULL      64
+
+typedef struct{
+    int count;
+    uint64_t short_bits[65536 / 64];
+    int num_full;
+    t_bt_uuid full[BT_UUID_SET_FULL];
+    uint8_t index[2 * BT_UUID_SET_FULL];    /* full slot + 1, 0 is empty */
+}t_bt_uuid_set;
+
+/*following functions handle binary uuids*/
+/* 36 character form or 4/8 hex digits on the base uuid, case insensitive */
+int bt_uuid_parse(const char *str, t_bt_uuid *uuid);
+/* lower case 36 character form into BT_UUID_STR_SIZE bytes */
+void bt_uuid_format(const t_bt_uuid *uuid, char *str);
+t_bt_uuid bt_uuid_from16(uint16_t uuid16);
+/* the 36 character form of a SIG uuid, returns str */
+char * bt_uuid16_format(uint16_t uuid16, char *str);
+/* the 16 bit value of a SIG uuid, -1 for any other */
+int bt_uuid_to16(const t_bt_uuid *uuid);
+void bt_uuid_set_init(t_bt_uuid_set *set);
+/* -1 once BT_UUID_SET_FULL non-SIG uuids are in */
+int bt_uuid_set_add(t_bt_uuid_set *set, const t_bt_uuid *uuid);
+int bt_uuid_set_has(const t_bt_uuid_set *set, const t_bt_uuid *uuid);
+/* 1 if any of the strings (a UUIDs property) is in the set */
+int bt_uuid_set_match(const t_bt_uuid_set *set, char **uuids, int count);
 
 
 
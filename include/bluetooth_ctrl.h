@@ -0,0 +1,62 @@
+#ifndef BLUETOOTH_CTRL_H
+#define BLUETOOTH_CTRL_H
+
+#include <stdint.h>
+
+/*
+* Local control socket (AF_UNIX, SOCK_STREAM) served from the event loop.
+*
+* Every frame starts with its total length, header included, in native byte
+* order. A request carries argc NUL terminated string arguments after the
+* header; the response echoes the request id, so a client may pipeline and
+* batch as many requests as it likes in one write and match the answers as
+* they come back. Responses to slow operations (connect, profile registration)
+* are sent when bluez replies and may overtake earlier ones.
+*
+* Device arguments may be an object path, "dev_XX_XX_XX_XX_XX_XX" or a
+* "XX:XX:XX:XX:XX:XX" address.
+*/
+
+#define CTRL_DEFAULT_SOCKET_PATH  "/var/run/dbus_bt.sock"
+#define CTRL_MAX_FRAME            1024
+#define CTRL_MAX_ARGS             8
+
+#define CTRL_OP_PING              0   /* -> "pong" */
+#define CTRL_OP_START_DISCOVERY   1
+#define CTRL_OP_STOP_DISCOVERY    2
+#define CTRL_OP_PAIR              3   /* device */
+#define CTRL_OP_CONNECT           4   /* device */
+#define CTRL_OP_CONNECT_PROFILE   5   /* device, uuid */
+#define CTRL_OP_ADD_PROFILE       6   /* path, uuid, name, auto connect "0"/"1" */
+#define CTRL_OP_MEDIA_CONTROL     7   /* device, Play/Pause/Stop/Next/Previous */
+#define CTRL_OP_AUDIO_SINK        8   /* device [, sink]: connect a2dp source + avrcp,
+                                         stream to "file:<path>"/"alsa:<dev>" */
+#define CTRL_OP_HFP_AG            9   /* device */
+#define CTRL_OP_AUDIO_STOP        10  /* device */
+#define CTRL_OP_METRICS           11  /* -> "name value" lines */
+#define CTRL_OP_PRESENCE_START    12  /* [timeout ms [, enter rssi [, leave rssi]]] */
+#define CTRL_OP_PRESENCE_STATS    13  /* [device] -> "name value" lines */
+#define CTRL_OP_TELEMETRY_START   14  /* [tick ms [, alpha [, kalman q [, kalman r]]]] */
+#define CTRL_OP_TELEMETRY_STATS   15  /* -> "name value" lines */
+#define CTRL_OP_DEVICE_FILTER     16  /* uuid...: found events only for these, none for all */
+
+typedef struct {
+    uint32_t len;   /* whole frame, header included */
+    uint32_t id;    /* echoed back in the response */
+    uint16_t op;    /* CTRL_OP_xxx */
+    uint16_t argc;  /* NUL terminated strings following the header */
+} tCtrlRequest;
+
+typedef struct {
+    uint32_t len;   /* whole frame, header included */
+    uint32_t id;
+    int32_t status; /* 0 or a negative errno */
+    /* optional NUL terminated text follows */
+} tCtrlResponse;
+
+/* must run after startEventLoop() and initServices() */
+int startControlServer(const char *socket_path);
+/* call once the event loop has been stopped */
+void stopControlServer();
+
+#endif
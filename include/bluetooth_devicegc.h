@@ -0,0 +1,79 @@
+#ifndef BLUETOOTH_DEVICEGC_H
+#define BLUETOOTH_DEVICEGC_H
+
+#include <stdint.h>
+
+#include <dbus/dbus.h>
+
+#include "bluetooth_common.h"
+
+/*
+* Stale device collector.
+*
+* bluetoothd keeps an object for every device discovery ever reported, and
+* each one carries its GATT objects. In a busy place that is thousands of
+* unpaired LE devices that will never come back. All of them land in every
+* GetManagedObjects reply and slow down every ObjectManager operation.
+*
+* The event loop feeds every Device1 update and every object below a
+* device. A device counts as seen when an update carries RSSI, advertising
+* data or Connected. Every sweep_s the collector queues the devices that:
+* - are not paired, trusted, blocked or connected, and
+* - have not been seen for max_age_s.
+* It removes them with Adapter1.RemoveDevice. The calls are async and
+* pipelined, up to pipeline in flight, but no more than rate_per_s are sent
+* each second, so bluetoothd is never flooded. A device that shows up again
+* while it waits in the queue is spared.
+*
+* Each sweep reports the objects under tracked devices before and after,
+* so the shrink of the object tree can be seen.
+*/
+
+#define DEVICE_GC_MAX_DEVICES           16384   /* power of two */
+#define DEVICE_GC_MAX_OBJECTS           32768   /* below devices, power of two */
+#define DEVICE_GC_DEFAULT_MAX_AGE_S     600
+#define DEVICE_GC_DEFAULT_SWEEP_S       60
+#define DEVICE_GC_DEFAULT_RATE          10      /* RemoveDevice per second */
+#define DEVICE_GC_DEFAULT_PIPELINE      4       /* RemoveDevice in flight */
+
+/* 0 for the defaults */
+typedef struct {
+    uint32_t max_age_s;
+    uint32_t sweep_s;
+    uint32_t rate_per_s;
+    uint32_t pipeline;
+} tDeviceGcConfig;
+
+typedef struct {
+    int devices;            /* tracked Device1 objects */
+    int objects;            /* those plus the objects below them */
+    int queued;             /* stale, waiting for their RemoveDevice */
+    int in_flight;
+    uint64_t sweeps;
+    uint64_t removed;       /* devices */
+    uint64_t removed_objects;
+    uint64_t spared;        /* seen again while queued */
+    uint64_t failures;
+    /* the last finished sweep */
+    int last_removed;
+    int last_objects_before;
+    int last_objects_after;
+} tDeviceGcStats;
+
+/*following functions are fed by the event loop*/
+void deviceGcDeviceUpdate(const char *device_path, t_property_value_array *array);
+void deviceGcDeviceRemoved(const char *device_path);
+/* GATT, media, ... objects below a device path, with the number of
+ * interfaces in the signal */
+void deviceGcObjectAdded(const char *path, int interfaces);
+void deviceGcObjectRemoved(const char *path, int interfaces);
+
+/*following functions may be called from any thread*/
+/* starts collecting, or changes the config of a running collector */
+int deviceGcStart(DBusConnection *conn, const tDeviceGcConfig *config);
+/* sweeps now rather than at the next period */
+int deviceGcSweep();
+void deviceGcStats(tDeviceGcStats *stats);
+void deviceGcCleanup();
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef BLUETOOTH_DISCOVERY_H
+#define BLUETOOTH_DISCOVERY_H
+
+#include <stdint.h>
+
+#include <dbus/dbus.h>
+
+/*
+* Discovery duty cycling on the default adapter.
+*
+* Whoever needs scan results registers a demand: scan for window_ms every
+* interval_ms (window equal to interval scans continuously). Demands are
+* merged into one cycle: the shortest interval, at the highest duty any of
+* them asks for. The cycle runs on the event loop off a timerfd and drives
+* StartDiscovery/StopDiscovery asynchronously.
+*
+* The radio is shared with the links, so:
+* - while a MediaTransport1 is active, demands that yield are dropped and
+*   the others are cut down to audio_duty_pct of the interval;
+* - while a Connect or Pair is in flight, and paging_hold_ms after the
+*   last one, nothing scans at all.
+* A window that is running when either starts is cut short. Scan, idle and
+* held-off time are accounted for so freshness can be weighed against link
+* quality.
+*
+* Demands are named by int ids that stay invalid once they are released.
+*/
+
+#define DISCOVERY_MAX_DEMANDS           16
+#define DISCOVERY_DEFAULT_AUDIO_DUTY    10      /* % */
+#define DISCOVERY_DEFAULT_PAGING_HOLD_MS 500
+#define DISCOVERY_RETRY_MS              5000    /* after StartDiscovery failed */
+#define DISCOVERY_MANUAL_INTERVAL_MS    10000   /* startDiscovery(), scans throughout */
+
+#define DISCOVERY_AUDIO_SHRINK          0   /* scan at the audio duty */
+#define DISCOVERY_AUDIO_YIELD           1   /* don't scan at all */
+
+typedef struct {
+    uint32_t window_ms;
+    uint32_t interval_ms;   /* >= window_ms */
+    int audio;              /* DISCOVERY_AUDIO_xxx */
+} tDiscoveryDemand;
+
+typedef struct {
+    uint8_t audio_duty_pct;     /* of the interval while audio is active */
+    uint32_t paging_hold_ms;
+} tDiscoveryConfig;
+
+typedef struct {
+    int demands;
+    int scanning;           /* StartDiscovery sent and not stopped */
+    int audio_active;       /* active transports */
+    int paging;             /* Connect/Pair in flight */
+    uint32_t window_ms;     /* merged cycle, 0 when nothing may scan */
+    uint32_t interval_ms;
+    uint64_t scan_ms;
+    uint64_t idle_ms;       /* demand but outside a window */
+    uint64_t held_ms;       /* demand but held off by audio or paging */
+    uint64_t windows;
+    uint64_t cut_short;     /* windows ended early by audio or paging */
+    uint64_t failures;      /* StartDiscovery errors */
+} tDiscoveryStats;
+
+/*following functions are fed by the event loop and the connection paths*/
+void discoveryTransportState(const char *transport_path, const char *state);
+/* 1 when a Connect/Pair goes out, 0 when its reply is in */
+void discoveryPaging(int begin);
+
+/*following functions may be called from any thread*/
+int discoveryRequest(DBusConnection *conn, const tDiscoveryDemand *demand);
+int discoveryRelease(int demand);
+void discoveryConfigure(const tDiscoveryConfig *config);
+void discoveryStats(tDiscoveryStats *stats);
+/* releases every demand, a running scan is stopped */
+void discoveryCleanup();
+
+#endif
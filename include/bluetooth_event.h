@@ -0,0 +1,105 @@
+#ifndef BLUETOOTH_EVENT_H
+#define BLUETOOTH_EVENT_H
+
+#include <stdint.h>
+
+#include "bluetooth_common.h"
+#include "bluetooth_adv.h"
+
+/*
+* Typed event stream.
+*
+* Every subscriber owns a single-producer/single-consumer ring of fixed-size
+* records plus an eventfd. The event loop thread is the producer; the
+* application polls the fd and drains records in batches, without callbacks
+* and without taking any lock on the consumer side.
+*/
+
+#define BT_EVENT_DEVICE_FOUND          0
+#define BT_EVENT_DEVICE_REMOVED        1
+#define BT_EVENT_PROPERTY_CHANGED      2
+#define BT_EVENT_PAIRING_RESULT        3
+#define BT_EVENT_CONNECTION_STATE      4
+#define BT_EVENT_MEDIA_STATUS          5
+#define BT_EVENT_MEDIA_TRACK           6
+#define BT_EVENT_ADVERTISEMENT         7   /* see bluetooth_adv.h */
+#define BT_EVENT_PRESENCE              8   /* see bluetooth_presence.h */
+#define BT_EVENT_TYPE_MAX              9
+
+#define BT_EVENT_MASK(type)            (1u << (type))
+#define BT_EVENT_MASK_ALL              0xffffffffu
+
+#define BT_EVENT_MAX_SUBSCRIBERS       16
+#define BT_EVENT_DEFAULT_DEPTH         256
+
+#define BT_EVENT_PATH_SIZE             64
+#define BT_EVENT_NAME_SIZE             32
+#define BT_EVENT_VALUE_SIZE            64
+
+/* 192 bytes, three cache lines, whatever the payload */
+typedef struct {
+    uint16_t type;          /* BT_EVENT_xxx */
+    uint16_t value_type;    /* dbus type of u.prop, 0 otherwise */
+    uint32_t seq;           /* per-subscriber sequence, gaps mean drops */
+    uint64_t timestamp_us;  /* CLOCK_MONOTONIC */
+    char path[BT_EVENT_PATH_SIZE];  /* object path the event refers to */
+    union {
+        struct {
+            char name[BT_EVENT_NAME_SIZE];
+            int32_t int_val;
+            char str_val[BT_EVENT_VALUE_SIZE]; /* strings, first array item */
+        } prop;
+        struct {
+            int32_t result; /* BOND_RESULT_xxx */
+        } pairing;
+        struct {
+            int32_t connected;
+        } connection;
+        struct {
+            char status[BT_EVENT_NAME_SIZE]; /* playing, paused, stopped... */
+        } media;
+        struct {
+            char title[48];     /* truncated */
+            char artist[32];
+            char album[24];
+            uint32_t duration;  /* ms */
+            uint32_t number;
+        } track;
+        tAdvRecord adv;
+        struct {
+            int32_t present;    /* 1 entered, 0 left */
+            int32_t rssi;       /* last seen, 127 if unknown */
+            uint32_t since_ms;  /* since the last sighting */
+        } presence;
+        uint8_t raw[112];
+    } u;
+} tBtEvent;
+
+typedef struct bt_event_subscriber tBtEventSubscriber;
+
+/*
+* depth is rounded up to a power of two. Returns NULL if the subscriber table
+* is full or out of memory.
+*/
+tBtEventSubscriber * subscribeEvents(uint32_t mask, unsigned int depth);
+void unsubscribeEvents(tBtEventSubscriber *sub);
+/* readable (EPOLLIN/POLLIN) while the ring holds undrained events */
+int eventSubscriberFd(tBtEventSubscriber *sub);
+/* copy up to max events out of the ring, returns the number copied */
+int drainEvents(tBtEventSubscriber *sub, tBtEvent *events, int max);
+/* events lost because the ring was full */
+uint64_t droppedEvents(tBtEventSubscriber *sub);
+
+/*following functions are used by the event loop to feed the stream*/
+void publishEvent(tBtEvent *evt);
+void publishDeviceEvent(int type, const char *path);
+/* one PROPERTY_CHANGED per entry, plus CONNECTION_STATE for "Connected" */
+void publishPropertyChanges(const char *path, t_property_value_array *array);
+void publishProperty(const char *path, const char *name, int type,
+                     int int_val, const char *str_val);
+void publishPairingResult(const char *path, int result);
+void publishMediaStatus(const char *path, const char *status);
+void publishMediaTrack(const char *path, const t_media_track *track);
+void publishPresence(const char *path, int present, int rssi, uint32_t since_ms);
+
+#endif
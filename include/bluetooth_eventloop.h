@@ -1,9 +1,29 @@
 #ifndef BLUETOOTH_EVENTLOOP_H
 #define BLUETOOTH_EVENTLOOP_H
 
+#include <poll.h>
+
+#include "bluetooth_common.h"
+
+/* invoked on the event loop thread with the poll() revents of fd */
+typedef void (*tEventLoopFdCb)(int fd, short revents, void *data);
+
 int initializeBluetoothEvent();
 int startEventLoop();
 void stopEventLoop();
 void cleanupBluetoothEvent();
 
+/*serve extra fds from the event loop, events are POLLIN/POLLOUT flags*/
+int addEventLoopFd(int fd, short events, tEventLoopFdCb cb, void *data);
+int modifyEventLoopFd(int fd, short events);
+void removeEventLoopFd(int fd);
+/* removeEventLoopFd() and close(); from other threads the close is left to
+ * the loop, so the fd number can't be reused while it still polls it */
+void closeEventLoopFd(int fd);
+
+/* BT_EVENT_DEVICE_FOUND only for devices whose UUIDs hit the set; one that
+ * misses is checked again as its UUIDs change. NULL turns the filter off
+ */
+int setDeviceUuidFilter(const t_bt_uuid_set *set);
+
 #endif
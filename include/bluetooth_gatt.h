@@ -0,0 +1,131 @@
+#ifndef BLUETOOTH_GATT_H
+#define BLUETOOTH_GATT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <dbus/dbus.h>
+
+/*
+* LE GATT client on the bluez object tree.
+*
+* Services, characteristics and descriptors are cached per device as the
+* event loop sees them, with binary UUIDs and a hash index from (device,
+* UUID) to the characteristic. The cache outlives a disconnect: objects
+* bluez takes away are only marked stale and are found again when it brings
+* them back. Once the device has resolved its services, whatever didn't come
+* back (Service Changed) is dropped and the cache counts as valid, which
+* lets the read scheduler go ahead on the next connect without waiting for
+* the services to resolve again.
+*
+* A subscription names a device and a characteristic UUID; once the
+* characteristic is resolved it is acquired with AcquireNotify and the socket
+* bluez returns is served by the event loop. Packets are read in batches with
+* recvmmsg into preallocated buffers and handed to the callback in place, so
+* a notification costs no D-Bus signal and no variant decode.
+*
+* Characteristics that only indicate can't be acquired; those fall back to
+* StartNotify and the Value of PropertiesChanged, still without a copy.
+* Subscriptions outlive disconnects and are acquired again once the device
+* has resolved its services.
+*
+* Writes go the other way through a writer on one characteristic. Payloads
+* are queued and cut into MTU sized packets as they are sent. With
+* write-without-response they are streamed into the AcquireWrite socket,
+* whose send buffer is sized for the window and which holds us back with
+* EAGAIN/POLLOUT once bluez falls behind. Otherwise every packet is a
+* WriteValue call, with up to window of them in flight instead of one
+* round trip each.
+*
+* Subscriptions and writers are named by int ids that stay invalid once
+* they are gone.
+*/
+
+#define GATT_MAX_DEVICES            256
+#define GATT_MAX_SERVICES           1024
+#define GATT_MAX_CHARACTERISTICS    4096
+#define GATT_MAX_DESCRIPTORS        4096
+#define GATT_MAX_SUBSCRIPTIONS      32
+#define GATT_NOTIFY_BATCH           16      /* packets per recvmmsg */
+#define GATT_NOTIFY_BUDGET          4       /* recvmmsg calls per wakeup */
+#define GATT_MAX_VALUE              512     /* longest ATT attribute value */
+#define GATT_ACQUIRE_TIMEOUT_MS     5000
+#define GATT_MAX_WRITERS            8
+#define GATT_WRITE_RING             (32 * 1024)     /* power of two */
+#define GATT_WRITE_RECORDS          512             /* power of two */
+#define GATT_WRITE_WINDOW           8       /* default packets in flight */
+#define GATT_DEFAULT_MTU            23      /* when bluez doesn't say */
+
+/* GattCharacteristic1.Flags */
+#define GATT_CHR_READ               0x01
+#define GATT_CHR_WRITE              0x02
+#define GATT_CHR_WRITE_NO_RESPONSE  0x04
+#define GATT_CHR_NOTIFY             0x08
+#define GATT_CHR_INDICATE           0x10
+
+/* event loop thread; data points into a reused buffer, valid until return */
+typedef void (*tGattNotifyCb)(int sub, const uint8_t *data, size_t len, void *user);
+
+typedef struct {
+    int acquired;           /* 1 AcquireNotify, 2 StartNotify, 0 not yet */
+    uint16_t mtu;
+    char characteristic[128];
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t batches;       /* recvmmsg calls that returned packets */
+} tGattSubStats;
+
+/* event loop thread, everything queued has been handed to bluez */
+typedef void (*tGattWriteCb)(int writer, void *user);
+
+typedef struct {
+    int mode;               /* 1 AcquireWrite socket, 2 WriteValue, 0 not yet */
+    uint16_t mtu;
+    uint64_t bytes;         /* handed to bluez */
+    uint64_t packets;
+    uint64_t stalls;        /* socket full, waited for POLLOUT */
+    uint64_t errors;        /* failed WriteValue calls */
+    uint64_t active_us;     /* time spent with data queued */
+    uint64_t bytes_per_sec; /* bytes over active_us */
+} tGattWriteStats;
+
+/*following functions are fed by the event loop*/
+void gattObjectAdded(const char *path, const char *ifc, DBusMessageIter *props);
+void gattObjectRemoved(const char *path, const char *ifc);
+void gattPropertiesChanged(const char *path, const char *ifc,
+                           DBusMessageIter *changed);
+/* Device1.ServicesResolved went true, acquire what is waiting on it */
+void gattServicesResolved(const char *device_path);
+/* Device1.Connected, tells a disconnect from a Service Changed */
+void gattDeviceConnected(const char *device_path, int connected);
+
+/*following functions may be called from any thread*/
+/* service_uuid may be NULL for any service; uuids may be 16 bit ("2a37") */
+int gattSubscribe(DBusConnection *conn, const char *device_path,
+                  const char *service_uuid, const char *chr_uuid,
+                  tGattNotifyCb cb, void *user);
+int gattUnsubscribe(int sub);
+int gattSubStats(int sub, tGattSubStats *stats);
+/* object path of a cached characteristic, -1 if not (yet) known */
+int gattFindCharacteristic(const char *device_path, const char *service_uuid,
+                           const char *chr_uuid, char *path, size_t size);
+/* object path of a descriptor of the characteristic at chr_path */
+int gattFindDescriptor(const char *device_path, const char *chr_path,
+                       const char *desc_uuid, char *path, size_t size);
+/* 1 if the services were resolved and no Service Changed came since */
+int gattDeviceCached(const char *device_path);
+/* window <= 0 takes GATT_WRITE_WINDOW, drained may be NULL */
+int gattWriterOpen(DBusConnection *conn, const char *device_path,
+                   const char *service_uuid, const char *chr_uuid,
+                   int window, tGattWriteCb drained, void *user);
+/* queues all of data or nothing: returns len, -1 if it doesn't fit */
+int gattWrite(int writer, const void *data, size_t len);
+/* drops whatever is still queued */
+int gattWriterClose(int writer);
+int gattWriterStats(int writer, tGattWriteStats *stats);
+/* sum of the device's writers */
+uint64_t gattDeviceWriteRate(const char *device_path);
+/* drops every subscription, writer and the cache */
+void gattCleanup();
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef BLUETOOTH_GATTREAD_H
+#define BLUETOOTH_GATTREAD_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <dbus/dbus.h>
+
+/*
+* Periodic GATT reads over a fleet of LE devices.
+*
+* A job is a (device, characteristic, period). Everything runs on the event
+* loop thread off one timerfd, nothing blocks on a reply. Jobs that are due
+* are taken most overdue first: a device that is connected and has resolved
+* its services gets all of its due reads at once, pipelined up to
+* GATT_READ_DEVICE_WINDOW. A device that isn't connected waits for a
+* connection slot; at most GATT_READ_CONNECTIONS per adapter are opened by
+* the scheduler. A connection it opened stays up while the device has
+* another job due within GATT_READ_LINGER_MS, and goes as soon as it is
+* idle if another device on the adapter is waiting for the slot.
+* Connections made by someone else are used but never closed. Reads start
+* right after Connect when the device's GATT cache is still valid (see
+* bluetooth_gatt.h), otherwise once its services have resolved.
+*
+* A device that can't be connected or resolved costs each of its due jobs a
+* failure and a period, so one bad device doesn't hold the others back.
+*/
+
+#define GATT_READ_MAX_JOBS          1024
+#define GATT_READ_MAX_DEVICES       256
+#define GATT_READ_MAX_ADAPTERS      4
+#define GATT_READ_CONNECTIONS       4       /* default per adapter */
+#define GATT_READ_DEVICE_WINDOW     4       /* ReadValue calls in flight */
+#define GATT_READ_LINGER_MS         2000
+#define GATT_READ_CONNECT_TIMEOUT_MS 10000  /* the Connect call */
+#define GATT_READ_RESOLVE_TIMEOUT_MS 10000  /* connected up to ServicesResolved */
+#define GATT_READ_TIMEOUT_MS        5000
+
+/* event loop thread; result 0 and the value, or -1 with data NULL */
+typedef void (*tGattReadCb)(int job, int result, const uint8_t *data, size_t len,
+                            void *user);
+
+typedef struct {
+    uint64_t reads;
+    uint64_t failures;      /* failed reads and unreachable device */
+    uint64_t last_latency_us;   /* ReadValue round trip */
+    uint64_t avg_latency_us;
+    uint64_t max_latency_us;
+    uint64_t last_lateness_us;  /* due time to reply */
+} tGattReadJobStats;
+
+typedef struct {
+    int jobs;
+    int connections;        /* opened by the scheduler and still up */
+    uint64_t reads;
+    uint64_t failures;
+    uint64_t connects;
+    uint64_t connect_failures;
+    uint64_t disconnects;
+    uint64_t reads_per_min; /* since the first job was added */
+} tGattReadStats;
+
+/*following functions are fed by the event loop*/
+void gattReadConnected(const char *device_path, int connected);
+void gattReadServicesResolved(const char *device_path);
+
+/*following functions may be called from any thread*/
+/* service_uuid may be NULL; the first read is due right away */
+int gattReadAddJob(DBusConnection *conn, const char *device_path,
+                   const char *service_uuid, const char *chr_uuid,
+                   uint32_t period_ms, tGattReadCb cb, void *user);
+int gattReadRemoveJob(int job);
+int gattReadJobStats(int job, tGattReadJobStats *stats);
+void gattReadStats(tGattReadStats *stats);
+/* connections the scheduler may hold open per adapter, <= 0 for the default */
+void gattReadSetConnectionLimit(int per_adapter);
+/* drops every job, connections opened by the scheduler stay up */
+void gattReadCleanup();
+
+#endif
@@ -0,0 +1,165 @@
+#ifndef BLUETOOTH_HFP_H
+#define BLUETOOTH_HFP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+* Hands-Free Profile AT engine, audio gateway (AG) and hands-free (HF) side.
+*
+* The engine is a plain struct the caller owns. Bytes from the RFCOMM link
+* go into hfpInput() in whatever pieces they arrive; lines are assembled in
+* place and parsed without allocating, and everything the engine answers
+* during one call is handed to send() as a single buffer. Numbers and other
+* strings passed to event() point into the line buffer and are only valid
+* during the callback.
+*
+* There is no clock in here: timers (ringing, command timeouts) are the
+* caller's business, so the same code runs on a socket, a socketpair
+* simulator or straight from memory.
+*/
+
+#define HFP_ROLE_AG               0
+#define HFP_ROLE_HF               1
+
+#define HFP_MAX_LINE              256
+#define HFP_OUT_SIZE              512
+#define HFP_NUMBER_SIZE           32
+
+/* AG supported features, +BRSF */
+#define HFP_AG_FEAT_3WAY          (1 << 0)
+#define HFP_AG_FEAT_ECNR          (1 << 1)
+#define HFP_AG_FEAT_VOICE_RECOG   (1 << 2)
+#define HFP_AG_FEAT_INBAND_RING   (1 << 3)
+#define HFP_AG_FEAT_REJECT        (1 << 5)
+#define HFP_AG_FEAT_ECS           (1 << 6)
+#define HFP_AG_FEAT_ECC           (1 << 7)
+#define HFP_AG_FEAT_EXT_ERRORS    (1 << 8)
+#define HFP_AG_FEAT_CODEC_NEG     (1 << 9)
+#define HFP_AG_DEFAULT_FEATURES   (HFP_AG_FEAT_3WAY | HFP_AG_FEAT_REJECT | \
+                                   HFP_AG_FEAT_ECS | HFP_AG_FEAT_EXT_ERRORS)
+
+/* HF supported features, AT+BRSF */
+#define HFP_HF_FEAT_ECNR          (1 << 0)
+#define HFP_HF_FEAT_3WAY          (1 << 1)
+#define HFP_HF_FEAT_CLI           (1 << 2)
+#define HFP_HF_FEAT_VOICE_RECOG   (1 << 3)
+#define HFP_HF_FEAT_VOLUME        (1 << 4)
+#define HFP_HF_FEAT_ECS           (1 << 5)
+#define HFP_HF_FEAT_ECC           (1 << 6)
+#define HFP_HF_FEAT_CODEC_NEG     (1 << 7)
+#define HFP_HF_DEFAULT_FEATURES   (HFP_HF_FEAT_3WAY | HFP_HF_FEAT_CLI | \
+                                   HFP_HF_FEAT_VOLUME | HFP_HF_FEAT_ECS)
+
+/* AG indicators in +CIND order, the HF maps whatever order the AG uses */
+#define HFP_IND_SERVICE           0
+#define HFP_IND_CALL              1
+#define HFP_IND_CALLSETUP         2   /* HFP_CALLSETUP_xxx */
+#define HFP_IND_CALLHELD          3
+#define HFP_IND_SIGNAL            4
+#define HFP_IND_ROAM              5
+#define HFP_IND_BATTCHG           6
+#define HFP_IND_MAX               7
+
+#define HFP_CALLSETUP_NONE        0
+#define HFP_CALLSETUP_INCOMING    1
+#define HFP_CALLSETUP_OUTGOING    2
+#define HFP_CALLSETUP_ALERTING    3
+
+#define HFP_VOLUME_SPEAKER        0   /* +VGS */
+#define HFP_VOLUME_MIC            1   /* +VGM */
+#define HFP_VOLUME_MAX            15
+
+/* service level connection progress */
+#define HFP_SLC_IDLE              0
+#define HFP_SLC_BRSF              1
+#define HFP_SLC_CIND_TEST         2
+#define HFP_SLC_CIND_READ         3
+#define HFP_SLC_CMER              4
+#define HFP_SLC_CHLD              5
+#define HFP_SLC_CONNECTED         6
+
+#define HFP_EVENT_SLC_CONNECTED   0
+#define HFP_EVENT_INDICATOR       1   /* index, value */
+#define HFP_EVENT_VOLUME          2   /* index HFP_VOLUME_xxx, value */
+#define HFP_EVENT_DIAL            3   /* AG: number, empty for redial */
+#define HFP_EVENT_ANSWER          4   /* AG: the HF picked up */
+#define HFP_EVENT_HANGUP          5   /* AG: the HF hung up or rejected */
+#define HFP_EVENT_RING            6   /* HF */
+#define HFP_EVENT_CALLER_ID       7   /* HF: number */
+#define HFP_EVENT_RESULT          8   /* HF: value 0 for OK, -1 for an error */
+#define HFP_EVENT_DTMF            9   /* AG: value is the digit */
+
+typedef struct {
+    int type;       /* HFP_EVENT_xxx */
+    int index;
+    int value;
+    const char *number;
+} tHfpEvent;
+
+typedef struct {
+    /* bytes for the link, -1 drops the connection */
+    int (*send)(void *user, const char *data, size_t len);
+    void (*event)(void *user, const tHfpEvent *event);
+} tHfpCallbacks;
+
+typedef struct {
+    uint64_t lines;         /* commands (AG) or result lines (HF) parsed */
+    uint64_t errors;        /* answered with ERROR, or ERROR received */
+    uint64_t overflows;     /* lines longer than HFP_MAX_LINE, dropped */
+    uint64_t sends;
+} tHfpStats;
+
+typedef struct {
+    int role;               /* HFP_ROLE_xxx */
+    int slc;                /* HFP_SLC_xxx */
+    uint32_t local_features;
+    uint32_t remote_features;
+    int ind[HFP_IND_MAX];
+    int ind_map[HFP_IND_MAX + 1];   /* HF: AG's 1-based index -> HFP_IND_xxx */
+    int ind_count;          /* HF: indicators the AG announced */
+    int reporting;          /* AG: +CMER enabled +CIEV */
+    uint32_t ind_active;    /* AG: +BIA mask */
+    int clip;
+    int ccwa;
+    int cmee;
+    int volume[2];
+    int incoming;           /* direction of the current call */
+    char number[HFP_NUMBER_SIZE];   /* current or last call */
+    int pending;            /* HF: a command is waiting for OK/ERROR */
+    int discard;            /* input line overflowed, skip to the next one */
+    size_t line_len;
+    char line[HFP_MAX_LINE];
+    size_t out_len;
+    char out[HFP_OUT_SIZE];
+    int failed;             /* send() returned -1 */
+    tHfpCallbacks cb;
+    void *user;
+    tHfpStats stats;
+} tHfp;
+
+/* features 0 picks the role's defaults */
+void initHfp(tHfp *h, int role, uint32_t features, const tHfpCallbacks *cb, void *user);
+/* feed link bytes, returns 0 or -1 if send() failed */
+int hfpInput(tHfp *h, const char *data, size_t len);
+
+/*following functions are for the HF side, -1 while a command is outstanding*/
+int hfpStartSlc(tHfp *h);
+int hfpAnswer(tHfp *h);
+int hfpHangup(tHfp *h);
+/* NULL number redials */
+int hfpDial(tHfp *h, const char *number);
+
+/*following functions are for the AG side, they report to the HF as needed*/
+int hfpSetIndicator(tHfp *h, int index, int value);
+int hfpIncomingCall(tHfp *h, const char *number);
+/* RING (+CLIP) again, the caller's timer decides when */
+int hfpRing(tHfp *h);
+int hfpCallAlerting(tHfp *h);
+int hfpCallActive(tHfp *h);
+int hfpCallEnded(tHfp *h);
+
+/* both sides: the AG reports +VGS/+VGM, the HF sends AT+VGS/AT+VGM */
+int hfpSetVolume(tHfp *h, int which, int value);
+
+#endif
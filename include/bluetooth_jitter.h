@@ -0,0 +1,57 @@
+#ifndef BLUETOOTH_JITTER_H
+#define BLUETOOTH_JITTER_H
+
+#include <stdint.h>
+
+/*
+* PCM jitter buffer between the transport reader and the sink.
+*
+* A single-producer/single-consumer ring of interleaved 16-bit frames: the
+* reader puts whatever a packet decoded to, the sink thread takes fixed
+* periods on the local clock. Neither side locks or allocates.
+*
+* The target depth follows the measured arrival jitter (RFC 3550 style
+* interarrival estimate plus a slowly decaying peak, which catches the
+* bursts A2DP sources like to send). Playback starts once the buffer holds
+* the target; the difference between the sender's clock and ours is
+* absorbed by dropping or repeating one frame per period whenever the
+* smoothed fill level leaves the band around the target.
+*/
+
+#define JITTER_MIN_MS       20
+#define JITTER_MAX_MS       250
+#define JITTER_PERIOD_MS    10      /* consumer pull size */
+
+typedef struct jitter_buffer tJitterBuffer;
+
+typedef struct {
+    uint64_t underruns;
+    uint64_t overruns;
+    uint64_t dropped_frames;
+    uint64_t inserted_frames;
+    uint32_t jitter_us;
+    uint32_t target_us;
+    uint32_t level_frames;
+} tJitterStats;
+
+tJitterBuffer * createJitterBuffer(int rate, int channels);
+void destroyJitterBuffer(tJitterBuffer *jb);
+/* frames per JITTER_PERIOD_MS at the buffer's rate */
+int jitterBufferPeriod(const tJitterBuffer *jb);
+
+/*following functions are for the producer thread only*/
+/* arrival_us is CLOCK_MONOTONIC when the packet came in, returns frames kept */
+int jitterBufferPut(tJitterBuffer *jb, const int16_t *pcm, int frames, uint64_t arrival_us);
+
+/*following functions are for the consumer thread only*/
+/*
+* Fill out with exactly frames frames. Returns frames, or 0 while the
+* buffer is still filling up to its target (out untouched). An underrun
+* plays what is left followed by silence and starts filling up again.
+*/
+int jitterBufferGet(tJitterBuffer *jb, int16_t *out, int frames);
+
+/* any thread */
+void jitterBufferStats(const tJitterBuffer *jb, tJitterStats *stats);
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef BLUETOOTH_MEDIA_H
+#define BLUETOOTH_MEDIA_H
+
+#include <stdint.h>
+#include <dbus/dbus.h>
+
+#define MEDIA_MAX_PLAYERS         16
+/* AVRCP absolute volume range carried by MediaTransport1.Volume */
+#define MEDIA_VOLUME_MAX          127
+#define MEDIA_VOLUME_STEP         8
+#define MEDIA_COMMAND_TIMEOUT_MS  1000
+/* Position is republished at most this often unless it jumps (seek) */
+#define MEDIA_POSITION_INTERVAL_MS 1000
+#define MEDIA_POSITION_SEEK_MS    2000
+#define MEDIA_CONFIG_SIZE         16
+
+typedef struct {
+    char path[128];
+    char state[16];             /* idle, pending, active */
+    int codec;                  /* a2dp codec id, -1 unknown */
+    uint8_t config[MEDIA_CONFIG_SIZE];
+    int config_len;
+} tMediaTransport;
+
+/*
+* following functions keep the player/transport cache, fed by the event loop.
+* MediaPlayer1/MediaTransport1 properties are published to the event stream
+* only when they differ from the last published value: Status as
+* MEDIA_STATUS, Track as MEDIA_TRACK, everything else as PROPERTY_CHANGED.
+*/
+void mediaObjectAdded(const char *path, const char *ifc, DBusMessageIter *props);
+void mediaObjectRemoved(const char *path, const char *ifc);
+void mediaPropertiesChanged(const char *path, const char *ifc,
+                            DBusMessageIter *changed);
+
+/*
+* Fire-and-forget player control. func is a MediaPlayer1 method (Play, Pause,
+* Stop, Next, Previous, FastForward, Rewind) or VolumeUp/VolumeDown.
+* Commands issued while an earlier one is still in flight are coalesced:
+* Next/Previous presses add up to a net skip count, Play/Pause/Stop keep the
+* last request, volume keeps the last target.
+* Returns -1 if no player is known for the device.
+*/
+int mediaPlayerCommand(DBusConnection *conn, const char *device_path,
+                       const char *func);
+/* absolute volume 0..MEDIA_VOLUME_MAX on the device's transport */
+int mediaSetVolume(DBusConnection *conn, const char *device_path, int volume);
+/* snapshot of the device's MediaTransport1, -1 if there is none */
+int mediaGetTransport(const char *device_path, tMediaTransport *transport);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef BLUETOOTH_METRICS_H
+#define BLUETOOTH_METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+* Process wide counters and gauges.
+*
+* Updates are relaxed atomics on a static table, so any thread, realtime
+* audio threads included, can bump them without a lock or a syscall. The
+* control socket dumps them as "name value" lines (CTRL_OP_METRICS).
+*/
+
+#define METRIC_AUDIO_UNDERRUNS          0   /* jitter buffer ran dry */
+#define METRIC_AUDIO_OVERRUNS           1   /* jitter buffer full, input dropped */
+#define METRIC_AUDIO_DROPPED_FRAMES     2   /* drift compensation */
+#define METRIC_AUDIO_INSERTED_FRAMES    3   /* drift compensation */
+#define METRIC_AUDIO_JITTER_US          4   /* gauge, last stream to update it */
+#define METRIC_AUDIO_LATENCY_US         5   /* gauge, jitter buffer target depth */
+#define METRIC_PROFILE_CONNECTIONS      6   /* gauge, open Profile1 connections */
+#define METRIC_PROFILE_RX_BYTES         7
+#define METRIC_PROFILE_TX_BYTES         8
+#define METRIC_GATT_NOTIFY_PACKETS      9
+#define METRIC_GATT_NOTIFY_BYTES        10
+#define METRIC_GATT_WRITE_BYTES         11
+#define METRIC_GATT_READS               12
+#define METRIC_GATT_READ_FAILURES       13
+#define METRIC_GATT_READ_LATENCY_US     14  /* gauge, last ReadValue round trip */
+#define METRIC_GATT_READ_CONNECTIONS    15  /* gauge, opened by the read scheduler */
+#define METRIC_ADV_RECORDS              16  /* decoded advertisement payloads */
+#define METRIC_ADV_MALFORMED            17
+#define METRIC_PRESENCE_DEVICES         18  /* gauge, devices in range */
+#define METRIC_DISCOVERY_SCAN_MS        19  /* time discovery ran */
+#define METRIC_DISCOVERY_HELD_MS        20  /* time it was held off by audio/paging */
+#define METRIC_DEVICE_GC_REMOVED        21  /* stale devices removed from bluez */
+#define METRIC_DEVICE_GC_OBJECTS        22  /* gauge, bluez objects of tracked devices */
+#define METRIC_MAX                      23
+
+/* n may be (uint64_t)-1 to take one off a gauge */
+void metricAdd(int id, uint64_t n);
+void metricSet(int id, uint64_t value);
+uint64_t metricGet(int id);
+/* "name value\n" per metric, returns the length written (truncated to size) */
+int formatMetrics(char *buf, size_t size);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef BLUETOOTH_PRESENCE_H
+#define BLUETOOTH_PRESENCE_H
+
+#include <stdint.h>
+
+#include "bluetooth_common.h"
+
+/*
+* Device presence: enter/leave events (BT_EVENT_PRESENCE) for devices in
+* radio range.
+*
+* A Device1 update carrying RSSI, ManufacturerData or ServiceData is a
+* sighting and only stamps the device's last-seen tick. Each tracked device
+* has one timer on a hierarchical timer wheel (bluetooth_timerwheel.h),
+* driven by a timerfd on the event loop. When it fires, a device seen
+* within the timeout is simply put back at last-seen + timeout, so a
+* sighting costs the same whatever the number of devices and the wheel
+* only does work once per timeout per device.
+*
+* Hysteresis: a device enters at enter_rssi or above and leaves when its
+* RSSI falls below leave_rssi, when it hasn't been seen for timeout_ms or
+* when bluez removes it. Devices that are out are forgotten after the same
+* timeout.
+*/
+
+#define PRESENCE_MAX_DEVICES        8192    /* power of two */
+#define PRESENCE_TICK_MS            100
+#define PRESENCE_DEFAULT_TIMEOUT_MS 10000
+#define PRESENCE_RSSI_UNSET         127
+
+typedef struct {
+    uint32_t timeout_ms;    /* 0 for the default */
+    int16_t enter_rssi;     /* dBm, PRESENCE_RSSI_UNSET for any */
+    int16_t leave_rssi;     /* dBm, below enter_rssi; PRESENCE_RSSI_UNSET for none */
+} tPresenceConfig;
+
+typedef struct {
+    int tracked;
+    int present;
+    uint64_t enters;
+    uint64_t leaves;
+    uint64_t sightings;
+    uint64_t expiries;      /* timers fired, rescheduled or not */
+} tPresenceStats;
+
+/*following functions are fed by the event loop*/
+void presenceDeviceUpdate(const char *device_path, t_property_value_array *array);
+void presenceDeviceRemoved(const char *device_path);
+
+/*following functions may be called from any thread*/
+/* starts tracking, or changes the config of a running engine */
+int presenceStart(const tPresenceConfig *config);
+/* 1 if the device is in, 0 otherwise */
+int presenceDevicePresent(const char *device_path);
+void presenceStats(tPresenceStats *stats);
+/* forgets every device without leave events */
+void presenceCleanup();
+
+#endif
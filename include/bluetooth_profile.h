@@ -0,0 +1,68 @@
+#ifndef BLUETOOTH_PROFILE_H
+#define BLUETOOTH_PROFILE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#include <dbus/dbus.h>
+
+/*
+* org.bluez.Profile1 server for profiles registered with RegisterProfile.
+*
+* NewConnection hands us the socket; it is made non-blocking and given to
+* one of a small pool of epoll workers, which owns it from then on. Reads
+* are batched with readv into buffers allocated when the connection comes
+* in, and outgoing data is queued in a per-connection ring drained with
+* writev when the socket is writable, so nothing blocks the event loop or
+* allocates per transfer.
+*
+* A connection is named by an int id that stays invalid once it is closed.
+*/
+
+#define PROFILE_MAX_OBJECTS       8
+#define PROFILE_MAX_CONNECTIONS   32
+#define PROFILE_WORKERS           2
+#define PROFILE_EPOLL_BATCH       32
+#define PROFILE_RX_BUFS           4
+#define PROFILE_RX_BUF_SIZE       4096
+#define PROFILE_RX_BUDGET         8       /* readv calls per wakeup, then yield */
+#define PROFILE_TX_SIZE           (64 * 1024) /* power of two */
+
+typedef struct {
+    /* event loop thread, before any data is delivered */
+    void (*connected)(int conn, const char *device, void *user);
+    /* worker thread, the buffers are reused once it returns */
+    void (*data)(int conn, const struct iovec *iov, int iovcnt, size_t len, void *user);
+    /* worker thread, the id is already invalid */
+    void (*disconnected)(int conn, void *user);
+    void *user;
+} tProfileHandler;
+
+typedef struct {
+    uint64_t rx_bytes;
+    uint64_t tx_bytes;
+    uint64_t rx_calls;      /* readv calls that returned data */
+    uint64_t tx_calls;
+    uint64_t tx_dropped;    /* bytes refused because the ring was full */
+    uint64_t tx_latency_max_us; /* queued until written */
+    uint64_t tx_latency_sum_us;
+    uint64_t tx_latency_count;
+} tProfileConnStats;
+
+int startProfileWorkers();
+/* closes every connection */
+void stopProfileWorkers();
+
+/* export Profile1 at path, handler may be NULL to just count and drop */
+int registerProfileObject(DBusConnection *conn, const char *path,
+                          const tProfileHandler *handler);
+void unregisterProfileObject(DBusConnection *conn, const char *path);
+
+/*following functions may be called from any thread*/
+/* returns len, or -1 if the connection is gone or the ring is full */
+int profileSend(int conn, const void *data, size_t len);
+int profileDisconnect(int conn);
+int profileConnStats(int conn, tProfileConnStats *stats);
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef BLUETOOTH_SBC_H
+#define BLUETOOTH_SBC_H
+
+#include <stdint.h>
+
+/*
+* SBC decoder for the A2DP sink path.
+*
+* Everything after the bitstream parsing is integer arithmetic with 64-bit
+* accumulation, so the scalar reference and the SIMD synthesis kernels give
+* bit-identical PCM. The kernels are picked at runtime from what the CPU
+* supports: AVX2 or SSE4.1 on x86, NEON on ARM.
+*/
+
+#define SBC_SYNCWORD              0x9c
+#define SBC_MAX_SUBBANDS          8
+#define SBC_MAX_BLOCKS            16
+#define SBC_MAX_CHANNELS          2
+/* PCM samples (all channels) one frame can produce */
+#define SBC_MAX_FRAME_SAMPLES     (SBC_MAX_BLOCKS * SBC_MAX_SUBBANDS * SBC_MAX_CHANNELS)
+#define SBC_MAX_FRAME_LENGTH      512
+
+#define SBC_MODE_MONO             0
+#define SBC_MODE_DUAL_CHANNEL     1
+#define SBC_MODE_STEREO           2
+#define SBC_MODE_JOINT_STEREO     3
+
+#define SBC_ALLOCATION_LOUDNESS   0
+#define SBC_ALLOCATION_SNR        1
+
+typedef struct {
+    int frequency;      /* Hz */
+    int blocks;
+    int mode;           /* SBC_MODE_xxx */
+    int channels;
+    int allocation;     /* SBC_ALLOCATION_xxx */
+    int subbands;
+    int bitpool;
+    int length;         /* bytes, header included */
+} tSbcFrameInfo;
+
+typedef struct sbc_decoder tSbcDecoder;
+
+/* impl is "scalar", "sse4.1", "avx2", "neon" or NULL for the best available */
+tSbcDecoder * createSbcDecoder(const char *impl);
+void destroySbcDecoder(tSbcDecoder *dec);
+const char * sbcDecoderImpl(const tSbcDecoder *dec);
+/* forget the filter history, eg: after a gap in the stream */
+void resetSbcDecoder(tSbcDecoder *dec);
+
+/*
+* Decode the frame at data into interleaved 16-bit PCM. pcm must hold
+* SBC_MAX_FRAME_SAMPLES. Returns the bytes consumed, or -1 for a bad or
+* truncated frame (info, if given, is filled in either way when the header
+* could be read).
+*/
+int sbcDecodeFrame(tSbcDecoder *dec, const uint8_t *data, int len,
+                   int16_t *pcm, tSbcFrameInfo *info);
+int sbcParseHeader(const uint8_t *data, int len, tSbcFrameInfo *info);
+
+/*following are the synthesis kernels, shared with bluetooth_sbc_simd.c*/
+typedef struct {
+    const char *name;
+    /* v[k] = round(sum_i n[i * 2m + k] * s[i] >> SBC_MATRIX_SHIFT), k < 2m */
+    void (*matrix)(const int32_t *n, const int32_t *s, int32_t *v, int m);
+    /* pcm[j * stride] = clip16(round(sum_t d[t * m + j] * u_t[j] >> 32)), j < m */
+    void (*window)(const int32_t *d, const int32_t *v, int16_t *pcm, int stride, int m);
+} tSbcKernels;
+
+#define SBC_MATRIX_SHIFT          28
+
+extern const tSbcKernels sbc_kernels_scalar;
+/* NULL where the build or the CPU has no such unit */
+const tSbcKernels * sbcKernelsSse41();
+const tSbcKernels * sbcKernelsAvx2();
+const tSbcKernels * sbcKernelsNeon();
+
+#endif
@@ -1,11 +1,80 @@
 #ifndef BLUETOOTH_SERVICE_H
 #define BLUETOOTH_SERVICE_H
 
+#include "bluetooth_common.h"
+#include "bluetooth_profile.h"
+#include "bluetooth_gatt.h"
+#include "bluetooth_gattread.h"
+#include "bluetooth_advmon.h"
+#include "bluetooth_discovery.h"
+#include "bluetooth_devicegc.h"
+#include "bluetooth_presence.h"
+#include "bluetooth_telemetry.h"
+
+/* result is 0 on success, -1 if bluez returned an error */
+typedef void (*tServiceResultCb)(int result, void *user);
+
 int initServices();
 int destoryServices();
 int startDiscovery();
 int stopDiscovery();
+
+#define DISC_FILTER_MAX_UUIDS 64
+
+struct disc_filter {
+    t_bt_uuid uuids[DISC_FILTER_MAX_UUIDS];
+    int num_uuids;
+    int16_t rssi;           /* 0 for none */
+    uint16_t path_loss;     /* 0 for none, ignored with rssi */
+    char transport[8];      /* "auto", "bredr", "le"; empty for auto */
+    uint8_t dup;            /* report every advertisement */
+};
+
+/* NULL removes the filter */
+int setDiscoveryFilter(struct disc_filter *filter);
+/* BT_EVENT_DEVICE_FOUND only for devices with one of these uuids, none for
+ * all; -1 on a bad uuid. see setDeviceUuidFilter() */
+int setDeviceFilter(const char **uuids, int count);
+int removeDevice(const char *device_path);
+/* removes unpaired devices not seen for a while, see bluetooth_devicegc.h */
+int startDeviceGc(const tDeviceGcConfig *config);
+/* enter/leave events for devices in range, see bluetooth_presence.h */
+int startPresence(const tPresenceConfig *config);
+/* smoothed RSSI per device, see bluetooth_telemetry.h */
+int startTelemetry(const tTelemetryConfig *config);
 int startPaireDevice(const char * device_path);
 int connectDevice(const char *device_path);
+int connectDeviceAsync(const char *device_path, tServiceResultCb cb, void *user);
+int connectProfile(const char *device_path, char *profile);
+int connectProfileAsync(const char *device_path, char *profile,
+                        tServiceResultCb cb, void *user);
+/* connections are served by the profile workers, see bluetooth_profile.h;
+ * registered async, cb gets the outcome unless these return -1 */
+int addProfile(char *path, char *uuid, char *name, int auto_connect,
+               tServiceResultCb cb, void *user);
+int addProfileHandler(char *path, char *uuid, char *name, int auto_connect,
+                      const tProfileHandler *handler, tServiceResultCb cb, void *user);
+/* HFP audio gateway on the profile workers, see bluetooth_hfp.h;
+ * 1 if already registered, cb is then not called */
+int startHfpGateway(tServiceResultCb cb, void *user);
+int mediaPlayerControl(const char *dev, const char *func);
+/* sink_spec as for createAudioSink(), the stream starts once bluez has audio */
+int startAudioSink(const char *device_path, const char *sink_spec);
+int stopAudioSink(const char *device_path);
+/* LE notifications through AcquireNotify, see bluetooth_gatt.h */
+int subscribeGattNotify(const char *device_path, const char *service_uuid,
+                        const char *chr_uuid, tGattNotifyCb cb, void *user);
+int unsubscribeGattNotify(int sub);
+/* queue with gattWrite(), close with gattWriterClose() */
+int openGattWriter(const char *device_path, const char *service_uuid,
+                   const char *chr_uuid, tGattWriteCb drained, void *user);
+/* periodic reads, see bluetooth_gattread.h; remove with gattReadRemoveJob() */
+int addGattReadJob(const char *device_path, const char *service_uuid,
+                   const char *chr_uuid, uint32_t period_ms, tGattReadCb cb, void *user);
+/* offloaded to bluez when it can, see bluetooth_advmon.h; remove with advMonitorRemove() */
+int addAdvertisementMonitor(const tAdvMonitorSpec *spec, tAdvMonitorCb cb, void *user);
+/* duty-cycled discovery next to startDiscovery(), see bluetooth_discovery.h */
+int requestDiscovery(const tDiscoveryDemand *demand);
+int releaseDiscovery(int demand);
 
 #endif
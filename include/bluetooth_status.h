@@ -0,0 +1,85 @@
+#ifndef BLUETOOTH_STATUS_H
+#define BLUETOOTH_STATUS_H
+
+#include <stdint.h>
+
+/*
+* Adapter and device state published by dbus_bt into POSIX shared memory.
+*
+* The page is guarded by a seqlock: the writer makes seq odd while it
+* updates and even again when done. Readers copy what they need and retry
+* if seq changed or was odd, so a snapshot costs a memcpy and never a
+* syscall or a lock. Only this header and libbtstatus are needed to read.
+*
+* When the device table is full, a new device takes the slot of the least
+* recently updated one that is neither connected nor paired, so scan noise
+* can't push those out.
+*/
+
+#define BT_STATUS_SHM_NAME        "/dbus_bt_status"
+#define BT_STATUS_MAGIC           0x42545354  /* "BTST" */
+#define BT_STATUS_VERSION         1
+#define BT_STATUS_MAX_DEVICES     128
+
+#define BT_STATUS_PATH_SIZE       64
+#define BT_STATUS_ADDR_SIZE       18
+#define BT_STATUS_NAME_SIZE       48
+
+#define BT_STATUS_RSSI_UNKNOWN    (-128)
+#define BT_STATUS_BATTERY_UNKNOWN (-1)
+
+typedef struct {
+    char address[BT_STATUS_ADDR_SIZE];
+    char name[BT_STATUS_NAME_SIZE];
+    uint8_t powered;
+    uint8_t discovering;
+    uint8_t discoverable;
+    uint8_t pairable;
+} tBtStatusAdapter;
+
+typedef struct {
+    char path[BT_STATUS_PATH_SIZE];
+    char address[BT_STATUS_ADDR_SIZE];
+    char name[BT_STATUS_NAME_SIZE];
+    int16_t rssi;           /* BT_STATUS_RSSI_UNKNOWN until seen */
+    int8_t battery;         /* percent, BT_STATUS_BATTERY_UNKNOWN if none */
+    uint8_t connected;
+    uint8_t paired;
+    uint8_t trusted;
+    uint64_t updated_us;    /* CLOCK_MONOTONIC of the last change */
+} tBtStatusDevice;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq;           /* odd while the writer is updating */
+    uint32_t num_devices;
+    uint64_t updated_us;
+    tBtStatusAdapter adapter;
+    tBtStatusDevice devices[BT_STATUS_MAX_DEVICES];
+} tBtStatusPage;
+
+/*following functions are the reader library (libbtstatus)*/
+/* maps the page read-only, NULL if dbus_bt hasn't created it */
+const tBtStatusPage * openStatusPage(const char *name);
+void closeStatusPage(const tBtStatusPage *page);
+/* consistent copy of the whole page, -EAGAIN if the writer kept it busy */
+int readStatusPage(const tBtStatusPage *page, tBtStatusPage *snapshot);
+/* consistent copy of one device, -1 if not present, -EAGAIN as above */
+int readStatusDevice(const tBtStatusPage *page, const char *address,
+                     tBtStatusDevice *device);
+
+/*following functions are used by dbus_bt to publish the page*/
+int initStatusPage(const char *name);
+void cleanupStatusPage();
+/* type is the dbus type of the value; strings go in str_val */
+void statusSetAdapterProperty(const char *name, int type, int int_val,
+                              const char *str_val);
+void statusSetDeviceProperty(const char *path, const char *name, int type,
+                             int int_val, const char *str_val);
+void statusRemoveDevice(const char *path);
+/* updates between these reach readers at once, in a single write section */
+void statusUpdateBegin();
+void statusUpdateEnd();
+
+#endif
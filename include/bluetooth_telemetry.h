@@ -0,0 +1,94 @@
+#ifndef BLUETOOTH_TELEMETRY_H
+#define BLUETOOTH_TELEMETRY_H
+
+#include <stdint.h>
+
+#include "bluetooth_common.h"
+
+/*
+* Per-device RSSI telemetry for proximity ranking.
+*
+* The table is a structure of arrays: last sample, EMA, Kalman estimate and
+* variance of every device sit in their own contiguous float arrays, dense
+* (a removed device is replaced by the last one), so the smoothing pass
+* every tick and the nearest-K selection are straight loops over memory
+* the SIMD kernels below run on. Devices are named by handles that stay
+* valid until the device goes away and are invalid after.
+*
+* Device1 RSSI changes only store the sample; the tick (a timerfd on the
+* event loop, only armed while there are devices) folds them in. A device
+* without a new sample keeps its estimate while its variance grows.
+*/
+
+#define TELEMETRY_MAX_DEVICES       16384   /* power of two */
+#define TELEMETRY_DEFAULT_TICK_MS   100
+#define TELEMETRY_DEFAULT_ALPHA     0.25f
+#define TELEMETRY_DEFAULT_Q         0.5f
+#define TELEMETRY_DEFAULT_R         16.0f
+
+/* 0 for the defaults */
+typedef struct {
+    uint32_t tick_ms;
+    float ema_alpha;        /* weight of a new sample, up to 1 */
+    float kalman_q;         /* process noise per tick, dB^2 */
+    float kalman_r;         /* measurement noise, dB^2 */
+} tTelemetryConfig;
+
+typedef struct {
+    float rssi;             /* last sample */
+    float ema;
+    float kalman;
+    float variance;         /* of the Kalman estimate */
+    uint32_t age_ms;        /* since the last sample */
+} tTelemetrySample;
+
+typedef struct {
+    int handle;
+    float rssi;             /* Kalman estimate */
+    char path[64];
+} tTelemetryNearest;
+
+typedef struct {
+    int devices;
+    uint64_t samples;
+    uint64_t ticks;
+    uint64_t last_tick_ns;  /* smoothing pass of the last tick */
+    const char *kernels;
+} tTelemetryStats;
+
+/*following functions are fed by the event loop*/
+void telemetryDeviceUpdate(const char *device_path, t_property_value_array *array);
+void telemetryDeviceRemoved(const char *device_path);
+
+/*following functions may be called from any thread*/
+/* starts the table, or changes the config of a running one */
+int telemetryStart(const tTelemetryConfig *config);
+int telemetryHandle(const char *device_path);
+int telemetryGet(int handle, tTelemetrySample *sample);
+/* up to k devices by smoothed RSSI, strongest first; returns how many */
+int telemetryNearest(tTelemetryNearest *nearest, int k);
+void telemetryStats(tTelemetryStats *stats);
+void telemetryCleanup();
+
+/*following are the kernels, shared with bluetooth_telemetry_kernels.c*/
+typedef struct {
+    float alpha, q, r;
+} tTelemetryParams;
+
+#define TELEMETRY_MAX_NEAREST       64
+
+typedef struct {
+    const char *name;
+    /* where pending[i] is 1 fold raw[i] into ema/x/p, then clear pending; i < n */
+    void (*smooth)(const float *raw, float *pending, float *ema, float *x, float *p,
+                   int n, const tTelemetryParams *params);
+    /* indices of the k largest value[i], largest first, k <= TELEMETRY_MAX_NEAREST */
+    int (*select)(const float *value, int n, int k, int *out);
+} tTelemetryKernels;
+
+extern const tTelemetryKernels telemetry_kernels_scalar;
+/* NULL where the build or the CPU has no such unit */
+const tTelemetryKernels * telemetryKernelsAvx2();
+const tTelemetryKernels * telemetryKernelsNeon();
+
+#endif
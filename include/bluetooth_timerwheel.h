@@ -0,0 +1,53 @@
+#ifndef BLUETOOTH_TIMERWHEEL_H
+#define BLUETOOTH_TIMERWHEEL_H
+
+#include <stdint.h>
+
+/*
+* Hierarchical timer wheel in ticks of the caller's choosing.
+*
+* TIMER_WHEEL_LEVELS rings of TIMER_WHEEL_SLOTS lists, each ring
+* TIMER_WHEEL_SLOTS times coarser than the one below. A timer goes into the
+* finest ring its delay fits, so adding, removing and moving one are O(1);
+* when time reaches a coarse slot its timers are cascaded into the finer
+* rings. Occupancy bitmaps let advancing skip empty slots.
+*
+* Nodes are embedded in the caller's structures, the wheel allocates
+* nothing and takes no lock: one thread owns it.
+*/
+
+#define TIMER_WHEEL_BITS    6
+#define TIMER_WHEEL_SLOTS   (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS  4
+/* longer delays are cut to this, the timer fires early */
+#define TIMER_WHEEL_MAX_DELAY ((1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+typedef struct tTimerNode {
+    struct tTimerNode *next;
+    struct tTimerNode *prev;    /* NULL while not pending */
+    uint64_t expires;           /* tick */
+} tTimerNode;
+
+typedef struct {
+    uint64_t now;               /* next tick to be processed */
+    int count;
+    uint64_t occupied[TIMER_WHEEL_LEVELS];
+    tTimerNode slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];    /* list heads */
+} tTimerWheel;
+
+/* the wheel hands fired nodes back, already removed */
+typedef void (*tTimerExpired)(tTimerNode *node, void *user);
+
+void timerWheelInit(tTimerWheel *w, uint64_t now);
+/* pending nodes are moved; an expiry in the past fires on the next advance */
+void timerWheelAdd(tTimerWheel *w, tTimerNode *node, uint64_t expires);
+void timerWheelRemove(tTimerWheel *w, tTimerNode *node);
+static inline int timerWheelPending(const tTimerNode *node) { return node->prev != 0; }
+/* fire everything due up to and including tick now, returns how many fired */
+int timerWheelAdvance(tTimerWheel *w, uint64_t now, tTimerExpired expired, void *user);
+/* earliest tick advancing has to happen at, UINT64_MAX if nothing is pending;
+ * may be before the first expiry when a coarse slot needs cascading
+ */
+uint64_t timerWheelNextTick(const tTimerWheel *w);
+
+#endif
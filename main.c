@@ -1,29 +1,50 @@
 #include <stdio.h>
+#include <string.h>
 #include <signal.h>
 #include <unistd.h>
 
 #include "bluetooth_eventloop.h"
 #include "bluetooth_service.h"
 #include "bluetooth_common.h"
+#include "bluetooth_ctrl.h"
+#include "bluetooth_status.h"
 
-#define DEFAULT_DEVICE_PATH "/org/bluez/hci0/dev_0C_12_62_24_15_E1"
-
-static int terminate = 0;
+static volatile sig_atomic_t terminate = 0;
 
 static void sig_term(int sig) {
     terminate = 1;
 }
 
-int main (void) {
+int main (int argc, char *argv[]) {
     int ret = 0;
     struct sigaction sa;
-    char cmd[64];
+    sigset_t term_set, wait_set;
+    const char *socket_path = argc > 1 ? argv[1] : CTRL_DEFAULT_SOCKET_PATH;
+
+    /* blocked before any thread starts, so they all inherit it and only
+     * sigsuspend() below takes the signal, with no window for losing it */
+    sigemptyset(&term_set);
+    sigaddset(&term_set, SIGTERM);
+    sigaddset(&term_set, SIGINT);
+    sigprocmask(SIG_BLOCK, &term_set, &wait_set);
+    sigdelset(&wait_set, SIGTERM);
+    sigdelset(&wait_set, SIGINT);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_flags = SA_NOCLDSTOP;
+    sa.sa_handler = sig_term;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT,  &sa, NULL);
+    /* a file sink may be a fifo whose reader goes away */
+    signal(SIGPIPE, SIG_IGN);
 
     ret = initializeBluetoothEvent();
     if (ret < 0) {
         printf("Failed to initialize bluetooth eventloop\n");
         return -1;
     }
+    if (initStatusPage(BT_STATUS_SHM_NAME) < 0) {
+        printf("Failed to create status page, readers will see nothing\n");
+    }
     ret = startEventLoop();
     if (ret < 0) {
         printf("Failed to start bluetooth eventloop\n");
@@ -35,49 +56,23 @@ int main (void) {
         goto exit;
     }
 
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_flags = SA_NOCLDSTOP;
-    sa.sa_handler = sig_term;
-    sigaction(SIGTERM, &sa, NULL);
-    sigaction(SIGINT,  &sa, NULL);
-
-    sleep(3);
-    //addProfile("/foo/bar/profile0", "0000110b-0000-1000-8000-00805f9b34fb", "a2dp_sink", 0);
-    //addProfile("/foo/bar/profile1", "0000110a-0000-1000-8000-00805f9b34fb", "a2dp_souce", 0);
-    //addProfile("/foo/bar/profile2", "0000110e-0000-1000-8000-00805f9b34fb", "avrcp_control", 0);
-    //addProfile("/foo/bar/profile3", "0000110c-0000-1000-8000-00805f9b34fb", "avrcp_control", 0);
+    /* requests now arrive on the control socket, served by the event loop */
+    ret = startControlServer(socket_path);
+    if (ret < 0) {
+        printf("Failed to start control server on %s\n", socket_path);
+        goto exit;
+    }
 
-    
     while (!terminate) {
-        memset(cmd, 0, sizeof(cmd));
-        scanf("%s", cmd);
-        if (strstr(cmd, "start_scan")) {
-            startDiscovery();
-        } else if (strstr(cmd, "stop_scan")) {
-            stopDiscovery();
-        } if (strstr(cmd, "pair")) {
-            startPaireDevice(DEFAULT_DEVICE_PATH);
-        } else if (strstr(cmd, "cancle_pair")) {
-
-        } else if (strstr(cmd, "connect_all")) {
-            connectDevice(DEFAULT_DEVICE_PATH);
-        } else if (strstr(cmd, "hfp-ag")) {
-            connectProfile(DEFAULT_DEVICE_PATH, "hfp-ag");
-        } else if (strstr(cmd, "audio-sink")) {
-            //connectProfile(DEFAULT_DEVICE_PATH, "0000110b-0000-1000-8000-00805f9b34fb");//a2dp sink
-            //connectProfile(DEFAULT_DEVICE_PATH, "0000110e-0000-1000-8000-00805f9b34fb");//avrcp remote
-            connectProfile(DEFAULT_DEVICE_PATH, "0000110a-0000-1000-8000-00805f9b34fb");//a2dp souce
-            connectProfile(DEFAULT_DEVICE_PATH, "0000110c-0000-1000-8000-00805f9b34fb");//avrcp control
-        } else if (strstr(cmd, "Play")) {
-            mediaPlayerControl("dev_50_8F_4C_E5_04_D9", "Play");
-        } else if (strstr(cmd, "Pause")) {
-            mediaPlayerControl("dev_50_8F_4C_E5_04_D9", "Pause");
-        }
+        sigsuspend(&wait_set);
     }
 
 exit:
     destoryServices();
     stopEventLoop();
+    stopControlServer();
+    cleanupStatusPage();
     cleanupBluetoothEvent();
+    return ret;
 }
 
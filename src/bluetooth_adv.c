@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "bluetooth_adv.h"
+#include "bluetooth_event.h"
+#include "bluetooth_metrics.h"
+
+typedef struct {
+    int source;             /* ADV_SOURCE_xxx */
+    uint16_t company;
+    t_bt_uuid uuid;
+    tAdvParser parser;
+    void *user;
+} tAdvParserEntry;
+
+static int parse_ibeacon(const uint8_t *data, size_t len, tAdvRecord *rec, void *user);
+static int parse_eddystone(const uint8_t *data, size_t len, tAdvRecord *rec, void *user);
+
+#define ADV_BUILTIN_PARSERS 2
+
+/* entries are written before g_num_parsers covers them and never change after */
+static pthread_mutex_t g_parser_lock = PTHREAD_MUTEX_INITIALIZER;
+static tAdvParserEntry g_parsers[ADV_MAX_PARSERS] = {
+    { ADV_SOURCE_MANUFACTURER, ADV_COMPANY_APPLE, { 0, 0 }, parse_ibeacon, NULL },
+    { ADV_SOURCE_SERVICE, 0, { (uint64_t)ADV_SERVICE_EDDYSTONE << 32 | 0x1000, BT_UUID_BASE_LO },
+      parse_eddystone, NULL },
+};
+static int g_num_parsers = ADV_BUILTIN_PARSERS;
+
+static tAdvStats g_stats;
+
+static uint16_t get_be16(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t get_be32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/* Apple 0x004c: 02 15, proximity uuid, major, minor, measured power at 1 m */
+static int parse_ibeacon(const uint8_t *data, size_t len, tAdvRecord *rec, void *user) {
+    if (len < 23 || data[0] != 0x02 || data[1] != 0x15)
+        return -1;
+    rec->format = ADV_FORMAT_IBEACON;
+    memcpy(rec->u.ibeacon.uuid, data + 2, 16);
+    rec->u.ibeacon.major = get_be16(data + 18);
+    rec->u.ibeacon.minor = get_be16(data + 20);
+    rec->tx_power = (int8_t)data[22];
+    return 0;
+}
+
+static const char * const eddystone_schemes[] = {
+    "http://www.", "https://www.", "http://", "https://",
+};
+
+static const char * const eddystone_expansions[] = {
+    ".com/", ".org/", ".edu/", ".net/", ".info/", ".biz/", ".gov/",
+    ".com", ".org", ".edu", ".net", ".info", ".biz", ".gov",
+};
+
+static void expand_url(const uint8_t *data, size_t len, char *url, size_t size) {
+    const char *part;
+    size_t n, pos = 0, i;
+
+    for (i = 0; i < len && pos + 1 < size; i++) {
+        if (data[i] < sizeof(eddystone_expansions) / sizeof(eddystone_expansions[0])) {
+            part = eddystone_expansions[data[i]];
+            n = strlen(part);
+            if (n > size - 1 - pos) n = size - 1 - pos;
+            memcpy(url + pos, part, n);
+            pos += n;
+        } else if (data[i] > 0x20 && data[i] < 0x7f) {
+            url[pos++] = data[i];
+        }
+    }
+    url[pos] = '\0';
+}
+
+/* service 0xfeaa: the first byte says which frame */
+static int parse_eddystone(const uint8_t *data, size_t len, tAdvRecord *rec, void *user) {
+    size_t n;
+
+    if (len < 2)
+        return -1;
+    switch (data[0]) {
+    case 0x00:      /* UID: tx power at 0 m, namespace, instance */
+        if (len < 18) return -1;
+        rec->format = ADV_FORMAT_EDDYSTONE_UID;
+        rec->tx_power = (int8_t)data[1];
+        memcpy(rec->u.eddystone_uid.namespace_id, data + 2, 10);
+        memcpy(rec->u.eddystone_uid.instance_id, data + 12, 6);
+        return 0;
+    case 0x10:      /* URL: tx power, scheme, encoded rest */
+        if (len < 3 || data[2] >= sizeof(eddystone_schemes) / sizeof(eddystone_schemes[0]))
+            return -1;
+        rec->format = ADV_FORMAT_EDDYSTONE_URL;
+        rec->tx_power = (int8_t)data[1];
+        n = strlen(eddystone_schemes[data[2]]);
+        memcpy(rec->u.eddystone_url.url, eddystone_schemes[data[2]], n);
+        expand_url(data + 3, len - 3, rec->u.eddystone_url.url + n,
+                   sizeof(rec->u.eddystone_url.url) - n);
+        return 0;
+    case 0x20:      /* TLM, only the unencrypted version 0 */
+        if (len < 14 || data[1] != 0x00) return -1;
+        rec->format = ADV_FORMAT_EDDYSTONE_TLM;
+        rec->u.eddystone_tlm.battery_mv = get_be16(data + 2);
+        rec->u.eddystone_tlm.temperature = (int16_t)get_be16(data + 4);
+        rec->u.eddystone_tlm.adv_count = get_be32(data + 6);
+        rec->u.eddystone_tlm.uptime_ds = get_be32(data + 10);
+        return 0;
+    }
+    return -1;
+}
+
+static int add_parser(const tAdvParserEntry *entry) {
+    int n;
+
+    pthread_mutex_lock(&g_parser_lock);
+    n = g_num_parsers;
+    if (n < ADV_MAX_PARSERS) {
+        g_parsers[n] = *entry;
+        __atomic_store_n(&g_num_parsers, n + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&g_parser_lock);
+    if (n == ADV_MAX_PARSERS) {
+        printf("%s: too many parsers\n", __FUNCTION__);
+        return -1;
+    }
+    return 0;
+}
+
+int advRegisterCompanyParser(uint16_t company, tAdvParser parser, void *user) {
+    tAdvParserEntry entry = { ADV_SOURCE_MANUFACTURER, company, { 0, 0 }, parser, user };
+
+    if (!parser) return -1;
+    return add_parser(&entry);
+}
+
+int advRegisterServiceParser(const char *service_uuid, tAdvParser parser, void *user) {
+    tAdvParserEntry entry = { ADV_SOURCE_SERVICE, 0, { 0, 0 }, parser, user };
+
+    if (!parser || bt_uuid_parse(service_uuid, &entry.uuid) < 0)
+        return -1;
+    return add_parser(&entry);
+}
+
+static const tAdvParserEntry * find_parser(int source, uint16_t company,
+                                           const t_bt_uuid *uuid) {
+    int i = __atomic_load_n(&g_num_parsers, __ATOMIC_ACQUIRE);
+
+    while (i-- > 0) {
+        if (g_parsers[i].source != source)
+            continue;
+        if (source == ADV_SOURCE_MANUFACTURER ? g_parsers[i].company == company :
+            BT_UUID_EQ(g_parsers[i].uuid, *uuid))
+            return &g_parsers[i];
+    }
+    return NULL;
+}
+
+int advDecodeMap(const t_variant_node *map, int16_t rssi, tAdvRecord *records, int max) {
+    const t_variant_node *key, *value;
+    const tAdvParserEntry *entry;
+    tAdvRecord *rec;
+    t_bt_uuid uuid = { 0, 0 };
+    int pos = 0, n = 0, id;
+
+    while (n < max && variant_map_next(map, &pos, &key, &value) == 0) {
+        if (value->type != DBUS_TYPE_ARRAY || value->element != DBUS_TYPE_BYTE)
+            continue;
+        rec = &records[n];
+        memset(&rec->u, 0, sizeof(rec->u));
+        rec->format = 0;
+        rec->tx_power = ADV_TX_POWER_NONE;
+        rec->rssi = rssi;
+        if (key->type == DBUS_TYPE_UINT16) {
+            rec->source = ADV_SOURCE_MANUFACTURER;
+            rec->id = (uint16_t)key->v.u64;
+        } else if (key->type == DBUS_TYPE_STRING && bt_uuid_parse(key->v.str, &uuid) == 0) {
+            rec->source = ADV_SOURCE_SERVICE;
+            id = bt_uuid_to16(&uuid);
+            rec->id = id < 0 ? 0 : id;
+        } else {
+            continue;
+        }
+        entry = find_parser(rec->source, rec->id, &uuid);
+        if (!entry) {
+            __atomic_add_fetch(&g_stats.unmatched, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (entry->parser(value->v.bytes, value->count, rec, entry->user) < 0) {
+            __atomic_add_fetch(&g_stats.malformed, 1, __ATOMIC_RELAXED);
+            metricAdd(METRIC_ADV_MALFORMED, 1);
+            continue;
+        }
+        n++;
+    }
+    return n;
+}
+
+void advStats(tAdvStats *stats) {
+    stats->records = __atomic_load_n(&g_stats.records, __ATOMIC_RELAXED);
+    stats->malformed = __atomic_load_n(&g_stats.malformed, __ATOMIC_RELAXED);
+    stats->unmatched = __atomic_load_n(&g_stats.unmatched, __ATOMIC_RELAXED);
+}
+
+void advPublishProperties(const char *path, t_property_value_array *array) {
+    tAdvRecord records[8];
+    t_property_value *value;
+    tBtEvent evt;
+    int16_t rssi = ADV_RSSI_NONE;
+    int i, j, n;
+
+    if (!array || !array->head) return;
+
+    for (i = 0; i < array->num; i++) {
+        if (array->head[i].type == DBUS_TYPE_INT16 && !strcmp(array->head[i].name, "RSSI"))
+            rssi = (int16_t)array->head[i].val.int_val;
+    }
+    for (i = 0; i < array->num; i++) {
+        value = &array->head[i];
+        if (value->type != DBUS_TYPE_DICT_ENTRY || !value->val.nodes)
+            continue;
+        n = advDecodeMap(value->val.nodes, rssi, records, 8);
+        for (j = 0; j < n; j++) {
+            memset(&evt, 0, sizeof(evt));
+            evt.type = BT_EVENT_ADVERTISEMENT;
+            snprintf(evt.path, sizeof(evt.path), "%s", path);
+            evt.u.adv = records[j];
+            publishEvent(&evt);
+        }
+        __atomic_add_fetch(&g_stats.records, n, __ATOMIC_RELAXED);
+        metricAdd(METRIC_ADV_RECORDS, n);
+    }
+}
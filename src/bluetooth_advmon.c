@@ -0,0 +1,813 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/timerfd.h>
+
+#include "bluetooth_advmon.h"
+#include "bluetooth_dbus_stubs.h"
+#include "bluetooth_eventloop.h"
+
+#define OBJECT_MANAGER_IFC  "org.freedesktop.DBus.ObjectManager"
+#define MONITOR_PATH_FMT    ADV_MONITOR_APP_PATH "/monitor%d"
+#define DEVICE_PATH_SIZE    64
+
+#define MON_SLOT_BITS       4       /* ADV_MONITOR_MAX */
+#define MON_SLOT(id)        ((id) & ((1 << MON_SLOT_BITS) - 1))
+#define MON_GEN(id)         ((uint32_t)(id) >> MON_SLOT_BITS)
+#define MON_ID(slot, gen)   ((int)(((gen) & 0x7ffffff) << MON_SLOT_BITS | (slot)))
+
+typedef enum {
+    MON_PENDING,            /* waiting for bluez to activate it */
+    MON_ACTIVE,             /* bluez does the matching */
+    MON_HOST,               /* we do */
+} tMonState;
+
+typedef enum {
+    APP_NONE,
+    APP_REGISTERING,
+    APP_REGISTERED,
+    APP_HOST,               /* no monitor manager, everything on the host */
+} tAppState;
+
+typedef struct {
+    int used;
+    uint32_t gen;
+    tMonState state;
+    tAdvMonitorSpec spec;
+    tAdvMonitorCb cb;
+    void *user;
+    uint64_t found;
+    uint64_t lost;
+} tAdvMonitor;
+
+/* host matching: monitors as bits, open addressed on the path hash */
+typedef struct {
+    int used;
+    uint32_t hash;
+    int16_t rssi;
+    uint32_t match;         /* monitors whose patterns it advertised */
+    uint32_t found;         /* monitors that reported it found */
+    uint64_t seen_us;       /* last advertisement */
+    /* per monitor: at or above rssi_high while not found, below rssi_low
+     * while found; 0 if not */
+    uint64_t since_us[ADV_MONITOR_MAX];
+    char path[DEVICE_PATH_SIZE];
+} tMonDevice;
+
+typedef struct {
+    int monitor;
+    int found;
+    tAdvMonitorCb cb;
+    void *user;
+} tMonNotify;
+
+static pthread_mutex_t g_advmon_lock = PTHREAD_MUTEX_INITIALIZER;
+static tAdvMonitor g_monitors[ADV_MONITOR_MAX];
+static tMonDevice g_devices[ADV_MONITOR_MAX_DEVICES];
+static DBusConnection *g_conn = NULL;
+static tAppState g_app_state = APP_NONE;
+static int g_tree_sent = 0;     /* bluez has fetched the objects */
+static uint32_t g_host_mask = 0;    /* monitors in MON_HOST */
+static int g_timer_fd = -1;         /* host timeouts */
+static uint64_t g_timer_us = 0;     /* when it fires, 0 if disarmed */
+
+static void on_timer(int fd, short revents, void *data);
+
+static uint64_t monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* lock held; fire at abs_us unless it is already due earlier */
+static void arm_timer(uint64_t abs_us) {
+    struct itimerspec its;
+
+    if (g_timer_fd < 0 || (g_timer_us && g_timer_us <= abs_us))
+        return;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = abs_us / 1000000;
+    its.it_value.tv_nsec = (abs_us % 1000000) * 1000;
+    timerfd_settime(g_timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+    g_timer_us = abs_us;
+}
+
+/* lock held */
+static int open_timer(void) {
+    g_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (g_timer_fd < 0 || addEventLoopFd(g_timer_fd, POLLIN, on_timer, NULL) < 0) {
+        printf("%s: no timer: %s\n", __FUNCTION__, strerror(errno));
+        if (g_timer_fd >= 0) close(g_timer_fd);
+        g_timer_fd = -1;
+        return -1;
+    }
+    g_timer_us = 0;
+    return 0;
+}
+
+static int valid_spec(const tAdvMonitorSpec *spec) {
+    const tAdvMonitorPattern *p;
+    int i;
+
+    if (!spec || spec->num_patterns <= 0 || spec->num_patterns > ADV_MONITOR_MAX_PATTERNS)
+        return 0;
+    for (i = 0; i < spec->num_patterns; i++) {
+        p = &spec->patterns[i];
+        if (!p->len || p->start + p->len > ADV_MONITOR_PATTERN_SIZE)
+            return 0;
+    }
+    return 1;
+}
+
+static void set_state(int slot, tMonState state) {
+    g_monitors[slot].state = state;
+    /* read without the lock to skip device updates while nothing is on the host */
+    if (state == MON_HOST)
+        __atomic_or_fetch(&g_host_mask, 1u << slot, __ATOMIC_RELAXED);
+    else
+        __atomic_and_fetch(&g_host_mask, ~(1u << slot), __ATOMIC_RELAXED);
+}
+
+static tAdvMonitor * lock_monitor(int id) {
+    tAdvMonitor *m;
+
+    if (id < 0)
+        return NULL;
+    m = &g_monitors[MON_SLOT(id)];
+    pthread_mutex_lock(&g_advmon_lock);
+    if (m->used && m->gen == MON_GEN(id))
+        return m;
+    pthread_mutex_unlock(&g_advmon_lock);
+    return NULL;
+}
+
+/*following functions build the objects bluez reads*/
+static void append_prop(DBusMessageIter *dict, const char *key, int type,
+                        const void *value) {
+    DBusMessageIter entry;
+
+    dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+    dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+    append_variant(&entry, type, (void *)value);
+    dbus_message_iter_close_container(dict, &entry);
+}
+
+/* a{sv} of AdvertisementMonitor1 */
+static void append_monitor_props(DBusMessageIter *iter, const tAdvMonitorSpec *spec) {
+    static const char *type = "or_patterns";
+    DBusMessageIter dict, entry, variant, array, pattern, bytes;
+    const char *key = "Patterns";
+    const uint8_t *data;
+    int i;
+
+    dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+    append_prop(&dict, "Type", DBUS_TYPE_STRING, &type);
+    if (spec->rssi_low != ADV_MONITOR_RSSI_UNSET)
+        append_prop(&dict, "RSSILowThreshold", DBUS_TYPE_INT16, &spec->rssi_low);
+    if (spec->rssi_high != ADV_MONITOR_RSSI_UNSET)
+        append_prop(&dict, "RSSIHighThreshold", DBUS_TYPE_INT16, &spec->rssi_high);
+    if (spec->rssi_low_timeout)
+        append_prop(&dict, "RSSILowTimeout", DBUS_TYPE_UINT16,
+                    &spec->rssi_low_timeout);
+    if (spec->rssi_high_timeout)
+        append_prop(&dict, "RSSIHighTimeout", DBUS_TYPE_UINT16,
+                    &spec->rssi_high_timeout);
+    append_prop(&dict, "RSSISamplingPeriod", DBUS_TYPE_UINT16, &spec->rssi_sampling);
+
+    /* a(yyay) */
+    dbus_message_iter_open_container(&dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+    dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+    dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, "a(yyay)", &variant);
+    dbus_message_iter_open_container(&variant, DBUS_TYPE_ARRAY, "(yyay)", &array);
+    for (i = 0; i < spec->num_patterns; i++) {
+        data = spec->patterns[i].data;
+        dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT, NULL, &pattern);
+        dbus_message_iter_append_basic(&pattern, DBUS_TYPE_BYTE, &spec->patterns[i].start);
+        dbus_message_iter_append_basic(&pattern, DBUS_TYPE_BYTE, &spec->patterns[i].ad_type);
+        dbus_message_iter_open_container(&pattern, DBUS_TYPE_ARRAY, "y", &bytes);
+        dbus_message_iter_append_fixed_array(&bytes, DBUS_TYPE_BYTE, &data,
+                                             spec->patterns[i].len);
+        dbus_message_iter_close_container(&pattern, &bytes);
+        dbus_message_iter_close_container(&array, &pattern);
+    }
+    dbus_message_iter_close_container(&variant, &array);
+    dbus_message_iter_close_container(&entry, &variant);
+    dbus_message_iter_close_container(&dict, &entry);
+    dbus_message_iter_close_container(iter, &dict);
+}
+
+/* a{sa{sv}} with the monitor interface */
+static void append_monitor_ifaces(DBusMessageIter *iter, const tAdvMonitorSpec *spec) {
+    DBusMessageIter ifaces, entry;
+    const char *ifc = ADV_MONITOR_IFC;
+
+    dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY, "{sa{sv}}", &ifaces);
+    dbus_message_iter_open_container(&ifaces, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+    dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &ifc);
+    append_monitor_props(&entry, spec);
+    dbus_message_iter_close_container(&ifaces, &entry);
+    dbus_message_iter_close_container(iter, &ifaces);
+}
+
+/* lock held */
+static void send_interfaces_changed(int slot, int added) {
+    DBusMessage *msg;
+    DBusMessageIter iter, array;
+    char path[DEVICE_PATH_SIZE];
+    const char *object = path, *ifc = ADV_MONITOR_IFC;
+
+    msg = dbus_message_new_signal(ADV_MONITOR_APP_PATH, OBJECT_MANAGER_IFC,
+                                  added ? "InterfacesAdded" : "InterfacesRemoved");
+    if (!msg) return;
+    snprintf(path, sizeof(path), MONITOR_PATH_FMT, slot);
+    dbus_message_iter_init_append(msg, &iter);
+    dbus_message_iter_append_basic(&iter, DBUS_TYPE_OBJECT_PATH, &object);
+    if (added) {
+        append_monitor_ifaces(&iter, &g_monitors[slot].spec);
+    } else {
+        dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "s", &array);
+        dbus_message_iter_append_basic(&array, DBUS_TYPE_STRING, &ifc);
+        dbus_message_iter_close_container(&iter, &array);
+    }
+    dbus_connection_send(g_conn, msg, NULL);
+    dbus_message_unref(msg);
+}
+
+static DBusHandlerResult send_reply(DBusConnection *conn, DBusMessage *reply) {
+    if (!reply) {
+        printf("%s: Cannot create message reply\n", __FUNCTION__);
+        return DBUS_HANDLER_RESULT_NEED_MEMORY;
+    }
+    dbus_connection_send(conn, reply, NULL);
+    dbus_message_unref(reply);
+    return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static DBusMessage * managed_objects_reply(DBusMessage *msg) {
+    DBusMessage *reply = dbus_message_new_method_return(msg);
+    DBusMessageIter iter, objects, entry;
+    char path[DEVICE_PATH_SIZE];
+    const char *object = path;
+    int i;
+
+    if (!reply) return NULL;
+    dbus_message_iter_init_append(reply, &iter);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{oa{sa{sv}}}", &objects);
+    pthread_mutex_lock(&g_advmon_lock);
+    for (i = 0; i < ADV_MONITOR_MAX; i++) {
+        if (!g_monitors[i].used || g_monitors[i].state == MON_HOST)
+            continue;
+        snprintf(path, sizeof(path), MONITOR_PATH_FMT, i);
+        dbus_message_iter_open_container(&objects, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+        dbus_message_iter_append_basic(&entry, DBUS_TYPE_OBJECT_PATH, &object);
+        append_monitor_ifaces(&entry, &g_monitors[i].spec);
+        dbus_message_iter_close_container(&objects, &entry);
+    }
+    g_tree_sent = 1;
+    pthread_mutex_unlock(&g_advmon_lock);
+    dbus_message_iter_close_container(&iter, &objects);
+    return reply;
+}
+
+/* DeviceFound/DeviceLost/Activate/Release on one monitor */
+static DBusHandlerResult monitor_call(DBusConnection *conn, DBusMessage *msg, int slot) {
+    const char *member = dbus_message_get_member(msg);
+    const char *device = NULL;
+    tAdvMonitorCb cb = NULL;
+    void *user = NULL;
+    int id = -1, found;
+
+    if (!dbus_message_has_interface(msg, ADV_MONITOR_IFC))
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    found = !strcmp(member, "DeviceFound");
+    if ((found || !strcmp(member, "DeviceLost")) &&
+        !dbus_message_get_args(msg, NULL, DBUS_TYPE_OBJECT_PATH, &device, DBUS_TYPE_INVALID))
+        return send_reply(conn, dbus_message_new_error(msg, BLUEZ_ERROR_IFC ".InvalidArguments",
+                                                       "Invalid arguments"));
+
+    pthread_mutex_lock(&g_advmon_lock);
+    if (g_monitors[slot].used) {
+        if (!strcmp(member, "Activate")) {
+            printf("%s: monitor %d offloaded\n", __FUNCTION__, slot);
+            set_state(slot, MON_ACTIVE);
+        } else if (!strcmp(member, "Release")) {
+            /* bluez gave up on it, keep it going here */
+            printf("%s: monitor %d released, matching on the host\n", __FUNCTION__, slot);
+            set_state(slot, MON_HOST);
+        } else if (device) {
+            if (found) g_monitors[slot].found++;
+            else g_monitors[slot].lost++;
+            cb = g_monitors[slot].cb;
+            user = g_monitors[slot].user;
+            id = MON_ID(slot, g_monitors[slot].gen);
+        }
+    }
+    pthread_mutex_unlock(&g_advmon_lock);
+
+    if (cb)
+        cb(id, device, found, user);
+    return send_reply(conn, dbus_message_new_method_return(msg));
+}
+
+static DBusHandlerResult advmon_event_filter(DBusConnection *conn, DBusMessage *msg,
+                                             void *data) {
+    const char *path = dbus_message_get_path(msg);
+    int slot;
+
+    if (dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_METHOD_CALL || !path)
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    if (!strcmp(path, ADV_MONITOR_APP_PATH)) {
+        if (dbus_message_is_method_call(msg, OBJECT_MANAGER_IFC, "GetManagedObjects"))
+            return send_reply(conn, managed_objects_reply(msg));
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    }
+    if (sscanf(path, MONITOR_PATH_FMT, &slot) != 1 || slot < 0 || slot >= ADV_MONITOR_MAX)
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    return monitor_call(conn, msg, slot);
+}
+
+static const DBusObjectPathVTable advmon_vtable = {
+    NULL, advmon_event_filter, NULL, NULL, NULL, NULL
+};
+
+/* lock held */
+static void fall_back_to_host() {
+    int i;
+
+    g_app_state = APP_HOST;
+    for (i = 0; i < ADV_MONITOR_MAX; i++) {
+        if (g_monitors[i].used)
+            set_state(i, MON_HOST);
+    }
+}
+
+static void onRegisterMonitorResult(DBusMessage *msg, void *user, void *n) {
+    DBusError err;
+
+    dbus_error_init(&err);
+    pthread_mutex_lock(&g_advmon_lock);
+    if (g_app_state != APP_REGISTERING) {
+        pthread_mutex_unlock(&g_advmon_lock);
+        return;
+    }
+    if (dbus_set_error_from_message(&err, msg)) {
+        /* UnknownMethod/UnknownObject without the experimental manager */
+        printf("%s: no monitor offload (%s), matching on the host\n",
+               __FUNCTION__, err.name);
+        dbus_error_free(&err);
+        fall_back_to_host();
+    } else {
+        g_app_state = APP_REGISTERED;
+    }
+    pthread_mutex_unlock(&g_advmon_lock);
+}
+
+/* lock held */
+static void register_app(DBusConnection *conn) {
+    DBusMessage *msg;
+
+    g_conn = dbus_connection_ref(conn);
+    g_tree_sent = 0;
+    if (!dbus_connection_register_fallback(conn, ADV_MONITOR_APP_PATH, &advmon_vtable, NULL)) {
+        printf("%s: Can't register object path %s for monitors!\n",
+               __FUNCTION__, ADV_MONITOR_APP_PATH);
+        fall_back_to_host();
+        return;
+    }
+    g_app_state = APP_REGISTERING;
+    msg = bluez_advertisement_monitor_manager1_register_monitor_new(ADAPTER_PATH,
+                                                                    ADV_MONITOR_APP_PATH);
+    if (!msg || !dbus_message_send_async(conn, msg, -1, onRegisterMonitorResult, NULL, NULL))
+        fall_back_to_host();
+    if (msg) dbus_message_unref(msg);
+}
+
+int advMonitorAdd(DBusConnection *conn, const tAdvMonitorSpec *spec,
+                  tAdvMonitorCb cb, void *user) {
+    tAdvMonitor *m;
+    int i;
+
+    if (!conn || !valid_spec(spec))
+        return -1;
+    pthread_mutex_lock(&g_advmon_lock);
+    if (g_timer_fd < 0 && open_timer() < 0) {
+        pthread_mutex_unlock(&g_advmon_lock);
+        return -1;
+    }
+    for (i = 0; i < ADV_MONITOR_MAX && g_monitors[i].used; i++);
+    if (i == ADV_MONITOR_MAX) {
+        pthread_mutex_unlock(&g_advmon_lock);
+        printf("%s: too many monitors\n", __FUNCTION__);
+        return -1;
+    }
+    m = &g_monitors[i];
+    m->used = 1;
+    m->gen++;
+    m->spec = *spec;
+    m->cb = cb;
+    m->user = user;
+    m->found = m->lost = 0;
+    set_state(i, g_app_state == APP_HOST ? MON_HOST : MON_PENDING);
+
+    if (g_app_state == APP_NONE)
+        register_app(conn);
+    else if (g_app_state != APP_HOST && g_tree_sent)
+        send_interfaces_changed(i, 1);
+    i = MON_ID(i, m->gen);
+    pthread_mutex_unlock(&g_advmon_lock);
+    return i;
+}
+
+/* lock held; forget what host matching knew about the monitor */
+static void clear_monitor_bits(int slot) {
+    uint32_t bit = 1u << slot;
+    int i;
+
+    for (i = 0; i < ADV_MONITOR_MAX_DEVICES; i++) {
+        g_devices[i].match &= ~bit;
+        g_devices[i].found &= ~bit;
+        g_devices[i].since_us[slot] = 0;
+    }
+}
+
+int advMonitorRemove(int monitor) {
+    tAdvMonitor *m = lock_monitor(monitor);
+    int slot = MON_SLOT(monitor);
+
+    if (!m) return -1;
+    if (m->state != MON_HOST && g_app_state != APP_HOST && g_tree_sent)
+        send_interfaces_changed(slot, 0);
+    if (m->state == MON_HOST)
+        clear_monitor_bits(slot);
+    set_state(slot, MON_PENDING);
+    m->used = 0;
+    pthread_mutex_unlock(&g_advmon_lock);
+    return 0;
+}
+
+int advMonitorStats(int monitor, tAdvMonitorStats *stats) {
+    tAdvMonitor *m = lock_monitor(monitor);
+
+    if (!m) return -1;
+    stats->offloaded = m->state == MON_ACTIVE ? 1 : m->state == MON_HOST ? -1 : 0;
+    stats->found = m->found;
+    stats->lost = m->lost;
+    pthread_mutex_unlock(&g_advmon_lock);
+    return 0;
+}
+
+int advMonitorOffloaded() {
+    int ret;
+
+    pthread_mutex_lock(&g_advmon_lock);
+    ret = g_app_state == APP_REGISTERED ? 1 : g_app_state == APP_HOST ? -1 : 0;
+    pthread_mutex_unlock(&g_advmon_lock);
+    return ret;
+}
+
+void advMonitorCleanup() {
+    DBusMessage *msg;
+
+    pthread_mutex_lock(&g_advmon_lock);
+    if (g_conn) {
+        if (g_app_state == APP_REGISTERED || g_app_state == APP_REGISTERING) {
+            msg = bluez_advertisement_monitor_manager1_unregister_monitor_new(
+                      ADAPTER_PATH, ADV_MONITOR_APP_PATH);
+            if (msg) {
+                dbus_connection_send(g_conn, msg, NULL);
+                dbus_message_unref(msg);
+            }
+        }
+        dbus_connection_unregister_object_path(g_conn, ADV_MONITOR_APP_PATH);
+        dbus_connection_unref(g_conn);
+        g_conn = NULL;
+    }
+    if (g_timer_fd >= 0) {
+        closeEventLoopFd(g_timer_fd);
+        g_timer_fd = -1;
+    }
+    g_timer_us = 0;
+    memset(g_monitors, 0, sizeof(g_monitors));
+    memset(g_devices, 0, sizeof(g_devices));
+    g_app_state = APP_NONE;
+    g_tree_sent = 0;
+    __atomic_store_n(&g_host_mask, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&g_advmon_lock);
+}
+
+/*following functions match on the host*/
+static uint32_t path_hash(const char *path) {
+    uint32_t h = 2166136261u;
+
+    while (*path)
+        h = (h ^ (uint8_t)*path++) * 16777619u;
+    return h;
+}
+
+/* lock held; slot of the device, -1 if it isn't there and create is 0 or no room */
+static int find_device(const char *path, int create) {
+    uint32_t hash = path_hash(path);
+    int i = hash & (ADV_MONITOR_MAX_DEVICES - 1), n;
+    static int full_logged = 0;
+
+    for (n = 0; n < ADV_MONITOR_MAX_DEVICES; n++) {
+        if (!g_devices[i].used)
+            break;
+        if (g_devices[i].hash == hash && !strcmp(g_devices[i].path, path))
+            return i;
+        i = (i + 1) & (ADV_MONITOR_MAX_DEVICES - 1);
+    }
+    if (!create || n == ADV_MONITOR_MAX_DEVICES || strlen(path) >= DEVICE_PATH_SIZE) {
+        if (create && n == ADV_MONITOR_MAX_DEVICES && !full_logged++)
+            printf("%s: device table full\n", __FUNCTION__);
+        return -1;
+    }
+    memset(&g_devices[i], 0, sizeof(g_devices[i]));
+    g_devices[i].used = 1;
+    g_devices[i].hash = hash;
+    g_devices[i].rssi = ADV_MONITOR_RSSI_UNSET;
+    strcpy(g_devices[i].path, path);
+    return i;
+}
+
+/* lock held; backward shift so probes never need tombstones */
+static void drop_device(int i) {
+    int j = i, home;
+
+    for (;;) {
+        j = (j + 1) & (ADV_MONITOR_MAX_DEVICES - 1);
+        if (!g_devices[j].used)
+            break;
+        home = g_devices[j].hash & (ADV_MONITOR_MAX_DEVICES - 1);
+        /* j can move to i unless its home lies cyclically in (i, j] */
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+            g_devices[i] = g_devices[j];
+            i = j;
+        }
+    }
+    g_devices[i].used = 0;
+}
+
+/* pattern against one AD structure given as prefix + data */
+static int pattern_hits(const tAdvMonitorPattern *p, const uint8_t *prefix, int prefix_len,
+                        const uint8_t *data, int len) {
+    int i, pos;
+    uint8_t c;
+
+    if (p->start + p->len > prefix_len + len)
+        return 0;
+    for (i = 0; i < p->len; i++) {
+        pos = p->start + i;
+        c = pos < prefix_len ? prefix[pos] : data[pos - prefix_len];
+        if (c != p->data[i])
+            return 0;
+    }
+    return 1;
+}
+
+/* monitors in mask with a pattern for the AD structure */
+static uint32_t match_ad(uint32_t mask, uint8_t ad_type, const uint8_t *prefix,
+                         int prefix_len, const uint8_t *data, int len) {
+    const tAdvMonitorSpec *spec;
+    uint32_t hits = 0;
+    int i, j;
+
+    for (i = 0; i < ADV_MONITOR_MAX; i++) {
+        if (!(mask & (1u << i)))
+            continue;
+        spec = &g_monitors[i].spec;
+        for (j = 0; j < spec->num_patterns; j++) {
+            if (spec->patterns[j].ad_type == ad_type &&
+                pattern_hits(&spec->patterns[j], prefix, prefix_len, data, len)) {
+                hits |= 1u << i;
+                break;
+            }
+        }
+    }
+    return hits;
+}
+
+/* ManufacturerData/ServiceData back into AD structures: the key goes first, little endian */
+static uint32_t match_map(uint32_t mask, const t_variant_node *map) {
+    const t_variant_node *key, *value;
+    uint8_t prefix[16];
+    t_bt_uuid uuid;
+    uint32_t hits = 0;
+    int pos = 0, i, uuid16;
+
+    while (variant_map_next(map, &pos, &key, &value) == 0) {
+        if (value->type != DBUS_TYPE_ARRAY || value->element != DBUS_TYPE_BYTE)
+            continue;
+        if (key->type == DBUS_TYPE_UINT16) {
+            prefix[0] = key->v.u64 & 0xff;
+            prefix[1] = key->v.u64 >> 8;
+            hits |= match_ad(mask, ADV_AD_MANUFACTURER, prefix, 2, value->v.bytes, value->count);
+        } else if (key->type == DBUS_TYPE_STRING && bt_uuid_parse(key->v.str, &uuid) == 0) {
+            if ((uuid16 = bt_uuid_to16(&uuid)) >= 0) {
+                prefix[0] = uuid16 & 0xff;
+                prefix[1] = uuid16 >> 8;
+                hits |= match_ad(mask, ADV_AD_SERVICE_DATA16, prefix, 2,
+                                 value->v.bytes, value->count);
+            } else {
+                for (i = 0; i < 8; i++) {
+                    prefix[i] = uuid.lo >> (8 * i);
+                    prefix[8 + i] = uuid.hi >> (8 * i);
+                }
+                hits |= match_ad(mask, ADV_AD_SERVICE_DATA128, prefix, 16,
+                                 value->v.bytes, value->count);
+            }
+        }
+    }
+    return hits;
+}
+
+/* silence that makes a found device lost */
+static uint64_t lost_after_us(const tAdvMonitorSpec *spec) {
+    return (spec->rssi_low_timeout ? spec->rssi_low_timeout : ADV_MONITOR_HOST_LOST_S) *
+           1000000ULL;
+}
+
+/*
+* lock held; moves the device between found and lost for the host monitors
+* as of now, notifications go to notify. The earliest time something may
+* change without another update goes into *next.
+*/
+static int step_device(tMonDevice *d, uint32_t mask, uint64_t now,
+                       tMonNotify *notify, uint64_t *next) {
+    const tAdvMonitorSpec *spec;
+    uint64_t due, lost_due;
+    uint32_t bit;
+    int i, n = 0;
+
+    for (i = 0; i < ADV_MONITOR_MAX; i++) {
+        bit = 1u << i;
+        if (!(d->match & mask & bit))
+            continue;
+        spec = &g_monitors[i].spec;
+        lost_due = d->seen_us + lost_after_us(spec);
+        if (!(d->found & bit)) {
+            if ((spec->rssi_high != ADV_MONITOR_RSSI_UNSET &&
+                 (d->rssi == ADV_MONITOR_RSSI_UNSET || d->rssi < spec->rssi_high)) ||
+                lost_due <= now) {
+                d->since_us[i] = 0;
+                continue;
+            }
+            if (!d->since_us[i])
+                d->since_us[i] = now;
+            due = d->since_us[i];
+            if (spec->rssi_high != ADV_MONITOR_RSSI_UNSET)
+                due += spec->rssi_high_timeout * 1000000ULL;
+            if (due > now) {
+                if (due < *next) *next = due;
+                continue;
+            }
+            d->found |= bit;
+            g_monitors[i].found++;
+            if (lost_due < *next) *next = lost_due;
+        } else {
+            due = lost_due;
+            if (spec->rssi_low != ADV_MONITOR_RSSI_UNSET &&
+                d->rssi != ADV_MONITOR_RSSI_UNSET && d->rssi < spec->rssi_low) {
+                if (!d->since_us[i])
+                    d->since_us[i] = now;
+                if (d->since_us[i] + spec->rssi_low_timeout * 1000000ULL < due)
+                    due = d->since_us[i] + spec->rssi_low_timeout * 1000000ULL;
+            } else {
+                d->since_us[i] = 0;
+            }
+            if (due > now) {
+                if (due < *next) *next = due;
+                continue;
+            }
+            d->found &= ~bit;
+            g_monitors[i].lost++;
+        }
+        d->since_us[i] = 0;
+        notify[n].monitor = MON_ID(i, g_monitors[i].gen);
+        notify[n].found = (d->found & bit) != 0;
+        notify[n].cb = g_monitors[i].cb;
+        notify[n++].user = g_monitors[i].user;
+    }
+    return n;
+}
+
+void advMonitorDeviceUpdate(const char *device_path, t_property_value_array *array) {
+    tMonNotify notify[ADV_MONITOR_MAX];
+    t_property_value *value;
+    tMonDevice *d;
+    uint32_t mask, hits = 0;
+    uint64_t now, next = UINT64_MAX;
+    int i, n, slot, has_rssi = 0, advertised = 0;
+    int16_t rssi = 0;
+
+    if (!__atomic_load_n(&g_host_mask, __ATOMIC_RELAXED) || !array || !array->head)
+        return;
+
+    pthread_mutex_lock(&g_advmon_lock);
+    mask = g_host_mask;
+    for (i = 0; i < array->num; i++) {
+        value = &array->head[i];
+        if (value->type == DBUS_TYPE_DICT_ENTRY && value->val.nodes) {
+            hits |= match_map(mask, value->val.nodes);
+            advertised = 1;
+        } else if (value->type == DBUS_TYPE_STRING && !strcmp(value->name, "Name") &&
+                   value->val.str_val) {
+            hits |= match_ad(mask, ADV_AD_NAME_COMPLETE, NULL, 0,
+                             (const uint8_t *)value->val.str_val, strlen(value->val.str_val));
+            hits |= match_ad(mask, ADV_AD_NAME_SHORT, NULL, 0,
+                             (const uint8_t *)value->val.str_val, strlen(value->val.str_val));
+        } else if (value->type == DBUS_TYPE_INT16 && !strcmp(value->name, "RSSI")) {
+            rssi = (int16_t)value->val.int_val;
+            has_rssi = 1;
+        }
+    }
+    slot = find_device(device_path, hits != 0);
+    if (slot < 0) {
+        pthread_mutex_unlock(&g_advmon_lock);
+        return;
+    }
+    d = &g_devices[slot];
+    now = monotonic_us();
+    d->match |= hits;
+    if (has_rssi)
+        d->rssi = rssi;
+    if (has_rssi || advertised || hits)
+        d->seen_us = now;
+
+    n = step_device(d, mask, now, notify, &next);
+    if (next != UINT64_MAX)
+        arm_timer(next);
+    pthread_mutex_unlock(&g_advmon_lock);
+
+    for (i = 0; i < n; i++) {
+        if (notify[i].cb)
+            notify[i].cb(notify[i].monitor, device_path, notify[i].found, notify[i].user);
+    }
+}
+
+/* RSSI timeouts and silence, without an update to trigger them */
+static void on_timer(int fd, short revents, void *data) {
+    tMonNotify notify[ADV_MONITOR_MAX];
+    char path[DEVICE_PATH_SIZE];
+    uint64_t expirations, now, next = UINT64_MAX;
+    uint32_t mask;
+    int i, j, n;
+
+    while (read(fd, &expirations, sizeof(expirations)) < 0 && errno == EINTR);
+    pthread_mutex_lock(&g_advmon_lock);
+    g_timer_us = 0;
+    now = monotonic_us();
+    for (i = 0; i < ADV_MONITOR_MAX_DEVICES; i++) {
+        mask = g_host_mask;
+        if (!g_devices[i].used || !(g_devices[i].match & mask))
+            continue;
+        n = step_device(&g_devices[i], mask, now, notify, &next);
+        if (!n)
+            continue;
+        /* callbacks run unlocked, the slot may move meanwhile */
+        strcpy(path, g_devices[i].path);
+        pthread_mutex_unlock(&g_advmon_lock);
+        for (j = 0; j < n; j++) {
+            if (notify[j].cb)
+                notify[j].cb(notify[j].monitor, path, notify[j].found, notify[j].user);
+        }
+        pthread_mutex_lock(&g_advmon_lock);
+    }
+    if (next != UINT64_MAX)
+        arm_timer(next);
+    pthread_mutex_unlock(&g_advmon_lock);
+}
+
+void advMonitorDeviceRemoved(const char *device_path) {
+    tMonNotify notify[ADV_MONITOR_MAX];
+    int i, n = 0, slot;
+
+    if (!__atomic_load_n(&g_host_mask, __ATOMIC_RELAXED))
+        return;
+    pthread_mutex_lock(&g_advmon_lock);
+    slot = find_device(device_path, 0);
+    if (slot < 0) {
+        pthread_mutex_unlock(&g_advmon_lock);
+        return;
+    }
+    for (i = 0; i < ADV_MONITOR_MAX; i++) {
+        if (!(g_devices[slot].found & (1u << i)) || !g_monitors[i].used)
+            continue;
+        g_monitors[i].lost++;
+        notify[n].monitor = MON_ID(i, g_monitors[i].gen);
+        notify[n].found = 0;
+        notify[n].cb = g_monitors[i].cb;
+        notify[n++].user = g_monitors[i].user;
+    }
+    drop_device(slot);
+    pthread_mutex_unlock(&g_advmon_lock);
+
+    for (i = 0; i < n; i++) {
+        if (notify[i].cb)
+            notify[i].cb(notify[i].monitor, device_path, 0, notify[i].user);
+    }
+}
@@ -0,0 +1,879 @@
+#define _GNU_SOURCE
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#ifdef HAVE_ALSA
+#include <alsa/asoundlib.h>
+#endif
+
+#include "bluetooth_audio.h"
+#include "bluetooth_sbc.h"
+#include "bluetooth_jitter.h"
+#include "bluetooth_media.h"
+#include "bluetooth_common.h"
+
+#define AUDIO_PATH_SIZE  128
+#define RTP_HEADER_SIZE  12
+
+/************************************ sinks *************************************/
+typedef struct {
+    char path[AUDIO_PATH_SIZE];
+    int fd;
+} tFileSink;
+
+static int file_sink_open(tAudioSink *sink, const tAudioFormat *fmt) {
+    tFileSink *f = sink->priv;
+
+    /* O_TRUNC is ignored for a fifo; without a reader it fails with ENXIO */
+    f->fd = open(f->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NONBLOCK, 0644);
+    if (f->fd < 0) {
+        if (errno == ENXIO)
+            return -EAGAIN;
+        printf("%s: open %s: %s\n", __FUNCTION__, f->path, strerror(errno));
+        return -1;
+    }
+    /* writes pace the stream thread, as before */
+    fcntl(f->fd, F_SETFL, fcntl(f->fd, F_GETFL) & ~O_NONBLOCK);
+    return 0;
+}
+
+static ssize_t file_sink_write(tAudioSink *sink, const struct iovec *iov, int iovcnt) {
+    tFileSink *f = sink->priv;
+    struct iovec local[AUDIO_BATCH];
+    struct iovec *v = local;
+    ssize_t n, total = 0;
+
+    if (iovcnt > AUDIO_BATCH) iovcnt = AUDIO_BATCH;
+    memcpy(local, iov, iovcnt * sizeof(struct iovec));
+
+    /* a pipe may take less than all of it */
+    while (iovcnt > 0) {
+        n = writev(f->fd, v, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        total += n;
+        while (iovcnt > 0 && (size_t)n >= v->iov_len) {
+            n -= v->iov_len;
+            v++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            v->iov_base = (char *)v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+    return total;
+}
+
+static void file_sink_close(tAudioSink *sink) {
+    tFileSink *f = sink->priv;
+    if (f->fd >= 0) close(f->fd);
+    f->fd = -1;
+}
+
+static void file_sink_destroy(tAudioSink *sink) {
+    file_sink_close(sink);
+    free(sink->priv);
+    free(sink);
+}
+
+tAudioSink * createFileSink(const char *path, int pcm) {
+    tAudioSink *sink;
+    tFileSink *f;
+
+    if (!path || strlen(path) >= AUDIO_PATH_SIZE) return NULL;
+    sink = calloc(1, sizeof(*sink));
+    f = calloc(1, sizeof(*f));
+    if (!sink || !f) {
+        free(sink);
+        free(f);
+        return NULL;
+    }
+    snprintf(f->path, sizeof(f->path), "%s", path);
+    f->fd = -1;
+    sink->open = file_sink_open;
+    sink->write = file_sink_write;
+    sink->close = file_sink_close;
+    sink->destroy = file_sink_destroy;
+    sink->pcm = pcm;
+    sink->priv = f;
+    return sink;
+}
+
+#ifdef HAVE_ALSA
+typedef struct {
+    char device[AUDIO_PATH_SIZE];
+    snd_pcm_t *pcm;
+    int frame_size;
+} tAlsaSink;
+
+static int alsa_sink_open(tAudioSink *sink, const tAudioFormat *fmt) {
+    tAlsaSink *a = sink->priv;
+    int err;
+
+    if (fmt->codec != AUDIO_CODEC_PCM) {
+        printf("%s: no decoder for codec 0x%x\n", __FUNCTION__, fmt->codec);
+        return -1;
+    }
+    err = snd_pcm_open(&a->pcm, a->device, SND_PCM_STREAM_PLAYBACK, 0);
+    if (err < 0) {
+        printf("%s: %s: %s\n", __FUNCTION__, a->device, snd_strerror(err));
+        a->pcm = NULL;
+        return -1;
+    }
+    /* 100ms of device buffering, soft resample allowed */
+    err = snd_pcm_set_params(a->pcm, SND_PCM_FORMAT_S16_LE,
+                             SND_PCM_ACCESS_RW_INTERLEAVED,
+                             fmt->channels, fmt->rate, 1, 100000);
+    if (err < 0) {
+        printf("%s: set params: %s\n", __FUNCTION__, snd_strerror(err));
+        snd_pcm_close(a->pcm);
+        a->pcm = NULL;
+        return -1;
+    }
+    a->frame_size = fmt->channels * 2;
+    return 0;
+}
+
+static ssize_t alsa_sink_write(tAudioSink *sink, const struct iovec *iov, int iovcnt) {
+    tAlsaSink *a = sink->priv;
+    snd_pcm_sframes_t n;
+    ssize_t total = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        n = snd_pcm_writei(a->pcm, iov[i].iov_base, iov[i].iov_len / a->frame_size);
+        if (n < 0) {
+            /* underrun or suspend, recover and try once more */
+            if (snd_pcm_recover(a->pcm, n, 1) < 0)
+                return -1;
+            n = snd_pcm_writei(a->pcm, iov[i].iov_base, iov[i].iov_len / a->frame_size);
+            if (n < 0)
+                return -1;
+        }
+        total += n * a->frame_size;
+    }
+    return total;
+}
+
+static void alsa_sink_close(tAudioSink *sink) {
+    tAlsaSink *a = sink->priv;
+    if (a->pcm) {
+        snd_pcm_drain(a->pcm);
+        snd_pcm_close(a->pcm);
+    }
+    a->pcm = NULL;
+}
+
+static void alsa_sink_destroy(tAudioSink *sink) {
+    alsa_sink_close(sink);
+    free(sink->priv);
+    free(sink);
+}
+#endif
+
+tAudioSink * createAlsaSink(const char *device) {
+#ifdef HAVE_ALSA
+    tAudioSink *sink;
+    tAlsaSink *a;
+
+    if (!device || strlen(device) >= AUDIO_PATH_SIZE) return NULL;
+    sink = calloc(1, sizeof(*sink));
+    a = calloc(1, sizeof(*a));
+    if (!sink || !a) {
+        free(sink);
+        free(a);
+        return NULL;
+    }
+    snprintf(a->device, sizeof(a->device), "%s", device);
+    sink->open = alsa_sink_open;
+    sink->write = alsa_sink_write;
+    sink->close = alsa_sink_close;
+    sink->destroy = alsa_sink_destroy;
+    sink->pcm = 1;
+    sink->priv = a;
+    return sink;
+#else
+    printf("%s: built without alsa\n", __FUNCTION__);
+    return NULL;
+#endif
+}
+
+tAudioSink * createAudioSink(const char *spec) {
+    if (!spec) return NULL;
+    if (!strncmp(spec, "alsa:", 5))
+        return createAlsaSink(spec + 5);
+    if (!strncmp(spec, "file:", 5))
+        return createFileSink(spec + 5, 0);
+    if (!strncmp(spec, "pcm:", 4))
+        return createFileSink(spec + 4, 1);
+    return createFileSink(spec, 0);
+}
+
+void destroyAudioSink(tAudioSink *sink) {
+    if (sink && sink->destroy)
+        sink->destroy(sink);
+}
+
+/*********************************** streams ************************************/
+enum {
+    STREAM_IDLE,        /* armed, waiting for the transport */
+    STREAM_ACQUIRING,
+    STREAM_RUNNING,
+    STREAM_STOPPING,    /* told to stop, the reader still tears its run down */
+};
+
+#define AUDIO_SINK_RETRY_MS  100
+
+typedef struct audio_stream tAudioStream;
+
+/* one acquisition; the reader thread owns it and frees it on its way out */
+typedef struct {
+    tAudioStream *stream;
+    DBusConnection *conn;
+    char transport[AUDIO_PATH_SIZE];
+    tAudioSink *sink;
+    int drop_sink;      /* the stream let go of the sink, destroy it when done */
+    int release;        /* Release the transport when done */
+    tAudioFormat fmt;
+    tAudioFormat sink_fmt;
+    int fd;
+    int stop_fd;
+    int mtu;
+    pthread_t thread;
+    uint8_t *ring;      /* AUDIO_RING_PACKETS slots of mtu bytes */
+    struct mmsghdr *msgs;
+    struct iovec *slots;
+    struct iovec *payload;
+    tSbcDecoder *decoder;   /* only when the sink wants PCM */
+    int16_t *pcm;           /* one packet worth of decoded audio */
+    /* decoded streams reach the sink through the jitter buffer */
+    tJitterBuffer *jitter;
+    int16_t *period;        /* one JITTER_PERIOD_MS of frames */
+    pthread_t sink_thread;
+    int sink_running;
+    tAudioStats stats;  /* reader thread, sink_errors by whoever writes the sink */
+} tAudioRun;
+
+struct audio_stream {
+    int used;
+    uint32_t generation;
+    int state;
+    DBusConnection *conn;
+    char device[AUDIO_PATH_SIZE];
+    char transport[AUDIO_PATH_SIZE];
+    tAudioSink *sink;
+    tAudioRun *run;         /* RUNNING and STOPPING */
+    const char *pending;    /* acquire method to call once STOPPING is over */
+    tAudioStats stats;      /* of the last run */
+};
+
+/*
+* Guards the table. Stream threads take it only once, to hand their run
+* back; stopping never waits for them with it held.
+*/
+static pthread_mutex_t g_audio_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_audio_cond = PTHREAD_COND_INITIALIZER;
+static tAudioStream g_streams[AUDIO_MAX_STREAMS];
+static uint32_t g_audio_generation = 0;
+static int g_audio_runs = 0;    /* reader threads not finished yet */
+
+static tAudioStream * find_stream(const char *device) {
+    int i;
+    for (i = 0; i < AUDIO_MAX_STREAMS; i++) {
+        if (g_streams[i].used && !strcmp(g_streams[i].device, device))
+            return &g_streams[i];
+    }
+    return NULL;
+}
+
+/* offset of the codec frames, -1 for a packet that isn't rtp */
+static int payload_offset(const uint8_t *pkt, int len, int codec) {
+    int off;
+
+    if (len < RTP_HEADER_SIZE || (pkt[0] >> 6) != 2)
+        return -1;
+    off = RTP_HEADER_SIZE + (pkt[0] & 0x0f) * 4;
+    if (pkt[0] & 0x10) {
+        if (len < off + 4) return -1;
+        off += 4 + ((pkt[off + 2] << 8) | pkt[off + 3]) * 4;
+    }
+    /* sbc media payload header: fragmentation bits and frame count */
+    if (codec == AUDIO_CODEC_SBC)
+        off += 1;
+    return off < len ? off : -1;
+}
+
+/* A2DP SBC codec information element, see A2DP spec 4.3.2 */
+static void sbc_format(const uint8_t *config, int len, tAudioFormat *fmt) {
+    if (len < 1) return;
+    if (config[0] & 0x80) fmt->rate = 16000;
+    else if (config[0] & 0x40) fmt->rate = 32000;
+    else if (config[0] & 0x20) fmt->rate = 44100;
+    else if (config[0] & 0x10) fmt->rate = 48000;
+    fmt->channels = (config[0] & 0x08) ? 1 : 2;
+}
+
+static uint64_t monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void publish_stats(tAudioStats *dst, const tAudioStats *src) {
+    __atomic_store_n(&dst->packets, src->packets, __ATOMIC_RELAXED);
+    __atomic_store_n(&dst->bytes, src->bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&dst->batches, src->batches, __ATOMIC_RELAXED);
+    __atomic_store_n(&dst->bad_packets, src->bad_packets, __ATOMIC_RELAXED);
+    __atomic_store_n(&dst->decode_errors, src->decode_errors, __ATOMIC_RELAXED);
+}
+
+#define AUDIO_PCM_PER_PACKET (AUDIO_MAX_FRAMES_PER_PACKET * SBC_MAX_FRAME_SAMPLES)
+
+/* decode the SBC frames of one packet into the pcm buffer, returns bytes of pcm */
+static int decode_packet(tAudioRun *r, const uint8_t *data, int len, tAudioStats *stats) {
+    tSbcFrameInfo info;
+    int used, frames, samples = 0;
+
+    for (frames = 0; frames < AUDIO_MAX_FRAMES_PER_PACKET && len >= 4; frames++) {
+        used = sbcDecodeFrame(r->decoder, data, len, r->pcm + samples, &info);
+        if (used < 0) {
+            stats->decode_errors++;
+            break;
+        }
+        samples += info.blocks * info.subbands * info.channels;
+        data += used;
+        len -= used;
+    }
+    return samples * sizeof(int16_t);
+}
+
+static int create_thread(pthread_t *thread, void *(*fn)(void *), tAudioRun *r) {
+    pthread_attr_t attr;
+    struct sched_param param;
+    int ret;
+
+    /* a realtime slot keeps reads going when all four cores are busy */
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = AUDIO_THREAD_PRIORITY;
+    pthread_attr_setschedparam(&attr, &param);
+    ret = pthread_create(thread, &attr, fn, r);
+    pthread_attr_destroy(&attr);
+    if (ret == EPERM) {
+        printf("%s: no realtime priority, running as a normal thread\n", __FUNCTION__);
+        ret = pthread_create(thread, NULL, fn, r);
+    }
+    return ret ? -1 : 0;
+}
+
+/* pulls one period from the jitter buffer every JITTER_PERIOD_MS of our clock */
+static void * sink_thread(void *arg) {
+    tAudioRun *r = arg;
+    int frames = jitterBufferPeriod(r->jitter);
+    struct iovec iov;
+    struct timespec next;
+    uint64_t now, deadline;
+
+    iov.iov_base = r->period;
+    iov.iov_len = (size_t)frames * r->fmt.channels * sizeof(int16_t);
+    deadline = monotonic_us();
+
+    while (__atomic_load_n(&r->sink_running, __ATOMIC_ACQUIRE)) {
+        deadline += JITTER_PERIOD_MS * 1000;
+        next.tv_sec = deadline / 1000000;
+        next.tv_nsec = (deadline % 1000000) * 1000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+
+        if (jitterBufferGet(r->jitter, r->period, frames) &&
+            r->sink->write(r->sink, &iov, 1) < 0)
+            __atomic_add_fetch(&r->stats.sink_errors, 1, __ATOMIC_RELAXED);
+
+        /* a sink that blocked for long: start over instead of bursting to catch up */
+        now = monotonic_us();
+        if (now > deadline + 4 * JITTER_PERIOD_MS * 1000)
+            deadline = now;
+    }
+    return NULL;
+}
+
+/* a fifo sink waits for its reader, packets that come meanwhile are dropped */
+static int open_sink(tAudioRun *r) {
+    struct pollfd fds[2];
+    int ret;
+
+    fds[0].fd = r->fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = r->stop_fd;
+    fds[1].events = POLLIN;
+
+    while ((ret = r->sink->open(r->sink, &r->sink_fmt)) == -EAGAIN) {
+        fds[0].revents = fds[1].revents = 0;
+        if (poll(fds, 2, AUDIO_SINK_RETRY_MS) < 0 && errno != EINTR)
+            return -1;
+        if (fds[1].revents || (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)))
+            return -1;
+        if (fds[0].revents & POLLIN)
+            while (recv(r->fd, r->ring, r->mtu, MSG_DONTWAIT) > 0);
+    }
+    return ret;
+}
+
+static void free_buffers(tAudioRun *r) {
+    if (r->ring) {
+        munlock(r->ring, (size_t)AUDIO_RING_PACKETS * r->mtu);
+        free(r->ring);
+    }
+    free(r->msgs);
+    free(r->slots);
+    free(r->payload);
+    free(r->pcm);
+    free(r->period);
+    if (r->decoder)
+        destroySbcDecoder(r->decoder);
+    destroyJitterBuffer(r->jitter);
+    r->decoder = NULL;
+    r->pcm = NULL;
+    r->period = NULL;
+    r->jitter = NULL;
+    r->ring = NULL;
+    r->msgs = NULL;
+    r->slots = NULL;
+    r->payload = NULL;
+}
+
+/* everything the threads touch is set up here, once per acquisition */
+static int alloc_buffers(tAudioRun *r) {
+    size_t size = (size_t)AUDIO_RING_PACKETS * r->mtu;
+    int i;
+
+    if (posix_memalign((void **)&r->ring, 64, size)) {
+        r->ring = NULL;
+        return -1;
+    }
+    r->msgs = calloc(AUDIO_BATCH, sizeof(struct mmsghdr));
+    r->slots = calloc(AUDIO_RING_PACKETS, sizeof(struct iovec));
+    r->payload = calloc(AUDIO_BATCH, sizeof(struct iovec));
+    if (!r->msgs || !r->slots || !r->payload) {
+        free_buffers(r);
+        return -1;
+    }
+    if (r->sink_fmt.codec == AUDIO_CODEC_PCM) {
+        r->decoder = createSbcDecoder(NULL);
+        r->pcm = malloc((size_t)AUDIO_PCM_PER_PACKET * sizeof(int16_t));
+        r->jitter = createJitterBuffer(r->fmt.rate, r->fmt.channels);
+        if (r->jitter)
+            r->period = calloc((size_t)jitterBufferPeriod(r->jitter) * r->fmt.channels,
+                               sizeof(int16_t));
+        if (!r->decoder || !r->pcm || !r->jitter || !r->period) {
+            free_buffers(r);
+            return -1;
+        }
+    }
+    for (i = 0; i < AUDIO_RING_PACKETS; i++) {
+        r->slots[i].iov_base = r->ring + (size_t)i * r->mtu;
+        r->slots[i].iov_len = r->mtu;
+    }
+    /* keep the ring resident, page faults under memory pressure cause dropouts */
+    memset(r->ring, 0, size);
+    mlock(r->ring, size);
+    return 0;
+}
+
+static int acquire(tAudioStream *s, const char *method);
+
+/* the reader's last act: hands the stream back and frees the run */
+static void finish_run(tAudioRun *r) {
+    tAudioStream *s = r->stream;
+    const char *method;
+
+    pthread_mutex_lock(&g_audio_mutex);
+    close(r->fd);
+    close(r->stop_fd);
+    free_buffers(r);
+    if (r->release)
+        dbus_func_args_async(r->conn, -1, NULL, NULL, NULL, r->transport,
+                             MEDIA_TRANSPORT_IFC, "Release", DBUS_TYPE_INVALID);
+    if (r->drop_sink)
+        destroyAudioSink(r->sink);
+    if (s->used && s->run == r) {
+        s->stats = r->stats;
+        s->run = NULL;
+        s->state = STREAM_IDLE;
+        /* the transport went pending again while we were stopping */
+        method = s->pending;
+        s->pending = NULL;
+        if (method)
+            acquire(s, method);
+    }
+    g_audio_runs--;
+    pthread_cond_broadcast(&g_audio_cond);
+    pthread_mutex_unlock(&g_audio_mutex);
+    free(r);
+}
+
+static void * stream_thread(void *arg) {
+    tAudioRun *r = arg;
+    tAudioStats stats;
+    struct pollfd fds[2];
+    unsigned int head = 0, slot;
+    uint8_t *pkt;
+    uint64_t arrival_us;
+    int i, n, off, len, out, sink_started = 0;
+
+    memset(&stats, 0, sizeof(stats));
+    if (open_sink(r) < 0)
+        goto done;
+    /* the sink thread is ours, we join it before letting the run go */
+    if (r->jitter) {
+        r->sink_running = 1;
+        if (create_thread(&r->sink_thread, sink_thread, r) < 0)
+            goto close_sink;
+        sink_started = 1;
+    }
+
+    fds[0].fd = r->fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = r->stop_fd;
+    fds[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[1].revents)
+            break;
+        if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL))
+            break;
+
+        /* point the batch at the next slots of the ring, no allocation */
+        for (i = 0; i < AUDIO_BATCH; i++) {
+            slot = (head + i) & (AUDIO_RING_PACKETS - 1);
+            r->msgs[i].msg_hdr.msg_iov = &r->slots[slot];
+            r->msgs[i].msg_hdr.msg_iovlen = 1;
+            r->msgs[i].msg_len = 0;
+        }
+        n = recvmmsg(r->fd, r->msgs, AUDIO_BATCH, MSG_DONTWAIT, NULL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) continue;
+            printf("%s: recvmmsg: %s\n", __FUNCTION__, strerror(errno));
+            break;
+        }
+        if (n == 0)
+            break;
+        arrival_us = monotonic_us();
+
+        /* skip the headers in place and hand the payloads over as one iovec */
+        for (i = 0, out = 0; i < n; i++) {
+            slot = (head + i) & (AUDIO_RING_PACKETS - 1);
+            pkt = r->slots[slot].iov_base;
+            len = r->msgs[i].msg_len;
+            off = payload_offset(pkt, len, r->fmt.codec);
+            if (off < 0) {
+                stats.bad_packets++;
+                continue;
+            }
+            stats.bytes += len - off;
+            if (r->jitter) {
+                len = decode_packet(r, pkt + off, len - off, &stats);
+                jitterBufferPut(r->jitter, r->pcm, len / (int)sizeof(int16_t) / r->fmt.channels,
+                                arrival_us);
+                continue;
+            }
+            r->payload[out].iov_base = pkt + off;
+            r->payload[out].iov_len = len - off;
+            out++;
+        }
+        head += n;
+        stats.packets += n;
+        stats.batches++;
+        if (out && r->sink->write(r->sink, r->payload, out) < 0)
+            __atomic_add_fetch(&r->stats.sink_errors, 1, __ATOMIC_RELAXED);
+        publish_stats(&r->stats, &stats);
+    }
+
+    if (sink_started) {
+        __atomic_store_n(&r->sink_running, 0, __ATOMIC_RELEASE);
+        pthread_join(r->sink_thread, NULL);
+    }
+close_sink:
+    r->sink->close(r->sink);
+done:
+    publish_stats(&r->stats, &stats);
+    finish_run(r);
+    return NULL;
+}
+
+/*
+* Tells the threads to stop and returns at once; the reader joins the sink
+* thread, closes the sink and hands the stream back without our lock.
+*/
+static void stop_running(tAudioStream *s, int release) {
+    uint64_t one = 1;
+
+    s->pending = NULL;
+    if (s->run) {
+        if (release)
+            s->run->release = 1;
+        if (write(s->run->stop_fd, &one, sizeof(one)) < 0)
+            printf("%s: %s\n", __FUNCTION__, strerror(errno));
+        s->state = STREAM_STOPPING;
+        return;
+    }
+    s->state = STREAM_IDLE;
+}
+
+/* a run still using the sink destroys it once it is done with it */
+static void drop_sink(tAudioStream *s) {
+    if (s->run && s->run->sink == s->sink)
+        s->run->drop_sink = 1;
+    else
+        destroyAudioSink(s->sink);
+    s->sink = NULL;
+}
+
+static void onAcquireResult(DBusMessage *msg, void *user, void *nat) {
+    long slot = (long)user;
+    tAudioStream *s;
+    tAudioRun *r;
+    tMediaTransport transport;
+    char device[AUDIO_PATH_SIZE];
+    DBusError err;
+    dbus_uint16_t imtu = 0, omtu = 0;
+    int fd = -1, have_transport;
+
+    dbus_error_init(&err);
+    if (dbus_set_error_from_message(&err, msg) ||
+        !dbus_message_get_args(msg, &err, DBUS_TYPE_UNIX_FD, &fd,
+                               DBUS_TYPE_UINT16, &imtu,
+                               DBUS_TYPE_UINT16, &omtu,
+                               DBUS_TYPE_INVALID)) {
+        LOG_AND_FREE_DBUS_ERROR(&err);
+        fd = -1;
+    }
+
+    /* the media cache is read outside our lock, it calls into us holding its own */
+    pthread_mutex_lock(&g_audio_mutex);
+    s = &g_streams[slot];
+    have_transport = s->used && s->generation == (uint32_t)(long)nat;
+    if (have_transport)
+        snprintf(device, sizeof(device), "%s", s->device);
+    pthread_mutex_unlock(&g_audio_mutex);
+    have_transport = have_transport && mediaGetTransport(device, &transport) == 0;
+
+    pthread_mutex_lock(&g_audio_mutex);
+    if (!s->used || s->generation != (uint32_t)(long)nat ||
+        s->state != STREAM_ACQUIRING || fd < 0) {
+        /* stopped meanwhile, or the acquire failed */
+        if (s->used && s->generation == (uint32_t)(long)nat) {
+            if (s->state == STREAM_ACQUIRING)
+                s->state = STREAM_IDLE;
+            else if (fd >= 0)
+                dbus_func_args_async(s->conn, -1, NULL, NULL, NULL, s->transport,
+                                     MEDIA_TRANSPORT_IFC, "Release",
+                                     DBUS_TYPE_INVALID);
+        }
+        if (fd >= 0) close(fd);
+        goto done;
+    }
+
+    r = calloc(1, sizeof(*r));
+    if (!r) {
+        close(fd);
+        s->state = STREAM_IDLE;
+        goto done;
+    }
+    r->stream = s;
+    r->conn = s->conn;
+    snprintf(r->transport, sizeof(r->transport), "%s", s->transport);
+    r->sink = s->sink;
+    r->fmt.codec = have_transport ? transport.codec : AUDIO_CODEC_SBC;
+    if (have_transport && transport.codec == AUDIO_CODEC_SBC)
+        sbc_format(transport.config, transport.config_len, &r->fmt);
+    r->sink_fmt = r->fmt;
+    if (r->sink->pcm && r->fmt.codec == AUDIO_CODEC_SBC)
+        r->sink_fmt.codec = AUDIO_CODEC_PCM;
+    r->fd = fd;
+    r->mtu = imtu ? imtu : 1024;
+    r->stop_fd = eventfd(0, EFD_CLOEXEC);
+    printf("%s: %s fd %d imtu %d codec 0x%x %dHz %dch\n", __FUNCTION__,
+           r->transport, fd, imtu, r->fmt.codec, r->fmt.rate, r->fmt.channels);
+
+    /* the sink is opened by the thread, a fifo may wait long for its reader */
+    if (r->stop_fd < 0 || alloc_buffers(r) < 0 ||
+        create_thread(&r->thread, stream_thread, r) < 0) {
+        if (r->stop_fd >= 0) close(r->stop_fd);
+        free_buffers(r);
+        free(r);
+        close(fd);
+        s->state = STREAM_IDLE;
+        goto done;
+    }
+    pthread_detach(r->thread);
+    g_audio_runs++;
+    memset(&s->stats, 0, sizeof(s->stats));
+    s->run = r;
+    s->state = STREAM_RUNNING;
+done:
+    pthread_mutex_unlock(&g_audio_mutex);
+}
+
+/* Acquire resumes a suspended transport, TryAcquire only takes a pending one */
+static int acquire(tAudioStream *s, const char *method) {
+    if (s->state == STREAM_STOPPING) {
+        /* the old run still holds the transport, go on once it let go */
+        s->pending = method;
+        return 0;
+    }
+    if (s->state != STREAM_IDLE || !s->transport[0])
+        return -1;
+    if (!dbus_func_args_async(s->conn, AUDIO_ACQUIRE_TIMEOUT_MS, onAcquireResult,
+                              (void *)(long)(s - g_streams),
+                              (void *)(long)s->generation,
+                              s->transport, MEDIA_TRANSPORT_IFC, method,
+                              DBUS_TYPE_INVALID))
+        return -1;
+    s->state = STREAM_ACQUIRING;
+    return 0;
+}
+
+int audioStreamStart(DBusConnection *conn, const char *device_path, tAudioSink *sink) {
+    tMediaTransport transport;
+    tAudioStream *s;
+    int i, have_transport;
+
+    if (!conn || !device_path || !sink || strlen(device_path) >= AUDIO_PATH_SIZE)
+        return -1;
+    have_transport = mediaGetTransport(device_path, &transport) == 0;
+
+    pthread_mutex_lock(&g_audio_mutex);
+    s = find_stream(device_path);
+    if (s) {
+        stop_running(s, 1);
+        drop_sink(s);
+    } else {
+        for (i = 0; i < AUDIO_MAX_STREAMS && g_streams[i].used; i++);
+        if (i == AUDIO_MAX_STREAMS) {
+            pthread_mutex_unlock(&g_audio_mutex);
+            destroyAudioSink(sink);
+            return -1;
+        }
+        s = &g_streams[i];
+        memset(s, 0, sizeof(*s));
+        s->used = 1;
+        s->generation = ++g_audio_generation;
+        s->state = STREAM_IDLE;
+        snprintf(s->device, sizeof(s->device), "%s", device_path);
+    }
+    s->conn = conn;
+    s->sink = sink;
+
+    /* otherwise wait for the transport to show up and go pending */
+    if (have_transport) {
+        snprintf(s->transport, sizeof(s->transport), "%s", transport.path);
+        if (!strcmp(transport.state, "pending"))
+            acquire(s, "TryAcquire");
+        else if (!strcmp(transport.state, "idle"))
+            acquire(s, "Acquire");
+    }
+    pthread_mutex_unlock(&g_audio_mutex);
+    return 0;
+}
+
+/* the slot is free at once, a run still stopping finishes on its own */
+static void free_stream(tAudioStream *s) {
+    stop_running(s, 1);
+    drop_sink(s);
+    s->run = NULL;
+    s->used = 0;
+}
+
+int audioStreamStop(const char *device_path) {
+    tAudioStream *s;
+    int ret = -1;
+
+    pthread_mutex_lock(&g_audio_mutex);
+    s = find_stream(device_path);
+    if (s) {
+        free_stream(s);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&g_audio_mutex);
+    return ret;
+}
+
+int audioStreamStats(const char *device_path, tAudioStats *stats) {
+    tAudioStream *s;
+    tAudioStats *src;
+    int ret = -1;
+
+    pthread_mutex_lock(&g_audio_mutex);
+    s = find_stream(device_path);
+    if (s) {
+        src = s->run ? &s->run->stats : &s->stats;
+        stats->packets = __atomic_load_n(&src->packets, __ATOMIC_RELAXED);
+        stats->bytes = __atomic_load_n(&src->bytes, __ATOMIC_RELAXED);
+        stats->batches = __atomic_load_n(&src->batches, __ATOMIC_RELAXED);
+        stats->bad_packets = __atomic_load_n(&src->bad_packets, __ATOMIC_RELAXED);
+        stats->decode_errors = __atomic_load_n(&src->decode_errors, __ATOMIC_RELAXED);
+        stats->sink_errors = __atomic_load_n(&src->sink_errors, __ATOMIC_RELAXED);
+        memset(&stats->jitter, 0, sizeof(stats->jitter));
+        if (s->run && s->run->jitter)
+            jitterBufferStats(s->run->jitter, &stats->jitter);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&g_audio_mutex);
+    return ret;
+}
+
+void audioStreamCleanup() {
+    int i;
+
+    pthread_mutex_lock(&g_audio_mutex);
+    for (i = 0; i < AUDIO_MAX_STREAMS; i++) {
+        if (g_streams[i].used)
+            free_stream(&g_streams[i]);
+    }
+    /* waits without the lock, the readers need it to finish */
+    while (g_audio_runs > 0)
+        pthread_cond_wait(&g_audio_cond, &g_audio_mutex);
+    pthread_mutex_unlock(&g_audio_mutex);
+}
+
+void audioTransportState(const char *device_path, const char *transport_path,
+                         const char *state) {
+    tAudioStream *s;
+
+    pthread_mutex_lock(&g_audio_mutex);
+    s = find_stream(device_path);
+    if (s) {
+        snprintf(s->transport, sizeof(s->transport), "%s", transport_path);
+        if (!strcmp(state, "pending")) {
+            /* the remote started streaming */
+            acquire(s, "TryAcquire");
+        } else if (!strcmp(state, "idle")) {
+            /* suspended, bluez has released the fd on its side */
+            stop_running(s, 0);
+        }
+    }
+    pthread_mutex_unlock(&g_audio_mutex);
+}
@@ -24,8 +24,11 @@ static Properties remote_device_properties[] = {
     {"Adapter", DBUS_TYPE_OBJECT_PATH},
     {"LegacyPairing", DBUS_TYPE_BOOLEAN},
     {"RSSI", DBUS_TYPE_INT16},
-    {"TX", DBUS_TYPE_UINT32},
-    {"Broadcaster", DBUS_TYPE_BOOLEAN}
+    {"TxPower", DBUS_TYPE_INT16},
+    {"Broadcaster", DBUS_TYPE_BOOLEAN},
+    {"ServicesResolved", DBUS_TYPE_BOOLEAN},
+    {"ManufacturerData", DBUS_TYPE_DICT_ENTRY},    /* a{qv} */
+    {"ServiceData", DBUS_TYPE_DICT_ENTRY},         /* a{sv} */
 };
 
 static Properties adapter_properties[] = {
@@ -42,6 +45,34 @@ static Properties adapter_properties[] = {
     {"UUIDs", DBUS_TYPE_ARRAY},
 };
 
+Properties media_player_properties[MEDIA_PLAYER_NUM_PROPERTIES] = {
+    {"Equalizer", DBUS_TYPE_STRING},
+    {"Repeat", DBUS_TYPE_STRING},
+    {"Shuffle", DBUS_TYPE_STRING},
+    {"Scan", DBUS_TYPE_STRING},
+    {"Status", DBUS_TYPE_STRING},
+    {"Position", DBUS_TYPE_UINT32},
+    {"Track", DBUS_TYPE_ARRAY},      /* a{sv}, see parse_media_track */
+    {"Device", DBUS_TYPE_OBJECT_PATH},
+    {"Name", DBUS_TYPE_STRING},
+    {"Type", DBUS_TYPE_STRING},
+    {"Subtype", DBUS_TYPE_STRING},
+    {"Browsable", DBUS_TYPE_BOOLEAN},
+    {"Searchable", DBUS_TYPE_BOOLEAN},
+    {"Playlist", DBUS_TYPE_OBJECT_PATH},
+};
+
+Properties media_transport_properties[MEDIA_TRANSPORT_NUM_PROPERTIES] = {
+    {"Device", DBUS_TYPE_OBJECT_PATH},
+    {"UUID", DBUS_TYPE_STRING},
+    {"Codec", DBUS_TYPE_BYTE},
+    {"Configuration", DBUS_TYPE_ARRAY},
+    {"State", DBUS_TYPE_STRING},
+    {"Delay", DBUS_TYPE_UINT16},
+    {"Volume", DBUS_TYPE_UINT16},
+    {"Endpoint", DBUS_TYPE_OBJECT_PATH},
+};
+
 typedef struct {
     void (*user_cb)(DBusMessage *, void *, void *);
     void *user;
@@ -71,6 +102,41 @@ void dbus_func_args_async_callback(DBusPendingCall *call, void *data) {
     free(req);
 }
 
+dbus_bool_t dbus_message_send_async(DBusConnection *conn,
+                                    DBusMessage *msg,
+                                    int timeout_ms,
+                                    void (*user_cb)(DBusMessage *,
+                                                    void *,
+                                                    void*),
+                                    void *user,
+                                    void *nat) {
+    dbus_async_call_t *pending;
+    DBusPendingCall *call = NULL;
+    dbus_bool_t reply = FALSE;
+
+    pending = (dbus_async_call_t *)malloc(sizeof(dbus_async_call_t));
+    if (!pending)
+        return FALSE;
+
+    pending->user_cb = user_cb;
+    pending->user = user;
+    pending->nat = nat;
+
+    /* Make the call. */
+    reply = dbus_connection_send_with_reply(conn, msg, &call, timeout_ms);
+    if (reply == TRUE && call != NULL) {
+        dbus_pending_call_set_notify(call,
+                                     dbus_func_args_async_callback,
+                                     pending,
+                                     NULL);
+    } else {
+        // not connected, or out of memory
+        free(pending);
+        reply = FALSE;
+    }
+    return reply;
+}
+
 static dbus_bool_t dbus_func_args_async_valist(DBusConnection *conn,
                                         int timeout_ms,
                                         void (*user_cb)(DBusMessage *,
@@ -84,7 +150,6 @@ static dbus_bool_t dbus_func_args_async_valist(DBusConnection *conn,
                                         int first_arg_type,
                                         va_list args) {
     DBusMessage *msg = NULL;
-    dbus_async_call_t *pending;
     dbus_bool_t reply = FALSE;
 
     /* Compose the command */
@@ -101,26 +166,8 @@ static dbus_bool_t dbus_func_args_async_valist(DBusConnection *conn,
         goto done;
     }
 
-    /* Make the call. */
-    pending = (dbus_async_call_t *)malloc(sizeof(dbus_async_call_t));
-    if (pending) {
-        DBusPendingCall *call;
-
-        pending->user_cb = user_cb;
-        pending->user = user;
-        pending->nat = nat;
-        //pending->method = msg;
-
-        reply = dbus_connection_send_with_reply(conn, msg,
-                                                &call,
-                                                timeout_ms);
-        if (reply == TRUE) {
-            dbus_pending_call_set_notify(call,
-                                         dbus_func_args_async_callback,
-                                         pending,
-                                         NULL);
-        }
-    }
+    reply = dbus_message_send_async(conn, msg, timeout_ms,
+                                    user_cb, user, nat);
 
 done:
     if (msg) dbus_message_unref(msg);
@@ -252,6 +299,37 @@ DBusMessage * dbus_func_args_error(DBusConnection *conn,
     return ret;
 }
 
+/* org.freedesktop.DBus.Properties.Set with a basic-typed value */
+dbus_bool_t dbus_set_property_async(DBusConnection *conn,
+                                    int timeout_ms,
+                                    void (*reply)(DBusMessage *, void *, void *),
+                                    void *user,
+                                    void *nat,
+                                    const char *path,
+                                    const char *ifc,
+                                    const char *name,
+                                    int type,
+                                    void *val) {
+    DBusMessage *msg;
+    DBusMessageIter iter;
+    dbus_bool_t ret;
+
+    msg = dbus_message_new_method_call(BLUEZ_DBUS_BASE_IFC, path,
+                                       DBUS_INTERFACE_PROPERTIES, "Set");
+    if (msg == NULL) {
+        printf("Could not allocate D-Bus message object!");
+        return FALSE;
+    }
+    dbus_message_iter_init_append(msg, &iter);
+    dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &ifc);
+    dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &name);
+    append_variant(&iter, type, val);
+
+    ret = dbus_message_send_async(conn, msg, timeout_ms, reply, user, nat);
+    dbus_message_unref(msg);
+    return ret;
+}
+
 int dbus_returns_int32(DBusMessage *reply) {
 
     DBusError err;
@@ -434,6 +512,124 @@ void free_array_of_bytes(char * byteArray){
 }
 
 /*******************parse functions*********************************************/
+#define VARIANT_MAX_DEPTH   32
+/* on the stack first, about 15 map entries; bigger maps go to the heap */
+#define PROPERTY_MAX_NODES  64
+#define PROPERTY_NODES_LIMIT 4096
+
+static int decode_value(DBusMessageIter *iter, t_variant_node *nodes, int max_nodes,
+                        int used, int depth){
+    DBusMessageIter sub;
+    DBusBasicValue basic;
+    t_variant_node *node;
+    int index = used, count = 0, len;
+
+    if (used >= max_nodes)
+        return VARIANT_NO_ROOM;
+    if (depth > VARIANT_MAX_DEPTH)
+        return -1;
+    node = &nodes[used++];
+    memset(node, 0, sizeof(*node));
+    node->type = dbus_message_iter_get_arg_type(iter);
+
+    switch (node->type) {
+    case DBUS_TYPE_BYTE:
+        dbus_message_iter_get_basic(iter, &basic);
+        node->v.u64 = basic.byt;
+        break;
+    case DBUS_TYPE_BOOLEAN:
+        dbus_message_iter_get_basic(iter, &basic);
+        node->v.u64 = basic.bool_val;
+        break;
+    case DBUS_TYPE_INT16:
+        dbus_message_iter_get_basic(iter, &basic);
+        node->v.i64 = basic.i16;
+        break;
+    case DBUS_TYPE_UINT16:
+        dbus_message_iter_get_basic(iter, &basic);
+        node->v.u64 = basic.u16;
+        break;
+    case DBUS_TYPE_INT32:
+        dbus_message_iter_get_basic(iter, &basic);
+        node->v.i64 = basic.i32;
+        break;
+    case DBUS_TYPE_UINT32:
+        dbus_message_iter_get_basic(iter, &basic);
+        node->v.u64 = basic.u32;
+        break;
+    case DBUS_TYPE_INT64:
+        dbus_message_iter_get_basic(iter, &basic);
+        node->v.i64 = basic.i64;
+        break;
+    case DBUS_TYPE_UINT64:
+        dbus_message_iter_get_basic(iter, &basic);
+        node->v.u64 = basic.u64;
+        break;
+    case DBUS_TYPE_DOUBLE:
+        dbus_message_iter_get_basic(iter, &basic);
+        node->v.dbl = basic.dbl;
+        break;
+    case DBUS_TYPE_UNIX_FD:
+        dbus_message_iter_get_basic(iter, &basic);
+        node->v.i64 = basic.fd;
+        break;
+    case DBUS_TYPE_STRING:
+    case DBUS_TYPE_OBJECT_PATH:
+    case DBUS_TYPE_SIGNATURE:
+        dbus_message_iter_get_basic(iter, &basic);
+        node->v.str = basic.str;
+        break;
+    case DBUS_TYPE_ARRAY:
+        node->element = dbus_message_iter_get_element_type(iter);
+        if (node->element == DBUS_TYPE_BYTE) {
+            /* advertisement payloads, no copy and no node per byte */
+            dbus_message_iter_recurse(iter, &sub);
+            dbus_message_iter_get_fixed_array(&sub, &node->v.bytes, &len);
+            node->count = len;
+            break;
+        }
+        /* fall through */
+    case DBUS_TYPE_STRUCT:
+    case DBUS_TYPE_DICT_ENTRY:
+    case DBUS_TYPE_VARIANT:
+        dbus_message_iter_recurse(iter, &sub);
+        while (dbus_message_iter_get_arg_type(&sub) != DBUS_TYPE_INVALID) {
+            used = decode_value(&sub, nodes, max_nodes, used, depth + 1);
+            if (used < 0)
+                return used;
+            count++;
+            dbus_message_iter_next(&sub);
+        }
+        nodes[index].count = count;
+        break;
+    default:
+        return -1;
+    }
+    nodes[index].next = used;
+    return used;
+}
+
+int decode_variant(DBusMessageIter *iter, t_variant_node *nodes, int max_nodes){
+    return decode_value(iter, nodes, max_nodes, 0, 0);
+}
+
+int variant_map_next(const t_variant_node *nodes, int *pos,
+                     const t_variant_node **key, const t_variant_node **value){
+    const t_variant_node *entry;
+    int i = *pos ? *pos : 1;
+
+    if (nodes[0].type != DBUS_TYPE_ARRAY || nodes[0].element != DBUS_TYPE_DICT_ENTRY ||
+        i >= nodes[0].next)
+        return -1;
+    entry = &nodes[i];
+    *key = &nodes[i + 1];
+    *value = &nodes[(*key)->next];
+    if ((*value)->type == DBUS_TYPE_VARIANT)
+        (*value)++;
+    *pos = entry->next;
+    return 0;
+}
+
 int get_property(DBusMessageIter iter, Properties *properties,
                   int max_num_properties, int *prop_index, u_property_value *value, int *len){
 
@@ -450,7 +646,7 @@ int get_property(DBusMessageIter iter, Properties *properties,
     if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_VARIANT)
         return -1;
     for (i = 0; i <  max_num_properties; i++) {
-        if (!strncmp(property, properties[i].name, strlen(property)))
+        if (!strcmp(property, properties[i].name))
             break;
     }
     *prop_index = i;
@@ -459,6 +655,44 @@ int get_property(DBusMessageIter iter, Properties *properties,
     dbus_message_iter_recurse(&iter, &prop_val);
     type = properties[*prop_index].type;
 
+    if (type == DBUS_TYPE_DICT_ENTRY) {
+        t_variant_node nodes[PROPERTY_MAX_NODES], *nodes_copy;
+        int n;
+
+        if (dbus_message_iter_get_arg_type(&prop_val) != DBUS_TYPE_ARRAY ||
+            dbus_message_iter_get_element_type(&prop_val) != DBUS_TYPE_DICT_ENTRY)
+            return -1;
+        n = decode_variant(&prop_val, nodes, PROPERTY_MAX_NODES);
+        if (n == VARIANT_NO_ROOM) {
+            /* a big map, decode it again straight into the heap */
+            value->nodes = malloc(PROPERTY_NODES_LIMIT * sizeof(t_variant_node));
+            if (!value->nodes)
+                return -1;
+            n = decode_variant(&prop_val, value->nodes, PROPERTY_NODES_LIMIT);
+            if (n < 0) {
+                if (n == VARIANT_NO_ROOM)
+                    printf("%s: %s needs more than %d nodes, dropped\n", __FUNCTION__,
+                           property, PROPERTY_NODES_LIMIT);
+                free(value->nodes);
+                return -1;
+            }
+            /* give back the unused tail */
+            nodes_copy = realloc(value->nodes, n * sizeof(t_variant_node));
+            if (nodes_copy)
+                value->nodes = nodes_copy;
+            *len = n;
+            return 0;
+        }
+        if (n < 0)
+            return -1;
+        value->nodes = malloc(n * sizeof(t_variant_node));
+        if (!value->nodes)
+            return -1;
+        memcpy(value->nodes, nodes, n * sizeof(t_variant_node));
+        *len = n;
+        return 0;
+    }
+
     if (dbus_message_iter_get_arg_type(&prop_val) != type) {
         printf("Property type mismatch in get_property: %d, expected:%d, index:%d",
              dbus_message_iter_get_arg_type(&prop_val), type, *prop_index);
@@ -471,8 +705,31 @@ int get_property(DBusMessageIter iter, Properties *properties,
         dbus_message_iter_get_basic(&prop_val, &value->str_val);
         *len = 1;
         break;
-    case DBUS_TYPE_UINT32:
     case DBUS_TYPE_INT16:
+    {
+        dbus_int16_t int16_val;
+        dbus_message_iter_get_basic(&prop_val, &int16_val);
+        value->int_val = int16_val;
+        *len = 1;
+        break;
+    }
+    case DBUS_TYPE_BYTE:
+    {
+        unsigned char byte_val;
+        dbus_message_iter_get_basic(&prop_val, &byte_val);
+        value->int_val = byte_val;
+        *len = 1;
+        break;
+    }
+    case DBUS_TYPE_UINT16:
+    {
+        dbus_uint16_t uint16_val;
+        dbus_message_iter_get_basic(&prop_val, &uint16_val);
+        value->int_val = uint16_val;
+        *len = 1;
+        break;
+    }
+    case DBUS_TYPE_UINT32:
     case DBUS_TYPE_BOOLEAN:
         dbus_message_iter_get_basic(&prop_val, &int_val);
         value->int_val = int_val;
@@ -520,6 +777,8 @@ void create_prop_array(t_property_value* p_value, Properties *property,
 	switch(p_value->type){
 		case DBUS_TYPE_UINT32:
 		case DBUS_TYPE_INT16:
+		case DBUS_TYPE_UINT16:
+		case DBUS_TYPE_BYTE:
 		case DBUS_TYPE_BOOLEAN:
 			p_value->val.int_val = value->int_val;
 			break;
@@ -527,6 +786,10 @@ void create_prop_array(t_property_value* p_value, Properties *property,
 		case DBUS_TYPE_OBJECT_PATH:
 			p_value->val.str_val = strdup(value->str_val);
 			break;
+		case DBUS_TYPE_DICT_ENTRY:
+			/* handed over, not copied */
+			p_value->val.nodes = value->nodes;
+			break;
 		case DBUS_TYPE_ARRAY:
 			p_value->val.array_val = malloc(p_value->len * sizeof(char*));
 			if(p_value->val.array_val){
@@ -541,6 +804,14 @@ void create_prop_array(t_property_value* p_value, Properties *property,
 	}
 }
 
+/* what get_property allocated for a value create_prop_array never took */
+static void free_temp_value(Properties *property, u_property_value *value){
+    if (property->type == DBUS_TYPE_ARRAY && value->array_val)
+        free(value->array_val);
+    else if (property->type == DBUS_TYPE_DICT_ENTRY && value->nodes)
+        free(value->nodes);
+}
+
 int parse_properties(DBusMessageIter *iter, Properties *properties,
                               const int max_num_properties, t_property_value_array *array){
     DBusMessageIter dict_entry, dict;
@@ -569,13 +840,14 @@ int parse_properties(DBusMessageIter *iter, Properties *properties,
             goto failure;
         dbus_message_iter_recurse(&dict, &dict_entry);
 
+        /* unknown names and type mismatches are skipped, not fatal */
         if (!get_property(dict_entry, properties, max_num_properties, &prop_index,
                           &value, &len)) {
+            if (values[prop_index].used)
+                free_temp_value(&properties[prop_index], &values[prop_index].value);
             values[prop_index].value = value;
             values[prop_index].len = len;
             values[prop_index].used = 1;
-        } else {
-            goto failure;
         }
     } while(dbus_message_iter_next(&dict));
 
@@ -595,8 +867,14 @@ int parse_properties(DBusMessageIter *iter, Properties *properties,
 				if (properties[i].type == DBUS_TYPE_ARRAY && values[i].used
                    && values[i].value.array_val != NULL)
 					free(values[i].value.array_val);
+			} else if (values[i].used) {
+				free_temp_value(&properties[i], &values[i].value);
 			}
 		}
+	} else {
+		for (i = 0; i < max_num_properties; i++)
+			if (values[i].used) free_temp_value(&properties[i], &values[i].value);
+		array->num = 0;
 	}
 
     return 0;
@@ -605,9 +883,8 @@ failure:
     if (dbus_error_is_set(&err))
         LOG_AND_FREE_DBUS_ERROR(&err);
     for (i = 0; i < max_num_properties; i++)
-        if (properties[i].type == DBUS_TYPE_ARRAY && values[i].used == 1
-                                        && values[i].value.array_val != NULL)
-            free(values[i].value.array_val);
+        if (values[i].used == 1)
+            free_temp_value(&properties[i], &values[i].value);
     return -1;
 }
 
@@ -628,11 +905,16 @@ int parse_property_change(DBusMessage *msg,
                       &prop_index, &value, &len)) {
 		if(array->head)
 			create_prop_array(&(array->head[0]),&(properties[prop_index]),&value,len);
+		else if (properties[prop_index].type == DBUS_TYPE_DICT_ENTRY)
+			free(value.nodes);
         if (properties[prop_index].type == DBUS_TYPE_ARRAY && value.array_val != NULL)
              free(value.array_val);
 		
         return 0;
     }
+    free(array->head);
+    array->head = NULL;
+    array->num = 0;
 failure:
     LOG_AND_FREE_DBUS_ERROR_WITH_MSG(&err, msg);
     return -1;							   
@@ -658,6 +940,46 @@ int parse_adapter_property_change( DBusMessage *msg,t_property_value_array *arra
                     sizeof(adapter_properties) / sizeof(Properties),array);
 }
 
+int parse_media_track(DBusMessageIter *iter, t_media_track *track){
+    DBusMessageIter dict, entry, value;
+    const char *key;
+    dbus_uint32_t u32;
+    int type;
+
+    memset(track, 0, sizeof(*track));
+    if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY)
+        return -1;
+    dbus_message_iter_recurse(iter, &dict);
+    while (dbus_message_iter_get_arg_type(&dict) == DBUS_TYPE_DICT_ENTRY) {
+        dbus_message_iter_recurse(&dict, &entry);
+        dbus_message_iter_get_basic(&entry, &key);
+        dbus_message_iter_next(&entry);
+        dbus_message_iter_recurse(&entry, &value);
+        type = dbus_message_iter_get_arg_type(&value);
+
+        if (type == DBUS_TYPE_STRING) {
+            if (!strcmp(key, "Title"))
+                dbus_message_iter_get_basic(&value, &track->title);
+            else if (!strcmp(key, "Artist"))
+                dbus_message_iter_get_basic(&value, &track->artist);
+            else if (!strcmp(key, "Album"))
+                dbus_message_iter_get_basic(&value, &track->album);
+            else if (!strcmp(key, "Genre"))
+                dbus_message_iter_get_basic(&value, &track->genre);
+        } else if (type == DBUS_TYPE_UINT32) {
+            dbus_message_iter_get_basic(&value, &u32);
+            if (!strcmp(key, "Duration"))
+                track->duration = u32;
+            else if (!strcmp(key, "TrackNumber"))
+                track->track_number = u32;
+            else if (!strcmp(key, "NumberOfTracks"))
+                track->number_of_tracks = u32;
+        }
+        dbus_message_iter_next(&dict);
+    }
+    return 0;
+}
+
 void print_property_value(t_property_value_array *array){
 	int i,j;
 	t_property_value* tmp = array->head;
@@ -673,6 +995,17 @@ void print_property_value(t_property_value_array *array){
 				printf("\n-------------array end------------\n");
 			}else if(tmp->type == DBUS_TYPE_OBJECT_PATH || tmp->type == DBUS_TYPE_STRING){
 				printf("string:%s\n",tmp->val.str_val);
+			}else if(tmp->type == DBUS_TYPE_DICT_ENTRY){
+				const t_variant_node *key, *value;
+				int pos = 0;
+				while(variant_map_next(tmp->val.nodes, &pos, &key, &value) == 0){
+					if(key->type == DBUS_TYPE_STRING) printf("%s:", key->v.str);
+					else printf("0x%04llx:", (unsigned long long)key->v.u64);
+					if(value->type == DBUS_TYPE_ARRAY && value->element == DBUS_TYPE_BYTE)
+						printf("%d bytes\t", value->count);
+					else printf("type %c\t", value->type);
+				}
+				printf("\n");
 			}else{
 				printf("int:%d\n",tmp->val.int_val);
 			}
@@ -708,6 +1041,8 @@ void free_property_value(t_property_value_array *array){
 				if(tmp->val.array_val)	free(tmp->val.array_val);
 			}else if(tmp->type == DBUS_TYPE_OBJECT_PATH || tmp->type == DBUS_TYPE_STRING){
 				if(tmp->val.str_val) free(tmp->val.str_val);
+			}else if(tmp->type == DBUS_TYPE_DICT_ENTRY){
+				if(tmp->val.nodes) free(tmp->val.nodes);
 			}
 			tmp++;
 		}
@@ -771,6 +1106,41 @@ void append_dict_args(DBusMessage *reply, const char *first_key, ...){
     va_end(var_args);
 }
 
+dbus_bool_t append_dict_entries(DBusMessageIter *iter, const t_dict_entry *entries, int count){
+    DBusMessageIter dict, entry, variant, array;
+    char sig[2] = { 0, '\0' };
+    dbus_bool_t ok = TRUE;
+    int i, j;
+
+    if (!dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY,
+                        DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+                        DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING
+                        DBUS_DICT_ENTRY_END_CHAR_AS_STRING, &dict))
+        return FALSE;
+    for (i = 0; ok && i < count; i++) {
+        sig[0] = entries[i].type;
+        ok = dbus_message_iter_open_container(&dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry) &&
+             dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &entries[i].key) &&
+             dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT,
+                        entries[i].type == DBUS_TYPE_ARRAY ? "as" : sig, &variant);
+        if (!ok) break;
+        if (entries[i].type == DBUS_TYPE_ARRAY) {
+            const char *const *strs = entries[i].value;
+
+            ok = dbus_message_iter_open_container(&variant, DBUS_TYPE_ARRAY,
+                                                  DBUS_TYPE_STRING_AS_STRING, &array);
+            for (j = 0; ok && j < entries[i].count; j++)
+                ok = dbus_message_iter_append_basic(&array, DBUS_TYPE_STRING, &strs[j]);
+            ok = ok && dbus_message_iter_close_container(&variant, &array);
+        } else {
+            ok = dbus_message_iter_append_basic(&variant, entries[i].type, entries[i].value);
+        }
+        ok = ok && dbus_message_iter_close_container(&entry, &variant) &&
+             dbus_message_iter_close_container(&dict, &entry);
+    }
+    return dbus_message_iter_close_container(iter, &dict) && ok;
+}
+
 int get_bdaddr(const char *str, bdaddr_t *ba) {
     char *d = ((char *)ba) + 5, *endp;
     int i;
@@ -840,3 +1210,151 @@ exit:
     return err;
 }
 
+
+/* hex digit value + 1, 0 for anything else */
+static const uint8_t hex_digits[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+    ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+/* n hex digits into *out, -1 on anything else; no branch per digit */
+static inline int parse_hex(const char *str, int n, uint64_t *out) {
+    uint64_t v = 0;
+    uint8_t d, bad = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        /* wraps to 0xff for a non digit */
+        d = hex_digits[(uint8_t)str[i]] - 1;
+        bad |= d;
+        v = v << 4 | (d & 0xf);
+    }
+    *out = v;
+    return bad & 0xf0 ? -1 : 0;
+}
+
+int bt_uuid_parse(const char *str, t_bt_uuid *uuid){
+    uint64_t a, b, c, d, e;
+    size_t len = str ? strlen(str) : 0;
+
+    if (len == 4 || len == 8) {
+        if (parse_hex(str, len, &a) < 0) return -1;
+        uuid->hi = a << 32 | 0x1000;
+        uuid->lo = BT_UUID_BASE_LO;
+        return 0;
+    }
+    /* xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx */
+    if (len != BT_UUID_STR_SIZE - 1)
+        return -1;
+    /* most are SIG uuids the way bluez writes them */
+    if (!memcmp(str + 8, "-0000-1000-8000-00805f9b34fb", 28)) {
+        if (parse_hex(str, 8, &a) < 0) return -1;
+        uuid->hi = a << 32 | 0x1000;
+        uuid->lo = BT_UUID_BASE_LO;
+        return 0;
+    }
+    if (str[8] != '-' || str[13] != '-' ||
+        str[18] != '-' || str[23] != '-')
+        return -1;
+    if (parse_hex(str, 8, &a) < 0 || parse_hex(str + 9, 4, &b) < 0 ||
+        parse_hex(str + 14, 4, &c) < 0 || parse_hex(str + 19, 4, &d) < 0 ||
+        parse_hex(str + 24, 12, &e) < 0)
+        return -1;
+    uuid->hi = a << 32 | b << 16 | c;
+    uuid->lo = d << 48 | e;
+    return 0;
+}
+
+static void format_hex(char *out, uint64_t v, int n) {
+    static const char digits[] = "0123456789abcdef";
+
+    while (n--) {
+        out[n] = digits[v & 0xf];
+        v >>= 4;
+    }
+}
+
+void bt_uuid_format(const t_bt_uuid *uuid, char *str){
+    format_hex(str, uuid->hi >> 32, 8);
+    str[8] = '-';
+    format_hex(str + 9, uuid->hi >> 16, 4);
+    str[13] = '-';
+    format_hex(str + 14, uuid->hi, 4);
+    str[18] = '-';
+    format_hex(str + 19, uuid->lo >> 48, 4);
+    str[23] = '-';
+    format_hex(str + 24, uuid->lo, 12);
+    str[36] = '\0';
+}
+
+t_bt_uuid bt_uuid_from16(uint16_t uuid16){
+    t_bt_uuid uuid = { (uint64_t)uuid16 << 32 | 0x1000, BT_UUID_BASE_LO };
+    return uuid;
+}
+
+char * bt_uuid16_format(uint16_t uuid16, char *str){
+    t_bt_uuid uuid = bt_uuid_from16(uuid16);
+
+    bt_uuid_format(&uuid, str);
+    return str;
+}
+
+int bt_uuid_to16(const t_bt_uuid *uuid){
+    if (uuid->lo != BT_UUID_BASE_LO || (uuid->hi & 0xffff0000ffffffffULL) != 0x1000)
+        return -1;
+    return (int)(uuid->hi >> 32);
+}
+
+void bt_uuid_set_init(t_bt_uuid_set *set){
+    memset(set, 0, sizeof(*set));
+}
+
+static unsigned int uuid_set_hash(const t_bt_uuid *uuid) {
+    uint64_t h = (uuid->hi ^ uuid->lo * 0xff51afd7ed558ccdULL) * 0x9e3779b97f4a7c15ULL;
+    return (unsigned int)(h >> 32) & (2 * BT_UUID_SET_FULL - 1);
+}
+
+int bt_uuid_set_add(t_bt_uuid_set *set, const t_bt_uuid *uuid){
+    int short_uuid = bt_uuid_to16(uuid);
+    unsigned int h;
+
+    if (bt_uuid_set_has(set, uuid))
+        return 0;
+    if (short_uuid >= 0) {
+        set->short_bits[short_uuid >> 6] |= 1ULL << (short_uuid & 63);
+    } else {
+        if (set->num_full == BT_UUID_SET_FULL)
+            return -1;
+        set->full[set->num_full] = *uuid;
+        for (h = uuid_set_hash(uuid); set->index[h]; h = (h + 1) & (2 * BT_UUID_SET_FULL - 1));
+        set->index[h] = ++set->num_full;
+    }
+    set->count++;
+    return 0;
+}
+
+int bt_uuid_set_has(const t_bt_uuid_set *set, const t_bt_uuid *uuid){
+    int short_uuid = bt_uuid_to16(uuid);
+    unsigned int h;
+
+    if (short_uuid >= 0)
+        return (set->short_bits[short_uuid >> 6] >> (short_uuid & 63)) & 1;
+    for (h = uuid_set_hash(uuid); set->index[h]; h = (h + 1) & (2 * BT_UUID_SET_FULL - 1)) {
+        if (BT_UUID_EQ(set->full[set->index[h] - 1], *uuid))
+            return 1;
+    }
+    return 0;
+}
+
+int bt_uuid_set_match(const t_bt_uuid_set *set, char **uuids, int count){
+    t_bt_uuid uuid;
+    int i;
+
+    for (i = 0; uuids && i < count; i++) {
+        if (bt_uuid_parse(uuids[i], &uuid) == 0 && bt_uuid_set_has(set, &uuid))
+            return 1;
+    }
+    return 0;
+}
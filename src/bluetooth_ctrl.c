@@ -0,0 +1,539 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "bluetooth_ctrl.h"
+#include "bluetooth_common.h"
+#include "bluetooth_eventloop.h"
+#include "bluetooth_service.h"
+#include "bluetooth_metrics.h"
+
+#define CTRL_MAX_CLIENTS   64
+#define CTRL_BUF_SIZE      (64 * 1024)
+#define CTRL_MAX_TEXT      1024
+#define CTRL_MAX_RESPONSE  (sizeof(tCtrlResponse) + CTRL_MAX_TEXT)
+
+typedef struct {
+    int fd;
+    uint32_t generation;
+    size_t in_len;
+    size_t out_len;
+    size_t out_off;
+    uint8_t in[CTRL_BUF_SIZE];
+    uint8_t out[CTRL_BUF_SIZE];
+} tCtrlClient;
+
+/* outstanding async request, the client may be gone when it completes */
+typedef struct {
+    int slot;
+    uint32_t generation;
+    uint32_t id;
+    int remaining;  /* bluez calls still to answer */
+    int status;
+    char path[128]; /* HFP_AG: headset to connect once the gateway is up */
+} tCtrlPending;
+
+static int g_listen_fd = -1;
+static char g_socket_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static tCtrlClient * g_clients[CTRL_MAX_CLIENTS];
+static uint32_t g_generation = 0;
+
+static void process_client(int slot);
+
+static void close_client(int slot) {
+    tCtrlClient *client = g_clients[slot];
+    if (!client) return;
+    removeEventLoopFd(client->fd);
+    close(client->fd);
+    free(client);
+    g_clients[slot] = NULL;
+}
+
+static int queue_response(tCtrlClient *client, uint32_t id, int status,
+                          const char *text) {
+    tCtrlResponse rsp;
+    size_t text_len = text ? strlen(text) + 1 : 0;
+
+    rsp.len = sizeof(rsp) + text_len;
+    rsp.id = id;
+    rsp.status = status;
+    if (client->out_len + rsp.len > CTRL_BUF_SIZE)
+        return -1;
+    memcpy(client->out + client->out_len, &rsp, sizeof(rsp));
+    if (text_len)
+        memcpy(client->out + client->out_len + sizeof(rsp), text, text_len);
+    client->out_len += rsp.len;
+    return 0;
+}
+
+/* stop reading while the input buffer is backed up behind unsent output */
+static void update_events(tCtrlClient *client) {
+    short events = 0;
+    if (client->in_len < CTRL_BUF_SIZE) events |= POLLIN;
+    if (client->out_off < client->out_len) events |= POLLOUT;
+    modifyEventLoopFd(client->fd, events);
+}
+
+/* returns -1 if the client went away */
+static int flush_client(int slot) {
+    tCtrlClient *client = g_clients[slot];
+    ssize_t n;
+
+    while (client->out_off < client->out_len) {
+        n = send(client->fd, client->out + client->out_off,
+                 client->out_len - client->out_off, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            close_client(slot);
+            return -1;
+        }
+        client->out_off += n;
+    }
+    if (client->out_off == client->out_len)
+        client->out_off = client->out_len = 0;
+    update_events(client);
+    return 0;
+}
+
+static void on_async_result(int result, void *user) {
+    tCtrlPending *pending = (tCtrlPending *)user;
+    tCtrlClient *client = g_clients[pending->slot];
+
+    if (result)
+        pending->status = -EIO;
+    if (--pending->remaining > 0)
+        return;
+
+    if (client && client->generation == pending->generation) {
+        if (queue_response(client, pending->id, pending->status, NULL) < 0) {
+            printf("%s: client not reading, dropping it\n", __FUNCTION__);
+            close_client(pending->slot);
+        } else if (flush_client(pending->slot) == 0) {
+            /* output space may have been what held the input back */
+            process_client(pending->slot);
+        }
+    }
+    free(pending);
+}
+
+/* gateway registered, now ask for the headset's side */
+static void on_hfp_gateway(int result, void *user) {
+    tCtrlPending *pending = (tCtrlPending *)user;
+    char uuid[BT_UUID_STR_SIZE];
+
+    bt_uuid16_format(BT_UUID16_HFP_HF, uuid);
+    if (result ||
+        connectProfileAsync(pending->path, uuid, on_async_result, pending) < 0)
+        on_async_result(-1, pending);
+}
+
+static tCtrlPending * new_pending(int slot, uint32_t id) {
+    tCtrlPending *pending = (tCtrlPending *)malloc(sizeof(tCtrlPending));
+    if (pending) {
+        pending->slot = slot;
+        pending->generation = g_clients[slot]->generation;
+        pending->id = id;
+        pending->remaining = 1;
+        pending->status = 0;
+    }
+    return pending;
+}
+
+/* object path for any of the accepted device spellings */
+static int device_path(const char *arg, char *path, size_t size) {
+    int i;
+
+    if (arg[0] == '/') {
+        snprintf(path, size, "%s", arg);
+    } else if (!strncmp(arg, "dev_", 4)) {
+        snprintf(path, size, "%s/%s", ADAPTER_PATH, arg);
+    } else if (strlen(arg) == BTADDR_SIZE - 1) {
+        i = snprintf(path, size, "%s/dev_%s", ADAPTER_PATH, arg);
+        for (i = i - (BTADDR_SIZE - 1); path[i]; i++) {
+            if (path[i] == ':') path[i] = '_';
+        }
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/* returns 1 if the response will be queued later */
+static int handle_request(int slot, tCtrlRequest *req, char **argv,
+                          int *status, const char **text) {
+    static char metrics[CTRL_MAX_TEXT];
+    char path[128];
+    char uuid[BT_UUID_STR_SIZE];
+    tCtrlPending *pending;
+    tPresenceConfig presence;
+    tPresenceStats presence_stats;
+    tTelemetryConfig telemetry;
+    tTelemetryStats telemetry_stats;
+    const char *dev;
+    int n;
+
+    *status = 0;
+    *text = NULL;
+
+    switch (req->op) {
+    case CTRL_OP_PING:
+        *text = "pong";
+        break;
+    case CTRL_OP_START_DISCOVERY:
+        *status = startDiscovery() ? -EIO : 0;
+        break;
+    case CTRL_OP_STOP_DISCOVERY:
+        *status = stopDiscovery() ? -EIO : 0;
+        break;
+    case CTRL_OP_PAIR:
+        if (req->argc < 1 || device_path(argv[0], path, sizeof(path)) < 0)
+            goto invalid;
+        *status = startPaireDevice(path) ? -EIO : 0;
+        break;
+    case CTRL_OP_CONNECT:
+    case CTRL_OP_CONNECT_PROFILE:
+        if (req->argc < (req->op == CTRL_OP_CONNECT ? 1 : 2) ||
+            device_path(argv[0], path, sizeof(path)) < 0)
+            goto invalid;
+        pending = new_pending(slot, req->id);
+        if (!pending) {
+            *status = -ENOMEM;
+            break;
+        }
+        if ((req->op == CTRL_OP_CONNECT ?
+             connectDeviceAsync(path, on_async_result, pending) :
+             connectProfileAsync(path, argv[1], on_async_result, pending)) < 0) {
+            free(pending);
+            *status = -EIO;
+            break;
+        }
+        return 1;
+    case CTRL_OP_AUDIO_SINK:
+        /* remote side is the a2dp source and avrcp target */
+        if (req->argc < 1 || device_path(argv[0], path, sizeof(path)) < 0)
+            goto invalid;
+        /* armed first so the transport is picked up as soon as it appears */
+        if (req->argc > 1 && startAudioSink(path, argv[1]) < 0) {
+            *status = -EINVAL;
+            break;
+        }
+        pending = new_pending(slot, req->id);
+        if (!pending) {
+            *status = -ENOMEM;
+            break;
+        }
+        /* a call that fails to go out is settled here, not through
+         * on_async_result: that would answer and re-enter process_client
+         * with this frame still unconsumed */
+        pending->remaining = 0;
+        bt_uuid16_format(BT_UUID16_A2DP_SOURCE, uuid);
+        if (connectProfileAsync(path, uuid, on_async_result, pending) == 0)
+            pending->remaining++;
+        else
+            pending->status = -EIO;
+        bt_uuid16_format(BT_UUID16_AVRCP_TARGET, uuid);
+        if (connectProfileAsync(path, uuid, on_async_result, pending) == 0)
+            pending->remaining++;
+        else
+            pending->status = -EIO;
+        if (!pending->remaining) {
+            free(pending);
+            *status = -EIO;
+            break;
+        }
+        return 1;
+    case CTRL_OP_AUDIO_STOP:
+        if (req->argc < 1 || device_path(argv[0], path, sizeof(path)) < 0)
+            goto invalid;
+        *status = stopAudioSink(path) ? -ENOENT : 0;
+        break;
+    case CTRL_OP_HFP_AG:
+        if (req->argc < 1 || device_path(argv[0], path, sizeof(path)) < 0)
+            goto invalid;
+        pending = new_pending(slot, req->id);
+        if (!pending) {
+            *status = -ENOMEM;
+            break;
+        }
+        snprintf(pending->path, sizeof(pending->path), "%s", path);
+        switch (startHfpGateway(on_hfp_gateway, pending)) {
+        case 0:
+            /* the connect follows from on_hfp_gateway */
+            return 1;
+        case 1:
+            break;
+        default:
+            free(pending);
+            *status = -EIO;
+            return 0;
+        }
+        /* the headset's side, bluez hands it to our registered gateway */
+        bt_uuid16_format(BT_UUID16_HFP_HF, uuid);
+        if (connectProfileAsync(path, uuid, on_async_result, pending) < 0) {
+            free(pending);
+            *status = -EIO;
+            break;
+        }
+        return 1;
+    case CTRL_OP_ADD_PROFILE:
+        if (req->argc < 4)
+            goto invalid;
+        pending = new_pending(slot, req->id);
+        if (!pending) {
+            *status = -ENOMEM;
+            break;
+        }
+        if (addProfile(argv[0], argv[1], argv[2], atoi(argv[3]),
+                       on_async_result, pending) < 0) {
+            free(pending);
+            *status = -EIO;
+            break;
+        }
+        return 1;
+    case CTRL_OP_METRICS:
+        formatMetrics(metrics, sizeof(metrics));
+        *text = metrics;
+        break;
+    case CTRL_OP_PRESENCE_START:
+        presence.timeout_ms = req->argc > 0 ? strtoul(argv[0], NULL, 10) : 0;
+        presence.enter_rssi = req->argc > 1 ? atoi(argv[1]) : PRESENCE_RSSI_UNSET;
+        presence.leave_rssi = req->argc > 2 ? atoi(argv[2]) : PRESENCE_RSSI_UNSET;
+        *status = startPresence(&presence) ? -EINVAL : 0;
+        break;
+    case CTRL_OP_PRESENCE_STATS:
+        if (req->argc > 0 && device_path(argv[0], path, sizeof(path)) < 0)
+            goto invalid;
+        presenceStats(&presence_stats);
+        n = snprintf(metrics, sizeof(metrics),
+                     "tracked %d\npresent %d\nenters %llu\nleaves %llu\n"
+                     "sightings %llu\nexpiries %llu\n",
+                     presence_stats.tracked, presence_stats.present,
+                     (unsigned long long)presence_stats.enters,
+                     (unsigned long long)presence_stats.leaves,
+                     (unsigned long long)presence_stats.sightings,
+                     (unsigned long long)presence_stats.expiries);
+        if (req->argc > 0)
+            snprintf(metrics + n, sizeof(metrics) - n, "device_present %d\n",
+                     presenceDevicePresent(path));
+        *text = metrics;
+        break;
+    case CTRL_OP_TELEMETRY_START:
+        telemetry.tick_ms = req->argc > 0 ? strtoul(argv[0], NULL, 10) : 0;
+        telemetry.ema_alpha = req->argc > 1 ? atof(argv[1]) : 0;
+        telemetry.kalman_q = req->argc > 2 ? atof(argv[2]) : 0;
+        telemetry.kalman_r = req->argc > 3 ? atof(argv[3]) : 0;
+        *status = startTelemetry(&telemetry) ? -EINVAL : 0;
+        break;
+    case CTRL_OP_TELEMETRY_STATS:
+        telemetryStats(&telemetry_stats);
+        snprintf(metrics, sizeof(metrics),
+                 "devices %d\nsamples %llu\nticks %llu\nlast_tick_ns %llu\n"
+                 "kernels %s\n",
+                 telemetry_stats.devices,
+                 (unsigned long long)telemetry_stats.samples,
+                 (unsigned long long)telemetry_stats.ticks,
+                 (unsigned long long)telemetry_stats.last_tick_ns,
+                 telemetry_stats.kernels);
+        *text = metrics;
+        break;
+    case CTRL_OP_DEVICE_FILTER:
+        *status = setDeviceFilter((const char **)argv, req->argc) ? -EINVAL : 0;
+        break;
+    case CTRL_OP_MEDIA_CONTROL:
+        if (req->argc < 2 || device_path(argv[0], path, sizeof(path)) < 0)
+            goto invalid;
+        dev = strrchr(path, '/') + 1;
+        *status = mediaPlayerControl(dev, argv[1]) ? -EIO : 0;
+        break;
+    default:
+        *status = -ENOSYS;
+        break;
+    }
+    return 0;
+
+invalid:
+    *status = -EINVAL;
+    return 0;
+}
+
+/* split the payload into argv, all strings must be terminated in-frame */
+static int parse_args(tCtrlRequest *req, char *payload, char **argv) {
+    char *p = payload;
+    char *end = payload + req->len - sizeof(tCtrlRequest);
+    int i;
+
+    if (req->argc > CTRL_MAX_ARGS)
+        return -1;
+    for (i = 0; i < req->argc; i++) {
+        argv[i] = p;
+        p = memchr(p, '\0', end - p);
+        if (!p) return -1;
+        p++;
+    }
+    return 0;
+}
+
+/* handle every complete frame that fits in the output buffer */
+static void process_client(int slot) {
+    tCtrlClient *client = g_clients[slot];
+    tCtrlRequest req;
+    char *argv[CTRL_MAX_ARGS];
+    const char *text;
+    size_t off = 0;
+    int status;
+
+    while (client->in_len - off >= sizeof(tCtrlRequest)) {
+        memcpy(&req, client->in + off, sizeof(req));
+        if (req.len < sizeof(req) || req.len > CTRL_MAX_FRAME) {
+            printf("%s: bad frame length %u\n", __FUNCTION__, req.len);
+            close_client(slot);
+            return;
+        }
+        if (client->in_len - off < req.len)
+            break;
+        if (CTRL_BUF_SIZE - client->out_len < CTRL_MAX_RESPONSE)
+            break;
+
+        /* the header is copied out for alignment, arguments stay in place */
+        if (parse_args(&req, (char *)client->in + off + sizeof(req), argv) < 0) {
+            queue_response(client, req.id, -EINVAL, NULL);
+        } else if (handle_request(slot, &req, argv, &status, &text) == 0) {
+            queue_response(client, req.id, status, text);
+        }
+        if (!g_clients[slot])
+            return;
+        off += req.len;
+    }
+
+    if (off) {
+        memmove(client->in, client->in + off, client->in_len - off);
+        client->in_len -= off;
+    }
+    if (client->out_len)
+        flush_client(slot);
+    else
+        update_events(client);
+}
+
+static void on_client_event(int fd, short revents, void *data) {
+    int slot = (int)(long)data;
+    tCtrlClient *client = g_clients[slot];
+    ssize_t n;
+
+    if (!client || client->fd != fd)
+        return;
+
+    if (revents & POLLOUT) {
+        if (flush_client(slot) < 0)
+            return;
+        process_client(slot);
+        if (!g_clients[slot])
+            return;
+    }
+
+    if ((revents & (POLLIN | POLLHUP | POLLERR)) && client->in_len < CTRL_BUF_SIZE) {
+        n = recv(fd, client->in + client->in_len,
+                 CTRL_BUF_SIZE - client->in_len, MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+            close_client(slot);
+            return;
+        }
+        if (n > 0) {
+            client->in_len += n;
+            process_client(slot);
+        }
+    }
+}
+
+static void on_listen_event(int fd, short revents, void *data) {
+    tCtrlClient *client;
+    int cfd, slot;
+
+    while ((cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        for (slot = 0; slot < CTRL_MAX_CLIENTS; slot++) {
+            if (!g_clients[slot]) break;
+        }
+        if (slot == CTRL_MAX_CLIENTS) {
+            printf("%s: too many control clients\n", __FUNCTION__);
+            close(cfd);
+            continue;
+        }
+        client = (tCtrlClient *)malloc(sizeof(tCtrlClient));
+        if (!client) {
+            close(cfd);
+            continue;
+        }
+        client->fd = cfd;
+        client->generation = ++g_generation;
+        client->in_len = client->out_len = client->out_off = 0;
+        g_clients[slot] = client;
+        if (addEventLoopFd(cfd, POLLIN, on_client_event, (void *)(long)slot) < 0) {
+            close(cfd);
+            free(client);
+            g_clients[slot] = NULL;
+        }
+    }
+}
+
+int startControlServer(const char *socket_path) {
+    struct sockaddr_un addr;
+
+    if (g_listen_fd >= 0) {
+        printf("%s: control server already running\n", __FUNCTION__);
+        return -1;
+    }
+    if (!socket_path) socket_path = CTRL_DEFAULT_SOCKET_PATH;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        printf("%s: socket path too long\n", __FUNCTION__);
+        return -1;
+    }
+
+    g_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (g_listen_fd < 0) {
+        printf("%s: socket: %s\n", __FUNCTION__, strerror(errno));
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+    snprintf(g_socket_path, sizeof(g_socket_path), "%s", socket_path);
+    unlink(socket_path);
+
+    if (bind(g_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(g_listen_fd, CTRL_MAX_CLIENTS) < 0) {
+        printf("%s: bind/listen %s: %s\n", __FUNCTION__, socket_path,
+               strerror(errno));
+        goto failure;
+    }
+    if (addEventLoopFd(g_listen_fd, POLLIN, on_listen_event, NULL) < 0) {
+        printf("%s: event loop not running\n", __FUNCTION__);
+        unlink(socket_path);
+        goto failure;
+    }
+    return 0;
+
+failure:
+    close(g_listen_fd);
+    g_listen_fd = -1;
+    return -1;
+}
+
+void stopControlServer() {
+    int slot;
+
+    if (g_listen_fd < 0) return;
+    for (slot = 0; slot < CTRL_MAX_CLIENTS; slot++)
+        close_client(slot);
+    removeEventLoopFd(g_listen_fd);
+    close(g_listen_fd);
+    g_listen_fd = -1;
+    unlink(g_socket_path);
+}
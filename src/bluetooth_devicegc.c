@@ -0,0 +1,577 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+
+#include "bluetooth_devicegc.h"
+#include "bluetooth_dbus_stubs.h"
+#include "bluetooth_eventloop.h"
+#include "bluetooth_metrics.h"
+
+#define DEVICE_PATH_SIZE    64
+/* path hash -> device + 1, 0 is empty; half full at most */
+#define INDEX_SIZE          (DEVICE_GC_MAX_DEVICES * 2)
+#define INDEX_MASK          (INDEX_SIZE - 1)
+#define OBJECT_INDEX_SIZE   (DEVICE_GC_MAX_OBJECTS * 2)
+#define OBJECT_INDEX_MASK   (OBJECT_INDEX_SIZE - 1)
+#define REMOVE_GEN_MASK     0x7fffffff
+
+typedef struct {
+    int used;
+    uint32_t hash;
+    uint8_t keep;           /* paired, trusted, blocked or connected */
+    uint8_t queued;
+    uint8_t removing;       /* RemoveDevice in flight, the slot is held till its reply */
+    uint32_t generation;    /* of that RemoveDevice */
+    int children;           /* objects below the device */
+    uint64_t last_seen_us;
+    int next_free;
+    char path[DEVICE_PATH_SIZE];
+} tGcDevice;
+
+/* the keep flags, one bit per property */
+#define KEEP_PAIRED         0x01
+#define KEEP_TRUSTED        0x02
+#define KEEP_BLOCKED        0x04
+#define KEEP_CONNECTED      0x08
+
+/* an object below a device, by the hash of its path; 0 is empty */
+typedef struct {
+    uint64_t hash;
+    int interfaces;
+} tGcObject;
+
+/* RemoveDevice user data: slot << 16 | objects going with the device,
+ * the device generation goes along as the other pointer */
+#define REMOVE_USER(slot, objects)  ((void *)(long)((slot) << 16 | \
+                                     ((objects) < 0xffff ? (objects) : 0xffff)))
+#define REMOVE_SLOT(user)           ((int)((long)(user) >> 16))
+#define REMOVE_OBJECTS(user)        ((int)((long)(user) & 0xffff))
+
+/* the event loop feeds the table and runs the timer, the lock is for the API */
+static pthread_mutex_t g_gc_lock = PTHREAD_MUTEX_INITIALIZER;
+static DBusConnection *g_conn = NULL;
+static int g_running = 0;
+static tDeviceGcConfig g_config;
+static tGcDevice g_devices[DEVICE_GC_MAX_DEVICES];
+static uint16_t g_index[INDEX_SIZE];
+static int g_free = -1;
+static int g_high = 0;                  /* slots at and above are unused */
+static int g_table_ready = 0;           /* the free list is built on first use */
+static int g_timer_fd = -1;
+static tGcObject g_objects[OBJECT_INDEX_SIZE];
+static int g_object_count = 0;
+/* not reset by cleanup, replies from before a restart don't match */
+static uint32_t g_remove_generation = 0;
+
+/* stale devices by slot, sent from g_queue_head on */
+static uint16_t g_queue[DEVICE_GC_MAX_DEVICES];
+static int g_queue_head = 0, g_queue_len = 0;
+static uint64_t g_next_sweep_us = 0;
+static uint64_t g_next_send_us = 0;
+static int g_sweep_open = 0;
+static int g_sweep_removed = 0, g_sweep_before = 0;
+static tDeviceGcStats g_stats;
+
+static uint64_t monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* run the collector at abs_us, as soon as possible for 0 */
+static void arm_timer(uint64_t abs_us) {
+    struct itimerspec its;
+
+    if (g_timer_fd < 0) return;
+    memset(&its, 0, sizeof(its));
+    if (abs_us) {
+        its.it_value.tv_sec = abs_us / 1000000;
+        its.it_value.tv_nsec = (abs_us % 1000000) * 1000;
+        timerfd_settime(g_timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+    } else {
+        /* relative 1ns: the loop wakes up, from whichever thread we are on */
+        its.it_value.tv_nsec = 1;
+        timerfd_settime(g_timer_fd, 0, &its, NULL);
+    }
+}
+
+static uint32_t path_hash(const char *path, size_t len) {
+    uint32_t h = 2166136261u;
+
+    while (len--)
+        h = (h ^ (uint8_t)*path++) * 16777619u;
+    return h;
+}
+
+/* lock held; index slot of the device, or of the empty slot it would take */
+static int find_index(const char *path, size_t len, uint32_t hash) {
+    int i = hash & INDEX_MASK;
+    tGcDevice *d;
+
+    while (g_index[i]) {
+        d = &g_devices[g_index[i] - 1];
+        if (d->hash == hash && !strncmp(d->path, path, len) && !d->path[len])
+            break;
+        i = (i + 1) & INDEX_MASK;
+    }
+    return i;
+}
+
+/* lock held; backward shift so probes never need tombstones */
+static void drop_index(int i) {
+    int j = i, home;
+
+    for (;;) {
+        j = (j + 1) & INDEX_MASK;
+        if (!g_index[j])
+            break;
+        home = g_devices[g_index[j] - 1].hash & INDEX_MASK;
+        /* j can move to i unless its home lies cyclically in (i, j] */
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+            g_index[i] = g_index[j];
+            i = j;
+        }
+    }
+    g_index[i] = 0;
+}
+
+/* 64 bits, object paths are many and a collision would skew the counts */
+static uint64_t object_hash(const char *path) {
+    uint64_t h = 14695981039346656037ULL;
+
+    while (*path)
+        h = (h ^ (uint8_t)*path++) * 1099511628211ULL;
+    return h ? h : 1;
+}
+
+/* lock held; slot of the object, or the empty slot it would take */
+static int find_object(uint64_t hash) {
+    int i = hash & OBJECT_INDEX_MASK;
+
+    while (g_objects[i].hash && g_objects[i].hash != hash)
+        i = (i + 1) & OBJECT_INDEX_MASK;
+    return i;
+}
+
+/* lock held; backward shift, as for the device index */
+static void drop_object(int i) {
+    int j = i, home;
+
+    for (;;) {
+        j = (j + 1) & OBJECT_INDEX_MASK;
+        if (!g_objects[j].hash)
+            break;
+        home = g_objects[j].hash & OBJECT_INDEX_MASK;
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+            g_objects[i] = g_objects[j];
+            i = j;
+        }
+    }
+    g_objects[i].hash = 0;
+    g_object_count--;
+}
+
+/* lock held; the device below path, NULL for device paths themselves */
+static tGcDevice * parent_of(const char *path) {
+    const char *dev = strstr(path, "/dev_"), *end;
+    int idx;
+
+    if (!dev || !(end = strchr(dev + 1, '/')) || end - path >= DEVICE_PATH_SIZE)
+        return NULL;
+    idx = find_index(path, end - path, path_hash(path, end - path));
+    return g_index[idx] ? &g_devices[g_index[idx] - 1] : NULL;
+}
+
+static void set_objects(int objects) {
+    g_stats.objects = objects;
+    metricSet(METRIC_DEVICE_GC_OBJECTS, objects);
+}
+
+/* lock held */
+static void free_slot(tGcDevice *d) {
+    d->next_free = g_free;
+    g_free = d - g_devices;
+}
+
+/* lock held; a slot with RemoveDevice in flight is freed by the reply */
+static void forget(tGcDevice *d) {
+    size_t len = strlen(d->path);
+
+    drop_index(find_index(d->path, len, d->hash));
+    /* a queued slot is skipped, d->queued is gone with it */
+    d->used = d->queued = 0;
+    if (!d->removing)
+        free_slot(d);
+    g_stats.devices--;
+    set_objects(g_stats.objects - 1 - d->children);
+}
+
+static int stale(const tGcDevice *d, uint64_t now) {
+    return d->used && !d->keep && !d->removing &&
+           now - d->last_seen_us >= g_config.max_age_s * 1000000ULL;
+}
+
+/* lock held; queue every stale device, the queue of a sweep still running is replaced */
+static void sweep(uint64_t now) {
+    tGcDevice *d;
+    int i;
+
+    for (i = g_queue_head; i < g_queue_len; i++)
+        g_devices[g_queue[i]].queued = 0;
+    g_queue_head = g_queue_len = 0;
+    for (i = 0; i < g_high; i++) {
+        d = &g_devices[i];
+        if (!stale(d, now))
+            continue;
+        d->queued = 1;
+        g_queue[g_queue_len++] = i;
+    }
+    if (!g_sweep_open) {
+        g_sweep_open = 1;
+        g_sweep_removed = 0;
+        g_sweep_before = g_stats.objects;
+    }
+    g_stats.queued = g_queue_len;
+    g_stats.sweeps++;
+}
+
+/* lock held; the sweep is over once its queue and pipeline are empty */
+static void close_sweep(void) {
+    if (!g_sweep_open || g_queue_head < g_queue_len || g_stats.in_flight)
+        return;
+    g_sweep_open = 0;
+    g_stats.last_removed = g_sweep_removed;
+    g_stats.last_objects_before = g_sweep_before;
+    g_stats.last_objects_after = g_stats.objects;
+    if (g_stats.last_removed)
+        printf("%s: removed %d stale devices, objects %d -> %d\n", __FUNCTION__,
+               g_stats.last_removed, g_stats.last_objects_before,
+               g_stats.last_objects_after);
+}
+
+static void onRemoveResult(DBusMessage *msg, void *user, void *n) {
+    int slot = REMOVE_SLOT(user);
+    tGcDevice *d;
+    DBusError err;
+
+    dbus_error_init(&err);
+    if (slot < 0 || slot >= DEVICE_GC_MAX_DEVICES)
+        return;
+    d = &g_devices[slot];
+    pthread_mutex_lock(&g_gc_lock);
+    /* the slot may have been cleaned up, and the collector started again */
+    if (!g_running || !d->removing || d->generation != (uint32_t)(long)n)
+        goto done;
+    d->removing = 0;
+    g_stats.in_flight--;
+    if (!dbus_set_error_from_message(&err, msg) ||
+        dbus_error_has_name(&err, BLUEZ_DBUS_BASE_IFC ".Error.DoesNotExist")) {
+        /* InterfacesRemoved came first and already took the objects off,
+         * unless bluez had lost the device */
+        if (d->used)
+            forget(d);
+        else
+            free_slot(d);
+        g_stats.removed++;
+        g_stats.removed_objects += REMOVE_OBJECTS(user);
+        g_sweep_removed++;
+        metricAdd(METRIC_DEVICE_GC_REMOVED, 1);
+    } else {
+        /* kept, the next sweep tries again */
+        printf("%s: %s\n", __FUNCTION__, err.name);
+        g_stats.failures++;
+        if (!d->used)
+            free_slot(d);
+    }
+    arm_timer(0);
+done:
+    pthread_mutex_unlock(&g_gc_lock);
+    if (dbus_error_is_set(&err)) dbus_error_free(&err);
+}
+
+/* lock held; send from the queue as far as the pipeline and the rate allow */
+static void pump(uint64_t now) {
+    DBusMessage *msg;
+    tGcDevice *d;
+
+    while (g_queue_head < g_queue_len && g_stats.in_flight < (int)g_config.pipeline &&
+           now >= g_next_send_us) {
+        d = &g_devices[g_queue[g_queue_head++]];
+        g_stats.queued--;
+        if (!d->queued)
+            continue;
+        d->queued = 0;
+        if (!stale(d, now)) {
+            g_stats.spared++;
+            continue;
+        }
+        msg = bluez_adapter1_remove_device_new(ADAPTER_PATH, d->path);
+        if (!msg)
+            continue;
+        g_remove_generation = (g_remove_generation + 1) & REMOVE_GEN_MASK;
+        if (!g_remove_generation) g_remove_generation = 1;
+        /* the device and its objects go, as they stand now */
+        if (dbus_message_send_async(g_conn, msg, -1, onRemoveResult,
+                                    REMOVE_USER((int)(d - g_devices), 1 + d->children),
+                                    (void *)(long)g_remove_generation)) {
+            d->generation = g_remove_generation;
+            d->removing = 1;
+            g_stats.in_flight++;
+            g_next_send_us = now + 1000000 / g_config.rate_per_s;
+        }
+        dbus_message_unref(msg);
+    }
+}
+
+static void on_timer(int fd, short revents, void *data) {
+    uint64_t expirations, now, next;
+
+    read(fd, &expirations, sizeof(expirations));
+    pthread_mutex_lock(&g_gc_lock);
+    if (!g_running)
+        goto done;
+    now = monotonic_us();
+    if (now >= g_next_sweep_us) {
+        sweep(now);
+        g_next_sweep_us = now + g_config.sweep_s * 1000000ULL;
+    }
+    pump(now);
+    close_sweep();
+    next = g_next_sweep_us;
+    if (g_queue_head < g_queue_len && g_stats.in_flight < (int)g_config.pipeline &&
+        g_next_send_us < next)
+        next = g_next_send_us;
+    /* else a reply pokes the timer */
+    arm_timer(next);
+done:
+    pthread_mutex_unlock(&g_gc_lock);
+}
+
+static void reset_devices(void) {
+    int i;
+
+    memset(g_index, 0, sizeof(g_index));
+    memset(g_objects, 0, sizeof(g_objects));
+    g_object_count = 0;
+    for (i = 0; i < DEVICE_GC_MAX_DEVICES; i++) {
+        g_devices[i].used = 0;
+        g_devices[i].removing = 0;
+        g_devices[i].generation = 0;
+        g_devices[i].next_free = i + 1 < DEVICE_GC_MAX_DEVICES ? i + 1 : -1;
+    }
+    g_free = 0;
+    g_high = 0;
+    g_table_ready = 1;
+}
+
+void deviceGcDeviceUpdate(const char *device_path, t_property_value_array *array) {
+    t_property_value *value;
+    tGcDevice *d;
+    size_t len;
+    uint32_t hash;
+    uint8_t bit;
+    int i, idx, seen = 0;
+    static int full_logged = 0;
+
+    if (!device_path || !array || !array->head ||
+        (len = strlen(device_path)) >= DEVICE_PATH_SIZE)
+        return;
+    hash = path_hash(device_path, len);
+    pthread_mutex_lock(&g_gc_lock);
+    if (!g_table_ready)
+        reset_devices();
+    idx = find_index(device_path, len, hash);
+    if (g_index[idx]) {
+        d = &g_devices[g_index[idx] - 1];
+    } else {
+        if (g_free < 0) {
+            if (!full_logged++)
+                printf("%s: device table full\n", __FUNCTION__);
+            goto done;
+        }
+        d = &g_devices[g_free];
+        g_free = d->next_free;
+        memset(d, 0, sizeof(*d));
+        d->used = 1;
+        d->hash = hash;
+        strcpy(d->path, device_path);
+        g_index[idx] = d - g_devices + 1;
+        if (d - g_devices >= g_high)
+            g_high = d - g_devices + 1;
+        g_stats.devices++;
+        set_objects(g_stats.objects + 1);
+        /* we can't know when bluez last saw it, start counting now */
+        seen = 1;
+    }
+    for (i = 0; i < array->num; i++) {
+        value = &array->head[i];
+        if (value->type == DBUS_TYPE_BOOLEAN) {
+            bit = !strcmp(value->name, "Paired") ? KEEP_PAIRED :
+                  !strcmp(value->name, "Trusted") ? KEEP_TRUSTED :
+                  !strcmp(value->name, "Blocked") ? KEEP_BLOCKED :
+                  !strcmp(value->name, "Connected") ? KEEP_CONNECTED : 0;
+            if (value->val.int_val)
+                d->keep |= bit;
+            else
+                d->keep &= ~bit;
+            /* a disconnect is a sighting too */
+            seen |= bit == KEEP_CONNECTED;
+        } else if ((value->type == DBUS_TYPE_INT16 && !strcmp(value->name, "RSSI")) ||
+                   (value->type == DBUS_TYPE_DICT_ENTRY &&
+                    (!strcmp(value->name, "ManufacturerData") ||
+                     !strcmp(value->name, "ServiceData")))) {
+            seen = 1;
+        }
+    }
+    if (seen)
+        d->last_seen_us = monotonic_us();
+done:
+    pthread_mutex_unlock(&g_gc_lock);
+}
+
+void deviceGcDeviceRemoved(const char *device_path) {
+    size_t len;
+    int idx;
+
+    if (!device_path || (len = strlen(device_path)) >= DEVICE_PATH_SIZE)
+        return;
+    pthread_mutex_lock(&g_gc_lock);
+    idx = find_index(device_path, len, path_hash(device_path, len));
+    if (g_index[idx])
+        forget(&g_devices[g_index[idx] - 1]);
+    pthread_mutex_unlock(&g_gc_lock);
+}
+
+/* an object counts from its first interface to its last */
+void deviceGcObjectAdded(const char *path, int interfaces) {
+    uint64_t hash;
+    tGcDevice *d;
+    int i;
+    static int full_logged = 0;
+
+    if (!path || interfaces <= 0) return;
+    hash = object_hash(path);
+    pthread_mutex_lock(&g_gc_lock);
+    if (!(d = parent_of(path)))
+        goto done;
+    i = find_object(hash);
+    if (g_objects[i].hash) {
+        g_objects[i].interfaces += interfaces;
+        goto done;
+    }
+    if (g_object_count >= DEVICE_GC_MAX_OBJECTS) {
+        if (!full_logged++)
+            printf("%s: object table full\n", __FUNCTION__);
+        goto done;
+    }
+    g_objects[i].hash = hash;
+    g_objects[i].interfaces = interfaces;
+    g_object_count++;
+    d->children++;
+    set_objects(g_stats.objects + 1);
+done:
+    pthread_mutex_unlock(&g_gc_lock);
+}
+
+void deviceGcObjectRemoved(const char *path, int interfaces) {
+    tGcDevice *d;
+    int i;
+
+    if (!path || interfaces <= 0) return;
+    pthread_mutex_lock(&g_gc_lock);
+    i = find_object(object_hash(path));
+    if (!g_objects[i].hash)
+        goto done;
+    g_objects[i].interfaces -= interfaces;
+    if (g_objects[i].interfaces > 0)
+        goto done;
+    drop_object(i);
+    /* a device already forgotten took its objects off with it */
+    if ((d = parent_of(path)) && d->children > 0) {
+        d->children--;
+        set_objects(g_stats.objects - 1);
+    }
+done:
+    pthread_mutex_unlock(&g_gc_lock);
+}
+
+int deviceGcStart(DBusConnection *conn, const tDeviceGcConfig *config) {
+    int ret = 0;
+
+    if (!conn || !config)
+        return -1;
+    pthread_mutex_lock(&g_gc_lock);
+    g_conn = conn;
+    g_config = *config;
+    if (!g_config.max_age_s) g_config.max_age_s = DEVICE_GC_DEFAULT_MAX_AGE_S;
+    if (!g_config.sweep_s) g_config.sweep_s = DEVICE_GC_DEFAULT_SWEEP_S;
+    if (!g_config.rate_per_s) g_config.rate_per_s = DEVICE_GC_DEFAULT_RATE;
+    if (!g_config.pipeline) g_config.pipeline = DEVICE_GC_DEFAULT_PIPELINE;
+    if (g_running) {
+        /* the new period counts from now */
+        g_next_sweep_us = monotonic_us() + g_config.sweep_s * 1000000ULL;
+        arm_timer(0);
+        goto done;
+    }
+
+    g_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (g_timer_fd < 0 || addEventLoopFd(g_timer_fd, POLLIN, on_timer, NULL) < 0) {
+        printf("%s: no timer: %s\n", __FUNCTION__, strerror(errno));
+        if (g_timer_fd >= 0) close(g_timer_fd);
+        g_timer_fd = -1;
+        ret = -1;
+        goto done;
+    }
+    /* devices are tracked all along, the first sweep is one period out */
+    g_next_sweep_us = monotonic_us() + g_config.sweep_s * 1000000ULL;
+    g_next_send_us = 0;
+    g_running = 1;
+    arm_timer(g_next_sweep_us);
+done:
+    pthread_mutex_unlock(&g_gc_lock);
+    return ret;
+}
+
+int deviceGcSweep() {
+    int ret = -1;
+
+    pthread_mutex_lock(&g_gc_lock);
+    if (g_running) {
+        g_next_sweep_us = 0;
+        arm_timer(0);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&g_gc_lock);
+    return ret;
+}
+
+void deviceGcStats(tDeviceGcStats *stats) {
+    if (!stats) return;
+    pthread_mutex_lock(&g_gc_lock);
+    *stats = g_stats;
+    pthread_mutex_unlock(&g_gc_lock);
+}
+
+void deviceGcCleanup() {
+    pthread_mutex_lock(&g_gc_lock);
+    if (g_timer_fd >= 0) {
+        closeEventLoopFd(g_timer_fd);
+        g_timer_fd = -1;
+    }
+    /* replies still to come find g_running off */
+    g_running = 0;
+    g_conn = NULL;
+    reset_devices();
+    g_queue_head = g_queue_len = 0;
+    g_sweep_open = 0;
+    memset(&g_stats, 0, sizeof(g_stats));
+    metricSet(METRIC_DEVICE_GC_OBJECTS, 0);
+    pthread_mutex_unlock(&g_gc_lock);
+}
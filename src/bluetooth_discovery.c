@@ -0,0 +1,398 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+
+#include "bluetooth_discovery.h"
+#include "bluetooth_common.h"
+#include "bluetooth_dbus_stubs.h"
+#include "bluetooth_eventloop.h"
+#include "bluetooth_metrics.h"
+
+#define TRANSPORT_PATH_SIZE     128
+#define MAX_TRANSPORTS          8
+
+/* ids are generation << 4 | slot, kept positive */
+#define DEMAND_ID(slot, gen)    ((int)(((gen) << 4) | (slot)))
+#define DEMAND_SLOT(id)         ((id) & 0xf)
+#define DEMAND_GEN(id)          ((uint32_t)(id) >> 4)
+#define DEMAND_GEN_MASK         0x7ffffff
+
+typedef struct {
+    int used;
+    uint32_t gen;
+    tDiscoveryDemand demand;
+} tDemandSlot;
+
+/* where the time goes */
+typedef enum {
+    ACCT_NONE,              /* nobody wants to scan */
+    ACCT_SCAN,
+    ACCT_IDLE,              /* between windows */
+    ACCT_HELD,              /* audio or paging */
+} tAcctState;
+
+/* requests and hooks come from any thread, the cycle runs on the event loop */
+static pthread_mutex_t g_disc_lock = PTHREAD_MUTEX_INITIALIZER;
+static DBusConnection *g_conn = NULL;
+static tDemandSlot g_demands[DISCOVERY_MAX_DEMANDS];
+static uint32_t g_generation = 0;
+static tDiscoveryConfig g_config = {
+    DISCOVERY_DEFAULT_AUDIO_DUTY, DISCOVERY_DEFAULT_PAGING_HOLD_MS
+};
+static char g_transports[MAX_TRANSPORTS][TRANSPORT_PATH_SIZE];
+static int g_paging = 0;
+static uint64_t g_paging_until_us = 0;
+static int g_timer_fd = -1;
+
+static int g_scanning = 0;
+static int g_cycle_valid = 0;
+static uint64_t g_cycle_start_us = 0;
+static uint64_t g_retry_until_us = 0;
+static tAcctState g_acct = ACCT_NONE;
+static uint64_t g_acct_since_us = 0;
+static uint64_t g_scan_us, g_idle_us, g_held_us;
+static tDiscoveryStats g_stats;
+
+static uint64_t monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* run the cycle at abs_us, as soon as possible for 0, never for UINT64_MAX */
+static void arm_timer(uint64_t abs_us) {
+    struct itimerspec its;
+
+    if (g_timer_fd < 0) return;
+    memset(&its, 0, sizeof(its));
+    if (abs_us == UINT64_MAX) {
+        timerfd_settime(g_timer_fd, 0, &its, NULL);
+    } else if (abs_us) {
+        its.it_value.tv_sec = abs_us / 1000000;
+        its.it_value.tv_nsec = (abs_us % 1000000) * 1000;
+        timerfd_settime(g_timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+    } else {
+        /* relative 1ns: the loop wakes up, from whichever thread we are on */
+        its.it_value.tv_nsec = 1;
+        timerfd_settime(g_timer_fd, 0, &its, NULL);
+    }
+}
+
+/* lock held; close the running account at now and open the next one */
+static void account(uint64_t now, tAcctState next) {
+    uint64_t spent = now - g_acct_since_us;
+
+    switch (g_acct) {
+    case ACCT_SCAN: g_scan_us += spent; break;
+    case ACCT_IDLE: g_idle_us += spent; break;
+    case ACCT_HELD: g_held_us += spent; break;
+    default: break;
+    }
+    g_acct = next;
+    g_acct_since_us = now;
+    metricSet(METRIC_DISCOVERY_SCAN_MS, g_scan_us / 1000);
+    metricSet(METRIC_DISCOVERY_HELD_MS, g_held_us / 1000);
+}
+
+static int audio_active(void) {
+    int i, n = 0;
+
+    for (i = 0; i < MAX_TRANSPORTS; i++)
+        n += g_transports[i][0] != '\0';
+    return n;
+}
+
+/* lock held; the merged cycle, window 0 if nothing may scan */
+static void merge(int audio, uint32_t *window, uint32_t *interval) {
+    const tDiscoveryDemand *d;
+    uint32_t duty = 0, duty_i, best = 0;
+    int i;
+
+    for (i = 0; i < DISCOVERY_MAX_DEMANDS; i++) {
+        if (!g_demands[i].used)
+            continue;
+        d = &g_demands[i].demand;
+        if (audio && d->audio == DISCOVERY_AUDIO_YIELD)
+            continue;
+        /* permille */
+        duty_i = (uint32_t)((uint64_t)d->window_ms * 1000 / d->interval_ms);
+        if (audio && duty_i > g_config.audio_duty_pct * 10u)
+            duty_i = g_config.audio_duty_pct * 10u;
+        if (!duty_i)
+            continue;
+        if (duty_i > duty)
+            duty = duty_i;
+        if (!best || d->interval_ms < best)
+            best = d->interval_ms;
+    }
+    *interval = best;
+    *window = (uint32_t)((uint64_t)best * duty / 1000);
+}
+
+static void onStartResult(DBusMessage *msg, void *user, void *n) {
+    DBusError err;
+
+    dbus_error_init(&err);
+    if (!dbus_set_error_from_message(&err, msg))
+        return;
+    pthread_mutex_lock(&g_disc_lock);
+    /* someone else's discovery counts as ours */
+    if (!dbus_error_has_name(&err, BLUEZ_DBUS_BASE_IFC ".Error.InProgress")) {
+        printf("%s: %s\n", __FUNCTION__, err.name);
+        g_stats.failures++;
+        if (g_scanning) {
+            g_scanning = 0;
+            g_retry_until_us = monotonic_us() + DISCOVERY_RETRY_MS * 1000ULL;
+            arm_timer(0);
+        }
+    }
+    pthread_mutex_unlock(&g_disc_lock);
+    dbus_error_free(&err);
+}
+
+static void onStopResult(DBusMessage *msg, void *user, void *n) {
+    DBusError err;
+
+    dbus_error_init(&err);
+    if (dbus_set_error_from_message(&err, msg))
+        LOG_AND_FREE_DBUS_ERROR(&err);
+}
+
+/* lock held */
+static void send_discovery(int start) {
+    DBusMessage *msg;
+
+    if (!g_conn) return;
+    msg = start ? bluez_adapter1_start_discovery_new(ADAPTER_PATH) :
+                  bluez_adapter1_stop_discovery_new(ADAPTER_PATH);
+    if (!msg) return;
+    if (dbus_message_send_async(g_conn, msg, -1, start ? onStartResult : onStopResult,
+                                NULL, NULL))
+        g_scanning = start;
+    dbus_message_unref(msg);
+}
+
+/* lock held; where the cycle should be at now */
+static void run_cycle(uint64_t now) {
+    uint32_t window = 0, interval = 0, full_window, full_interval;
+    uint64_t next = UINT64_MAX, window_end;
+    tAcctState acct;
+    int audio = audio_active(), held, want = 0, i, demands = 0;
+
+    for (i = 0; i < DISCOVERY_MAX_DEMANDS; i++)
+        demands += g_demands[i].used;
+    held = g_paging || now < g_paging_until_us;
+    if (!held)
+        merge(audio, &window, &interval);
+
+    if (!demands) {
+        acct = ACCT_NONE;
+        g_cycle_valid = 0;
+    } else if (held || !window) {
+        acct = ACCT_HELD;
+        g_cycle_valid = 0;
+        if (!g_paging && now < g_paging_until_us)
+            next = g_paging_until_us;
+    } else if (now < g_retry_until_us) {
+        acct = ACCT_IDLE;
+        next = g_retry_until_us;
+    } else {
+        if (!g_cycle_valid || now >= g_cycle_start_us + interval * 1000ULL) {
+            g_cycle_start_us = now;
+            g_cycle_valid = 1;
+        }
+        window_end = g_cycle_start_us + window * 1000ULL;
+        if (window >= interval) {
+            want = 1;
+        } else if (now < window_end) {
+            want = 1;
+            next = window_end;
+        } else {
+            next = g_cycle_start_us + interval * 1000ULL;
+        }
+        acct = want ? ACCT_SCAN : ACCT_IDLE;
+    }
+
+    if (g_scanning && !want && demands) {
+        /* would the window have gone on without audio and paging? */
+        merge(0, &full_window, &full_interval);
+        if (held || (audio && (!window || now < g_cycle_start_us + full_window * 1000ULL)))
+            g_stats.cut_short++;
+    }
+    if (want && !g_scanning) {
+        send_discovery(1);
+        if (g_scanning) g_stats.windows++;
+    } else if (!want && g_scanning) {
+        send_discovery(0);
+    }
+    /* StartDiscovery couldn't even be sent, try again later */
+    if (want && !g_scanning) {
+        acct = ACCT_IDLE;
+        g_retry_until_us = now + DISCOVERY_RETRY_MS * 1000ULL;
+        next = g_retry_until_us;
+    }
+    account(now, acct);
+
+    g_stats.window_ms = window;
+    g_stats.interval_ms = interval;
+    arm_timer(next);
+}
+
+static void on_timer(int fd, short revents, void *data) {
+    uint64_t expirations;
+
+    read(fd, &expirations, sizeof(expirations));
+    pthread_mutex_lock(&g_disc_lock);
+    run_cycle(monotonic_us());
+    pthread_mutex_unlock(&g_disc_lock);
+}
+
+void discoveryTransportState(const char *transport_path, const char *state) {
+    int i, free_slot = -1, found = -1, active;
+
+    if (!transport_path || !state)
+        return;
+    active = !strcmp(state, "active");
+    pthread_mutex_lock(&g_disc_lock);
+    for (i = 0; i < MAX_TRANSPORTS; i++) {
+        if (!g_transports[i][0]) {
+            if (free_slot < 0) free_slot = i;
+        } else if (!strcmp(g_transports[i], transport_path)) {
+            found = i;
+        }
+    }
+    if (active && found < 0 && free_slot >= 0) {
+        snprintf(g_transports[free_slot], TRANSPORT_PATH_SIZE, "%s", transport_path);
+        arm_timer(0);
+    } else if (!active && found >= 0) {
+        g_transports[found][0] = '\0';
+        arm_timer(0);
+    }
+    pthread_mutex_unlock(&g_disc_lock);
+}
+
+void discoveryPaging(int begin) {
+    pthread_mutex_lock(&g_disc_lock);
+    if (begin) {
+        if (!g_paging++)
+            arm_timer(0);
+    } else if (g_paging > 0 && !--g_paging) {
+        g_paging_until_us = monotonic_us() + g_config.paging_hold_ms * 1000ULL;
+        arm_timer(0);
+    }
+    pthread_mutex_unlock(&g_disc_lock);
+}
+
+int discoveryRequest(DBusConnection *conn, const tDiscoveryDemand *demand) {
+    int i, id = -1;
+
+    if (!conn || !demand || !demand->interval_ms || demand->window_ms > demand->interval_ms)
+        return -1;
+
+    pthread_mutex_lock(&g_disc_lock);
+    if (g_timer_fd < 0) {
+        g_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (g_timer_fd < 0 || addEventLoopFd(g_timer_fd, POLLIN, on_timer, NULL) < 0) {
+            printf("%s: no timer: %s\n", __FUNCTION__, strerror(errno));
+            if (g_timer_fd >= 0) close(g_timer_fd);
+            g_timer_fd = -1;
+            goto done;
+        }
+        g_acct_since_us = monotonic_us();
+    }
+    g_conn = conn;
+    for (i = 0; i < DISCOVERY_MAX_DEMANDS; i++) {
+        if (!g_demands[i].used)
+            break;
+    }
+    if (i == DISCOVERY_MAX_DEMANDS) {
+        printf("%s: no room for another demand\n", __FUNCTION__);
+        goto done;
+    }
+    g_generation = (g_generation + 1) & DEMAND_GEN_MASK;
+    if (!g_generation) g_generation = 1;
+    g_demands[i].used = 1;
+    g_demands[i].gen = g_generation;
+    g_demands[i].demand = *demand;
+    /* a demand for fresher results starts its window now */
+    g_cycle_valid = 0;
+    g_stats.demands++;
+    id = DEMAND_ID(i, g_generation);
+    arm_timer(0);
+done:
+    pthread_mutex_unlock(&g_disc_lock);
+    return id;
+}
+
+int discoveryRelease(int demand) {
+    tDemandSlot *d;
+    int ret = -1;
+
+    if (demand < 0)
+        return -1;
+    pthread_mutex_lock(&g_disc_lock);
+    d = &g_demands[DEMAND_SLOT(demand)];
+    if (d->used && d->gen == DEMAND_GEN(demand)) {
+        d->used = 0;
+        g_stats.demands--;
+        arm_timer(0);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&g_disc_lock);
+    return ret;
+}
+
+void discoveryConfigure(const tDiscoveryConfig *config) {
+    if (!config) return;
+    pthread_mutex_lock(&g_disc_lock);
+    g_config = *config;
+    if (g_config.audio_duty_pct > 100)
+        g_config.audio_duty_pct = 100;
+    arm_timer(0);
+    pthread_mutex_unlock(&g_disc_lock);
+}
+
+void discoveryStats(tDiscoveryStats *stats) {
+    uint64_t now;
+
+    if (!stats) return;
+    pthread_mutex_lock(&g_disc_lock);
+    /* the running account up to now, without closing it */
+    now = monotonic_us();
+    *stats = g_stats;
+    stats->scanning = g_scanning;
+    stats->audio_active = audio_active();
+    stats->paging = g_paging;
+    stats->scan_ms = (g_scan_us + (g_acct == ACCT_SCAN ? now - g_acct_since_us : 0)) / 1000;
+    stats->idle_ms = (g_idle_us + (g_acct == ACCT_IDLE ? now - g_acct_since_us : 0)) / 1000;
+    stats->held_ms = (g_held_us + (g_acct == ACCT_HELD ? now - g_acct_since_us : 0)) / 1000;
+    pthread_mutex_unlock(&g_disc_lock);
+}
+
+void discoveryCleanup() {
+    pthread_mutex_lock(&g_disc_lock);
+    if (g_scanning)
+        send_discovery(0);
+    if (g_timer_fd >= 0) {
+        closeEventLoopFd(g_timer_fd);
+        g_timer_fd = -1;
+    }
+    memset(g_demands, 0, sizeof(g_demands));
+    memset(g_transports, 0, sizeof(g_transports));
+    memset(&g_stats, 0, sizeof(g_stats));
+    g_scanning = g_cycle_valid = g_paging = 0;
+    g_paging_until_us = g_retry_until_us = 0;
+    g_acct = ACCT_NONE;
+    g_scan_us = g_idle_us = g_held_us = 0;
+    metricSet(METRIC_DISCOVERY_SCAN_MS, 0);
+    metricSet(METRIC_DISCOVERY_HELD_MS, 0);
+    g_conn = NULL;
+    pthread_mutex_unlock(&g_disc_lock);
+}
@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "bluetooth_event.h"
+
+#define CACHE_LINE_SIZE 64
+
+struct bt_event_subscriber {
+    /* producer side */
+    uint32_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+    uint32_t seq;
+    uint64_t dropped;
+    /* consumer side */
+    uint32_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+    /* shared, read-mostly */
+    int signalled __attribute__((aligned(CACHE_LINE_SIZE)));
+    uint32_t mask;
+    uint32_t size_mask;
+    int efd;
+    tBtEvent *ring;
+};
+
+/*
+* The table is only locked by producers and by (un)subscribe. Producers are
+* serialized through it, so every ring keeps exactly one producer at a time.
+*/
+static pthread_mutex_t g_subscriber_mutex = PTHREAD_MUTEX_INITIALIZER;
+static tBtEventSubscriber * g_subscribers[BT_EVENT_MAX_SUBSCRIBERS];
+
+static uint64_t monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void signal_subscriber(tBtEventSubscriber *sub) {
+    uint64_t one = 1;
+    if (!__atomic_exchange_n(&sub->signalled, 1, __ATOMIC_SEQ_CST))
+        write(sub->efd, &one, sizeof(one));
+}
+
+tBtEventSubscriber * subscribeEvents(uint32_t mask, unsigned int depth) {
+    tBtEventSubscriber *sub;
+    unsigned int size = 1;
+    int i;
+
+    if (depth == 0) depth = BT_EVENT_DEFAULT_DEPTH;
+    while (size < depth) size <<= 1;
+
+    if (posix_memalign((void **)&sub, CACHE_LINE_SIZE, sizeof(*sub)))
+        return NULL;
+    memset(sub, 0, sizeof(*sub));
+    sub->mask = mask;
+    sub->size_mask = size - 1;
+    sub->ring = (tBtEvent *)calloc(size, sizeof(tBtEvent));
+    sub->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!sub->ring || sub->efd < 0) {
+        printf("%s: out of resources!\n", __FUNCTION__);
+        goto failure;
+    }
+
+    pthread_mutex_lock(&g_subscriber_mutex);
+    for (i = 0; i < BT_EVENT_MAX_SUBSCRIBERS; i++) {
+        if (g_subscribers[i] == NULL) {
+            g_subscribers[i] = sub;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_subscriber_mutex);
+    if (i == BT_EVENT_MAX_SUBSCRIBERS) {
+        printf("%s: too many subscribers\n", __FUNCTION__);
+        goto failure;
+    }
+    return sub;
+
+failure:
+    if (sub->efd >= 0) close(sub->efd);
+    if (sub->ring) free(sub->ring);
+    free(sub);
+    return NULL;
+}
+
+void unsubscribeEvents(tBtEventSubscriber *sub) {
+    int i;
+    if (!sub) return;
+
+    pthread_mutex_lock(&g_subscriber_mutex);
+    for (i = 0; i < BT_EVENT_MAX_SUBSCRIBERS; i++) {
+        if (g_subscribers[i] == sub) {
+            g_subscribers[i] = NULL;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_subscriber_mutex);
+
+    close(sub->efd);
+    free(sub->ring);
+    free(sub);
+}
+
+int eventSubscriberFd(tBtEventSubscriber *sub) {
+    return sub ? sub->efd : -1;
+}
+
+uint64_t droppedEvents(tBtEventSubscriber *sub) {
+    return sub ? __atomic_load_n(&sub->dropped, __ATOMIC_RELAXED) : 0;
+}
+
+int drainEvents(tBtEventSubscriber *sub, tBtEvent *events, int max) {
+    uint32_t head, tail;
+    uint64_t counter;
+    int n = 0;
+
+    if (!sub || !events || max <= 0) return 0;
+
+    tail = sub->tail;
+    head = __atomic_load_n(&sub->head, __ATOMIC_ACQUIRE);
+    while (tail != head && n < max) {
+        memcpy(&events[n++], &sub->ring[tail & sub->size_mask], sizeof(tBtEvent));
+        tail++;
+    }
+    __atomic_store_n(&sub->tail, tail, __ATOMIC_RELEASE);
+
+    if (tail != head)
+        return n;   /* still readable, leave the eventfd set */
+
+    /*
+    * Ring is empty: disarm, then re-check. A producer that pushed before
+    * seeing signalled == 0 is caught by the second look at head.
+    */
+    __atomic_store_n(&sub->signalled, 0, __ATOMIC_SEQ_CST);
+    read(sub->efd, &counter, sizeof(counter));
+    if (__atomic_load_n(&sub->head, __ATOMIC_SEQ_CST) != tail)
+        signal_subscriber(sub);
+    return n;
+}
+
+static void push_event(tBtEventSubscriber *sub, const tBtEvent *evt) {
+    uint32_t head = sub->head;
+    uint32_t tail = __atomic_load_n(&sub->tail, __ATOMIC_ACQUIRE);
+    tBtEvent *slot;
+
+    if (head - tail > sub->size_mask) {
+        __atomic_store_n(&sub->dropped, sub->dropped + 1, __ATOMIC_RELAXED);
+        sub->seq++;
+        return;
+    }
+    slot = &sub->ring[head & sub->size_mask];
+    memcpy(slot, evt, sizeof(tBtEvent));
+    slot->seq = sub->seq++;
+    __atomic_store_n(&sub->head, head + 1, __ATOMIC_SEQ_CST);
+    signal_subscriber(sub);
+}
+
+void publishEvent(tBtEvent *evt) {
+    int i;
+
+    if (!evt->timestamp_us)
+        evt->timestamp_us = monotonic_us();
+
+    pthread_mutex_lock(&g_subscriber_mutex);
+    for (i = 0; i < BT_EVENT_MAX_SUBSCRIBERS; i++) {
+        tBtEventSubscriber *sub = g_subscribers[i];
+        if (sub && (sub->mask & BT_EVENT_MASK(evt->type)))
+            push_event(sub, evt);
+    }
+    pthread_mutex_unlock(&g_subscriber_mutex);
+}
+
+static void init_event(tBtEvent *evt, int type, const char *path) {
+    memset(evt, 0, sizeof(*evt));
+    evt->type = type;
+    if (path)
+        snprintf(evt->path, sizeof(evt->path), "%s", path);
+}
+
+void publishDeviceEvent(int type, const char *path) {
+    tBtEvent evt;
+    init_event(&evt, type, path);
+    publishEvent(&evt);
+}
+
+/* "key=hex" of the first map entry, returns the number of entries */
+static int format_map(const t_variant_node *nodes, char *buf, size_t size) {
+    const t_variant_node *key, *value;
+    int pos = 0, entries = 0, i, n;
+
+    buf[0] = '\0';
+    while (variant_map_next(nodes, &pos, &key, &value) == 0) {
+        if (entries++) continue;
+        if (key->type == DBUS_TYPE_STRING)
+            n = snprintf(buf, size, "%s=", key->v.str);
+        else
+            n = snprintf(buf, size, "%04x=", (unsigned)key->v.u64);
+        if (value->type != DBUS_TYPE_ARRAY || value->element != DBUS_TYPE_BYTE)
+            continue;
+        for (i = 0; i < value->count && n + 3 <= (int)size; i++)
+            n += snprintf(buf + n, size - n, "%02x", value->v.bytes[i]);
+    }
+    return entries;
+}
+
+void publishPropertyChanges(const char *path, t_property_value_array *array) {
+    tBtEvent evt;
+    t_property_value *value;
+    size_t len;
+    int i;
+
+    if (!array || !array->head) return;
+
+    for (i = 0; i < array->num; i++) {
+        value = &array->head[i];
+        /* bluez names are short, one that doesn't fit would be ambiguous */
+        len = strlen(value->name);
+        if (len >= BT_EVENT_NAME_SIZE) {
+            printf("%s: property name too long: %s\n", __FUNCTION__, value->name);
+            continue;
+        }
+        init_event(&evt, BT_EVENT_PROPERTY_CHANGED, path);
+        evt.value_type = value->type;
+        memcpy(evt.u.prop.name, value->name, len + 1);
+        switch (value->type) {
+        case DBUS_TYPE_STRING:
+        case DBUS_TYPE_OBJECT_PATH:
+            if (value->val.str_val)
+                snprintf(evt.u.prop.str_val, sizeof(evt.u.prop.str_val),
+                         "%s", value->val.str_val);
+            break;
+        case DBUS_TYPE_ARRAY:
+            evt.u.prop.int_val = value->len;
+            if (value->len > 0 && value->val.array_val && value->val.array_val[0])
+                snprintf(evt.u.prop.str_val, sizeof(evt.u.prop.str_val),
+                         "%s", value->val.array_val[0]);
+            break;
+        case DBUS_TYPE_DICT_ENTRY:
+            evt.u.prop.int_val = format_map(value->val.nodes, evt.u.prop.str_val,
+                                            sizeof(evt.u.prop.str_val));
+            break;
+        default:
+            evt.u.prop.int_val = value->val.int_val;
+            break;
+        }
+        publishEvent(&evt);
+
+        if (value->type == DBUS_TYPE_BOOLEAN && !strcmp(value->name, "Connected")) {
+            init_event(&evt, BT_EVENT_CONNECTION_STATE, path);
+            evt.u.connection.connected = value->val.int_val;
+            publishEvent(&evt);
+        }
+    }
+}
+
+void publishProperty(const char *path, const char *name, int type,
+                     int int_val, const char *str_val) {
+    tBtEvent evt;
+    init_event(&evt, BT_EVENT_PROPERTY_CHANGED, path);
+    evt.value_type = type;
+    snprintf(evt.u.prop.name, sizeof(evt.u.prop.name), "%s", name);
+    evt.u.prop.int_val = int_val;
+    if (str_val)
+        snprintf(evt.u.prop.str_val, sizeof(evt.u.prop.str_val), "%s", str_val);
+    publishEvent(&evt);
+}
+
+void publishPairingResult(const char *path, int result) {
+    tBtEvent evt;
+    init_event(&evt, BT_EVENT_PAIRING_RESULT, path);
+    evt.u.pairing.result = result;
+    publishEvent(&evt);
+}
+
+void publishMediaStatus(const char *path, const char *status) {
+    tBtEvent evt;
+    init_event(&evt, BT_EVENT_MEDIA_STATUS, path);
+    if (status)
+        snprintf(evt.u.media.status, sizeof(evt.u.media.status), "%s", status);
+    publishEvent(&evt);
+}
+
+void publishMediaTrack(const char *path, const t_media_track *track) {
+    tBtEvent evt;
+    init_event(&evt, BT_EVENT_MEDIA_TRACK, path);
+    if (track->title)
+        snprintf(evt.u.track.title, sizeof(evt.u.track.title), "%s", track->title);
+    if (track->artist)
+        snprintf(evt.u.track.artist, sizeof(evt.u.track.artist), "%s", track->artist);
+    if (track->album)
+        snprintf(evt.u.track.album, sizeof(evt.u.track.album), "%s", track->album);
+    evt.u.track.duration = track->duration;
+    evt.u.track.number = track->track_number;
+    publishEvent(&evt);
+}
+
+void publishPresence(const char *path, int present, int rssi, uint32_t since_ms) {
+    tBtEvent evt;
+    init_event(&evt, BT_EVENT_PRESENCE, path);
+    evt.u.presence.present = present;
+    evt.u.presence.rssi = rssi;
+    evt.u.presence.since_ms = since_ms;
+    publishEvent(&evt);
+}
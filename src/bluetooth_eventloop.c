@@ -11,12 +11,39 @@
 
 #include "bluetooth_eventloop.h"
 #include "bluetooth_common.h"
+#include "bluetooth_event.h"
+#include "bluetooth_status.h"
+#include "bluetooth_media.h"
+#include "bluetooth_gatt.h"
+#include "bluetooth_gattread.h"
+#include "bluetooth_adv.h"
+#include "bluetooth_advmon.h"
+#include "bluetooth_presence.h"
+#include "bluetooth_telemetry.h"
+#include "bluetooth_devicegc.h"
 
 /************************** bluetooth eventloop *********************************/
 #define EVENT_LOOP_EXIT 1
 #define EVENT_LOOP_ADD  2
 #define EVENT_LOOP_REMOVE 3
 #define EVENT_LOOP_WAKEUP 4
+#define EVENT_LOOP_ADD_FD 5
+#define EVENT_LOOP_MODIFY_FD 6
+#define EVENT_LOOP_REMOVE_FD 7
+#define EVENT_LOOP_CLOSE_FD 8
+
+/* non-dbus fds served by the loop */
+typedef struct {
+    tEventLoopFdCb cb;
+    void *data;
+} tEventLoopFd;
+
+typedef struct {
+    int fd;
+    short events;
+    tEventLoopFdCb cb;
+    void *data;
+} tEventLoopFdCtl;
 
 typedef struct event_loop_native_data_t {
     DBusConnection *conn;
@@ -32,6 +59,8 @@ typedef struct event_loop_native_data_t {
     int pollDataSize;
     /* mem for matching set of dbus watch ptrs */
     DBusWatch **watchData;
+    /* mem for matching set of fd callbacks, cb is NULL for dbus watches */
+    tEventLoopFd *fdData;
     /* pair of sockets for event loop control, Reader and Writer */
     int controlFdR;
     int controlFdW;
@@ -45,6 +74,7 @@ static void tearDownEventLoop(tBluetoothEvent *nat);
 static DBusHandlerResult event_filter(DBusConnection *conn, DBusMessage *msg,
                                       void *data);
 static int setUpEventLoop(tBluetoothEvent *nat);
+static void sync_managed_objects(tBluetoothEvent *nat);
 static int register_agent(tBluetoothEvent * nat,
                           const char *agent_path, const char *capabilities);
 static void unregister_agent(tBluetoothEvent * nat,
@@ -118,6 +148,39 @@ void dbusWakeup(void *data) {
     write(nat->controlFdW, &control, sizeof(char));
 }
 
+static int growPollData(tBluetoothEvent *nat) {
+    printf("Bluetooth EventLoop poll struct growing\n");
+    struct pollfd *temp = (struct pollfd *)malloc(
+            sizeof(struct pollfd) * (nat->pollMemberCount+1));
+    if (!temp) {
+        return -1;
+    }
+    memcpy(temp, nat->pollData, sizeof(struct pollfd) *
+            nat->pollMemberCount);
+    free(nat->pollData);
+    nat->pollData = temp;
+    DBusWatch **temp2 = (DBusWatch **)malloc(sizeof(DBusWatch *) *
+            (nat->pollMemberCount+1));
+    if (!temp2) {
+        return -1;
+    }
+    memcpy(temp2, nat->watchData, sizeof(DBusWatch *) *
+            nat->pollMemberCount);
+    free(nat->watchData);
+    nat->watchData = temp2;
+    tEventLoopFd *temp3 = (tEventLoopFd *)malloc(sizeof(tEventLoopFd) *
+            (nat->pollMemberCount+1));
+    if (!temp3) {
+        return -1;
+    }
+    memcpy(temp3, nat->fdData, sizeof(tEventLoopFd) *
+            nat->pollMemberCount);
+    free(nat->fdData);
+    nat->fdData = temp3;
+    nat->pollDataSize++;
+    return 0;
+}
+
 static void handleWatchAdd(tBluetoothEvent *nat) {
     DBusWatch *watch;
     int newFD,y;
@@ -135,31 +198,15 @@ static void handleWatchAdd(tBluetoothEvent *nat) {
         }
     }
     if (nat->pollMemberCount == nat->pollDataSize) {
-        printf("Bluetooth EventLoop poll struct growing");
-        struct pollfd *temp = (struct pollfd *)malloc(
-                sizeof(struct pollfd) * (nat->pollMemberCount+1));
-        if (!temp) {
+        if (growPollData(nat) < 0)
             return;
-        }
-        memcpy(temp, nat->pollData, sizeof(struct pollfd) *
-                nat->pollMemberCount);
-        free(nat->pollData);
-        nat->pollData = temp;
-        DBusWatch **temp2 = (DBusWatch **)malloc(sizeof(DBusWatch *) *
-                (nat->pollMemberCount+1));
-        if (!temp2) {
-            return;
-        }
-        memcpy(temp2, nat->watchData, sizeof(DBusWatch *) *
-                nat->pollMemberCount);
-        free(nat->watchData);
-        nat->watchData = temp2;
-        nat->pollDataSize++;
     }
     nat->pollData[nat->pollMemberCount].fd = newFD;
     nat->pollData[nat->pollMemberCount].revents = 0;
     nat->pollData[nat->pollMemberCount].events = events;
     nat->watchData[nat->pollMemberCount] = watch;
+    nat->fdData[nat->pollMemberCount].cb = NULL;
+    nat->fdData[nat->pollMemberCount].data = NULL;
     nat->pollMemberCount++;
 }
 
@@ -180,12 +227,120 @@ static void handleWatchRemove(tBluetoothEvent *nat) {
             nat->pollData[y].events = nat->pollData[newCount].events;
             nat->pollData[y].revents = nat->pollData[newCount].revents;
             nat->watchData[y] = nat->watchData[newCount];
+            nat->fdData[y] = nat->fdData[newCount];
             return;
         }
     }
     printf("WatchRemove given with unknown watch");
 }
 
+static int findFd(tBluetoothEvent *nat, int fd) {
+    int y;
+    for (y = 0; y < nat->pollMemberCount; y++) {
+        if (nat->pollData[y].fd == fd && nat->fdData[y].cb != NULL)
+            return y;
+    }
+    return -1;
+}
+
+static void applyFdControl(tBluetoothEvent *nat, char op, tEventLoopFdCtl *ctl) {
+    int y = findFd(nat, ctl->fd);
+
+    switch (op) {
+    case EVENT_LOOP_ADD_FD:
+        if (y >= 0) {
+            printf("EventLoop fd %d duplicate add\n", ctl->fd);
+            return;
+        }
+        if (nat->pollMemberCount == nat->pollDataSize) {
+            if (growPollData(nat) < 0)
+                return;
+        }
+        y = nat->pollMemberCount++;
+        nat->pollData[y].fd = ctl->fd;
+        nat->pollData[y].events = ctl->events;
+        nat->pollData[y].revents = 0;
+        nat->watchData[y] = NULL;
+        nat->fdData[y].cb = ctl->cb;
+        nat->fdData[y].data = ctl->data;
+        break;
+    case EVENT_LOOP_MODIFY_FD:
+        if (y >= 0)
+            nat->pollData[y].events = ctl->events;
+        break;
+    case EVENT_LOOP_REMOVE_FD:
+    case EVENT_LOOP_CLOSE_FD:
+        if (y >= 0) {
+            int newCount = --nat->pollMemberCount;
+            nat->pollData[y] = nat->pollData[newCount];
+            nat->watchData[y] = nat->watchData[newCount];
+            nat->fdData[y] = nat->fdData[newCount];
+        }
+        /* nothing polls it anymore, the number can't be reused under us */
+        if (op == EVENT_LOOP_CLOSE_FD)
+            close(ctl->fd);
+        break;
+    }
+}
+
+static void handleFdControl(tBluetoothEvent *nat, char op) {
+    tEventLoopFdCtl ctl;
+    read(nat->controlFdR, &ctl, sizeof(ctl));
+    applyFdControl(nat, op, &ctl);
+}
+
+/*
+* On the loop thread the change is applied at once, so a callback may safely
+* remove (and close) its own fd. Other threads go through the control socket.
+*/
+static int sendFdControl(char op, int fd, short events,
+                         tEventLoopFdCb cb, void *data) {
+    tBluetoothEvent *nat = g_bluetooth_evt;
+    char buf[1 + sizeof(tEventLoopFdCtl)];
+    tEventLoopFdCtl ctl;
+
+    if (!nat || !nat->pollData)
+        return -1;
+    memset(&ctl, 0, sizeof(ctl));
+    ctl.fd = fd;
+    ctl.events = events;
+    ctl.cb = cb;
+    ctl.data = data;
+
+    if (nat->running && pthread_equal(pthread_self(), nat->thread)) {
+        applyFdControl(nat, op, &ctl);
+        return 0;
+    }
+    /* one write so concurrent callers can't interleave */
+    buf[0] = op;
+    memcpy(buf + 1, &ctl, sizeof(ctl));
+    if (write(nat->controlFdW, buf, sizeof(buf)) != sizeof(buf))
+        return -1;
+    return 0;
+}
+
+int addEventLoopFd(int fd, short events, tEventLoopFdCb cb, void *data) {
+    if (fd < 0 || !cb)
+        return -1;
+    return sendFdControl(EVENT_LOOP_ADD_FD, fd, events, cb, data);
+}
+
+int modifyEventLoopFd(int fd, short events) {
+    return sendFdControl(EVENT_LOOP_MODIFY_FD, fd, events, NULL, NULL);
+}
+
+void removeEventLoopFd(int fd) {
+    sendFdControl(EVENT_LOOP_REMOVE_FD, fd, 0, NULL, NULL);
+}
+
+void closeEventLoopFd(int fd) {
+    if (fd < 0)
+        return;
+    /* loop gone, nobody polls it */
+    if (sendFdControl(EVENT_LOOP_CLOSE_FD, fd, 0, NULL, NULL) < 0)
+        close(fd);
+}
+
 static void *eventLoopMain(void *ptr) {
     int i = 0;
     tBluetoothEvent *nat = (tBluetoothEvent *)ptr;
@@ -230,8 +385,28 @@ static void *eventLoopMain(void *ptr) {
                         // noop
                         break;
                     }
+                    case EVENT_LOOP_ADD_FD:
+                    case EVENT_LOOP_MODIFY_FD:
+                    case EVENT_LOOP_REMOVE_FD:
+                    case EVENT_LOOP_CLOSE_FD:
+                    {
+                        handleFdControl(nat, data);
+                        break;
+                    }
                     }
                 }
+            } else if (nat->fdData[i].cb) {
+                short events = nat->pollData[i].revents;
+                int fd = nat->pollData[i].fd;
+                nat->pollData[i].revents = 0;
+                if (events & POLLNVAL) {
+                    // closed before it was removed
+                    continue;
+                }
+                nat->fdData[i].cb(fd, events, nat->fdData[i].data);
+                // the callback may have removed its entry, revisit this slot
+                if (i < nat->pollMemberCount && nat->pollData[i].fd != fd)
+                    i--;
             } else {
                 short events = nat->pollData[i].revents;
                 unsigned int flags = unix_events_to_dbus_flags(events);
@@ -271,7 +446,7 @@ static void tearDownEventLoop(tBluetoothEvent *nat){
         }
 
         dbus_bus_remove_match(nat->conn,
-                "type='signal',interface='"BLUEZ_DBUS_BASE_IFC".MediaControl1'",
+                "type='signal',interface='"DBUS_INTERFACE_PROPERTIES"'",
                 &err);
         if (dbus_error_is_set(&err)) {
             LOG_AND_FREE_DBUS_ERROR(&err);
@@ -359,6 +534,13 @@ int startEventLoop(){
         goto done;
     }
 
+    nat->fdData = (tEventLoopFd *)calloc(DEFAULT_INITIAL_POLLFD_COUNT,
+            sizeof(tEventLoopFd));
+    if (!nat->fdData) {
+        printf("out of memory error starting EventLoop!");
+        goto done;
+    }
+
     memset(nat->pollData, 0, sizeof(struct pollfd) *
             DEFAULT_INITIAL_POLLFD_COUNT);
     memset(nat->watchData, 0, sizeof(DBusWatch *) *
@@ -395,6 +577,8 @@ done:
         nat->pollData = NULL;
         if (nat->watchData) free(nat->watchData);
         nat->watchData = NULL;
+        if (nat->fdData) free(nat->fdData);
+        nat->fdData = NULL;
         nat->pollDataSize = 0;
         nat->pollMemberCount = 0;
     }
@@ -418,6 +602,8 @@ void stopEventLoop(){
         nat->pollData = NULL;
         free(nat->watchData);
         nat->watchData = NULL;
+        free(nat->fdData);
+        nat->fdData = NULL;
         nat->pollDataSize = 0;
         nat->pollMemberCount = 0;
 
@@ -479,16 +665,281 @@ static int setUpEventLoop(tBluetoothEvent *nat){
             return -1;
         }
         dbus_bus_add_match(nat->conn,
-                "type='signal',interface='"BLUEZ_DBUS_BASE_IFC".MediaControl1'",
+                "type='signal',interface='"DBUS_INTERFACE_PROPERTIES"'",
                 &err);
         if (dbus_error_is_set(&err)) {
             LOG_AND_FREE_DBUS_ERROR(&err);
             return -1;
         }
+
+        sync_managed_objects(nat);
     }
     return 0;
 }
 
+#define BATTERY_IFC BLUEZ_DBUS_BASE_IFC ".Battery1"
+
+/* mirror a parsed Adapter1/Device1 property set into the status page */
+static void update_status(const char *path, const char *ifc,
+                          t_property_value_array *array) {
+    t_property_value *value;
+    const char *str_val;
+    int i, is_device = !strcmp(ifc, DEVICE_IFC);
+
+    /* the whole set in one write section (the caller's for InterfacesAdded) */
+    statusUpdateBegin();
+    for (i = 0; i < array->num; i++) {
+        value = &array->head[i];
+        str_val = (value->type == DBUS_TYPE_STRING ||
+                   value->type == DBUS_TYPE_OBJECT_PATH) ? value->val.str_val : NULL;
+        if (is_device)
+            statusSetDeviceProperty(path, value->name, value->type,
+                                    value->val.int_val, str_val);
+        else
+            statusSetAdapterProperty(value->name, value->type,
+                                     value->val.int_val, str_val);
+    }
+    statusUpdateEnd();
+    for (i = 0; is_device && i < array->num; i++) {
+        value = &array->head[i];
+        if (!strcmp(value->name, "ServicesResolved") && value->val.int_val) {
+            gattServicesResolved(path);
+            gattReadServicesResolved(path);
+        }
+        if (!strcmp(value->name, "Connected")) {
+            gattDeviceConnected(path, value->val.int_val);
+            gattReadConnected(path, value->val.int_val);
+        }
+    }
+    if (is_device) {
+        advMonitorDeviceUpdate(path, array);
+        presenceDeviceUpdate(path, array);
+        telemetryDeviceUpdate(path, array);
+        deviceGcDeviceUpdate(path, array);
+    }
+}
+
+/* local scan filter, a copy of the caller's set */
+static pthread_mutex_t g_uuid_filter_lock = PTHREAD_MUTEX_INITIALIZER;
+static t_bt_uuid_set g_uuid_filter;
+static int g_uuid_filter_on = 0;
+
+/*
+* Devices bluez announced that missed the filter, their UUIDs often only come
+* with a later PropertiesChanged. Event loop thread only.
+*/
+#define PENDING_DEVICES     1024    /* power of two, half full at most */
+#define PENDING_PATH_SIZE   64
+
+typedef struct {
+    int used;
+    uint32_t hash;
+    char path[PENDING_PATH_SIZE];
+} tPendingDevice;
+
+static tPendingDevice g_pending[PENDING_DEVICES];
+static int g_pending_count = 0;
+
+int setDeviceUuidFilter(const t_bt_uuid_set *set) {
+    pthread_mutex_lock(&g_uuid_filter_lock);
+    if (set)
+        memcpy(&g_uuid_filter, set, sizeof(g_uuid_filter));
+    g_uuid_filter_on = set != NULL;
+    pthread_mutex_unlock(&g_uuid_filter_lock);
+    return 0;
+}
+
+/* 1 if a device with these properties passes the filter */
+static int device_wanted(t_property_value_array *array) {
+    t_property_value *value;
+    int i, wanted = 0;
+
+    if (!__atomic_load_n(&g_uuid_filter_on, __ATOMIC_RELAXED))
+        return 1;
+    for (i = 0; array && i < array->num; i++) {
+        value = &array->head[i];
+        if (value->type != DBUS_TYPE_ARRAY || strcmp(value->name, "UUIDs"))
+            continue;
+        pthread_mutex_lock(&g_uuid_filter_lock);
+        wanted = !g_uuid_filter_on ||
+                 bt_uuid_set_match(&g_uuid_filter, value->val.array_val, value->len);
+        pthread_mutex_unlock(&g_uuid_filter_lock);
+        break;
+    }
+    return wanted;
+}
+
+static uint32_t path_hash(const char *path) {
+    uint32_t h = 2166136261u;
+
+    while (*path)
+        h = (h ^ (uint8_t)*path++) * 16777619u;
+    return h;
+}
+
+/* slot of the pending device, -1 if it isn't there */
+static int find_pending(const char *path) {
+    uint32_t hash = path_hash(path);
+    int i = hash & (PENDING_DEVICES - 1);
+
+    for (; g_pending[i].used; i = (i + 1) & (PENDING_DEVICES - 1)) {
+        if (g_pending[i].hash == hash && !strcmp(g_pending[i].path, path))
+            return i;
+    }
+    return -1;
+}
+
+static void add_pending(const char *path) {
+    uint32_t hash = path_hash(path);
+    int i = hash & (PENDING_DEVICES - 1);
+    static int full_logged = 0;
+
+    if (find_pending(path) >= 0)
+        return;
+    if (g_pending_count >= PENDING_DEVICES / 2 || strlen(path) >= PENDING_PATH_SIZE) {
+        if (!full_logged++)
+            printf("%s: no room for %s\n", __FUNCTION__, path);
+        return;
+    }
+    while (g_pending[i].used)
+        i = (i + 1) & (PENDING_DEVICES - 1);
+    g_pending[i].used = 1;
+    g_pending[i].hash = hash;
+    strcpy(g_pending[i].path, path);
+    g_pending_count++;
+}
+
+/* backward shift so probes never need tombstones */
+static void drop_pending(const char *path) {
+    int i = g_pending_count ? find_pending(path) : -1, j = i, home;
+
+    if (i < 0)
+        return;
+    for (;;) {
+        j = (j + 1) & (PENDING_DEVICES - 1);
+        if (!g_pending[j].used)
+            break;
+        home = g_pending[j].hash & (PENDING_DEVICES - 1);
+        /* j can move to i unless its home lies cyclically in (i, j] */
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+            g_pending[i] = g_pending[j];
+            i = j;
+        }
+    }
+    g_pending[i].used = 0;
+    g_pending_count--;
+}
+
+/* a device that missed the filter may pass once its UUIDs are in */
+static void check_pending(const char *path, t_property_value_array *array) {
+    if (!g_pending_count || find_pending(path) < 0 || !device_wanted(array))
+        return;
+    drop_pending(path);
+    publishDeviceEvent(BT_EVENT_DEVICE_FOUND, path);
+}
+
+/* Battery1 lives on the device object, Percentage is a byte */
+static void battery_changed(const char *path, DBusMessageIter *iter) {
+    DBusMessageIter dict, entry, value;
+    const char *key;
+    unsigned char percentage;
+
+    if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY)
+        return;
+    dbus_message_iter_recurse(iter, &dict);
+    while (dbus_message_iter_get_arg_type(&dict) == DBUS_TYPE_DICT_ENTRY) {
+        dbus_message_iter_recurse(&dict, &entry);
+        dbus_message_iter_get_basic(&entry, &key);
+        dbus_message_iter_next(&entry);
+        dbus_message_iter_recurse(&entry, &value);
+        if (!strcmp(key, "Percentage") &&
+            dbus_message_iter_get_arg_type(&value) == DBUS_TYPE_BYTE) {
+            dbus_message_iter_get_basic(&value, &percentage);
+            statusSetDeviceProperty(path, key, DBUS_TYPE_BYTE, percentage, NULL);
+        }
+        dbus_message_iter_next(&dict);
+    }
+}
+
+/* walk the a{sa{sv}} interface map of one object */
+static void handle_interfaces(const char *path, DBusMessageIter *ifaces,
+                              int publish) {
+    DBusMessageIter entry, count = *ifaces;
+    t_property_value_array array;
+    const char *key;
+    int n;
+
+    for (n = 0; dbus_message_iter_get_arg_type(&count) == DBUS_TYPE_DICT_ENTRY; n++)
+        dbus_message_iter_next(&count);
+    deviceGcObjectAdded(path, n);
+    /* a new device shows up on the status page whole or not at all */
+    statusUpdateBegin();
+    while (dbus_message_iter_get_arg_type(ifaces) == DBUS_TYPE_DICT_ENTRY) {
+        dbus_message_iter_recurse(ifaces, &entry);
+        dbus_message_iter_get_basic(&entry, &key);
+        dbus_message_iter_next(&entry);
+
+        memset(&array, 0, sizeof(array));
+        if (!strcmp(key, DEVICE_IFC)) {
+            if (parse_remote_device_properties(&entry, &array) == 0) {
+                if (publish && device_wanted(&array)) {
+                    publishDeviceEvent(BT_EVENT_DEVICE_FOUND, path);
+                    advPublishProperties(path, &array);
+                } else if (publish) {
+                    add_pending(path);
+                }
+                update_status(path, key, &array);
+                free_property_value(&array);
+            } else if (publish && device_wanted(NULL)) {
+                publishDeviceEvent(BT_EVENT_DEVICE_FOUND, path);
+            } else if (publish) {
+                add_pending(path);
+            }
+        } else if (!strcmp(key, ADAPTER_IFC)) {
+            if (parse_adapter_properties(&entry, &array) == 0) {
+                update_status(path, key, &array);
+                free_property_value(&array);
+            }
+        } else if (!strcmp(key, BATTERY_IFC)) {
+            battery_changed(path, &entry);
+        } else if (!strcmp(key, MEDIA_PLAYER_IFC) ||
+                   !strcmp(key, MEDIA_TRANSPORT_IFC)) {
+            mediaObjectAdded(path, key, &entry);
+        } else if (!strcmp(key, GATT_SERVICE_IFC) ||
+                   !strcmp(key, GATT_CHARACTERISTIC_IFC) ||
+                   !strcmp(key, GATT_DESCRIPTOR_IFC)) {
+            gattObjectAdded(path, key, &entry);
+        }
+        dbus_message_iter_next(ifaces);
+    }
+    statusUpdateEnd();
+}
+
+/* GetManagedObjects -> a{oa{sa{sv}}}, seeds state for objects that already exist */
+static void sync_managed_objects(tBluetoothEvent *nat) {
+    DBusMessage *reply;
+    DBusMessageIter iter, objects, object, ifaces;
+    const char *path;
+
+    reply = dbus_func_args(nat->conn, "/", "org.freedesktop.DBus.ObjectManager",
+                           "GetManagedObjects", DBUS_TYPE_INVALID);
+    if (!reply)
+        return;
+    if (dbus_message_iter_init(reply, &iter) &&
+        dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_ARRAY) {
+        dbus_message_iter_recurse(&iter, &objects);
+        while (dbus_message_iter_get_arg_type(&objects) == DBUS_TYPE_DICT_ENTRY) {
+            dbus_message_iter_recurse(&objects, &object);
+            dbus_message_iter_get_basic(&object, &path);
+            dbus_message_iter_next(&object);
+            dbus_message_iter_recurse(&object, &ifaces);
+            handle_interfaces(path, &ifaces, 0);
+            dbus_message_iter_next(&objects);
+        }
+    }
+    dbus_message_unref(reply);
+}
+
 static int interface_added(DBusMessage *msg) {
 	const char *path;
     DBusMessageIter iter = { 0 }, subiter = { 0 };
@@ -508,29 +959,106 @@ static int interface_added(DBusMessage *msg) {
 		dbus_message_iter_get_element_type(&iter) != DBUS_TYPE_DICT_ENTRY)
 		goto failure;
 	dbus_message_iter_recurse(&iter, &subiter);
+	handle_interfaces(path, &subiter, 1);
 
-	while (dbus_message_iter_get_arg_type(&subiter) == DBUS_TYPE_DICT_ENTRY) {
-		DBusMessageIter value, entry;
-		const char *key;
-
-		dbus_message_iter_recurse(&subiter, &entry);
-		dbus_message_iter_get_basic(&entry, &key);
-		printf("interface_added key <%s>\n", key);
-		dbus_message_iter_next(&entry);
-		//dbus_message_iter_recurse(&entry, &value);
-
-		//if (parse_ext_opt(ext, key, &value) < 0)
-		//	error("Invalid value for profile option %s", key);
-
-		dbus_message_iter_next(&subiter);
-	}
-	
     return 0;
 failure:
     LOG_AND_FREE_DBUS_ERROR_WITH_MSG(&err, msg);
     return -1;
 }
 
+static int interface_removed(DBusMessage *msg) {
+    const char *path, *ifc;
+    DBusMessageIter iter, subiter, count;
+    int n;
+
+    if (!dbus_message_iter_init(msg, &iter) ||
+        dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_OBJECT_PATH)
+        return -1;
+    dbus_message_iter_get_basic(&iter, &path);
+
+    /* as */
+    dbus_message_iter_next(&iter);
+    if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY ||
+        dbus_message_iter_get_element_type(&iter) != DBUS_TYPE_STRING)
+        return -1;
+    dbus_message_iter_recurse(&iter, &subiter);
+
+    count = subiter;
+    for (n = 0; dbus_message_iter_get_arg_type(&count) == DBUS_TYPE_STRING; n++)
+        dbus_message_iter_next(&count);
+    deviceGcObjectRemoved(path, n);
+    while (dbus_message_iter_get_arg_type(&subiter) == DBUS_TYPE_STRING) {
+        dbus_message_iter_get_basic(&subiter, &ifc);
+        printf("interface_removed <%s> <%s>\n", path, ifc);
+        if (!strcmp(ifc, DEVICE_IFC)) {
+            publishDeviceEvent(BT_EVENT_DEVICE_REMOVED, path);
+            drop_pending(path);
+            statusRemoveDevice(path);
+            gattReadConnected(path, 0);
+            gattObjectRemoved(path, ifc);
+            advMonitorDeviceRemoved(path);
+            presenceDeviceRemoved(path);
+            telemetryDeviceRemoved(path);
+            deviceGcDeviceRemoved(path);
+        } else if (!strcmp(ifc, MEDIA_PLAYER_IFC) ||
+                   !strcmp(ifc, MEDIA_TRANSPORT_IFC)) {
+            mediaObjectRemoved(path, ifc);
+        } else if (!strcmp(ifc, GATT_SERVICE_IFC) ||
+                   !strcmp(ifc, GATT_CHARACTERISTIC_IFC) ||
+                   !strcmp(ifc, GATT_DESCRIPTOR_IFC)) {
+            gattObjectRemoved(path, ifc);
+        }
+        dbus_message_iter_next(&subiter);
+    }
+    return 0;
+}
+
+/* org.freedesktop.DBus.Properties.PropertiesChanged(s, a{sv}, as) */
+static int properties_changed(DBusMessage *msg) {
+    DBusMessageIter iter;
+    const char *ifc;
+    const char *path = dbus_message_get_path(msg);
+    t_property_value_array array;
+    int ret;
+
+    if (!dbus_message_iter_init(msg, &iter) ||
+        dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_STRING)
+        return -1;
+    dbus_message_iter_get_basic(&iter, &ifc);
+    dbus_message_iter_next(&iter);
+
+    memset(&array, 0, sizeof(array));
+    if (!strcmp(ifc, DEVICE_IFC)) {
+        ret = parse_remote_device_properties(&iter, &array);
+    } else if (!strcmp(ifc, ADAPTER_IFC)) {
+        ret = parse_adapter_properties(&iter, &array);
+    } else if (!strcmp(ifc, MEDIA_PLAYER_IFC) ||
+               !strcmp(ifc, MEDIA_TRANSPORT_IFC)) {
+        mediaPropertiesChanged(path, ifc, &iter);
+        return 0;
+    } else if (!strcmp(ifc, BATTERY_IFC)) {
+        battery_changed(path, &iter);
+        return 0;
+    } else if (!strcmp(ifc, GATT_CHARACTERISTIC_IFC)) {
+        gattPropertiesChanged(path, ifc, &iter);
+        return 0;
+    } else {
+        return 0;
+    }
+    if (ret < 0)
+        return -1;
+
+    if (!strcmp(ifc, DEVICE_IFC))
+        check_pending(path, &array);
+    publishPropertyChanges(path, &array);
+    if (!strcmp(ifc, DEVICE_IFC))
+        advPublishProperties(path, &array);
+    update_status(path, ifc, &array);
+    free_property_value(&array);
+    return 0;
+}
+
 static DBusHandlerResult event_filter(DBusConnection *conn, DBusMessage *msg,
                                       void *data){
     DBusError err;
@@ -550,8 +1078,10 @@ static DBusHandlerResult event_filter(DBusConnection *conn, DBusMessage *msg,
                                       "PropertyChanged")) {
         t_property_value_array str_array;
         memset(&str_array,0,sizeof(str_array));
-        parse_adapter_property_change(msg, &str_array);
-        print_property_value(&str_array);
+        if (parse_adapter_property_change(msg, &str_array) == 0) {
+            print_property_value(&str_array);
+            publishPropertyChanges(dbus_message_get_path(msg), &str_array);
+        }
         free_property_value(&str_array);
     }else if (dbus_message_is_signal(msg,
                                       "org.bluez.Device1",
@@ -559,11 +1089,16 @@ static DBusHandlerResult event_filter(DBusConnection *conn, DBusMessage *msg,
         t_property_value_array str_array;
         const char *remote_device_path;
         memset(&str_array,0,sizeof(str_array));
-        parse_remote_device_property_change(msg,&str_array);
-        print_property_value(&str_array);
-        //remote_device_path = dbus_message_get_path(msg);
-        //if (gDbusEvtHdl) gDbusEvtHdl(DEVICE_PROPERTY_CHANGE, remote_device_path, &str_array);
-        free_property_value(&str_array);        
+        if (parse_remote_device_property_change(msg,&str_array) == 0) {
+            print_property_value(&str_array);
+            remote_device_path = dbus_message_get_path(msg);
+            publishPropertyChanges(remote_device_path, &str_array);
+        }
+        free_property_value(&str_array);
+    }else if (dbus_message_is_signal(msg,
+                                      DBUS_INTERFACE_PROPERTIES,
+                                      "PropertiesChanged")) {
+        properties_changed(msg);
     }else if (dbus_message_is_signal(msg,
                                       "org.freedesktop.DBus.ObjectManager",
                                       "InterfacesAdded")) {
@@ -574,6 +1109,7 @@ static DBusHandlerResult event_filter(DBusConnection *conn, DBusMessage *msg,
                                       "org.freedesktop.DBus.ObjectManager",
                                       "InterfacesRemoved")) {
         printf("Interfaces removed\n");
+        interface_removed(msg);
     }
 
     return DBUS_HANDLER_RESULT_HANDLED;
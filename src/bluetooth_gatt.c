@@ -0,0 +1,1581 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "bluetooth_gatt.h"
+#include "bluetooth_common.h"
+#include "bluetooth_dbus_stubs.h"
+#include "bluetooth_eventloop.h"
+#include "bluetooth_metrics.h"
+
+#define GATT_PATH_SIZE      128
+#define GATT_REL_SIZE       40      /* "/service000a/char000b/desc000c" */
+#define GATT_INDEX_SIZE     (2 * GATT_MAX_CHARACTERISTICS)
+
+/* ids are generation << 8 | slot, kept positive */
+#define SUB_ID(slot, gen)   ((int)(((gen) << 8) | (slot)))
+#define SUB_SLOT(id)        ((id) & 0xff)
+#define SUB_GEN(id)         ((uint32_t)(id) >> 8)
+
+typedef enum {
+    SUB_IDLE,               /* waiting for the characteristic or the device */
+    SUB_ACQUIRING,          /* AcquireNotify in flight */
+    SUB_ACQUIRED,           /* fd served by the event loop */
+    SUB_STARTING,           /* StartNotify in flight */
+    SUB_NOTIFYING,          /* values arrive as PropertiesChanged */
+} tGattSubState;
+
+/*
+* The attribute cache is kept per device. Objects keep their slot when bluez
+* takes them away, only marked stale, so a reconnect finds them again; the
+* stale ones are dropped once the device resolves its services. Object paths
+* are stored relative to the device path.
+*
+* bluez drops the objects of a device that isn't bonded on disconnect, which
+* leaves the cache good for the reconnect. Only a Service Changed, or the
+* device going away, makes it invalid. A removal while connected can be
+* either, bluez may drop the objects just ahead of Connected going false. It
+* is taken as a Service Changed when objects come back on the same link, or
+* when some but not all of them are gone by the time the link drops.
+*/
+typedef struct {
+    int used;
+    int valid;              /* resolved, and no Service Changed since */
+    int connected;
+    int removed;            /* objects went away on the current link */
+    uint32_t hash;          /* of path, checked before the strcmp */
+    char path[GATT_PATH_SIZE];
+} tGattDevice;
+
+typedef struct {
+    int used;
+    int present;            /* exported by bluez right now */
+    int dev;
+    t_bt_uuid uuid;
+    char rel[GATT_REL_SIZE];
+} tGattService;
+
+typedef struct {
+    int used;
+    int present;
+    int dev;
+    int service;            /* slot in g_services, -1 until that shows up */
+    unsigned int flags;
+    uint16_t mtu;           /* ATT MTU if bluez reports it, 0 otherwise */
+    t_bt_uuid uuid;
+    char rel[GATT_REL_SIZE];
+} tGattChr;
+
+typedef struct {
+    int used;
+    int present;
+    int dev;
+    int chr;                /* slot in g_chrs, -1 until that shows up */
+    t_bt_uuid uuid;
+    char rel[GATT_REL_SIZE];
+} tGattDesc;
+
+typedef struct {
+    int used;
+    int closing;            /* unsubscribed, fd left for the event loop to close */
+    uint32_t generation;
+    DBusConnection *conn;
+    char device[GATT_PATH_SIZE];
+    t_bt_uuid service_uuid;
+    t_bt_uuid uuid;
+    char chr[GATT_PATH_SIZE];           /* "" until resolved */
+    unsigned int flags;
+    int use_start;          /* AcquireNotify was refused, use StartNotify */
+    tGattSubState state;
+    int fd;
+    uint16_t mtu;
+    tGattNotifyCb cb;
+    void *user;
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t batches;
+} tGattSub;
+
+typedef enum {
+    WRITER_IDLE,            /* waiting for the characteristic or the device */
+    WRITER_ACQUIRING,       /* AcquireWrite in flight */
+    WRITER_SOCKET,          /* packets go to the AcquireWrite socket */
+    WRITER_VALUE,           /* packets go out as pipelined WriteValue calls */
+} tGattWriterState;
+
+/*
+* Queued payloads live in a byte ring; rec[] keeps the length of each
+* gattWrite() so a packet never spans two of them. Packets are cut to the
+* MTU only when they are sent, the MTU is not known before that.
+*/
+typedef struct {
+    int used;
+    int closing;
+    uint32_t generation;
+    DBusConnection *conn;
+    char device[GATT_PATH_SIZE];
+    t_bt_uuid service_uuid;
+    t_bt_uuid uuid;
+    char chr[GATT_PATH_SIZE];
+    unsigned int flags;
+    int use_value;          /* AcquireWrite was refused */
+    tGattWriterState state;
+    int fd;
+    int pollout;            /* waiting for the socket to drain */
+    int failed;             /* write error, the loop tears the socket down */
+    uint16_t mtu;
+    int window;
+    int in_flight;          /* WriteValue calls without a reply */
+    tGattWriteCb drained;
+    void *user;
+    uint8_t ring[GATT_WRITE_RING];
+    uint32_t head, tail;    /* free running byte counters */
+    uint32_t rec[GATT_WRITE_RECORDS];
+    uint32_t rec_head, rec_tail;
+    uint32_t rec_off;       /* bytes of rec[rec_head] already sent */
+    uint64_t busy_since_us; /* 0 while the queue is empty */
+    tGattWriteStats stats;
+} tGattWriter;
+
+/* subscriptions come from any thread, everything else from the event loop */
+static pthread_mutex_t g_gatt_mutex = PTHREAD_MUTEX_INITIALIZER;
+static tGattDevice g_devices[GATT_MAX_DEVICES];
+static tGattService g_services[GATT_MAX_SERVICES];
+static tGattChr g_chrs[GATT_MAX_CHARACTERISTICS];
+static tGattDesc g_descs[GATT_MAX_DESCRIPTORS];
+/* (device, uuid) -> characteristic slot + 1, open addressing; 0 is empty */
+static uint16_t g_chr_index[GATT_INDEX_SIZE];
+static int g_index_dirty = 0;   /* rebuilt on the next lookup */
+static tGattSub g_subs[GATT_MAX_SUBSCRIPTIONS];
+static uint32_t g_sub_generation = 0;
+static tGattWriter g_writers[GATT_MAX_WRITERS];
+static uint32_t g_writer_generation = 0;
+
+/* notification batch, only touched by the event loop thread */
+static uint8_t g_rx_bufs[GATT_NOTIFY_BATCH][GATT_MAX_VALUE];
+static struct iovec g_rx_iov[GATT_NOTIFY_BATCH];
+static struct mmsghdr g_rx_msgs[GATT_NOTIFY_BATCH];
+static int g_rx_ready = 0;
+
+static const struct {
+    const char *name;
+    unsigned int flag;
+} chr_flags[] = {
+    { "read", GATT_CHR_READ },
+    { "write", GATT_CHR_WRITE },
+    { "write-without-response", GATT_CHR_WRITE_NO_RESPONSE },
+    { "notify", GATT_CHR_NOTIFY },
+    { "indicate", GATT_CHR_INDICATE },
+};
+
+static void try_acquire(tGattSub *s);
+static void try_open_writer(tGattWriter *w);
+
+/* /org/bluez/hci0/dev_XX_XX_XX_XX_XX_XX/service000a/char000b -> .../dev_XX_... */
+static int device_of(const char *path, char *device, size_t size) {
+    const char *dev = strstr(path, "/dev_");
+    const char *end;
+    size_t len;
+
+    if (!dev) return -1;
+    end = strchr(dev + 1, '/');
+    len = end ? (size_t)(end - path) : strlen(path);
+    if (len >= size) return -1;
+    memcpy(device, path, len);
+    device[len] = '\0';
+    return 0;
+}
+
+static tGattSub * lock_sub(int id) {
+    tGattSub *s;
+
+    if (id < 0 || SUB_SLOT(id) >= GATT_MAX_SUBSCRIPTIONS)
+        return NULL;
+    pthread_mutex_lock(&g_gatt_mutex);
+    s = &g_subs[SUB_SLOT(id)];
+    if (!s->used || s->closing || s->generation != SUB_GEN(id)) {
+        pthread_mutex_unlock(&g_gatt_mutex);
+        return NULL;
+    }
+    return s;
+}
+
+/* the reply carries the slot and generation, the subscription may be gone */
+static tGattSub * sub_from_reply(void *user, void *nat) {
+    long slot = (long)user;
+    tGattSub *s;
+
+    if (slot < 0 || slot >= GATT_MAX_SUBSCRIPTIONS)
+        return NULL;
+    s = &g_subs[slot];
+    if (!s->used || s->closing || s->generation != (uint32_t)(long)nat)
+        return NULL;
+    return s;
+}
+
+/* FNV-1a; device paths only differ in their last few bytes */
+static uint32_t path_hash(const char *path) {
+    uint32_t h = 2166136261u;
+
+    while (*path)
+        h = (h ^ (uint8_t)*path++) * 16777619u;
+    return h;
+}
+
+/* slot of the device, created on demand when create is set; -1 if none */
+static int find_device(const char *path, int create) {
+    uint32_t hash = path_hash(path);
+    int i, free_slot = -1;
+
+    for (i = 0; i < GATT_MAX_DEVICES; i++) {
+        if (g_devices[i].used && g_devices[i].hash == hash &&
+            !strcmp(g_devices[i].path, path))
+            return i;
+        if (!g_devices[i].used && free_slot < 0)
+            free_slot = i;
+    }
+    if (!create || free_slot < 0 || strlen(path) >= GATT_PATH_SIZE)
+        return -1;
+    memset(&g_devices[free_slot], 0, sizeof(g_devices[0]));
+    g_devices[free_slot].used = 1;
+    g_devices[free_slot].hash = hash;
+    snprintf(g_devices[free_slot].path, GATT_PATH_SIZE, "%s", path);
+    return free_slot;
+}
+
+/* full object path of an entry, -1 if it doesn't fit */
+static int object_path(int dev, const char *rel, char *path) {
+    int len = snprintf(path, GATT_PATH_SIZE, "%s%s", g_devices[dev].path, rel);
+    return len < 0 || len >= GATT_PATH_SIZE ? -1 : 0;
+}
+
+/* the path below the device, NULL if it doesn't fit */
+static const char * rel_path(int dev, const char *path) {
+    const char *rel = path + strlen(g_devices[dev].path);
+    return strlen(rel) < GATT_REL_SIZE ? rel : NULL;
+}
+
+static tGattService * find_service(int dev, const char *rel) {
+    int i;
+
+    for (i = 0; i < GATT_MAX_SERVICES; i++) {
+        if (g_services[i].used && g_services[i].dev == dev &&
+            !strcmp(g_services[i].rel, rel))
+            return &g_services[i];
+    }
+    return NULL;
+}
+
+static tGattChr * find_chr(int dev, const char *rel) {
+    int i;
+
+    for (i = 0; i < GATT_MAX_CHARACTERISTICS; i++) {
+        if (g_chrs[i].used && g_chrs[i].dev == dev && !strcmp(g_chrs[i].rel, rel))
+            return &g_chrs[i];
+    }
+    return NULL;
+}
+
+static tGattDesc * find_desc(int dev, const char *rel) {
+    int i;
+
+    for (i = 0; i < GATT_MAX_DESCRIPTORS; i++) {
+        if (g_descs[i].used && g_descs[i].dev == dev && !strcmp(g_descs[i].rel, rel))
+            return &g_descs[i];
+    }
+    return NULL;
+}
+
+static unsigned int chr_hash(int dev, const t_bt_uuid *uuid) {
+    uint64_t h = (uuid->hi ^ uuid->lo ^ (uint64_t)dev) * 0x9e3779b97f4a7c15ULL;
+    return (unsigned int)(h >> 32) & (GATT_INDEX_SIZE - 1);
+}
+
+static void index_chr(int slot) {
+    unsigned int h = chr_hash(g_chrs[slot].dev, &g_chrs[slot].uuid);
+
+    while (g_chr_index[h])
+        h = (h + 1) & (GATT_INDEX_SIZE - 1);
+    g_chr_index[h] = slot + 1;
+}
+
+/* open addressing can't just clear a slot, removals rebuild the lot */
+static void rebuild_index(void) {
+    int i;
+
+    memset(g_chr_index, 0, sizeof(g_chr_index));
+    for (i = 0; i < GATT_MAX_CHARACTERISTICS; i++) {
+        if (g_chrs[i].used)
+            index_chr(i);
+    }
+    g_index_dirty = 0;
+}
+
+/* a present characteristic wins over a stale one with the same uuid */
+static tGattChr * match_chr(const char *device, const t_bt_uuid *service_uuid,
+                            const t_bt_uuid *uuid) {
+    tGattChr *c, *stale = NULL;
+    unsigned int h;
+    int dev = find_device(device, 0);
+
+    if (dev < 0) return NULL;
+    if (g_index_dirty) rebuild_index();
+    for (h = chr_hash(dev, uuid); g_chr_index[h]; h = (h + 1) & (GATT_INDEX_SIZE - 1)) {
+        c = &g_chrs[g_chr_index[h] - 1];
+        if (c->dev != dev || !BT_UUID_EQ(c->uuid, *uuid))
+            continue;
+        if (!BT_UUID_IS_NULL(*service_uuid) &&
+            (c->service < 0 || !BT_UUID_EQ(g_services[c->service].uuid, *service_uuid)))
+            continue;
+        if (c->present)
+            return c;
+        if (!stale)
+            stale = c;
+    }
+    return stale;
+}
+
+/* some objects of the device still exported */
+static int device_present(int dev) {
+    int i;
+
+    for (i = 0; i < GATT_MAX_SERVICES; i++) {
+        if (g_services[i].used && g_services[i].dev == dev && g_services[i].present)
+            return 1;
+    }
+    return 0;
+}
+
+/* forget everything about the device */
+static void drop_device(int dev) {
+    int i;
+
+    for (i = 0; i < GATT_MAX_SERVICES; i++) {
+        if (g_services[i].dev == dev) g_services[i].used = 0;
+    }
+    for (i = 0; i < GATT_MAX_CHARACTERISTICS; i++) {
+        if (g_chrs[i].dev == dev) g_chrs[i].used = 0;
+    }
+    for (i = 0; i < GATT_MAX_DESCRIPTORS; i++) {
+        if (g_descs[i].dev == dev) g_descs[i].used = 0;
+    }
+    g_devices[dev].used = 0;
+    g_index_dirty = 1;
+}
+
+/* close a socket the loop serves, on the loop thread or once it has stopped */
+static void drop_fd(int *fd) {
+    if (*fd < 0) return;
+    removeEventLoopFd(*fd);
+    close(*fd);
+    *fd = -1;
+}
+
+static void release_sub(tGattSub *s) {
+    drop_fd(&s->fd);
+    s->used = 0;
+    s->closing = 0;
+}
+
+static int reply_failed(DBusMessage *msg, DBusError *err) {
+    if (dbus_set_error_from_message(err, msg)) {
+        printf("%s: D-Bus error: %s (%s)\n", __FUNCTION__, err->name, err->message);
+        return 1;
+    }
+    return 0;
+}
+
+static void on_notify_fd(int fd, short revents, void *data);
+
+static void onAcquireNotifyResult(DBusMessage *msg, void *user, void *nat) {
+    DBusError err;
+    tGattSub *s;
+    uint16_t mtu = 0;
+    int fd = -1, failed;
+
+    dbus_error_init(&err);
+    failed = bluez_gatt_characteristic1_acquire_notify_parse(msg, &fd, &mtu, &err) < 0;
+
+    pthread_mutex_lock(&g_gatt_mutex);
+    s = sub_from_reply(user, nat);
+    if (!s || s->state != SUB_ACQUIRING) {
+        if (fd >= 0) close(fd);
+    } else if (failed) {
+        printf("%s: %s: %s\n", __FUNCTION__, s->chr,
+               dbus_error_is_set(&err) ? err.name : "bad reply");
+        s->state = SUB_IDLE;
+        /* already notifying through StartNotify for someone else: join that */
+        if (dbus_error_has_name(&err, BLUEZ_ERROR_IFC ".NotPermitted") ||
+            dbus_error_has_name(&err, BLUEZ_ERROR_IFC ".NotSupported")) {
+            s->use_start = 1;
+            try_acquire(s);
+        }
+    } else {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        s->fd = fd;
+        s->mtu = mtu;
+        s->state = SUB_ACQUIRED;
+        if (addEventLoopFd(fd, POLLIN, on_notify_fd, (void *)(long)(s - g_subs)) < 0) {
+            close(fd);
+            s->fd = -1;
+            s->state = SUB_IDLE;
+        }
+    }
+    pthread_mutex_unlock(&g_gatt_mutex);
+    dbus_error_free(&err);
+}
+
+static void onStartNotifyResult(DBusMessage *msg, void *user, void *nat) {
+    DBusError err;
+    tGattSub *s;
+    int failed;
+
+    dbus_error_init(&err);
+    failed = reply_failed(msg, &err);
+    pthread_mutex_lock(&g_gatt_mutex);
+    s = sub_from_reply(user, nat);
+    if (s && s->state == SUB_STARTING)
+        s->state = failed ? SUB_IDLE : SUB_NOTIFYING;
+    pthread_mutex_unlock(&g_gatt_mutex);
+    dbus_error_free(&err);
+}
+
+/* called with the lock held, nothing happens until the chr is resolved */
+static void try_acquire(tGattSub *s) {
+    char path[GATT_PATH_SIZE];
+    tGattChr *c;
+    DBusMessage *msg;
+    void (*done)(DBusMessage *, void *, void *);
+    tGattSubState next;
+
+    if (s->state != SUB_IDLE || !s->conn)
+        return;
+    c = match_chr(s->device, &s->service_uuid, &s->uuid);
+    if (!c || object_path(c->dev, c->rel, path) < 0) {
+        s->chr[0] = '\0';
+        return;
+    }
+    if (strcmp(s->chr, path)) {
+        memcpy(s->chr, path, sizeof(s->chr));
+        s->flags = c->flags;
+        s->use_start = 0;
+    }
+
+    if ((s->flags & GATT_CHR_NOTIFY) && !s->use_start) {
+        msg = bluez_gatt_characteristic1_acquire_notify_new(s->chr, NULL, 0);
+        done = onAcquireNotifyResult;
+        next = SUB_ACQUIRING;
+    } else if (s->flags & (GATT_CHR_NOTIFY | GATT_CHR_INDICATE)) {
+        msg = bluez_gatt_characteristic1_start_notify_new(s->chr);
+        done = onStartNotifyResult;
+        next = SUB_STARTING;
+    } else {
+        printf("%s: %s neither notifies nor indicates\n", __FUNCTION__, s->chr);
+        return;
+    }
+    if (!msg) return;
+    if (dbus_message_send_async(s->conn, msg, GATT_ACQUIRE_TIMEOUT_MS, done,
+                                (void *)(long)(s - g_subs),
+                                (void *)(long)s->generation))
+        s->state = next;
+    dbus_message_unref(msg);
+}
+
+static void stop_notify(tGattSub *s) {
+    DBusMessage *msg;
+
+    if (s->state != SUB_STARTING && s->state != SUB_NOTIFYING)
+        return;
+    msg = bluez_gatt_characteristic1_stop_notify_new(s->chr);
+    if (!msg) return;
+    dbus_message_send_async(s->conn, msg, GATT_ACQUIRE_TIMEOUT_MS, NULL, NULL, NULL);
+    dbus_message_unref(msg);
+}
+
+static void setup_rx_batch(void) {
+    int i;
+
+    for (i = 0; i < GATT_NOTIFY_BATCH; i++) {
+        g_rx_iov[i].iov_base = g_rx_bufs[i];
+        g_rx_iov[i].iov_len = GATT_MAX_VALUE;
+        memset(&g_rx_msgs[i], 0, sizeof(g_rx_msgs[i]));
+        g_rx_msgs[i].msg_hdr.msg_iov = &g_rx_iov[i];
+        g_rx_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    g_rx_ready = 1;
+}
+
+/*
+* Event loop thread. Each datagram on the socket is one notification value;
+* up to GATT_NOTIFY_BATCH of them come in per recvmmsg and go to the callback
+* straight from the batch buffers. The peer closing (device gone) shows up
+* as POLLHUP, after any packets still queued.
+*/
+static void on_notify_fd(int fd, short revents, void *data) {
+    long slot = (long)data;
+    tGattSub *s = &g_subs[slot];
+    tGattNotifyCb cb;
+    void *user;
+    uint64_t packets = 0, bytes = 0, batches = 0;
+    int id, i, n, round, eof = 0;
+
+    pthread_mutex_lock(&g_gatt_mutex);
+    if (!s->used || s->fd != fd) {
+        pthread_mutex_unlock(&g_gatt_mutex);
+        removeEventLoopFd(fd);
+        return;
+    }
+    if (s->closing) {
+        release_sub(s);
+        pthread_mutex_unlock(&g_gatt_mutex);
+        return;
+    }
+    cb = s->cb;
+    user = s->user;
+    id = SUB_ID(slot, s->generation);
+    pthread_mutex_unlock(&g_gatt_mutex);
+
+    if (!g_rx_ready)
+        setup_rx_batch();
+
+    for (round = 0; round < GATT_NOTIFY_BUDGET && !eof; round++) {
+        n = recvmmsg(fd, g_rx_msgs, GATT_NOTIFY_BATCH, MSG_DONTWAIT, NULL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                eof = 1;
+            break;
+        }
+        if (n == 0) {
+            eof = 1;
+            break;
+        }
+        batches++;
+        for (i = 0; i < n; i++) {
+            /* past the end of a closed socket every slot reads as empty */
+            if (g_rx_msgs[i].msg_len == 0 && (revents & POLLHUP)) {
+                eof = 1;
+                break;
+            }
+            packets++;
+            bytes += g_rx_msgs[i].msg_len;
+            if (cb) cb(id, g_rx_bufs[i], g_rx_msgs[i].msg_len, user);
+            /* the callback may have unsubscribed */
+            if (__atomic_load_n(&s->closing, __ATOMIC_RELAXED))
+                cb = NULL;
+        }
+        if (n < GATT_NOTIFY_BATCH)
+            break;
+    }
+    metricAdd(METRIC_GATT_NOTIFY_PACKETS, packets);
+    metricAdd(METRIC_GATT_NOTIFY_BYTES, bytes);
+
+    pthread_mutex_lock(&g_gatt_mutex);
+    if (s->used && s->fd == fd) {
+        s->packets += packets;
+        s->bytes += bytes;
+        s->batches += batches;
+        if (s->closing) {
+            release_sub(s);
+        } else if (eof) {
+            /* acquired again once the device has resolved its services */
+            printf("%s: %s closed\n", __FUNCTION__, s->chr);
+            drop_fd(&s->fd);
+            s->state = SUB_IDLE;
+        }
+    }
+    pthread_mutex_unlock(&g_gatt_mutex);
+}
+
+static unsigned int parse_flags(char **flags, int count) {
+    unsigned int mask = 0;
+    size_t j;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < sizeof(chr_flags) / sizeof(chr_flags[0]); j++) {
+            if (flags[i] && !strcmp(flags[i], chr_flags[j].name))
+                mask |= chr_flags[j].flag;
+        }
+    }
+    return mask;
+}
+
+static Properties gatt_object_properties[] = {
+    {"UUID", DBUS_TYPE_STRING},
+    {"Device", DBUS_TYPE_OBJECT_PATH},      /* services */
+    {"Service", DBUS_TYPE_OBJECT_PATH},     /* characteristics */
+    {"Characteristic", DBUS_TYPE_OBJECT_PATH},  /* descriptors */
+    {"Flags", DBUS_TYPE_ARRAY},
+    {"MTU", DBUS_TYPE_UINT16},
+};
+
+/* pick UUID, the parent, Flags and MTU out of an a{sv}, nothing is kept */
+static void read_object(DBusMessageIter *props, t_bt_uuid *uuid, char *parent,
+                        tGattChr *chr) {
+    DBusMessageIter dict, entry;
+    u_property_value val;
+    int idx, len;
+
+    if (dbus_message_iter_get_arg_type(props) != DBUS_TYPE_ARRAY)
+        return;
+    dbus_message_iter_recurse(props, &dict);
+    for (; dbus_message_iter_get_arg_type(&dict) == DBUS_TYPE_DICT_ENTRY;
+         dbus_message_iter_next(&dict)) {
+        dbus_message_iter_recurse(&dict, &entry);
+        if (get_property(entry, gatt_object_properties,
+                         sizeof(gatt_object_properties) / sizeof(Properties),
+                         &idx, &val, &len) < 0)
+            continue;
+        switch (idx) {
+        case 0:
+            if (bt_uuid_parse(val.str_val, uuid) < 0) memset(uuid, 0, sizeof(*uuid));
+            break;
+        case 1:
+        case 2:
+        case 3:
+            snprintf(parent, GATT_PATH_SIZE, "%s", val.str_val);
+            break;
+        case 4:
+            if (chr) chr->flags = parse_flags(val.array_val, len);
+            if (val.array_val) free(val.array_val);
+            break;
+        case 5:
+            if (chr) chr->mtu = val.int_val;
+            break;
+        }
+    }
+}
+
+/* slot of a parent object named by its full path, -1 if not cached */
+static int parent_slot(int dev, const char *parent, int is_service) {
+    const char *rel;
+    tGattService *svc;
+    tGattChr *c;
+
+    if (strncmp(parent, g_devices[dev].path, strlen(g_devices[dev].path)))
+        return -1;
+    rel = rel_path(dev, parent);
+    if (!rel) return -1;
+    if (is_service) {
+        svc = find_service(dev, rel);
+        return svc ? svc - g_services : -1;
+    }
+    c = find_chr(dev, rel);
+    return c ? c - g_chrs : -1;
+}
+
+/* children that showed up before their parent: rel starts with the parent's */
+static void adopt_children(int dev, const char *rel, int slot, int is_service) {
+    size_t len = strlen(rel);
+    int i;
+
+    if (is_service) {
+        for (i = 0; i < GATT_MAX_CHARACTERISTICS; i++) {
+            if (g_chrs[i].used && g_chrs[i].dev == dev && g_chrs[i].service < 0 &&
+                !strncmp(g_chrs[i].rel, rel, len) && g_chrs[i].rel[len] == '/')
+                g_chrs[i].service = slot;
+        }
+    } else {
+        for (i = 0; i < GATT_MAX_DESCRIPTORS; i++) {
+            if (g_descs[i].used && g_descs[i].dev == dev && g_descs[i].chr < 0 &&
+                !strncmp(g_descs[i].rel, rel, len) && g_descs[i].rel[len] == '/')
+                g_descs[i].chr = slot;
+        }
+    }
+}
+
+static void add_service(int dev, const char *rel, DBusMessageIter *props) {
+    char parent[GATT_PATH_SIZE];
+    tGattService *svc = find_service(dev, rel);
+    int i;
+
+    for (i = 0; !svc && i < GATT_MAX_SERVICES; i++) {
+        if (!g_services[i].used) {
+            svc = &g_services[i];
+            memset(svc, 0, sizeof(*svc));
+        }
+    }
+    if (!svc) {
+        printf("%s: service table full, ignoring %s%s\n", __FUNCTION__,
+               g_devices[dev].path, rel);
+        return;
+    }
+    svc->used = 1;
+    svc->present = 1;
+    svc->dev = dev;
+    snprintf(svc->rel, sizeof(svc->rel), "%s", rel);
+    if (props) read_object(props, &svc->uuid, parent, NULL);
+    adopt_children(dev, rel, svc - g_services, 1);
+}
+
+static void add_chr(int dev, const char *rel, DBusMessageIter *props) {
+    char parent[GATT_PATH_SIZE] = "";
+    tGattChr *c = find_chr(dev, rel);
+    t_bt_uuid old = { 0, 0 };
+    int i, fresh = !c;
+
+    for (i = 0; !c && i < GATT_MAX_CHARACTERISTICS; i++) {
+        if (!g_chrs[i].used) {
+            c = &g_chrs[i];
+            memset(c, 0, sizeof(*c));
+        }
+    }
+    if (!c) {
+        printf("%s: characteristic table full, ignoring %s%s\n", __FUNCTION__,
+               g_devices[dev].path, rel);
+        return;
+    }
+    if (!fresh) old = c->uuid;
+    c->used = 1;
+    c->present = 1;
+    c->dev = dev;
+    snprintf(c->rel, sizeof(c->rel), "%s", rel);
+    if (props) read_object(props, &c->uuid, parent, c);
+    c->service = parent[0] ? parent_slot(dev, parent, 1) : -1;
+    if (fresh)
+        index_chr(c - g_chrs);
+    else if (!BT_UUID_EQ(old, c->uuid))
+        g_index_dirty = 1;
+    adopt_children(dev, rel, c - g_chrs, 0);
+}
+
+static void add_desc(int dev, const char *rel, DBusMessageIter *props) {
+    char parent[GATT_PATH_SIZE] = "";
+    tGattDesc *d = find_desc(dev, rel);
+    int i;
+
+    for (i = 0; !d && i < GATT_MAX_DESCRIPTORS; i++) {
+        if (!g_descs[i].used) {
+            d = &g_descs[i];
+            memset(d, 0, sizeof(*d));
+        }
+    }
+    if (!d) {
+        printf("%s: descriptor table full, ignoring %s%s\n", __FUNCTION__,
+               g_devices[dev].path, rel);
+        return;
+    }
+    d->used = 1;
+    d->present = 1;
+    d->dev = dev;
+    snprintf(d->rel, sizeof(d->rel), "%s", rel);
+    if (props) read_object(props, &d->uuid, parent, NULL);
+    d->chr = parent[0] ? parent_slot(dev, parent, 0) : -1;
+}
+
+void gattObjectAdded(const char *path, const char *ifc, DBusMessageIter *props) {
+    char device[GATT_PATH_SIZE];
+    const char *rel;
+    int i, dev;
+
+    if (strcmp(ifc, GATT_SERVICE_IFC) && strcmp(ifc, GATT_CHARACTERISTIC_IFC) &&
+        strcmp(ifc, GATT_DESCRIPTOR_IFC))
+        return;
+    if (device_of(path, device, sizeof(device)) < 0)
+        return;
+
+    pthread_mutex_lock(&g_gatt_mutex);
+    dev = find_device(device, 1);
+    rel = dev >= 0 ? rel_path(dev, path) : NULL;
+    if (!rel) {
+        printf("%s: no room for %s\n", __FUNCTION__, path);
+        goto done;
+    }
+    if (g_devices[dev].connected && g_devices[dev].removed && g_devices[dev].valid) {
+        printf("%s: %s changed its services\n", __FUNCTION__, device);
+        g_devices[dev].valid = 0;
+    }
+    if (!strcmp(ifc, GATT_SERVICE_IFC))
+        add_service(dev, rel, props);
+    else if (!strcmp(ifc, GATT_CHARACTERISTIC_IFC))
+        add_chr(dev, rel, props);
+    else
+        add_desc(dev, rel, props);
+
+    /* anything waiting on this device may resolve now */
+    for (i = 0; i < GATT_MAX_SUBSCRIPTIONS; i++) {
+        if (g_subs[i].used && !g_subs[i].closing &&
+            g_subs[i].state == SUB_IDLE && !strcmp(g_subs[i].device, device))
+            try_acquire(&g_subs[i]);
+    }
+    for (i = 0; i < GATT_MAX_WRITERS; i++) {
+        if (g_writers[i].used && !g_writers[i].closing &&
+            g_writers[i].state == WRITER_IDLE && !strcmp(g_writers[i].device, device))
+            try_open_writer(&g_writers[i]);
+    }
+done:
+    pthread_mutex_unlock(&g_gatt_mutex);
+}
+
+/*
+* bluez takes the objects away on disconnect unless the device is bonded,
+* and on Service Changed. Either way they are kept, stale, until the device
+* has resolved its services again; gattDeviceConnected tells the two apart.
+*/
+void gattObjectRemoved(const char *path, const char *ifc) {
+    char device[GATT_PATH_SIZE];
+    const char *rel;
+    tGattService *svc;
+    tGattChr *c;
+    tGattDesc *d;
+    int i, dev;
+
+    pthread_mutex_lock(&g_gatt_mutex);
+    if (!strcmp(ifc, DEVICE_IFC)) {
+        dev = find_device(path, 0);
+        if (dev >= 0) drop_device(dev);
+        goto done;
+    }
+    if (device_of(path, device, sizeof(device)) < 0 ||
+        (dev = find_device(device, 0)) < 0 || !(rel = rel_path(dev, path)))
+        goto done;
+
+    if (g_devices[dev].connected)
+        g_devices[dev].removed = 1;
+    if (!strcmp(ifc, GATT_CHARACTERISTIC_IFC)) {
+        c = find_chr(dev, rel);
+        if (c) c->present = 0;
+        for (i = 0; i < GATT_MAX_SUBSCRIPTIONS; i++) {
+            tGattSub *s = &g_subs[i];
+            if (!s->used || strcmp(s->chr, path))
+                continue;
+            /* an acquired socket hangs up by itself */
+            if (s->state != SUB_ACQUIRED)
+                s->state = SUB_IDLE;
+            s->chr[0] = '\0';
+        }
+        for (i = 0; i < GATT_MAX_WRITERS; i++) {
+            tGattWriter *w = &g_writers[i];
+            if (!w->used || strcmp(w->chr, path))
+                continue;
+            if (w->state != WRITER_SOCKET)
+                w->state = WRITER_IDLE;
+            w->chr[0] = '\0';
+        }
+    } else if (!strcmp(ifc, GATT_SERVICE_IFC)) {
+        svc = find_service(dev, rel);
+        if (svc) svc->present = 0;
+    } else if (!strcmp(ifc, GATT_DESCRIPTOR_IFC)) {
+        d = find_desc(dev, rel);
+        if (d) d->present = 0;
+    }
+done:
+    pthread_mutex_unlock(&g_gatt_mutex);
+}
+
+/* what bluez didn't bring back by ServicesResolved is gone for good */
+static void prune_device(int dev) {
+    int i;
+
+    for (i = 0; i < GATT_MAX_DESCRIPTORS; i++) {
+        if (g_descs[i].used && g_descs[i].dev == dev && !g_descs[i].present)
+            g_descs[i].used = 0;
+    }
+    for (i = 0; i < GATT_MAX_CHARACTERISTICS; i++) {
+        if (g_chrs[i].used && g_chrs[i].dev == dev && !g_chrs[i].present) {
+            g_chrs[i].used = 0;
+            g_index_dirty = 1;
+        }
+    }
+    for (i = 0; i < GATT_MAX_SERVICES; i++) {
+        if (g_services[i].used && g_services[i].dev == dev && !g_services[i].present)
+            g_services[i].used = 0;
+    }
+    /* slots of dropped parents may be reused, children point nowhere */
+    for (i = 0; i < GATT_MAX_CHARACTERISTICS; i++) {
+        if (g_chrs[i].used && g_chrs[i].dev == dev && g_chrs[i].service >= 0 &&
+            !g_services[g_chrs[i].service].used)
+            g_chrs[i].service = -1;
+    }
+    for (i = 0; i < GATT_MAX_DESCRIPTORS; i++) {
+        if (g_descs[i].used && g_descs[i].dev == dev && g_descs[i].chr >= 0 &&
+            !g_chrs[g_descs[i].chr].used)
+            g_descs[i].chr = -1;
+    }
+    g_devices[dev].valid = 1;
+}
+
+/* StartNotify subscriptions: Value arrives in PropertiesChanged */
+void gattPropertiesChanged(const char *path, const char *ifc,
+                           DBusMessageIter *changed) {
+    DBusMessageIter dict, entry, value, bytes;
+    const uint8_t *data = NULL;
+    const char *key;
+    tGattNotifyCb cb = NULL;
+    void *user = NULL;
+    tGattSub *s = NULL;
+    int i, id = -1, len = 0;
+
+    if (strcmp(ifc, GATT_CHARACTERISTIC_IFC) ||
+        dbus_message_iter_get_arg_type(changed) != DBUS_TYPE_ARRAY)
+        return;
+    dbus_message_iter_recurse(changed, &dict);
+    for (; dbus_message_iter_get_arg_type(&dict) == DBUS_TYPE_DICT_ENTRY;
+         dbus_message_iter_next(&dict)) {
+        dbus_message_iter_recurse(&dict, &entry);
+        dbus_message_iter_get_basic(&entry, &key);
+        if (strcmp(key, "Value"))
+            continue;
+        dbus_message_iter_next(&entry);
+        dbus_message_iter_recurse(&entry, &value);
+        if (dbus_message_iter_get_arg_type(&value) != DBUS_TYPE_ARRAY ||
+            dbus_message_iter_get_element_type(&value) != DBUS_TYPE_BYTE)
+            return;
+        dbus_message_iter_recurse(&value, &bytes);
+        dbus_message_iter_get_fixed_array(&bytes, &data, &len);
+        break;
+    }
+    if (!data)
+        return;
+
+    pthread_mutex_lock(&g_gatt_mutex);
+    for (i = 0; i < GATT_MAX_SUBSCRIPTIONS; i++) {
+        if (g_subs[i].used && !g_subs[i].closing &&
+            (g_subs[i].state == SUB_NOTIFYING || g_subs[i].state == SUB_STARTING) &&
+            !strcmp(g_subs[i].chr, path)) {
+            s = &g_subs[i];
+            s->packets++;
+            s->bytes += len;
+            cb = s->cb;
+            user = s->user;
+            id = SUB_ID(i, s->generation);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_gatt_mutex);
+    if (!s)
+        return;
+    metricAdd(METRIC_GATT_NOTIFY_PACKETS, 1);
+    metricAdd(METRIC_GATT_NOTIFY_BYTES, len);
+    if (cb) cb(id, data, len, user);
+}
+
+void gattServicesResolved(const char *device_path) {
+    int i, dev;
+
+    pthread_mutex_lock(&g_gatt_mutex);
+    dev = find_device(device_path, 1);
+    if (dev >= 0) prune_device(dev);
+    for (i = 0; i < GATT_MAX_SUBSCRIPTIONS; i++) {
+        if (g_subs[i].used && !g_subs[i].closing &&
+            !strcmp(g_subs[i].device, device_path)) {
+            /* notifications stop with the link, StartNotify is not remembered */
+            if (g_subs[i].state == SUB_NOTIFYING)
+                g_subs[i].state = SUB_IDLE;
+            try_acquire(&g_subs[i]);
+        }
+    }
+    for (i = 0; i < GATT_MAX_WRITERS; i++) {
+        if (g_writers[i].used && !g_writers[i].closing &&
+            !strcmp(g_writers[i].device, device_path))
+            try_open_writer(&g_writers[i]);
+    }
+    pthread_mutex_unlock(&g_gatt_mutex);
+}
+
+int gattSubscribe(DBusConnection *conn, const char *device_path,
+                  const char *service_uuid, const char *chr_uuid,
+                  tGattNotifyCb cb, void *user) {
+    t_bt_uuid svc = { 0, 0 }, uuid;
+    tGattSub *s = NULL;
+    int i, id = -1;
+
+    if (!conn || !device_path || !cb || bt_uuid_parse(chr_uuid, &uuid) < 0)
+        return -1;
+    if (service_uuid && bt_uuid_parse(service_uuid, &svc) < 0)
+        return -1;
+    if (strlen(device_path) >= GATT_PATH_SIZE)
+        return -1;
+
+    pthread_mutex_lock(&g_gatt_mutex);
+    for (i = 0; i < GATT_MAX_SUBSCRIPTIONS; i++) {
+        /* bluez hands out one notify socket per characteristic */
+        if (g_subs[i].used && !g_subs[i].closing &&
+            !strcmp(g_subs[i].device, device_path) &&
+            BT_UUID_EQ(g_subs[i].uuid, uuid) && BT_UUID_EQ(g_subs[i].service_uuid, svc)) {
+            printf("%s: %s %s is already subscribed\n", __FUNCTION__, device_path, chr_uuid);
+            goto done;
+        }
+        if (!g_subs[i].used && !s)
+            s = &g_subs[i];
+    }
+    if (!s) {
+        printf("%s: subscription table full\n", __FUNCTION__);
+        goto done;
+    }
+    memset(s, 0, sizeof(*s));
+    s->used = 1;
+    s->fd = -1;
+    g_sub_generation = (g_sub_generation + 1) & 0x7fffff;
+    if (!g_sub_generation) g_sub_generation = 1;
+    s->generation = g_sub_generation;
+    s->conn = conn;
+    s->cb = cb;
+    s->user = user;
+    s->state = SUB_IDLE;
+    snprintf(s->device, sizeof(s->device), "%s", device_path);
+    s->service_uuid = svc;
+    s->uuid = uuid;
+    id = SUB_ID(s - g_subs, s->generation);
+    try_acquire(s);
+done:
+    pthread_mutex_unlock(&g_gatt_mutex);
+    return id;
+}
+
+int gattUnsubscribe(int id) {
+    tGattSub *s = lock_sub(id);
+
+    if (!s) return -1;
+    stop_notify(s);
+    if (s->fd >= 0) {
+        /* the loop owns the fd: wake it with a hangup and let it close */
+        __atomic_store_n(&s->closing, 1, __ATOMIC_RELAXED);
+        shutdown(s->fd, SHUT_RDWR);
+    } else {
+        release_sub(s);
+    }
+    pthread_mutex_unlock(&g_gatt_mutex);
+    return 0;
+}
+
+int gattSubStats(int id, tGattSubStats *stats) {
+    tGattSub *s = lock_sub(id);
+
+    if (!s || !stats) {
+        if (s) pthread_mutex_unlock(&g_gatt_mutex);
+        return -1;
+    }
+    memset(stats, 0, sizeof(*stats));
+    stats->acquired = s->state == SUB_ACQUIRED ? 1 : s->state == SUB_NOTIFYING ? 2 : 0;
+    stats->mtu = s->mtu;
+    snprintf(stats->characteristic, sizeof(stats->characteristic), "%s", s->chr);
+    stats->packets = s->packets;
+    stats->bytes = s->bytes;
+    stats->batches = s->batches;
+    pthread_mutex_unlock(&g_gatt_mutex);
+    return 0;
+}
+
+int gattFindCharacteristic(const char *device_path, const char *service_uuid,
+                           const char *chr_uuid, char *path, size_t size) {
+    char full[GATT_PATH_SIZE];
+    t_bt_uuid svc = { 0, 0 }, uuid;
+    tGattChr *c;
+    int ret = -1;
+
+    if (!device_path || !path || bt_uuid_parse(chr_uuid, &uuid) < 0)
+        return -1;
+    if (service_uuid && bt_uuid_parse(service_uuid, &svc) < 0)
+        return -1;
+    pthread_mutex_lock(&g_gatt_mutex);
+    c = match_chr(device_path, &svc, &uuid);
+    if (c && object_path(c->dev, c->rel, full) == 0 && strlen(full) < size) {
+        memcpy(path, full, strlen(full) + 1);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&g_gatt_mutex);
+    return ret;
+}
+
+int gattFindDescriptor(const char *device_path, const char *chr_path,
+                       const char *desc_uuid, char *path, size_t size) {
+    char full[GATT_PATH_SIZE];
+    const char *rel;
+    t_bt_uuid uuid;
+    tGattChr *c;
+    int i, dev, ret = -1;
+
+    if (!device_path || !chr_path || !path || bt_uuid_parse(desc_uuid, &uuid) < 0)
+        return -1;
+    pthread_mutex_lock(&g_gatt_mutex);
+    dev = find_device(device_path, 0);
+    rel = dev >= 0 ? rel_path(dev, chr_path) : NULL;
+    c = rel ? find_chr(dev, rel) : NULL;
+    for (i = 0; c && i < GATT_MAX_DESCRIPTORS; i++) {
+        if (g_descs[i].used && g_descs[i].chr == c - g_chrs &&
+            BT_UUID_EQ(g_descs[i].uuid, uuid)) {
+            if (object_path(dev, g_descs[i].rel, full) == 0 &&
+                strlen(full) < size) {
+                memcpy(path, full, strlen(full) + 1);
+                ret = 0;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_gatt_mutex);
+    return ret;
+}
+
+void gattDeviceConnected(const char *device_path, int connected) {
+    tGattDevice *d;
+    int dev;
+
+    pthread_mutex_lock(&g_gatt_mutex);
+    dev = find_device(device_path, connected);
+    if (dev >= 0) {
+        d = &g_devices[dev];
+        /* a disconnect takes all of the objects, or none when bonded */
+        if (d->connected && !connected && d->removed && d->valid &&
+            device_present(dev)) {
+            printf("%s: %s changed its services\n", __FUNCTION__, device_path);
+            d->valid = 0;
+        }
+        d->connected = connected;
+        d->removed = 0;
+    }
+    pthread_mutex_unlock(&g_gatt_mutex);
+}
+
+int gattDeviceCached(const char *device_path) {
+    int dev, ret;
+
+    if (!device_path) return 0;
+    pthread_mutex_lock(&g_gatt_mutex);
+    dev = find_device(device_path, 0);
+    ret = dev >= 0 && g_devices[dev].valid;
+    pthread_mutex_unlock(&g_gatt_mutex);
+    return ret;
+}
+
+/********************************** write pipeline ******************************/
+
+static uint64_t monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static tGattWriter * lock_writer(int id) {
+    tGattWriter *w;
+
+    if (id < 0 || SUB_SLOT(id) >= GATT_MAX_WRITERS)
+        return NULL;
+    pthread_mutex_lock(&g_gatt_mutex);
+    w = &g_writers[SUB_SLOT(id)];
+    if (!w->used || w->closing || w->generation != SUB_GEN(id)) {
+        pthread_mutex_unlock(&g_gatt_mutex);
+        return NULL;
+    }
+    return w;
+}
+
+static tGattWriter * writer_from_reply(void *user, void *nat) {
+    long slot = (long)user;
+    tGattWriter *w;
+
+    if (slot < 0 || slot >= GATT_MAX_WRITERS)
+        return NULL;
+    w = &g_writers[slot];
+    if (!w->used || w->closing || w->generation != (uint32_t)(long)nat)
+        return NULL;
+    return w;
+}
+
+static void release_writer(tGattWriter *w) {
+    drop_fd(&w->fd);
+    w->used = 0;
+    w->closing = 0;
+}
+
+/* the busy clock stops when nothing is queued or in flight, 1 if it just did */
+static int writer_drained(tGattWriter *w) {
+    if (w->rec_head != w->rec_tail || w->in_flight || !w->busy_since_us)
+        return 0;
+    w->stats.active_us += monotonic_us() - w->busy_since_us;
+    w->busy_since_us = 0;
+    return 1;
+}
+
+static void onWriteValueResult(DBusMessage *msg, void *user, void *nat);
+
+/*
+* Send from the head of the queue until it is empty, the socket pushes back
+* or the window of WriteValue calls is full. A socket waiting for POLLOUT
+* is left alone unless writable says it came. Called with the lock held;
+* returns 1 if the queue drained.
+*/
+static int flush_writer(tGattWriter *w, int writable) {
+    const char *type = (w->flags & GATT_CHR_WRITE_NO_RESPONSE) ? "command" : "request";
+    const t_dict_entry options[] = {
+        { "type", DBUS_TYPE_STRING, &type, 0 },
+    };
+    uint8_t buf[GATT_MAX_VALUE];
+    const uint8_t *data;
+    struct iovec iov[2];
+    uint32_t chunk, len, pos, first;
+    uint64_t sent = 0;
+    DBusMessage *msg;
+    dbus_bool_t ok;
+    int full = w->pollout && !writable;
+    ssize_t n;
+
+    chunk = w->mtu > 3 ? w->mtu - 3 : GATT_DEFAULT_MTU - 3;
+    if (chunk > GATT_MAX_VALUE) chunk = GATT_MAX_VALUE;
+
+    while (w->rec_head != w->rec_tail) {
+        if (w->state == WRITER_VALUE ? w->in_flight >= w->window :
+            w->state != WRITER_SOCKET || full || w->failed)
+            break;
+        len = w->rec[w->rec_head & (GATT_WRITE_RECORDS - 1)] - w->rec_off;
+        if (len > chunk) len = chunk;
+        pos = w->head & (GATT_WRITE_RING - 1);
+        first = GATT_WRITE_RING - pos < len ? GATT_WRITE_RING - pos : len;
+        iov[0].iov_base = w->ring + pos;
+        iov[0].iov_len = first;
+        iov[1].iov_base = w->ring;
+        iov[1].iov_len = len - first;
+
+        if (w->state == WRITER_SOCKET) {
+            /* one datagram is one Write Command */
+            n = writev(w->fd, iov, len > first ? 2 : 1);
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                w->stats.stalls++;
+                full = 1;
+                break;
+            }
+            if (n < 0) {
+                /* gattWrite may be on any thread: hang up and let the loop close */
+                printf("%s: %s: %s\n", __FUNCTION__, w->chr, strerror(errno));
+                w->failed = 1;
+                shutdown(w->fd, SHUT_RDWR);
+                break;
+            }
+        } else {
+            data = w->ring + pos;
+            if (len > first) {
+                memcpy(buf, iov[0].iov_base, first);
+                memcpy(buf + first, w->ring, len - first);
+                data = buf;
+            }
+            msg = bluez_gatt_characteristic1_write_value_new(w->chr, data, len, options,
+                                                            sizeof(options) / sizeof(options[0]));
+            ok = msg && dbus_message_send_async(w->conn, msg, GATT_ACQUIRE_TIMEOUT_MS,
+                                                onWriteValueResult,
+                                                (void *)(long)(w - g_writers),
+                                                (void *)(long)w->generation);
+            if (msg) dbus_message_unref(msg);
+            /* out of memory or no bus, the next write or reply tries again */
+            if (!ok) break;
+            w->in_flight++;
+        }
+        w->head += len;
+        w->rec_off += len;
+        if (w->rec_off == w->rec[w->rec_head & (GATT_WRITE_RECORDS - 1)]) {
+            w->rec_head++;
+            w->rec_off = 0;
+        }
+        w->stats.bytes += len;
+        w->stats.packets++;
+        sent += len;
+    }
+    if (sent) metricAdd(METRIC_GATT_WRITE_BYTES, sent);
+    if (w->state == WRITER_SOCKET && !w->failed && full != w->pollout) {
+        modifyEventLoopFd(w->fd, full ? POLLOUT : 0);
+        w->pollout = full;
+    }
+    return writer_drained(w);
+}
+
+static void onWriteValueResult(DBusMessage *msg, void *user, void *nat) {
+    DBusError err;
+    tGattWriter *w;
+    tGattWriteCb cb = NULL;
+    void *cb_user = NULL;
+    int id = -1, failed;
+
+    dbus_error_init(&err);
+    failed = reply_failed(msg, &err);
+    pthread_mutex_lock(&g_gatt_mutex);
+    w = writer_from_reply(user, nat);
+    if (w) {
+        if (w->in_flight > 0) w->in_flight--;
+        if (failed) w->stats.errors++;
+        if (flush_writer(w, 0) && w->drained) {
+            cb = w->drained;
+            cb_user = w->user;
+            id = SUB_ID(w - g_writers, w->generation);
+        }
+    }
+    pthread_mutex_unlock(&g_gatt_mutex);
+    dbus_error_free(&err);
+    if (cb) cb(id, cb_user);
+}
+
+/* event loop thread: the socket has room again, or bluez hung up */
+static void on_write_fd(int fd, short revents, void *data) {
+    tGattWriter *w = &g_writers[(long)data];
+    tGattWriteCb cb = NULL;
+    void *cb_user = NULL;
+    int id = -1;
+
+    pthread_mutex_lock(&g_gatt_mutex);
+    if (!w->used || w->fd != fd) {
+        pthread_mutex_unlock(&g_gatt_mutex);
+        removeEventLoopFd(fd);
+        return;
+    }
+    if (w->closing) {
+        release_writer(w);
+    } else if (w->failed || (revents & (POLLHUP | POLLERR))) {
+        /* queued data waits for the device to come back */
+        printf("%s: %s closed\n", __FUNCTION__, w->chr);
+        drop_fd(&w->fd);
+        w->pollout = 0;
+        w->failed = 0;
+        w->state = WRITER_IDLE;
+    } else if (flush_writer(w, revents & POLLOUT) && w->drained) {
+        cb = w->drained;
+        cb_user = w->user;
+        id = SUB_ID(w - g_writers, w->generation);
+    }
+    pthread_mutex_unlock(&g_gatt_mutex);
+    if (cb) cb(id, cb_user);
+}
+
+static void onAcquireWriteResult(DBusMessage *msg, void *user, void *nat) {
+    DBusError err;
+    tGattWriter *w;
+    tGattWriteCb cb = NULL;
+    void *cb_user = NULL;
+    uint16_t mtu = 0;
+    int fd = -1, failed, sndbuf, id = -1;
+
+    dbus_error_init(&err);
+    failed = bluez_gatt_characteristic1_acquire_write_parse(msg, &fd, &mtu, &err) < 0;
+
+    pthread_mutex_lock(&g_gatt_mutex);
+    w = writer_from_reply(user, nat);
+    if (!w || w->state != WRITER_ACQUIRING) {
+        if (fd >= 0) close(fd);
+    } else if (failed) {
+        printf("%s: %s: %s\n", __FUNCTION__, w->chr,
+               dbus_error_is_set(&err) ? err.name : "bad reply");
+        w->state = WRITER_IDLE;
+        /* acquired by someone else: WriteValue still works */
+        if (dbus_error_has_name(&err, BLUEZ_ERROR_IFC ".NotPermitted") ||
+            dbus_error_has_name(&err, BLUEZ_ERROR_IFC ".NotSupported")) {
+            w->use_value = 1;
+            try_open_writer(w);
+        }
+    } else {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        /* the kernel backs off at this much unread, which is our window */
+        sndbuf = w->window * mtu;
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+        w->fd = fd;
+        w->mtu = mtu;
+        w->pollout = 0;
+        w->failed = 0;
+        w->state = WRITER_SOCKET;
+        if (addEventLoopFd(fd, 0, on_write_fd, (void *)(long)(w - g_writers)) < 0) {
+            close(fd);
+            w->fd = -1;
+            w->state = WRITER_IDLE;
+        } else if (flush_writer(w, 1) && w->drained) {
+            cb = w->drained;
+            cb_user = w->user;
+            id = SUB_ID(w - g_writers, w->generation);
+        }
+    }
+    pthread_mutex_unlock(&g_gatt_mutex);
+    dbus_error_free(&err);
+    if (cb) cb(id, cb_user);
+}
+
+/* called with the lock held, nothing happens until the chr is resolved */
+static void try_open_writer(tGattWriter *w) {
+    char path[GATT_PATH_SIZE];
+    tGattChr *c;
+    DBusMessage *msg;
+
+    if (w->state != WRITER_IDLE || !w->conn)
+        return;
+    c = match_chr(w->device, &w->service_uuid, &w->uuid);
+    if (!c || object_path(c->dev, c->rel, path) < 0) {
+        w->chr[0] = '\0';
+        return;
+    }
+    if (strcmp(w->chr, path)) {
+        memcpy(w->chr, path, sizeof(w->chr));
+        w->flags = c->flags;
+        w->use_value = 0;
+    }
+
+    if ((w->flags & GATT_CHR_WRITE_NO_RESPONSE) && !w->use_value) {
+        msg = bluez_gatt_characteristic1_acquire_write_new(w->chr, NULL, 0);
+        if (!msg) return;
+        if (dbus_message_send_async(w->conn, msg, GATT_ACQUIRE_TIMEOUT_MS,
+                                    onAcquireWriteResult,
+                                    (void *)(long)(w - g_writers),
+                                    (void *)(long)w->generation))
+            w->state = WRITER_ACQUIRING;
+        dbus_message_unref(msg);
+    } else if (w->flags & (GATT_CHR_WRITE | GATT_CHR_WRITE_NO_RESPONSE)) {
+        w->mtu = c->mtu ? c->mtu : GATT_DEFAULT_MTU;
+        w->state = WRITER_VALUE;
+        /* replies report the drain */
+        flush_writer(w, 0);
+    } else {
+        printf("%s: %s is not writable\n", __FUNCTION__, w->chr);
+    }
+}
+
+int gattWriterOpen(DBusConnection *conn, const char *device_path,
+                   const char *service_uuid, const char *chr_uuid,
+                   int window, tGattWriteCb drained, void *user) {
+    t_bt_uuid svc = { 0, 0 }, uuid;
+    tGattWriter *w = NULL;
+    int i, id = -1;
+
+    if (!conn || !device_path || bt_uuid_parse(chr_uuid, &uuid) < 0)
+        return -1;
+    if (service_uuid && bt_uuid_parse(service_uuid, &svc) < 0)
+        return -1;
+    if (strlen(device_path) >= GATT_PATH_SIZE)
+        return -1;
+
+    pthread_mutex_lock(&g_gatt_mutex);
+    for (i = 0; i < GATT_MAX_WRITERS && !w; i++) {
+        if (!g_writers[i].used)
+            w = &g_writers[i];
+    }
+    if (!w) {
+        printf("%s: writer table full\n", __FUNCTION__);
+        goto done;
+    }
+    memset(w, 0, sizeof(*w));
+    w->used = 1;
+    w->fd = -1;
+    g_writer_generation = (g_writer_generation + 1) & 0x7fffff;
+    if (!g_writer_generation) g_writer_generation = 1;
+    w->generation = g_writer_generation;
+    w->conn = conn;
+    w->window = window > 0 ? window : GATT_WRITE_WINDOW;
+    w->drained = drained;
+    w->user = user;
+    w->state = WRITER_IDLE;
+    snprintf(w->device, sizeof(w->device), "%s", device_path);
+    w->service_uuid = svc;
+    w->uuid = uuid;
+    id = SUB_ID(w - g_writers, w->generation);
+    try_open_writer(w);
+done:
+    pthread_mutex_unlock(&g_gatt_mutex);
+    return id;
+}
+
+int gattWrite(int id, const void *data, size_t len) {
+    tGattWriter *w;
+    uint32_t pos, first;
+
+    if (!data || !len || len > GATT_WRITE_RING)
+        return -1;
+    w = lock_writer(id);
+    if (!w) return -1;
+    if (GATT_WRITE_RING - (w->tail - w->head) < len ||
+        w->rec_tail - w->rec_head == GATT_WRITE_RECORDS) {
+        pthread_mutex_unlock(&g_gatt_mutex);
+        return -1;
+    }
+    pos = w->tail & (GATT_WRITE_RING - 1);
+    first = GATT_WRITE_RING - pos < len ? GATT_WRITE_RING - pos : len;
+    memcpy(w->ring + pos, data, first);
+    memcpy(w->ring, (const uint8_t *)data + first, len - first);
+    w->tail += len;
+    w->rec[w->rec_tail++ & (GATT_WRITE_RECORDS - 1)] = len;
+    if (!w->busy_since_us)
+        w->busy_since_us = monotonic_us();
+    /* the drain callback is for the event loop, the caller knows */
+    flush_writer(w, 0);
+    pthread_mutex_unlock(&g_gatt_mutex);
+    return len;
+}
+
+int gattWriterClose(int id) {
+    tGattWriter *w = lock_writer(id);
+
+    if (!w) return -1;
+    if (w->fd >= 0) {
+        /* the loop owns the fd: wake it with a hangup and let it close */
+        w->closing = 1;
+        shutdown(w->fd, SHUT_RDWR);
+    } else {
+        release_writer(w);
+    }
+    pthread_mutex_unlock(&g_gatt_mutex);
+    return 0;
+}
+
+/* called with the lock held */
+static void writer_stats(tGattWriter *w, tGattWriteStats *stats) {
+    *stats = w->stats;
+    stats->mode = w->state == WRITER_SOCKET ? 1 : w->state == WRITER_VALUE ? 2 : 0;
+    stats->mtu = w->mtu;
+    if (w->busy_since_us)
+        stats->active_us += monotonic_us() - w->busy_since_us;
+    stats->bytes_per_sec = stats->active_us ?
+                           stats->bytes * 1000000 / stats->active_us : 0;
+}
+
+int gattWriterStats(int id, tGattWriteStats *stats) {
+    tGattWriter *w;
+
+    if (!stats) return -1;
+    w = lock_writer(id);
+    if (!w) return -1;
+    writer_stats(w, stats);
+    pthread_mutex_unlock(&g_gatt_mutex);
+    return 0;
+}
+
+uint64_t gattDeviceWriteRate(const char *device_path) {
+    tGattWriteStats stats;
+    uint64_t rate = 0;
+    int i;
+
+    if (!device_path) return 0;
+    pthread_mutex_lock(&g_gatt_mutex);
+    for (i = 0; i < GATT_MAX_WRITERS; i++) {
+        if (g_writers[i].used && !g_writers[i].closing &&
+            !strcmp(g_writers[i].device, device_path)) {
+            writer_stats(&g_writers[i], &stats);
+            rate += stats.bytes_per_sec;
+        }
+    }
+    pthread_mutex_unlock(&g_gatt_mutex);
+    return rate;
+}
+
+void gattCleanup() {
+    int i;
+
+    pthread_mutex_lock(&g_gatt_mutex);
+    for (i = 0; i < GATT_MAX_SUBSCRIPTIONS; i++) {
+        if (g_subs[i].used) {
+            stop_notify(&g_subs[i]);
+            release_sub(&g_subs[i]);
+        }
+    }
+    for (i = 0; i < GATT_MAX_WRITERS; i++) {
+        if (g_writers[i].used)
+            release_writer(&g_writers[i]);
+    }
+    memset(g_devices, 0, sizeof(g_devices));
+    memset(g_services, 0, sizeof(g_services));
+    memset(g_chrs, 0, sizeof(g_chrs));
+    memset(g_descs, 0, sizeof(g_descs));
+    memset(g_chr_index, 0, sizeof(g_chr_index));
+    g_index_dirty = 0;
+    pthread_mutex_unlock(&g_gatt_mutex);
+}
@@ -0,0 +1,630 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/timerfd.h>
+
+#include "bluetooth_gattread.h"
+#include "bluetooth_gatt.h"
+#include "bluetooth_common.h"
+#include "bluetooth_dbus_stubs.h"
+#include "bluetooth_eventloop.h"
+#include "bluetooth_metrics.h"
+#include "bluetooth_discovery.h"
+
+#define READ_PATH_SIZE      128
+#define READ_UUID_SIZE      40
+
+/* ids are generation << 10 | slot, kept positive */
+#define JOB_ID(slot, gen)   ((int)(((gen) << 10) | (slot)))
+#define JOB_SLOT(id)        ((id) & 0x3ff)
+#define JOB_GEN(id)         ((uint32_t)(id) >> 10)
+#define JOB_GEN_MASK        0x1fffff
+
+typedef enum {
+    DEV_DOWN,               /* not connected */
+    DEV_CONNECTING,         /* Connect in flight */
+    DEV_CONNECTED,          /* waiting for ServicesResolved */
+    DEV_READY,              /* reads go out */
+    DEV_DISCONNECTING,      /* Disconnect in flight */
+} tReadDevState;
+
+typedef struct {
+    int used;
+    uint32_t generation;    /* replies carry it, a reused or reset slot differs */
+    int jobs;               /* referencing this device */
+    int adapter;
+    char path[READ_PATH_SIZE];
+    tReadDevState state;
+    int owned;              /* the scheduler connected it */
+    int in_flight;
+    uint64_t deadline_us;   /* CONNECTING/CONNECTED give up at this point */
+    /* filled in by each tick */
+    uint64_t next_due_us;
+    int waiting;            /* has a due job it can't read */
+} tReadDevice;
+
+typedef struct {
+    int used;
+    int closing;            /* removed with a read in flight */
+    uint32_t generation;
+    int dev;
+    char service_uuid[READ_UUID_SIZE];
+    char uuid[READ_UUID_SIZE];
+    char chr[READ_PATH_SIZE];   /* resolved object path, "" until then */
+    uint64_t period_us;
+    uint64_t due_us;
+    uint64_t sent_us;       /* 0 unless a read is in flight */
+    tGattReadCb cb;
+    void *user;
+    tGattReadJobStats stats;
+    uint64_t latency_sum_us;
+} tReadJob;
+
+/* jobs come from any thread, everything else runs on the event loop */
+static pthread_mutex_t g_read_mutex = PTHREAD_MUTEX_INITIALIZER;
+static DBusConnection *g_read_conn = NULL;
+static tReadJob g_jobs[GATT_READ_MAX_JOBS];
+static tReadDevice g_devices[GATT_READ_MAX_DEVICES];
+static char g_adapters[GATT_READ_MAX_ADAPTERS][READ_PATH_SIZE];
+static uint32_t g_job_generation = 0;
+static uint32_t g_device_generation = 0;
+static int g_connection_limit = GATT_READ_CONNECTIONS;
+static int g_timer_fd = -1;
+static uint64_t g_start_us = 0;
+static tGattReadStats g_stats;
+
+/* due jobs of one tick, sorted most overdue first */
+static int g_due[GATT_READ_MAX_JOBS];
+
+static uint64_t monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* run the scheduler at abs_us, or as soon as possible for 0 */
+static void arm_timer(uint64_t abs_us) {
+    struct itimerspec its;
+
+    if (g_timer_fd < 0) return;
+    memset(&its, 0, sizeof(its));
+    if (abs_us) {
+        its.it_value.tv_sec = abs_us / 1000000;
+        its.it_value.tv_nsec = (abs_us % 1000000) * 1000;
+        timerfd_settime(g_timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+    } else {
+        /* relative 1ns: the loop wakes up, from whichever thread we are on */
+        its.it_value.tv_nsec = 1;
+        timerfd_settime(g_timer_fd, 0, &its, NULL);
+    }
+}
+
+static tReadJob * lock_job(int id) {
+    tReadJob *j;
+
+    if (id < 0 || JOB_SLOT(id) >= GATT_READ_MAX_JOBS)
+        return NULL;
+    pthread_mutex_lock(&g_read_mutex);
+    j = &g_jobs[JOB_SLOT(id)];
+    if (!j->used || j->closing || j->generation != JOB_GEN(id)) {
+        pthread_mutex_unlock(&g_read_mutex);
+        return NULL;
+    }
+    return j;
+}
+
+/* /org/bluez/hci0/dev_XX_... -> index of /org/bluez/hci0, -1 if full */
+static int adapter_of(const char *device_path) {
+    const char *end = strstr(device_path, "/dev_");
+    size_t len = end ? (size_t)(end - device_path) : strlen(device_path);
+    int i;
+
+    if (len >= READ_PATH_SIZE) return -1;
+    for (i = 0; i < GATT_READ_MAX_ADAPTERS; i++) {
+        if (!g_adapters[i][0]) {
+            memcpy(g_adapters[i], device_path, len);
+            g_adapters[i][len] = '\0';
+            return i;
+        }
+        if (strlen(g_adapters[i]) == len && !strncmp(g_adapters[i], device_path, len))
+            return i;
+    }
+    return -1;
+}
+
+static tReadDevice * find_device(const char *path) {
+    int i;
+
+    for (i = 0; i < GATT_READ_MAX_DEVICES; i++) {
+        if (g_devices[i].used && !strcmp(g_devices[i].path, path))
+            return &g_devices[i];
+    }
+    return NULL;
+}
+
+/* a connection slot is taken from Connect until the disconnect is seen */
+static int holds_slot(const tReadDevice *d) {
+    return d->owned && d->state != DEV_DOWN;
+}
+
+static void release_slot(tReadDevice *d) {
+    if (holds_slot(d)) {
+        g_stats.connections--;
+        metricAdd(METRIC_GATT_READ_CONNECTIONS, (uint64_t)-1);
+    }
+    d->owned = 0;
+}
+
+static void set_down(tReadDevice *d) {
+    release_slot(d);
+    d->state = DEV_DOWN;
+    /* a device without jobs is only kept while its connection is ours */
+    if (!d->jobs) d->used = 0;
+}
+
+/*
+* A cache that held at the last resolve is trusted, no waiting on
+* ServicesResolved; otherwise the wait gets a deadline of its own.
+*/
+static void set_connected(tReadDevice *d) {
+    if (gattDeviceCached(d->path)) {
+        d->state = DEV_READY;
+        return;
+    }
+    d->state = DEV_CONNECTED;
+    d->deadline_us = monotonic_us() + GATT_READ_RESOLVE_TIMEOUT_MS * 1000ULL;
+}
+
+/* the device a Connect/Disconnect reply is for, NULL if the slot moved on */
+static tReadDevice * device_from_reply(void *user, void *nat) {
+    long slot = (long)user;
+    tReadDevice *d;
+
+    if (slot < 0 || slot >= GATT_READ_MAX_DEVICES)
+        return NULL;
+    d = &g_devices[slot];
+    if (!d->used || d->generation != (uint32_t)(long)nat)
+        return NULL;
+    return d;
+}
+
+/* every due job of an unreachable device loses a period */
+static void fail_due_jobs(tReadDevice *d, uint64_t now) {
+    int i, dev = d - g_devices;
+
+    for (i = 0; i < GATT_READ_MAX_JOBS; i++) {
+        tReadJob *j = &g_jobs[i];
+        if (j->used && !j->closing && j->dev == dev && !j->sent_us && j->due_us <= now) {
+            j->stats.failures++;
+            j->due_us = now + j->period_us;
+            g_stats.failures++;
+            metricAdd(METRIC_GATT_READ_FAILURES, 1);
+        }
+    }
+}
+
+static void onDisconnectResult(DBusMessage *msg, void *user, void *nat) {
+    tReadDevice *d;
+    DBusError err;
+
+    dbus_error_init(&err);
+    if (dbus_set_error_from_message(&err, msg))
+        LOG_AND_FREE_DBUS_ERROR(&err);
+    pthread_mutex_lock(&g_read_mutex);
+    d = device_from_reply(user, nat);
+    /* Connected=false may have come first */
+    if (d && d->state == DEV_DISCONNECTING)
+        set_down(d);
+    arm_timer(0);
+    pthread_mutex_unlock(&g_read_mutex);
+}
+
+static void disconnect_device(tReadDevice *d) {
+    DBusMessage *msg = bluez_device1_disconnect_new(d->path);
+
+    if (!msg) return;
+    if (dbus_message_send_async(g_read_conn, msg, -1, onDisconnectResult,
+                                (void *)(long)(d - g_devices), (void *)(long)d->generation)) {
+        d->state = DEV_DISCONNECTING;
+        g_stats.disconnects++;
+    }
+    dbus_message_unref(msg);
+}
+
+static void onConnectResult(DBusMessage *msg, void *user, void *nat) {
+    tReadDevice *d;
+    DBusError err;
+
+    dbus_error_init(&err);
+    discoveryPaging(0);
+    pthread_mutex_lock(&g_read_mutex);
+    d = device_from_reply(user, nat);
+    if (!d || d->state != DEV_CONNECTING) {
+        /* Connected/ServicesResolved got there first, or the slot moved on */
+    } else if (!dbus_set_error_from_message(&err, msg)) {
+        set_connected(d);
+    } else if (dbus_error_has_name(&err, BLUEZ_ERROR_IFC ".AlreadyConnected")) {
+        /* somebody else's connection, use it but leave it up */
+        release_slot(d);
+        set_connected(d);
+    } else {
+        printf("%s: %s: %s\n", __FUNCTION__, d->path, err.name);
+        g_stats.connect_failures++;
+        fail_due_jobs(d, monotonic_us());
+        set_down(d);
+    }
+    arm_timer(0);
+    pthread_mutex_unlock(&g_read_mutex);
+    if (dbus_error_is_set(&err)) dbus_error_free(&err);
+}
+
+static void connect_device(tReadDevice *d, uint64_t now) {
+    DBusMessage *msg = bluez_device1_connect_new(d->path);
+
+    if (!msg) return;
+    /* no scanning while we page, until onConnectResult */
+    discoveryPaging(1);
+    if (dbus_message_send_async(g_read_conn, msg, GATT_READ_CONNECT_TIMEOUT_MS,
+                                onConnectResult, (void *)(long)(d - g_devices),
+                                (void *)(long)d->generation)) {
+        d->state = DEV_CONNECTING;
+        d->owned = 1;
+        d->deadline_us = now + GATT_READ_CONNECT_TIMEOUT_MS * 1000ULL;
+        g_stats.connects++;
+        g_stats.connections++;
+        metricAdd(METRIC_GATT_READ_CONNECTIONS, 1);
+    } else {
+        discoveryPaging(0);
+    }
+    dbus_message_unref(msg);
+}
+
+static void onReadResult(DBusMessage *msg, void *user, void *nat) {
+    tReadJob *j = &g_jobs[(long)user];
+    tGattReadCb cb = NULL;
+    void *cb_user = NULL;
+    const uint8_t *value = NULL;
+    int len = 0, failed, id = -1;
+    uint64_t now = monotonic_us(), latency;
+    DBusError err;
+
+    dbus_error_init(&err);
+    failed = bluez_gatt_characteristic1_read_value_parse(msg, &value, &len, &err) < 0;
+
+    pthread_mutex_lock(&g_read_mutex);
+    if (!j->used || j->generation != (uint32_t)(long)nat || !j->sent_us)
+        goto done;
+    if (g_devices[j->dev].in_flight > 0)
+        g_devices[j->dev].in_flight--;
+    if (j->closing) {
+        j->used = 0;
+        if (--g_devices[j->dev].jobs == 0 && g_devices[j->dev].state == DEV_DOWN)
+            g_devices[j->dev].used = 0;
+        goto done;
+    }
+
+    latency = now - j->sent_us;
+    j->sent_us = 0;
+    if (failed) {
+        printf("%s: %s: %s\n", __FUNCTION__, j->chr,
+               dbus_error_is_set(&err) ? err.name : "bad reply");
+        /* resolved again next time, the object may have gone */
+        j->chr[0] = '\0';
+        j->stats.failures++;
+        g_stats.failures++;
+        metricAdd(METRIC_GATT_READ_FAILURES, 1);
+    } else {
+        j->stats.reads++;
+        j->stats.last_latency_us = latency;
+        j->latency_sum_us += latency;
+        j->stats.avg_latency_us = j->latency_sum_us / j->stats.reads;
+        if (latency > j->stats.max_latency_us) j->stats.max_latency_us = latency;
+        g_stats.reads++;
+        metricAdd(METRIC_GATT_READS, 1);
+        metricSet(METRIC_GATT_READ_LATENCY_US, latency);
+    }
+    j->stats.last_lateness_us = now > j->due_us ? now - j->due_us : 0;
+    /* keep the phase, unless we are a whole period behind */
+    j->due_us += j->period_us;
+    if (j->due_us < now) j->due_us = now;
+    cb = j->cb;
+    cb_user = j->user;
+    id = JOB_ID(j - g_jobs, j->generation);
+    arm_timer(0);
+done:
+    pthread_mutex_unlock(&g_read_mutex);
+    if (cb) cb(id, failed ? -1 : 0, failed ? NULL : value, failed ? 0 : len, cb_user);
+    if (dbus_error_is_set(&err)) dbus_error_free(&err);
+}
+
+/* 0 if the read went out */
+static int send_read(tReadJob *j, uint64_t now) {
+    tReadDevice *d = &g_devices[j->dev];
+    DBusMessage *msg;
+    dbus_bool_t ok;
+
+    if (!j->chr[0] &&
+        gattFindCharacteristic(d->path, j->service_uuid[0] ? j->service_uuid : NULL,
+                               j->uuid, j->chr, sizeof(j->chr)) < 0) {
+        printf("%s: %s has no %s\n", __FUNCTION__, d->path, j->uuid);
+        j->chr[0] = '\0';
+        j->stats.failures++;
+        j->due_us = now + j->period_us;
+        g_stats.failures++;
+        metricAdd(METRIC_GATT_READ_FAILURES, 1);
+        return -1;
+    }
+    msg = bluez_gatt_characteristic1_read_value_new(j->chr, NULL, 0);
+    if (!msg) return -1;
+    ok = dbus_message_send_async(g_read_conn, msg, GATT_READ_TIMEOUT_MS, onReadResult,
+                                 (void *)(long)(j - g_jobs), (void *)(long)j->generation);
+    dbus_message_unref(msg);
+    if (!ok) return -1;
+    j->sent_us = now;
+    d->in_flight++;
+    return 0;
+}
+
+static int cmp_due(const void *a, const void *b) {
+    uint64_t x = g_jobs[*(const int *)a].due_us, y = g_jobs[*(const int *)b].due_us;
+    return x < y ? -1 : x > y;
+}
+
+/* event loop thread, called with the lock held */
+static void schedule(void) {
+    uint64_t now = monotonic_us(), next = now + 60 * 1000000ULL;
+    int used[GATT_READ_MAX_ADAPTERS] = { 0 }, waiting[GATT_READ_MAX_ADAPTERS] = { 0 };
+    int i, ndue = 0;
+    tReadDevice *d;
+    tReadJob *j;
+
+    for (i = 0; i < GATT_READ_MAX_DEVICES; i++) {
+        d = &g_devices[i];
+        if (!d->used) continue;
+        d->next_due_us = UINT64_MAX;
+        d->waiting = 0;
+        if (holds_slot(d)) used[d->adapter]++;
+        /* connected but the services never resolved; Connect itself times out */
+        if (d->state == DEV_CONNECTED && d->deadline_us <= now) {
+            printf("%s: %s didn't resolve its services\n", __FUNCTION__, d->path);
+            g_stats.connect_failures++;
+            fail_due_jobs(d, now);
+            if (d->owned)
+                disconnect_device(d);
+            else
+                d->state = DEV_DOWN;
+        }
+    }
+
+    for (i = 0; i < GATT_READ_MAX_JOBS; i++) {
+        j = &g_jobs[i];
+        if (!j->used || j->closing || j->sent_us) continue;
+        d = &g_devices[j->dev];
+        if (j->due_us < d->next_due_us) d->next_due_us = j->due_us;
+        if (j->due_us <= now)
+            g_due[ndue++] = i;
+        else if (j->due_us < next)
+            next = j->due_us;
+    }
+    qsort(g_due, ndue, sizeof(g_due[0]), cmp_due);
+
+    /* most overdue first: read where we can, connect where there is room */
+    for (i = 0; i < ndue; i++) {
+        j = &g_jobs[g_due[i]];
+        d = &g_devices[j->dev];
+        if (d->state == DEV_READY) {
+            if (d->in_flight < GATT_READ_DEVICE_WINDOW && send_read(j, now) == 0)
+                continue;
+            if (j->due_us <= now) d->waiting = 1;
+        } else if (d->state == DEV_DOWN) {
+            if (used[d->adapter] < g_connection_limit) {
+                connect_device(d, now);
+                if (holds_slot(d)) used[d->adapter]++;
+            } else if (!d->waiting) {
+                waiting[d->adapter]++;
+            }
+            d->waiting = 1;
+        } else {
+            d->waiting = 1;
+        }
+    }
+
+    /* give back connections that have nothing to do for a while */
+    for (i = 0; i < GATT_READ_MAX_DEVICES; i++) {
+        d = &g_devices[i];
+        if (!d->used) continue;
+        if (d->state == DEV_CONNECTING || d->state == DEV_CONNECTED) {
+            if (d->deadline_us < next) next = d->deadline_us;
+            continue;
+        }
+        if (d->state != DEV_READY || !d->owned || d->in_flight || d->waiting)
+            continue;
+        if (d->next_due_us == UINT64_MAX || waiting[d->adapter] ||
+            d->next_due_us - now > GATT_READ_LINGER_MS * 1000ULL) {
+            disconnect_device(d);
+            if (waiting[d->adapter]) waiting[d->adapter]--;
+        }
+    }
+    arm_timer(next);
+}
+
+static void on_timer(int fd, short revents, void *data) {
+    uint64_t expirations;
+
+    while (read(fd, &expirations, sizeof(expirations)) < 0 && errno == EINTR);
+    pthread_mutex_lock(&g_read_mutex);
+    if (g_read_conn) schedule();
+    pthread_mutex_unlock(&g_read_mutex);
+}
+
+void gattReadConnected(const char *device_path, int connected) {
+    tReadDevice *d;
+
+    pthread_mutex_lock(&g_read_mutex);
+    d = find_device(device_path);
+    if (d && !connected && d->state != DEV_DOWN) {
+        set_down(d);
+        arm_timer(0);
+    } else if (d && connected && d->state == DEV_DOWN) {
+        /* someone else's connection */
+        set_connected(d);
+        arm_timer(0);
+    }
+    pthread_mutex_unlock(&g_read_mutex);
+}
+
+void gattReadServicesResolved(const char *device_path) {
+    tReadDevice *d;
+
+    pthread_mutex_lock(&g_read_mutex);
+    d = find_device(device_path);
+    if (d && d->state != DEV_DISCONNECTING && d->state != DEV_READY) {
+        d->state = DEV_READY;
+        arm_timer(0);
+    }
+    pthread_mutex_unlock(&g_read_mutex);
+}
+
+int gattReadAddJob(DBusConnection *conn, const char *device_path,
+                   const char *service_uuid, const char *chr_uuid,
+                   uint32_t period_ms, tGattReadCb cb, void *user) {
+    tReadJob *j = NULL;
+    tReadDevice *d;
+    int i, adapter, id = -1;
+
+    if (!conn || !device_path || !chr_uuid || !period_ms ||
+        strlen(device_path) >= READ_PATH_SIZE || strlen(chr_uuid) >= READ_UUID_SIZE ||
+        (service_uuid && strlen(service_uuid) >= READ_UUID_SIZE))
+        return -1;
+
+    pthread_mutex_lock(&g_read_mutex);
+    if (g_timer_fd < 0) {
+        g_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (g_timer_fd < 0 || addEventLoopFd(g_timer_fd, POLLIN, on_timer, NULL) < 0) {
+            printf("%s: no timer: %s\n", __FUNCTION__, strerror(errno));
+            if (g_timer_fd >= 0) close(g_timer_fd);
+            g_timer_fd = -1;
+            goto done;
+        }
+        g_start_us = monotonic_us();
+    }
+    g_read_conn = conn;
+
+    d = find_device(device_path);
+    for (i = 0; i < GATT_READ_MAX_DEVICES && !d; i++) {
+        if (!g_devices[i].used) {
+            adapter = adapter_of(device_path);
+            if (adapter < 0) break;
+            d = &g_devices[i];
+            memset(d, 0, sizeof(*d));
+            d->used = 1;
+            g_device_generation = (g_device_generation + 1) & JOB_GEN_MASK;
+            if (!g_device_generation) g_device_generation = 1;
+            d->generation = g_device_generation;
+            d->adapter = adapter;
+            d->state = DEV_DOWN;
+            snprintf(d->path, sizeof(d->path), "%s", device_path);
+        }
+    }
+    for (i = 0; i < GATT_READ_MAX_JOBS && d && !j; i++) {
+        if (!g_jobs[i].used)
+            j = &g_jobs[i];
+    }
+    if (!j) {
+        printf("%s: no room for %s\n", __FUNCTION__, device_path);
+        if (d && !d->jobs && d->state == DEV_DOWN) d->used = 0;
+        goto done;
+    }
+
+    memset(j, 0, sizeof(*j));
+    j->used = 1;
+    g_job_generation = (g_job_generation + 1) & JOB_GEN_MASK;
+    if (!g_job_generation) g_job_generation = 1;
+    j->generation = g_job_generation;
+    j->dev = d - g_devices;
+    snprintf(j->service_uuid, sizeof(j->service_uuid), "%s", service_uuid ? service_uuid : "");
+    snprintf(j->uuid, sizeof(j->uuid), "%s", chr_uuid);
+    j->period_us = period_ms * 1000ULL;
+    j->due_us = monotonic_us();
+    j->cb = cb;
+    j->user = user;
+    d->jobs++;
+    g_stats.jobs++;
+    id = JOB_ID(j - g_jobs, j->generation);
+    arm_timer(0);
+done:
+    pthread_mutex_unlock(&g_read_mutex);
+    return id;
+}
+
+int gattReadRemoveJob(int id) {
+    tReadJob *j = lock_job(id);
+    tReadDevice *d;
+
+    if (!j) return -1;
+    d = &g_devices[j->dev];
+    g_stats.jobs--;
+    if (j->sent_us) {
+        /* the reply frees the slot */
+        j->closing = 1;
+    } else {
+        j->used = 0;
+        if (--d->jobs == 0 && d->state == DEV_DOWN)
+            d->used = 0;
+    }
+    /* an idle connection of ours goes on the next tick */
+    arm_timer(0);
+    pthread_mutex_unlock(&g_read_mutex);
+    return 0;
+}
+
+int gattReadJobStats(int id, tGattReadJobStats *stats) {
+    tReadJob *j;
+
+    if (!stats) return -1;
+    j = lock_job(id);
+    if (!j) return -1;
+    *stats = j->stats;
+    pthread_mutex_unlock(&g_read_mutex);
+    return 0;
+}
+
+void gattReadStats(tGattReadStats *stats) {
+    uint64_t elapsed;
+
+    if (!stats) return;
+    pthread_mutex_lock(&g_read_mutex);
+    *stats = g_stats;
+    elapsed = g_start_us ? monotonic_us() - g_start_us : 0;
+    stats->reads_per_min = elapsed ? stats->reads * 60000000ULL / elapsed : 0;
+    pthread_mutex_unlock(&g_read_mutex);
+}
+
+void gattReadSetConnectionLimit(int per_adapter) {
+    pthread_mutex_lock(&g_read_mutex);
+    g_connection_limit = per_adapter > 0 ? per_adapter : GATT_READ_CONNECTIONS;
+    arm_timer(0);
+    pthread_mutex_unlock(&g_read_mutex);
+}
+
+void gattReadCleanup() {
+    pthread_mutex_lock(&g_read_mutex);
+    if (g_timer_fd >= 0) {
+        closeEventLoopFd(g_timer_fd);
+        g_timer_fd = -1;
+    }
+    /* replies still in flight find their slot unused */
+    memset(g_jobs, 0, sizeof(g_jobs));
+    memset(g_devices, 0, sizeof(g_devices));
+    memset(g_adapters, 0, sizeof(g_adapters));
+    memset(&g_stats, 0, sizeof(g_stats));
+    metricSet(METRIC_GATT_READ_CONNECTIONS, 0);
+    g_read_conn = NULL;
+    g_start_us = 0;
+    pthread_mutex_unlock(&g_read_mutex);
+}
@@ -0,0 +1,783 @@
+#include <string.h>
+
+#include "bluetooth_hfp.h"
+
+#define AT_EXEC     0   /* AT+X */
+#define AT_SET      1   /* AT+X=... */
+#define AT_READ     2   /* AT+X? */
+#define AT_TEST     3   /* AT+X=? */
+
+/* +CME ERROR codes */
+#define CME_NOT_ALLOWED     3
+#define CME_NOT_SUPPORTED   4
+
+static const struct {
+    const char *name;
+    int max;
+} hfp_indicators[HFP_IND_MAX] = {
+    { "service", 1 },
+    { "call", 1 },
+    { "callsetup", 3 },
+    { "callheld", 2 },
+    { "signal", 5 },
+    { "roam", 1 },
+    { "battchg", 5 },
+};
+
+static const char hfp_cind_test[] =
+    "\r\n+CIND: (\"service\",(0,1)),(\"call\",(0,1)),(\"callsetup\",(0-3)),"
+    "(\"callheld\",(0-2)),(\"signal\",(0-5)),(\"roam\",(0,1)),(\"battchg\",(0-5))\r\n";
+
+/************************************ output ************************************/
+static void flush(tHfp *h) {
+    if (!h->out_len) return;
+    if (h->cb.send(h->user, h->out, h->out_len) < 0)
+        h->failed = 1;
+    h->stats.sends++;
+    h->out_len = 0;
+}
+
+static void put(tHfp *h, const char *s, size_t len) {
+    if (h->out_len + len > HFP_OUT_SIZE)
+        flush(h);
+    if (len > HFP_OUT_SIZE) len = HFP_OUT_SIZE;
+    memcpy(h->out + h->out_len, s, len);
+    h->out_len += len;
+}
+
+static void put_str(tHfp *h, const char *s) {
+    put(h, s, strlen(s));
+}
+
+static void put_int(tHfp *h, int v) {
+    char buf[12];
+    int i = sizeof(buf);
+    unsigned int u = v < 0 ? -(unsigned int)v : (unsigned int)v;
+
+    do {
+        buf[--i] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (v < 0) buf[--i] = '-';
+    put(h, buf + i, sizeof(buf) - i);
+}
+
+static void ag_ok(tHfp *h) {
+    put(h, "\r\nOK\r\n", 6);
+}
+
+static void ag_error(tHfp *h, int cme) {
+    h->stats.errors++;
+    if (h->cmee) {
+        put_str(h, "\r\n+CME ERROR: ");
+        put_int(h, cme);
+        put(h, "\r\n", 2);
+    } else {
+        put(h, "\r\nERROR\r\n", 9);
+    }
+}
+
+static void emit(tHfp *h, int type, int index, int value, const char *number) {
+    tHfpEvent ev;
+
+    if (!h->cb.event) return;
+    ev.type = type;
+    ev.index = index;
+    ev.value = value;
+    ev.number = number;
+    h->cb.event(h->user, &ev);
+}
+
+/********************************** arguments ***********************************/
+static int parse_int(char **p, int *v) {
+    char *s = *p;
+    int n = 0, neg = 0;
+
+    while (*s == ' ') s++;
+    if (*s == '-') {
+        neg = 1;
+        s++;
+    }
+    if (*s < '0' || *s > '9')
+        return -1;
+    while (*s >= '0' && *s <= '9')
+        n = n * 10 + (*s++ - '0');
+    while (*s == ' ') s++;
+    if (*s == ',') s++;
+    *v = neg ? -n : n;
+    *p = s;
+    return 0;
+}
+
+/* a "quoted" string, unquoted in place */
+static char * parse_quoted(char **p) {
+    char *s = *p, *start;
+
+    while (*s == ' ') s++;
+    if (*s != '"') return NULL;
+    start = ++s;
+    while (*s && *s != '"') s++;
+    if (!*s) return NULL;
+    *s++ = '\0';
+    if (*s == ',') s++;
+    *p = s;
+    return start;
+}
+
+static void copy_number(tHfp *h, const char *number, size_t len) {
+    if (len >= sizeof(h->number)) len = sizeof(h->number) - 1;
+    memcpy(h->number, number, len);
+    h->number[len] = '\0';
+}
+
+/****************************** audio gateway side ******************************/
+static void ag_report(tHfp *h, int index) {
+    /* call status indicators can't be deactivated */
+    if (!h->reporting || h->slc < HFP_SLC_CMER)
+        return;
+    if (index > HFP_IND_CALLHELD && !(h->ind_active & (1u << index)))
+        return;
+    put_str(h, "\r\n+CIEV: ");
+    put_int(h, index + 1);
+    put(h, ",", 1);
+    put_int(h, h->ind[index]);
+    put(h, "\r\n", 2);
+}
+
+static void ag_set(tHfp *h, int index, int value) {
+    if (h->ind[index] == value) return;
+    h->ind[index] = value;
+    ag_report(h, index);
+}
+
+static void ag_slc_connected(tHfp *h) {
+    h->slc = HFP_SLC_CONNECTED;
+    emit(h, HFP_EVENT_SLC_CONNECTED, 0, 0, NULL);
+}
+
+static void ag_ring(tHfp *h) {
+    put(h, "\r\nRING\r\n", 8);
+    if (h->clip && h->number[0]) {
+        put_str(h, "\r\n+CLIP: \"");
+        put_str(h, h->number);
+        put_str(h, "\",129\r\n");
+    }
+}
+
+static void cmd_brsf(tHfp *h, int type, char *args) {
+    int v;
+    if (type != AT_SET || parse_int(&args, &v) < 0) {
+        ag_error(h, CME_NOT_ALLOWED);
+        return;
+    }
+    h->remote_features = v;
+    h->slc = HFP_SLC_BRSF;
+    put_str(h, "\r\n+BRSF: ");
+    put_int(h, h->local_features);
+    put(h, "\r\n", 2);
+    ag_ok(h);
+}
+
+static void cmd_cind(tHfp *h, int type, char *args) {
+    int i;
+
+    if (type == AT_TEST) {
+        put(h, hfp_cind_test, sizeof(hfp_cind_test) - 1);
+        if (h->slc < HFP_SLC_CIND_TEST) h->slc = HFP_SLC_CIND_TEST;
+    } else if (type == AT_READ) {
+        put_str(h, "\r\n+CIND: ");
+        for (i = 0; i < HFP_IND_MAX; i++) {
+            if (i) put(h, ",", 1);
+            put_int(h, h->ind[i]);
+        }
+        put(h, "\r\n", 2);
+        if (h->slc < HFP_SLC_CIND_READ) h->slc = HFP_SLC_CIND_READ;
+    } else {
+        ag_error(h, CME_NOT_ALLOWED);
+        return;
+    }
+    ag_ok(h);
+}
+
+static void cmd_cmer(tHfp *h, int type, char *args) {
+    int mode, keyp = 0, disp = 0, ind = 0;
+
+    if (type != AT_SET || parse_int(&args, &mode) < 0) {
+        ag_error(h, CME_NOT_ALLOWED);
+        return;
+    }
+    parse_int(&args, &keyp);
+    parse_int(&args, &disp);
+    parse_int(&args, &ind);
+    h->reporting = mode == 3 && ind == 1;
+    ag_ok(h);
+    if (h->slc < HFP_SLC_CMER) {
+        h->slc = HFP_SLC_CMER;
+        /* with three way calling on both sides the HF still asks for +CHLD */
+        if (!((h->local_features & HFP_AG_FEAT_3WAY) &&
+              (h->remote_features & HFP_HF_FEAT_3WAY)))
+            ag_slc_connected(h);
+    }
+}
+
+static void cmd_chld(tHfp *h, int type, char *args) {
+    int v;
+
+    if (type == AT_TEST) {
+        put_str(h, "\r\n+CHLD: (0,1,2,3)\r\n");
+        ag_ok(h);
+        if (h->slc == HFP_SLC_CMER) {
+            h->slc = HFP_SLC_CHLD;
+            ag_slc_connected(h);
+        }
+    } else if (type == AT_SET && parse_int(&args, &v) == 0 && v >= 0 && v <= 3) {
+        /* single call only: 0 and 1 end the call that is set up or running */
+        ag_ok(h);
+        if (v <= 1 && (h->ind[HFP_IND_CALL] || h->ind[HFP_IND_CALLSETUP])) {
+            emit(h, HFP_EVENT_HANGUP, 0, 0, NULL);
+            ag_set(h, HFP_IND_CALL, 0);
+            ag_set(h, HFP_IND_CALLSETUP, HFP_CALLSETUP_NONE);
+        }
+    } else {
+        ag_error(h, CME_NOT_SUPPORTED);
+    }
+}
+
+/* AT+CLIP, +CCWA, +CMEE, +NREC: a single 0/1, answered here; -1 if invalid */
+static int cmd_flag(tHfp *h, int type, char *args) {
+    int v;
+    if (type != AT_SET || parse_int(&args, &v) < 0) {
+        ag_error(h, CME_NOT_ALLOWED);
+        return -1;
+    }
+    ag_ok(h);
+    return v != 0;
+}
+
+static void cmd_volume(tHfp *h, int type, char *args, int which) {
+    int v;
+    if (type != AT_SET || parse_int(&args, &v) < 0 || v < 0 || v > HFP_VOLUME_MAX) {
+        ag_error(h, CME_NOT_ALLOWED);
+        return;
+    }
+    h->volume[which] = v;
+    ag_ok(h);
+    emit(h, HFP_EVENT_VOLUME, which, v, NULL);
+}
+
+static void cmd_answer(tHfp *h, int type, char *args) {
+    if (h->ind[HFP_IND_CALLSETUP] != HFP_CALLSETUP_INCOMING) {
+        ag_error(h, CME_NOT_ALLOWED);
+        return;
+    }
+    ag_ok(h);
+    emit(h, HFP_EVENT_ANSWER, 0, 0, NULL);
+    ag_set(h, HFP_IND_CALL, 1);
+    ag_set(h, HFP_IND_CALLSETUP, HFP_CALLSETUP_NONE);
+}
+
+static void cmd_chup(tHfp *h, int type, char *args) {
+    if (!h->ind[HFP_IND_CALL] && !h->ind[HFP_IND_CALLSETUP]) {
+        ag_error(h, CME_NOT_ALLOWED);
+        return;
+    }
+    ag_ok(h);
+    emit(h, HFP_EVENT_HANGUP, 0, 0, NULL);
+    ag_set(h, HFP_IND_CALL, 0);
+    ag_set(h, HFP_IND_CALLSETUP, HFP_CALLSETUP_NONE);
+}
+
+static void start_outgoing(tHfp *h) {
+    h->incoming = 0;
+    ag_ok(h);
+    emit(h, HFP_EVENT_DIAL, 0, 0, h->number);
+    ag_set(h, HFP_IND_CALLSETUP, HFP_CALLSETUP_OUTGOING);
+}
+
+/* ATD<number>; memory dialling (ATD>n;) isn't supported */
+static void cmd_dial(tHfp *h, int type, char *args) {
+    size_t len = strlen(args);
+
+    if (len && args[len - 1] == ';') len--;
+    if (!len || args[0] == '>' || h->ind[HFP_IND_CALL] || h->ind[HFP_IND_CALLSETUP]) {
+        ag_error(h, args[0] == '>' ? CME_NOT_SUPPORTED : CME_NOT_ALLOWED);
+        return;
+    }
+    copy_number(h, args, len);
+    start_outgoing(h);
+}
+
+static void cmd_bldn(tHfp *h, int type, char *args) {
+    if (!h->number[0] || h->ind[HFP_IND_CALL] || h->ind[HFP_IND_CALLSETUP]) {
+        ag_error(h, CME_NOT_ALLOWED);
+        return;
+    }
+    start_outgoing(h);
+}
+
+static void cmd_clcc(tHfp *h, int type, char *args) {
+    int stat;
+
+    if (h->ind[HFP_IND_CALL] || h->ind[HFP_IND_CALLSETUP]) {
+        if (h->ind[HFP_IND_CALL]) stat = 0;
+        else if (h->ind[HFP_IND_CALLSETUP] == HFP_CALLSETUP_INCOMING) stat = 4;
+        else if (h->ind[HFP_IND_CALLSETUP] == HFP_CALLSETUP_ALERTING) stat = 3;
+        else stat = 2;
+        put_str(h, "\r\n+CLCC: 1,");
+        put_int(h, h->incoming);
+        put(h, ",", 1);
+        put_int(h, stat);
+        put_str(h, ",0,0,\"");
+        put_str(h, h->number);
+        put_str(h, "\",129\r\n");
+    }
+    ag_ok(h);
+}
+
+static void cmd_cops(tHfp *h, int type, char *args) {
+    if (type == AT_READ)
+        put_str(h, "\r\n+COPS: 0,0,\"dbus_bt\"\r\n");
+    ag_ok(h);
+}
+
+/* AT+BIA=,,,,0,1,1: empty fields leave the indicator as it is */
+static void cmd_bia(tHfp *h, int type, char *args) {
+    int i = 0;
+
+    if (type != AT_SET) {
+        ag_error(h, CME_NOT_ALLOWED);
+        return;
+    }
+    while (*args && i < HFP_IND_MAX) {
+        if (*args == '1') h->ind_active |= 1u << i;
+        else if (*args == '0') h->ind_active &= ~(1u << i);
+        while (*args && *args != ',') args++;
+        if (*args == ',') args++;
+        i++;
+    }
+    ag_ok(h);
+}
+
+static void cmd_vts(tHfp *h, int type, char *args) {
+    if (type != AT_SET || !args[0]) {
+        ag_error(h, CME_NOT_ALLOWED);
+        return;
+    }
+    ag_ok(h);
+    emit(h, HFP_EVENT_DTMF, 0, args[0], NULL);
+}
+
+static void cmd_ok(tHfp *h, int type, char *args) {
+    ag_ok(h);
+}
+
+static void cmd_clip(tHfp *h, int type, char *args) {
+    int v = cmd_flag(h, type, args);
+    if (v >= 0) h->clip = v;
+}
+
+static void cmd_ccwa(tHfp *h, int type, char *args) {
+    int v = cmd_flag(h, type, args);
+    if (v >= 0) h->ccwa = v;
+}
+
+static void cmd_cmee(tHfp *h, int type, char *args) {
+    int v = cmd_flag(h, type, args);
+    if (v >= 0) h->cmee = v;
+}
+
+static void cmd_nrec(tHfp *h, int type, char *args) {
+    cmd_flag(h, type, args);
+}
+
+static void cmd_vgs(tHfp *h, int type, char *args) {
+    cmd_volume(h, type, args, HFP_VOLUME_SPEAKER);
+}
+
+static void cmd_vgm(tHfp *h, int type, char *args) {
+    cmd_volume(h, type, args, HFP_VOLUME_MIC);
+}
+
+/* most frequent first, the table is searched linearly */
+static const struct {
+    const char *name;
+    size_t len;
+    void (*handler)(tHfp *h, int type, char *args);
+} ag_commands[] = {
+    { "+VGS", 4, cmd_vgs },
+    { "+VGM", 4, cmd_vgm },
+    { "+CLCC", 5, cmd_clcc },
+    { "A", 1, cmd_answer },
+    { "+CHUP", 5, cmd_chup },
+    { "D", 1, cmd_dial },
+    { "+BLDN", 5, cmd_bldn },
+    { "+VTS", 4, cmd_vts },
+    { "+BRSF", 5, cmd_brsf },
+    { "+CIND", 5, cmd_cind },
+    { "+CMER", 5, cmd_cmer },
+    { "+CHLD", 5, cmd_chld },
+    { "+CLIP", 5, cmd_clip },
+    { "+CCWA", 5, cmd_ccwa },
+    { "+CMEE", 5, cmd_cmee },
+    { "+NREC", 5, cmd_nrec },
+    { "+BIA", 4, cmd_bia },
+    { "+COPS", 5, cmd_cops },
+    { "+BAC", 4, cmd_ok },
+    { "+BCS", 4, cmd_ok },
+    { "+CNUM", 5, cmd_ok },
+    { "+BTRH", 5, cmd_ok },
+};
+#define NUM_AG_COMMANDS (sizeof(ag_commands) / sizeof(ag_commands[0]))
+
+static void ag_line(tHfp *h, char *line, size_t len) {
+    char *name, *p;
+    size_t name_len, i;
+    int type;
+
+    if (len < 2 || (line[0] != 'A' && line[0] != 'a') || (line[1] != 'T' && line[1] != 't')) {
+        ag_error(h, CME_NOT_SUPPORTED);
+        return;
+    }
+    name = p = line + 2;
+    if (*p == 'D' || *p == 'd') {
+        /* the rest is the number, keep its case */
+        *p = 'D';
+        cmd_dial(h, AT_SET, p + 1);
+        return;
+    }
+    if (*p == '+') p++;
+    while ((*p >= 'A' && *p <= 'Z') || (*p >= 'a' && *p <= 'z')) {
+        if (*p >= 'a') *p -= 'a' - 'A';
+        p++;
+    }
+    name_len = p - name;
+
+    if (p[0] == '=' && p[1] == '?') {
+        type = AT_TEST;
+        p += 2;
+    } else if (p[0] == '=') {
+        type = AT_SET;
+        p++;
+    } else if (p[0] == '?') {
+        type = AT_READ;
+        p++;
+    } else {
+        type = AT_EXEC;
+    }
+
+    if (!name_len && type == AT_EXEC) {
+        /* plain AT, the HF checking we are there */
+        ag_ok(h);
+        return;
+    }
+    for (i = 0; i < NUM_AG_COMMANDS; i++) {
+        if (ag_commands[i].len == name_len && !memcmp(ag_commands[i].name, name, name_len)) {
+            ag_commands[i].handler(h, type, p);
+            return;
+        }
+    }
+    ag_error(h, CME_NOT_SUPPORTED);
+}
+
+/******************************* hands-free side ********************************/
+/* str is a dial string, ATD<number>; */
+static int hf_command(tHfp *h, const char *cmd, int value, const char *str) {
+    if (h->pending) return -1;
+    put_str(h, cmd);
+    if (value >= 0) put_int(h, value);
+    if (str) {
+        put_str(h, str);
+        put(h, ";", 1);
+    }
+    put(h, "\r", 1);
+    h->pending = 1;
+    return 0;
+}
+
+/* SLC setup, one step per OK */
+static void hf_slc_next(tHfp *h) {
+    switch (h->slc) {
+    case HFP_SLC_IDLE:
+        h->slc = HFP_SLC_BRSF;
+        hf_command(h, "AT+BRSF=", h->local_features, NULL);
+        break;
+    case HFP_SLC_BRSF:
+        h->slc = HFP_SLC_CIND_TEST;
+        hf_command(h, "AT+CIND=?", -1, NULL);
+        break;
+    case HFP_SLC_CIND_TEST:
+        h->slc = HFP_SLC_CIND_READ;
+        hf_command(h, "AT+CIND?", -1, NULL);
+        break;
+    case HFP_SLC_CIND_READ:
+        h->slc = HFP_SLC_CMER;
+        hf_command(h, "AT+CMER=3,0,0,1", -1, NULL);
+        break;
+    case HFP_SLC_CMER:
+        if ((h->local_features & HFP_HF_FEAT_3WAY) &&
+            (h->remote_features & HFP_AG_FEAT_3WAY)) {
+            h->slc = HFP_SLC_CHLD;
+            hf_command(h, "AT+CHLD=?", -1, NULL);
+            break;
+        }
+        /* fall through */
+    case HFP_SLC_CHLD:
+        h->slc = HFP_SLC_CONNECTED;
+        /* caller id is what the rest of the product wants to show */
+        if (h->local_features & HFP_HF_FEAT_CLI)
+            hf_command(h, "AT+CLIP=1", -1, NULL);
+        emit(h, HFP_EVENT_SLC_CONNECTED, 0, 0, NULL);
+        break;
+    }
+}
+
+static void hf_result(tHfp *h, int ok) {
+    int slc_step = h->slc != HFP_SLC_CONNECTED;
+
+    h->pending = 0;
+    if (!ok) h->stats.errors++;
+    if (slc_step) {
+        /* +CHLD is optional, anything else failing ends the setup */
+        if (ok || h->slc == HFP_SLC_CHLD)
+            hf_slc_next(h);
+        else
+            h->slc = HFP_SLC_IDLE;
+    }
+    emit(h, HFP_EVENT_RESULT, 0, ok ? 0 : -1, NULL);
+}
+
+/* +CIND: ("service",(0,1)),("call",(0,1)),... in the AG's order */
+static void hf_cind_test(tHfp *h, char *args) {
+    char *name;
+    int i, n = 0;
+
+    while (*args && n < HFP_IND_MAX) {
+        while (*args && *args != '"') args++;
+        if (!(name = parse_quoted(&args)))
+            break;
+        h->ind_map[++n] = -1;
+        for (i = 0; i < HFP_IND_MAX; i++) {
+            if (!strcmp(name, hfp_indicators[i].name)) {
+                h->ind_map[n] = i;
+                break;
+            }
+        }
+        /* skip the value range */
+        while (*args && *args != ')') args++;
+        if (*args) args++;
+    }
+    h->ind_count = n;
+}
+
+static void hf_indicator(tHfp *h, int ag_index, int value) {
+    int i;
+
+    if (ag_index < 1 || ag_index > h->ind_count || (i = h->ind_map[ag_index]) < 0)
+        return;
+    if (value < 0 || value > hfp_indicators[i].max || h->ind[i] == value)
+        return;
+    h->ind[i] = value;
+    emit(h, HFP_EVENT_INDICATOR, i, value, NULL);
+}
+
+static void hf_line(tHfp *h, char *line, size_t len) {
+    char *args, *number;
+    int a, b, i;
+
+    if (!strcmp(line, "OK")) {
+        hf_result(h, 1);
+    } else if (!strcmp(line, "ERROR") || !strncmp(line, "+CME ERROR:", 11)) {
+        hf_result(h, 0);
+    } else if (!strcmp(line, "RING")) {
+        emit(h, HFP_EVENT_RING, 0, 0, NULL);
+    } else if (!strncmp(line, "+CIEV:", 6)) {
+        args = line + 6;
+        if (parse_int(&args, &a) == 0 && parse_int(&args, &b) == 0)
+            hf_indicator(h, a, b);
+    } else if (!strncmp(line, "+VGS", 4) || !strncmp(line, "+VGM", 4)) {
+        /* both "+VGS: 7" and "+VGS=7" are out there */
+        args = line + 5;
+        if (parse_int(&args, &a) == 0 && a >= 0 && a <= HFP_VOLUME_MAX) {
+            i = line[3] == 'S' ? HFP_VOLUME_SPEAKER : HFP_VOLUME_MIC;
+            h->volume[i] = a;
+            emit(h, HFP_EVENT_VOLUME, i, a, NULL);
+        }
+    } else if (!strncmp(line, "+CLIP:", 6)) {
+        args = line + 6;
+        if ((number = parse_quoted(&args))) {
+            copy_number(h, number, strlen(number));
+            emit(h, HFP_EVENT_CALLER_ID, 0, 0, number);
+        }
+    } else if (!strncmp(line, "+CIND:", 6)) {
+        args = line + 6;
+        while (*args == ' ') args++;
+        if (*args == '(') {
+            hf_cind_test(h, args);
+        } else {
+            for (i = 1; i <= h->ind_count && parse_int(&args, &a) == 0; i++) {
+                if (h->ind_map[i] >= 0)
+                    h->ind[h->ind_map[i]] = a;
+            }
+        }
+    } else if (!strncmp(line, "+BRSF:", 6)) {
+        args = line + 6;
+        if (parse_int(&args, &a) == 0)
+            h->remote_features = a;
+    }
+    /* +CHLD, +COPS, +CLCC and friends carry nothing we keep */
+}
+
+/************************************* api **************************************/
+void initHfp(tHfp *h, int role, uint32_t features, const tHfpCallbacks *cb, void *user) {
+    memset(h, 0, sizeof(*h));
+    h->role = role;
+    if (!features)
+        features = role == HFP_ROLE_AG ? HFP_AG_DEFAULT_FEATURES : HFP_HF_DEFAULT_FEATURES;
+    h->local_features = features;
+    h->cb = *cb;
+    h->user = user;
+    h->ind_active = (1u << HFP_IND_MAX) - 1;
+    h->ind[HFP_IND_SERVICE] = 1;
+    h->ind[HFP_IND_SIGNAL] = 5;
+    h->ind[HFP_IND_BATTCHG] = 5;
+    h->volume[HFP_VOLUME_SPEAKER] = h->volume[HFP_VOLUME_MIC] = 8;
+}
+
+int hfpInput(tHfp *h, const char *data, size_t len) {
+    const char *end = data + len;
+    char c;
+
+    while (data < end) {
+        c = *data++;
+        if (c == '\r' || c == '\n') {
+            if (h->line_len && !h->discard) {
+                h->line[h->line_len] = '\0';
+                h->stats.lines++;
+                if (h->role == HFP_ROLE_AG)
+                    ag_line(h, h->line, h->line_len);
+                else
+                    hf_line(h, h->line, h->line_len);
+            }
+            h->line_len = 0;
+            h->discard = 0;
+        } else if (h->line_len < HFP_MAX_LINE - 1) {
+            h->line[h->line_len++] = c;
+        } else if (!h->discard) {
+            h->stats.overflows++;
+            h->discard = 1;
+        }
+    }
+    flush(h);
+    return h->failed ? -1 : 0;
+}
+
+int hfpStartSlc(tHfp *h) {
+    if (h->role != HFP_ROLE_HF || h->slc != HFP_SLC_IDLE || h->pending)
+        return -1;
+    hf_slc_next(h);
+    flush(h);
+    return h->failed ? -1 : 0;
+}
+
+static int hf_call_command(tHfp *h, const char *cmd, const char *str) {
+    if (h->role != HFP_ROLE_HF || h->slc != HFP_SLC_CONNECTED ||
+        hf_command(h, cmd, -1, str) < 0)
+        return -1;
+    flush(h);
+    return h->failed ? -1 : 0;
+}
+
+int hfpAnswer(tHfp *h) {
+    return hf_call_command(h, "ATA", NULL);
+}
+
+int hfpHangup(tHfp *h) {
+    return hf_call_command(h, "AT+CHUP", NULL);
+}
+
+int hfpDial(tHfp *h, const char *number) {
+    if (!number)
+        return hf_call_command(h, "AT+BLDN", NULL);
+    if (strlen(number) >= HFP_NUMBER_SIZE || strchr(number, ';'))
+        return -1;
+    return hf_call_command(h, "ATD", number);
+}
+
+static int ag_done(tHfp *h) {
+    flush(h);
+    return h->failed ? -1 : 0;
+}
+
+int hfpSetIndicator(tHfp *h, int index, int value) {
+    if (h->role != HFP_ROLE_AG || index < 0 || index >= HFP_IND_MAX ||
+        value < 0 || value > hfp_indicators[index].max)
+        return -1;
+    ag_set(h, index, value);
+    return ag_done(h);
+}
+
+int hfpIncomingCall(tHfp *h, const char *number) {
+    if (h->role != HFP_ROLE_AG || h->ind[HFP_IND_CALL] || h->ind[HFP_IND_CALLSETUP])
+        return -1;
+    copy_number(h, number ? number : "", number ? strlen(number) : 0);
+    h->incoming = 1;
+    ag_set(h, HFP_IND_CALLSETUP, HFP_CALLSETUP_INCOMING);
+    if (h->slc == HFP_SLC_CONNECTED)
+        ag_ring(h);
+    return ag_done(h);
+}
+
+int hfpRing(tHfp *h) {
+    if (h->role != HFP_ROLE_AG || h->ind[HFP_IND_CALLSETUP] != HFP_CALLSETUP_INCOMING)
+        return -1;
+    if (h->slc == HFP_SLC_CONNECTED)
+        ag_ring(h);
+    return ag_done(h);
+}
+
+int hfpCallAlerting(tHfp *h) {
+    if (h->role != HFP_ROLE_AG || h->ind[HFP_IND_CALLSETUP] != HFP_CALLSETUP_OUTGOING)
+        return -1;
+    ag_set(h, HFP_IND_CALLSETUP, HFP_CALLSETUP_ALERTING);
+    return ag_done(h);
+}
+
+int hfpCallActive(tHfp *h) {
+    if (h->role != HFP_ROLE_AG || (!h->ind[HFP_IND_CALLSETUP] && !h->ind[HFP_IND_CALL]))
+        return -1;
+    /* call goes up before callsetup goes down, as the spec's sequences show */
+    ag_set(h, HFP_IND_CALL, 1);
+    ag_set(h, HFP_IND_CALLSETUP, HFP_CALLSETUP_NONE);
+    return ag_done(h);
+}
+
+int hfpCallEnded(tHfp *h) {
+    if (h->role != HFP_ROLE_AG)
+        return -1;
+    ag_set(h, HFP_IND_CALL, 0);
+    ag_set(h, HFP_IND_CALLSETUP, HFP_CALLSETUP_NONE);
+    ag_set(h, HFP_IND_CALLHELD, 0);
+    return ag_done(h);
+}
+
+int hfpSetVolume(tHfp *h, int which, int value) {
+    if ((which != HFP_VOLUME_SPEAKER && which != HFP_VOLUME_MIC) ||
+        value < 0 || value > HFP_VOLUME_MAX)
+        return -1;
+    if (h->role == HFP_ROLE_HF) {
+        if (h->slc != HFP_SLC_CONNECTED ||
+            hf_command(h, which == HFP_VOLUME_SPEAKER ? "AT+VGS=" : "AT+VGM=",
+                       value, NULL) < 0)
+            return -1;
+        h->volume[which] = value;
+        flush(h);
+        return h->failed ? -1 : 0;
+    }
+    h->volume[which] = value;
+    if (h->slc == HFP_SLC_CONNECTED) {
+        put_str(h, which == HFP_VOLUME_SPEAKER ? "\r\n+VGS: " : "\r\n+VGM: ");
+        put_int(h, value);
+        put(h, "\r\n", 2);
+    }
+    return ag_done(h);
+}
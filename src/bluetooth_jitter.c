@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "bluetooth_jitter.h"
+#include "bluetooth_metrics.h"
+
+/* a gap this long is a pause or a new stream, not jitter */
+#define JITTER_RESET_US     1000000
+
+struct jitter_buffer {
+    int rate;
+    int channels;
+    uint32_t capacity;      /* frames, power of two */
+    int16_t *ring;
+    uint32_t target_frames; /* producer stores, consumer loads */
+    tJitterStats stats;     /* relaxed atomics, each field has one writer */
+
+    /* producer side */
+    uint32_t write __attribute__((aligned(64)));
+    uint64_t received;      /* frames since the reference arrival */
+    int64_t last_transit;
+    int64_t jitter_us;
+    int64_t peak_us;
+
+    /* consumer side */
+    uint32_t read __attribute__((aligned(64)));
+    int playing;
+    int64_t level_avg;      /* fill level in frames, x16 */
+};
+
+tJitterBuffer * createJitterBuffer(int rate, int channels) {
+    tJitterBuffer *jb;
+    uint32_t frames = (uint64_t)2 * JITTER_MAX_MS * rate / 1000;
+    size_t size;
+
+    if (rate <= 0 || channels <= 0) return NULL;
+    if (posix_memalign((void **)&jb, 64, sizeof(*jb)))
+        return NULL;
+    memset(jb, 0, sizeof(*jb));
+    jb->rate = rate;
+    jb->channels = channels;
+    for (jb->capacity = 1024; jb->capacity < frames; jb->capacity <<= 1);
+    size = (size_t)jb->capacity * channels * sizeof(int16_t);
+    jb->ring = calloc(1, size);
+    if (!jb->ring) {
+        free(jb);
+        return NULL;
+    }
+    /* the consumer runs against a deadline, no page faults please */
+    mlock(jb->ring, size);
+    jb->target_frames = (uint64_t)JITTER_MIN_MS * rate / 1000;
+    jb->stats.target_us = JITTER_MIN_MS * 1000;
+    return jb;
+}
+
+void destroyJitterBuffer(tJitterBuffer *jb) {
+    if (!jb) return;
+    munlock(jb->ring, (size_t)jb->capacity * jb->channels * sizeof(int16_t));
+    free(jb->ring);
+    free(jb);
+}
+
+int jitterBufferPeriod(const tJitterBuffer *jb) {
+    return jb->rate * JITTER_PERIOD_MS / 1000;
+}
+
+/* interarrival jitter against the media clock, see RFC 3550 A.8 */
+static void update_target(tJitterBuffer *jb, int frames, uint64_t arrival_us) {
+    int64_t transit, d, target_us;
+
+    transit = (int64_t)arrival_us - (int64_t)(jb->received * 1000000 / jb->rate);
+    if (jb->received) {
+        d = transit - jb->last_transit;
+        if (d < 0) d = -d;
+        if (d > JITTER_RESET_US) {
+            jb->received = 0;
+            transit = arrival_us;
+        } else {
+            jb->jitter_us += (d - jb->jitter_us) / 16;
+            /* the peak forgets in a few hundred packets, seconds of audio */
+            jb->peak_us -= jb->peak_us / 256;
+            if (d > jb->peak_us) jb->peak_us = d;
+        }
+    }
+    jb->last_transit = transit;
+    jb->received += frames;
+
+    target_us = 4 * jb->jitter_us > jb->peak_us ? 4 * jb->jitter_us : jb->peak_us;
+    target_us += JITTER_PERIOD_MS * 1000;
+    if (target_us < JITTER_MIN_MS * 1000) target_us = JITTER_MIN_MS * 1000;
+    if (target_us > JITTER_MAX_MS * 1000) target_us = JITTER_MAX_MS * 1000;
+
+    __atomic_store_n(&jb->target_frames, (uint32_t)(target_us * jb->rate / 1000000),
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&jb->stats.jitter_us, (uint32_t)jb->jitter_us, __ATOMIC_RELAXED);
+    __atomic_store_n(&jb->stats.target_us, (uint32_t)target_us, __ATOMIC_RELAXED);
+    metricSet(METRIC_AUDIO_JITTER_US, jb->jitter_us);
+    metricSet(METRIC_AUDIO_LATENCY_US, target_us);
+}
+
+int jitterBufferPut(tJitterBuffer *jb, const int16_t *pcm, int frames, uint64_t arrival_us) {
+    uint32_t w = jb->write;
+    uint32_t r = __atomic_load_n(&jb->read, __ATOMIC_ACQUIRE);
+    uint32_t space = jb->capacity - (w - r);
+    uint32_t pos, first;
+
+    if (frames <= 0) return 0;
+    update_target(jb, frames, arrival_us);
+    if ((uint32_t)frames > space) {
+        /* the sink stalled; newest audio goes, the reader never blocks */
+        __atomic_add_fetch(&jb->stats.overruns, 1, __ATOMIC_RELAXED);
+        metricAdd(METRIC_AUDIO_OVERRUNS, 1);
+        frames = space;
+    }
+    pos = w & (jb->capacity - 1);
+    first = jb->capacity - pos;
+    if (first > (uint32_t)frames) first = frames;
+    memcpy(jb->ring + (size_t)pos * jb->channels, pcm,
+           (size_t)first * jb->channels * sizeof(int16_t));
+    memcpy(jb->ring, pcm + (size_t)first * jb->channels,
+           (size_t)(frames - first) * jb->channels * sizeof(int16_t));
+    __atomic_store_n(&jb->write, w + frames, __ATOMIC_RELEASE);
+    return frames;
+}
+
+static void copy_out(const tJitterBuffer *jb, uint32_t r, int16_t *out, int frames) {
+    uint32_t pos = r & (jb->capacity - 1);
+    uint32_t first = jb->capacity - pos;
+
+    if (first > (uint32_t)frames) first = frames;
+    memcpy(out, jb->ring + (size_t)pos * jb->channels,
+           (size_t)first * jb->channels * sizeof(int16_t));
+    memcpy(out + (size_t)first * jb->channels, jb->ring,
+           (size_t)(frames - first) * jb->channels * sizeof(int16_t));
+}
+
+int jitterBufferGet(tJitterBuffer *jb, int16_t *out, int frames) {
+    uint32_t r = jb->read;
+    uint32_t level = __atomic_load_n(&jb->write, __ATOMIC_ACQUIRE) - r;
+    uint32_t target = __atomic_load_n(&jb->target_frames, __ATOMIC_RELAXED);
+    int64_t band = frames / 2;
+    int ch = jb->channels;
+
+    if (!jb->playing) {
+        if (level < target || level < (uint32_t)frames)
+            return 0;
+        jb->playing = 1;
+        jb->level_avg = (int64_t)level * 16;
+    }
+
+    if (level < (uint32_t)frames) {
+        copy_out(jb, r, out, level);
+        memset(out + (size_t)level * ch, 0, (size_t)(frames - level) * ch * sizeof(int16_t));
+        __atomic_store_n(&jb->read, r + level, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&jb->stats.underruns, 1, __ATOMIC_RELAXED);
+        metricAdd(METRIC_AUDIO_UNDERRUNS, 1);
+        jb->playing = 0;
+        return frames;
+    }
+
+    /* at most one frame per period, well above any crystal drift */
+    jb->level_avg += (int64_t)level - jb->level_avg / 16;
+    if (jb->level_avg / 16 > (int64_t)target + band && level > (uint32_t)frames) {
+        copy_out(jb, r, out, frames);
+        r += frames + 1;
+        __atomic_add_fetch(&jb->stats.dropped_frames, 1, __ATOMIC_RELAXED);
+        metricAdd(METRIC_AUDIO_DROPPED_FRAMES, 1);
+    } else if (jb->level_avg / 16 < (int64_t)target - band && frames > 1) {
+        copy_out(jb, r, out, frames - 1);
+        memcpy(out + (size_t)(frames - 1) * ch, out + (size_t)(frames - 2) * ch,
+               ch * sizeof(int16_t));
+        r += frames - 1;
+        __atomic_add_fetch(&jb->stats.inserted_frames, 1, __ATOMIC_RELAXED);
+        metricAdd(METRIC_AUDIO_INSERTED_FRAMES, 1);
+    } else {
+        copy_out(jb, r, out, frames);
+        r += frames;
+    }
+    __atomic_store_n(&jb->read, r, __ATOMIC_RELEASE);
+    return frames;
+}
+
+void jitterBufferStats(const tJitterBuffer *jb, tJitterStats *stats) {
+    stats->underruns = __atomic_load_n(&jb->stats.underruns, __ATOMIC_RELAXED);
+    stats->overruns = __atomic_load_n(&jb->stats.overruns, __ATOMIC_RELAXED);
+    stats->dropped_frames = __atomic_load_n(&jb->stats.dropped_frames, __ATOMIC_RELAXED);
+    stats->inserted_frames = __atomic_load_n(&jb->stats.inserted_frames, __ATOMIC_RELAXED);
+    stats->jitter_us = __atomic_load_n(&jb->stats.jitter_us, __ATOMIC_RELAXED);
+    stats->target_us = __atomic_load_n(&jb->stats.target_us, __ATOMIC_RELAXED);
+    stats->level_frames = __atomic_load_n(&jb->write, __ATOMIC_ACQUIRE) -
+                          __atomic_load_n(&jb->read, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,638 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "bluetooth_media.h"
+#include "bluetooth_common.h"
+#include "bluetooth_dbus_stubs.h"
+#include "bluetooth_event.h"
+#include "bluetooth_audio.h"
+#include "bluetooth_discovery.h"
+
+typedef enum {
+    PLAYER_CTR_PLAY,
+    PLAYER_CTR_PAUSE,
+    PLAYER_CTR_STOP,
+    PLAYER_CTR_NEXT,
+    PLAYER_CTR_PREVIOUS,
+    PLAYER_CTR_FASTFORWARD,
+    PLAYER_CTR_REWIND,
+    PLAYER_CTR_VOLUME_UP,
+    PLAYER_CTR_VOLUME_DOWN,
+    PLAYER_CTR_INVALID,
+}PlayerCtlOpt;
+
+static const char * player_ctl_names[PLAYER_CTR_INVALID] = {
+    "Play", "Pause", "Stop", "Next", "Previous", "FastForward", "Rewind",
+    "VolumeUp", "VolumeDown"
+};
+
+/* MediaPlayer1 calls, volume goes through the transport instead */
+static DBusMessage *(*const player_ctl_calls[PLAYER_CTR_VOLUME_UP])(const char *path) = {
+    bluez_media_player1_play_new, bluez_media_player1_pause_new,
+    bluez_media_player1_stop_new, bluez_media_player1_next_new,
+    bluez_media_player1_previous_new, bluez_media_player1_fast_forward_new,
+    bluez_media_player1_rewind_new
+};
+
+#define MEDIA_QUEUE_SIZE 8
+#define MEDIA_PATH_SIZE  128
+
+/* a queued command; skips are stored as PLAYER_CTR_NEXT with a signed count */
+typedef struct {
+    int opt;
+    int count;
+} tMediaCmd;
+
+/* last published value of one schema property; strings are compared by
+ * hash, and against the copy only when the hashes match */
+typedef struct {
+    int valid;
+    int int_val;
+    uint32_t str_hash;
+    char *str_val;
+} tMediaProp;
+
+typedef struct {
+    int used;
+    uint32_t generation;
+    DBusConnection *conn;
+    char device[MEDIA_PATH_SIZE];
+    char player[MEDIA_PATH_SIZE];
+    char transport[MEDIA_PATH_SIZE];
+    /* player commands */
+    int in_flight;
+    int queued;
+    tMediaCmd queue[MEDIA_QUEUE_SIZE];
+    /* transport volume */
+    int volume;             /* last confirmed, -1 unknown */
+    int volume_target;      /* waiting to be sent, -1 none */
+    int volume_sent;        /* in flight, -1 none */
+    /* change tracking */
+    tMediaProp player_props[MEDIA_PLAYER_NUM_PROPERTIES];
+    tMediaProp transport_props[MEDIA_TRANSPORT_NUM_PROPERTIES];
+    uint32_t track_hash;
+    char *track_strings;    /* title, artist, album, genre, each terminated */
+    uint32_t track_duration;
+    uint32_t track_number;
+    int playing;
+    uint64_t position_us;   /* when Position was last published, 0 forces */
+    /* transport stream parameters */
+    int codec;
+    uint8_t config[MEDIA_CONFIG_SIZE];
+    int config_len;
+    char state[16];
+} tMediaPlayer;
+
+/* commands come from any thread, replies from the event loop */
+static pthread_mutex_t g_media_mutex = PTHREAD_MUTEX_INITIALIZER;
+static tMediaPlayer g_players[MEDIA_MAX_PLAYERS];
+static uint32_t g_media_generation = 0;
+
+/* /org/bluez/hci0/dev_XX_XX_XX_XX_XX_XX/player0 -> /org/bluez/hci0/dev_XX_... */
+static int device_of(const char *path, char *device, size_t size) {
+    const char *dev = strstr(path, "/dev_");
+    const char *end;
+    size_t len;
+
+    if (!dev) return -1;
+    end = strchr(dev + 1, '/');
+    len = end ? (size_t)(end - path) : strlen(path);
+    if (len >= size) return -1;
+    memcpy(device, path, len);
+    device[len] = '\0';
+    return 0;
+}
+
+static tMediaPlayer * find_player(const char *device, int create) {
+    tMediaPlayer *free_slot = NULL;
+    int i;
+
+    for (i = 0; i < MEDIA_MAX_PLAYERS; i++) {
+        if (g_players[i].used && !strcmp(g_players[i].device, device))
+            return &g_players[i];
+        if (!g_players[i].used && !free_slot)
+            free_slot = &g_players[i];
+    }
+    if (!create || !free_slot)
+        return NULL;
+
+    memset(free_slot, 0, sizeof(*free_slot));
+    free_slot->used = 1;
+    free_slot->generation = ++g_media_generation;
+    free_slot->volume = free_slot->volume_target = free_slot->volume_sent = -1;
+    snprintf(free_slot->device, sizeof(free_slot->device), "%s", device);
+    return free_slot;
+}
+
+/* the reply carries the slot and generation, the entry may be gone by then */
+static tMediaPlayer * player_from_reply(void *user, void *nat) {
+    long slot = (long)user;
+    tMediaPlayer *p;
+
+    if (slot < 0 || slot >= MEDIA_MAX_PLAYERS)
+        return NULL;
+    p = &g_players[slot];
+    if (!p->used || p->generation != (uint32_t)(long)nat)
+        return NULL;
+    return p;
+}
+
+static int reply_failed(DBusMessage *msg) {
+    DBusError err;
+    dbus_error_init(&err);
+    if (dbus_set_error_from_message(&err, msg)) {
+        LOG_AND_FREE_DBUS_ERROR(&err);
+        return 1;
+    }
+    return 0;
+}
+
+static void flush_player(tMediaPlayer *p);
+static void flush_volume(tMediaPlayer *p);
+
+static void onPlayerCommandResult(DBusMessage *msg, void *user, void *nat) {
+    tMediaPlayer *p;
+
+    reply_failed(msg);
+    pthread_mutex_lock(&g_media_mutex);
+    p = player_from_reply(user, nat);
+    if (p) {
+        if (p->in_flight > 0) p->in_flight--;
+        flush_player(p);
+    }
+    pthread_mutex_unlock(&g_media_mutex);
+}
+
+static void onVolumeResult(DBusMessage *msg, void *user, void *nat) {
+    int failed = reply_failed(msg);
+    tMediaPlayer *p;
+
+    pthread_mutex_lock(&g_media_mutex);
+    p = player_from_reply(user, nat);
+    if (p) {
+        if (!failed) p->volume = p->volume_sent;
+        p->volume_sent = -1;
+        flush_volume(p);
+    }
+    pthread_mutex_unlock(&g_media_mutex);
+}
+
+static int send_player_command(tMediaPlayer *p, int opt) {
+    DBusMessage *msg = player_ctl_calls[opt](p->player);
+    dbus_bool_t ret;
+
+    if (!msg) return -1;
+    ret = dbus_message_send_async(p->conn, msg, MEDIA_COMMAND_TIMEOUT_MS,
+                                  onPlayerCommandResult,
+                                  (void *)(long)(p - g_players),
+                                  (void *)(long)p->generation);
+    dbus_message_unref(msg);
+    if (!ret) return -1;
+    p->in_flight++;
+    return 0;
+}
+
+/* send the head of the queue unless a command is still in flight */
+static void flush_player(tMediaPlayer *p) {
+    tMediaCmd cmd;
+    int i, n;
+
+    while (p->in_flight == 0 && p->queued > 0 && p->player[0]) {
+        cmd = p->queue[0];
+        memmove(&p->queue[0], &p->queue[1], (p->queued - 1) * sizeof(tMediaCmd));
+        p->queued--;
+
+        if (cmd.opt == PLAYER_CTR_NEXT) {
+            /* Next/Previous presses that cancelled out send nothing */
+            n = cmd.count < 0 ? -cmd.count : cmd.count;
+            for (i = 0; i < n; i++)
+                send_player_command(p, cmd.count < 0 ? PLAYER_CTR_PREVIOUS
+                                                      : PLAYER_CTR_NEXT);
+        } else {
+            send_player_command(p, cmd.opt);
+        }
+    }
+}
+
+static void flush_volume(tMediaPlayer *p) {
+    dbus_uint16_t volume;
+
+    if (p->volume_sent >= 0 || p->volume_target < 0 || !p->transport[0])
+        return;
+    volume = p->volume_target;
+    if (dbus_set_property_async(p->conn, MEDIA_COMMAND_TIMEOUT_MS,
+                                onVolumeResult,
+                                (void *)(long)(p - g_players),
+                                (void *)(long)p->generation,
+                                p->transport, MEDIA_TRANSPORT_IFC, "Volume",
+                                DBUS_TYPE_UINT16, &volume)) {
+        p->volume_sent = p->volume_target;
+        p->volume_target = -1;
+    }
+}
+
+static void enqueue_command(tMediaPlayer *p, int opt) {
+    tMediaCmd *tail = p->queued ? &p->queue[p->queued - 1] : NULL;
+    int delta = 0;
+
+    if (opt == PLAYER_CTR_NEXT || opt == PLAYER_CTR_PREVIOUS) {
+        delta = opt == PLAYER_CTR_NEXT ? 1 : -1;
+        opt = PLAYER_CTR_NEXT;
+        if (tail && tail->opt == PLAYER_CTR_NEXT) {
+            tail->count += delta;
+            return;
+        }
+    } else if (tail && tail->opt <= PLAYER_CTR_STOP && opt <= PLAYER_CTR_STOP) {
+        /* play/pause/stop: only the last request matters */
+        tail->opt = opt;
+        return;
+    } else if (tail && tail->opt == opt) {
+        return;
+    }
+
+    if (p->queued == MEDIA_QUEUE_SIZE)
+        p->queued--;
+    p->queue[p->queued].opt = opt;
+    p->queue[p->queued].count = delta;
+    p->queued++;
+}
+
+int mediaPlayerCommand(DBusConnection *conn, const char *device_path,
+                       const char *func) {
+    tMediaPlayer *p;
+    int opt, base, ret = -1;
+
+    if (!conn || !device_path || !func) return -1;
+    for (opt = 0; opt < PLAYER_CTR_INVALID; opt++) {
+        if (!strcmp(func, player_ctl_names[opt])) break;
+    }
+    if (opt == PLAYER_CTR_INVALID) {
+        printf("%s: unknown command %s\n", __FUNCTION__, func);
+        return -1;
+    }
+
+    pthread_mutex_lock(&g_media_mutex);
+    p = find_player(device_path, 0);
+    if (!p) {
+        printf("%s: no player known for %s\n", __FUNCTION__, device_path);
+        goto done;
+    }
+    p->conn = conn;
+
+    if (opt == PLAYER_CTR_VOLUME_UP || opt == PLAYER_CTR_VOLUME_DOWN) {
+        if (!p->transport[0]) goto done;
+        /* steps accumulate on the newest target, not the confirmed value */
+        base = p->volume_target >= 0 ? p->volume_target :
+               p->volume_sent >= 0 ? p->volume_sent :
+               p->volume >= 0 ? p->volume : MEDIA_VOLUME_MAX / 2;
+        base += opt == PLAYER_CTR_VOLUME_UP ? MEDIA_VOLUME_STEP : -MEDIA_VOLUME_STEP;
+        p->volume_target = base < 0 ? 0 : base > MEDIA_VOLUME_MAX ? MEDIA_VOLUME_MAX : base;
+        flush_volume(p);
+    } else {
+        if (!p->player[0]) goto done;
+        enqueue_command(p, opt);
+        flush_player(p);
+    }
+    ret = 0;
+done:
+    pthread_mutex_unlock(&g_media_mutex);
+    return ret;
+}
+
+int mediaSetVolume(DBusConnection *conn, const char *device_path, int volume) {
+    tMediaPlayer *p;
+    int ret = -1;
+
+    if (!conn || !device_path || volume < 0 || volume > MEDIA_VOLUME_MAX)
+        return -1;
+    pthread_mutex_lock(&g_media_mutex);
+    p = find_player(device_path, 0);
+    if (p && p->transport[0]) {
+        p->conn = conn;
+        p->volume_target = volume;
+        flush_volume(p);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&g_media_mutex);
+    return ret;
+}
+
+static uint64_t monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* FNV-1a */
+static uint32_t hash_str(uint32_t h, const char *str) {
+    if (!str) return h;
+    while (*str) {
+        h ^= (unsigned char)*str++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t hash_track(const t_media_track *track) {
+    uint32_t h = 2166136261u;
+    h = hash_str(h, track->title);
+    h = hash_str(h, track->artist);
+    h = hash_str(h, track->album);
+    h = hash_str(h, track->genre);
+    h ^= track->duration;
+    h *= 16777619u;
+    h ^= track->track_number;
+    h *= 16777619u;
+    return h ? h : 1;
+}
+
+static void reset_props(tMediaProp *props, int num) {
+    int i;
+
+    for (i = 0; i < num; i++)
+        free(props[i].str_val);
+    memset(props, 0, num * sizeof(*props));
+}
+
+static void reset_track(tMediaPlayer *p) {
+    free(p->track_strings);
+    p->track_strings = NULL;
+    p->track_hash = 0;
+}
+
+/* same hash is not enough, a collision would hide the change */
+static int same_string(const tMediaProp *prop, uint32_t h, const char *str) {
+    return prop->valid && prop->str_hash == h &&
+           !strcmp(prop->str_val ? prop->str_val : "", str ? str : "");
+}
+
+static int same_track(const tMediaPlayer *p, uint32_t h, const t_media_track *track) {
+    const char *fields[] = { track->title, track->artist, track->album, track->genre };
+    const char *s = p->track_strings;
+    int i;
+
+    if (!s || p->track_hash != h || p->track_duration != track->duration ||
+        p->track_number != track->track_number)
+        return 0;
+    for (i = 0; i < 4; i++) {
+        if (strcmp(s, fields[i] ? fields[i] : ""))
+            return 0;
+        s += strlen(s) + 1;
+    }
+    return 1;
+}
+
+static void keep_track(tMediaPlayer *p, uint32_t h, const t_media_track *track) {
+    const char *fields[] = { track->title, track->artist, track->album, track->genre };
+    size_t len[4], total = 0;
+    char *s;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        len[i] = fields[i] ? strlen(fields[i]) : 0;
+        total += len[i] + 1;
+    }
+    reset_track(p);
+    p->track_hash = h;
+    p->track_duration = track->duration;
+    p->track_number = track->track_number;
+    p->track_strings = s = (char *)malloc(total);
+    for (i = 0; s && i < 4; i++) {
+        memcpy(s, fields[i] ? fields[i] : "", len[i] + 1);
+        s += len[i] + 1;
+    }
+}
+
+/*
+* Position ticks every second or faster while playing. Only pass one on when
+* the interval has elapsed or when it is not where playback would have put
+* it (seek, track change).
+*/
+static int position_due(tMediaPlayer *p, tMediaProp *last, uint32_t position) {
+    uint64_t now = monotonic_us();
+    int64_t elapsed_ms, expected, drift;
+
+    if (!last->valid || !p->position_us)
+        goto due;
+    elapsed_ms = (now - p->position_us) / 1000;
+    if (elapsed_ms >= MEDIA_POSITION_INTERVAL_MS)
+        goto due;
+    expected = (uint32_t)last->int_val + (p->playing ? elapsed_ms : 0);
+    drift = (int64_t)position - expected;
+    if (drift > MEDIA_POSITION_SEEK_MS || drift < -MEDIA_POSITION_SEEK_MS)
+        goto due;
+    return 0;
+due:
+    p->position_us = now;
+    return 1;
+}
+
+/*
+* Walk an a{sv} of MediaPlayer1 or MediaTransport1 properties and publish the
+* entries that differ from what was last published. Nothing is copied out of
+* the message: strings are compared by hash and Track is decoded in place.
+*/
+static void track_changes(tMediaPlayer *p, const char *path, int is_player,
+                          DBusMessageIter *props) {
+    Properties *table = is_player ? media_player_properties : media_transport_properties;
+    int num = is_player ? MEDIA_PLAYER_NUM_PROPERTIES : MEDIA_TRANSPORT_NUM_PROPERTIES;
+    tMediaProp *cache = is_player ? p->player_props : p->transport_props;
+    DBusMessageIter dict, entry, value, bytes;
+    u_property_value val;
+    t_media_track track;
+    const char *key;
+    const uint8_t *config;
+    uint32_t h = 0;
+    int idx, len, type, changed;
+
+    if (dbus_message_iter_get_arg_type(props) != DBUS_TYPE_ARRAY)
+        return;
+    dbus_message_iter_recurse(props, &dict);
+    for (; dbus_message_iter_get_arg_type(&dict) == DBUS_TYPE_DICT_ENTRY;
+         dbus_message_iter_next(&dict)) {
+        dbus_message_iter_recurse(&dict, &entry);
+        dbus_message_iter_get_basic(&entry, &key);
+
+        if (!is_player && !strcmp(key, "Configuration")) {
+            /* codec capabilities, kept for whoever acquires the transport */
+            value = entry;
+            dbus_message_iter_next(&value);
+            dbus_message_iter_recurse(&value, &value);
+            if (dbus_message_iter_get_arg_type(&value) == DBUS_TYPE_ARRAY &&
+                dbus_message_iter_get_element_type(&value) == DBUS_TYPE_BYTE) {
+                dbus_message_iter_recurse(&value, &bytes);
+                dbus_message_iter_get_fixed_array(&bytes, &config, &len);
+                if (len > MEDIA_CONFIG_SIZE) len = MEDIA_CONFIG_SIZE;
+                memcpy(p->config, config, len);
+                p->config_len = len;
+            }
+            continue;
+        }
+        if (is_player) {
+            if (!strcmp(key, "Track")) {
+                value = entry;
+                dbus_message_iter_next(&value);
+                dbus_message_iter_recurse(&value, &value);
+                if (parse_media_track(&value, &track) == 0 &&
+                    !same_track(p, h = hash_track(&track), &track)) {
+                    /* a new track restarts Position, let the next one through */
+                    if (p->track_hash)
+                        p->position_us = 0;
+                    keep_track(p, h, &track);
+                    publishMediaTrack(path, &track);
+                }
+                continue;
+            }
+        }
+
+        /* unknown names and type mismatches are skipped, not fatal */
+        if (get_property(entry, table, num, &idx, &val, &len) < 0)
+            continue;
+        type = table[idx].type;
+        if (type == DBUS_TYPE_ARRAY) {
+            if (val.array_val) free(val.array_val);
+            continue;
+        }
+        if (type == DBUS_TYPE_STRING || type == DBUS_TYPE_OBJECT_PATH) {
+            h = hash_str(2166136261u, val.str_val);
+            changed = !same_string(&cache[idx], h, val.str_val);
+        } else {
+            changed = !cache[idx].valid || cache[idx].int_val != val.int_val;
+        }
+        if (!changed)
+            continue;
+        if (is_player && !strcmp(table[idx].name, "Position") &&
+            !position_due(p, &cache[idx], val.int_val))
+            continue;
+
+        cache[idx].valid = 1;
+        cache[idx].int_val = val.int_val;
+        cache[idx].str_hash = h;
+        if (type == DBUS_TYPE_STRING || type == DBUS_TYPE_OBJECT_PATH) {
+            free(cache[idx].str_val);
+            cache[idx].str_val = val.str_val ? strdup(val.str_val) : NULL;
+        }
+
+        if (is_player && !strcmp(table[idx].name, "Status")) {
+            p->playing = !strcmp(val.str_val, "playing");
+            p->position_us = 0;
+            publishMediaStatus(path, val.str_val);
+            continue;
+        }
+        if (!is_player && !strcmp(table[idx].name, "Volume"))
+            p->volume = val.int_val;
+        if (!is_player && !strcmp(table[idx].name, "Codec"))
+            p->codec = val.int_val;
+        if (!is_player && !strcmp(table[idx].name, "State")) {
+            snprintf(p->state, sizeof(p->state), "%s", val.str_val);
+            audioTransportState(p->device, path, val.str_val);
+            discoveryTransportState(path, val.str_val);
+        }
+        publishProperty(path, table[idx].name, type,
+                        type == DBUS_TYPE_STRING || type == DBUS_TYPE_OBJECT_PATH ?
+                        0 : val.int_val,
+                        type == DBUS_TYPE_STRING || type == DBUS_TYPE_OBJECT_PATH ?
+                        val.str_val : NULL);
+    }
+}
+
+void mediaObjectAdded(const char *path, const char *ifc, DBusMessageIter *props) {
+    char device[MEDIA_PATH_SIZE];
+    tMediaPlayer *p;
+
+    if (device_of(path, device, sizeof(device)) < 0)
+        return;
+
+    pthread_mutex_lock(&g_media_mutex);
+    p = find_player(device, 1);
+    if (!p) {
+        printf("%s: player table full, ignoring %s\n", __FUNCTION__, path);
+    } else if (!strcmp(ifc, MEDIA_PLAYER_IFC)) {
+        if (strcmp(p->player, path)) {
+            reset_props(p->player_props, MEDIA_PLAYER_NUM_PROPERTIES);
+            reset_track(p);
+            p->playing = 0;
+            p->position_us = 0;
+        }
+        snprintf(p->player, sizeof(p->player), "%s", path);
+        if (props) track_changes(p, path, 1, props);
+        p->in_flight = 0;
+        flush_player(p);
+    } else if (!strcmp(ifc, MEDIA_TRANSPORT_IFC)) {
+        if (strcmp(p->transport, path)) {
+            reset_props(p->transport_props, MEDIA_TRANSPORT_NUM_PROPERTIES);
+            p->codec = -1;
+            p->config_len = 0;
+            p->state[0] = '\0';
+        }
+        snprintf(p->transport, sizeof(p->transport), "%s", path);
+        if (props) track_changes(p, path, 0, props);
+    }
+    pthread_mutex_unlock(&g_media_mutex);
+}
+
+void mediaObjectRemoved(const char *path, const char *ifc) {
+    char device[MEDIA_PATH_SIZE];
+    tMediaPlayer *p;
+
+    if (device_of(path, device, sizeof(device)) < 0)
+        return;
+
+    pthread_mutex_lock(&g_media_mutex);
+    p = find_player(device, 0);
+    if (p) {
+        if (!strcmp(ifc, MEDIA_PLAYER_IFC) && !strcmp(p->player, path)) {
+            p->player[0] = '\0';
+            p->queued = 0;
+            reset_props(p->player_props, MEDIA_PLAYER_NUM_PROPERTIES);
+            reset_track(p);
+        } else if (!strcmp(ifc, MEDIA_TRANSPORT_IFC) && !strcmp(p->transport, path)) {
+            p->transport[0] = '\0';
+            p->volume = p->volume_target = -1;
+            reset_props(p->transport_props, MEDIA_TRANSPORT_NUM_PROPERTIES);
+            audioTransportState(p->device, path, "idle");
+            discoveryTransportState(path, "idle");
+        }
+        if (!p->player[0] && !p->transport[0])
+            p->used = 0;
+    }
+    pthread_mutex_unlock(&g_media_mutex);
+}
+
+void mediaPropertiesChanged(const char *path, const char *ifc,
+                            DBusMessageIter *changed) {
+    char device[MEDIA_PATH_SIZE];
+    tMediaPlayer *p;
+
+    if (device_of(path, device, sizeof(device)) < 0)
+        return;
+
+    pthread_mutex_lock(&g_media_mutex);
+    p = find_player(device, 0);
+    if (p && !strcmp(ifc, MEDIA_PLAYER_IFC) && !strcmp(p->player, path))
+        track_changes(p, path, 1, changed);
+    else if (p && !strcmp(ifc, MEDIA_TRANSPORT_IFC) && !strcmp(p->transport, path))
+        track_changes(p, path, 0, changed);
+    pthread_mutex_unlock(&g_media_mutex);
+}
+
+int mediaGetTransport(const char *device_path, tMediaTransport *transport) {
+    tMediaPlayer *p;
+    int ret = -1;
+
+    pthread_mutex_lock(&g_media_mutex);
+    p = find_player(device_path, 0);
+    if (p && p->transport[0]) {
+        snprintf(transport->path, sizeof(transport->path), "%s", p->transport);
+        snprintf(transport->state, sizeof(transport->state), "%s", p->state);
+        transport->codec = p->codec;
+        memcpy(transport->config, p->config, p->config_len);
+        transport->config_len = p->config_len;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&g_media_mutex);
+    return ret;
+}
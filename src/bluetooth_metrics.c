@@ -0,0 +1,65 @@
+#include <stdio.h>
+
+#include "bluetooth_metrics.h"
+
+static const char * const metric_names[METRIC_MAX] = {
+    "audio_underruns",
+    "audio_overruns",
+    "audio_dropped_frames",
+    "audio_inserted_frames",
+    "audio_jitter_us",
+    "audio_latency_us",
+    "profile_connections",
+    "profile_rx_bytes",
+    "profile_tx_bytes",
+    "gatt_notify_packets",
+    "gatt_notify_bytes",
+    "gatt_write_bytes",
+    "gatt_reads",
+    "gatt_read_failures",
+    "gatt_read_latency_us",
+    "gatt_read_connections",
+    "adv_records",
+    "adv_malformed",
+    "presence_devices",
+    "discovery_scan_ms",
+    "discovery_held_ms",
+    "device_gc_removed",
+    "device_gc_objects",
+};
+
+static uint64_t g_metrics[METRIC_MAX];
+
+void metricAdd(int id, uint64_t n) {
+    if (id >= 0 && id < METRIC_MAX)
+        __atomic_add_fetch(&g_metrics[id], n, __ATOMIC_RELAXED);
+}
+
+void metricSet(int id, uint64_t value) {
+    if (id >= 0 && id < METRIC_MAX)
+        __atomic_store_n(&g_metrics[id], value, __ATOMIC_RELAXED);
+}
+
+uint64_t metricGet(int id) {
+    if (id < 0 || id >= METRIC_MAX) return 0;
+    return __atomic_load_n(&g_metrics[id], __ATOMIC_RELAXED);
+}
+
+int formatMetrics(char *buf, size_t size) {
+    size_t len = 0;
+    int i, n;
+
+    if (!size) return 0;
+    buf[0] = '\0';
+    for (i = 0; i < METRIC_MAX; i++) {
+        n = snprintf(buf + len, size - len, "%s %llu\n", metric_names[i],
+                     (unsigned long long)metricGet(i));
+        /* whole lines only */
+        if (n < 0 || (size_t)n >= size - len) {
+            buf[len] = '\0';
+            break;
+        }
+        len += n;
+    }
+    return len;
+}
@@ -0,0 +1,333 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+
+#include "bluetooth_presence.h"
+#include "bluetooth_timerwheel.h"
+#include "bluetooth_eventloop.h"
+#include "bluetooth_event.h"
+#include "bluetooth_metrics.h"
+
+#define DEVICE_PATH_SIZE    64
+/* path hash -> device + 1, 0 is empty; half full at most */
+#define INDEX_SIZE          (PRESENCE_MAX_DEVICES * 2)
+#define INDEX_MASK          (INDEX_SIZE - 1)
+
+typedef struct {
+    tTimerNode timer;       /* first, fired nodes are cast back */
+    uint32_t hash;
+    int present;
+    int16_t rssi;
+    uint64_t last_seen;     /* tick */
+    int next_free;
+    char path[DEVICE_PATH_SIZE];
+} tPresenceDevice;
+
+/* updates and the timer run on the event loop, the lock is for the API */
+static pthread_mutex_t g_presence_lock = PTHREAD_MUTEX_INITIALIZER;
+static int g_running = 0;
+static tPresenceConfig g_config;
+static uint64_t g_timeout_ticks;
+static tTimerWheel g_wheel;
+static tPresenceDevice g_devices[PRESENCE_MAX_DEVICES];
+static uint16_t g_index[INDEX_SIZE];
+static int g_free = -1;
+static int g_timer_fd = -1;
+static uint64_t g_start_us = 0;
+static uint64_t g_armed = UINT64_MAX;   /* tick the timerfd goes off at */
+static tPresenceStats g_stats;
+
+static uint64_t monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t now_tick(void) {
+    return (monotonic_us() - g_start_us) / (PRESENCE_TICK_MS * 1000);
+}
+
+/* lock held; the timerfd follows the earliest tick the wheel needs */
+static void rearm(void) {
+    struct itimerspec its;
+    uint64_t next = timerWheelNextTick(&g_wheel), abs_us;
+
+    if (next == g_armed || g_timer_fd < 0)
+        return;
+    g_armed = next;
+    memset(&its, 0, sizeof(its));
+    if (next != UINT64_MAX) {
+        abs_us = g_start_us + next * PRESENCE_TICK_MS * 1000;
+        its.it_value.tv_sec = abs_us / 1000000;
+        its.it_value.tv_nsec = (abs_us % 1000000) * 1000;
+    }
+    timerfd_settime(g_timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static uint32_t path_hash(const char *path) {
+    uint32_t h = 2166136261u;
+
+    while (*path)
+        h = (h ^ (uint8_t)*path++) * 16777619u;
+    return h;
+}
+
+/* lock held; index slot of the device, or of the empty slot it would take */
+static int find_index(const char *path, uint32_t hash) {
+    int i = hash & INDEX_MASK;
+    tPresenceDevice *d;
+
+    while (g_index[i]) {
+        d = &g_devices[g_index[i] - 1];
+        if (d->hash == hash && !strcmp(d->path, path))
+            break;
+        i = (i + 1) & INDEX_MASK;
+    }
+    return i;
+}
+
+/* lock held; backward shift so probes never need tombstones */
+static void drop_index(int i) {
+    int j = i, home;
+
+    for (;;) {
+        j = (j + 1) & INDEX_MASK;
+        if (!g_index[j])
+            break;
+        home = g_devices[g_index[j] - 1].hash & INDEX_MASK;
+        /* j can move to i unless its home lies cyclically in (i, j] */
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+            g_index[i] = g_index[j];
+            i = j;
+        }
+    }
+    g_index[i] = 0;
+}
+
+static void publish(const tPresenceDevice *d, uint64_t tick) {
+    g_stats.present += d->present ? 1 : -1;
+    if (d->present)
+        g_stats.enters++;
+    else
+        g_stats.leaves++;
+    metricSet(METRIC_PRESENCE_DEVICES, g_stats.present);
+    publishPresence(d->path, d->present, d->rssi,
+                    (uint32_t)(tick - d->last_seen) * PRESENCE_TICK_MS);
+}
+
+/* lock held; the timer is no longer pending */
+static void forget(tPresenceDevice *d) {
+    drop_index(find_index(d->path, d->hash));
+    d->next_free = g_free;
+    g_free = d - g_devices;
+    g_stats.tracked--;
+}
+
+static void on_expired(tTimerNode *node, void *user) {
+    tPresenceDevice *d = (tPresenceDevice *)node;
+    uint64_t tick = *(uint64_t *)user;
+
+    g_stats.expiries++;
+    if (tick - d->last_seen < g_timeout_ticks) {
+        /* seen since it was scheduled */
+        timerWheelAdd(&g_wheel, &d->timer, d->last_seen + g_timeout_ticks);
+        return;
+    }
+    if (d->present) {
+        d->present = 0;
+        publish(d, tick);
+    }
+    forget(d);
+}
+
+static void on_timer(int fd, short revents, void *data) {
+    uint64_t expirations, tick;
+
+    read(fd, &expirations, sizeof(expirations));
+    pthread_mutex_lock(&g_presence_lock);
+    if (g_running) {
+        tick = now_tick();
+        timerWheelAdvance(&g_wheel, tick, on_expired, &tick);
+        g_armed = UINT64_MAX;
+        rearm();
+    }
+    pthread_mutex_unlock(&g_presence_lock);
+}
+
+void presenceDeviceUpdate(const char *device_path, t_property_value_array *array) {
+    t_property_value *value;
+    tPresenceDevice *d;
+    uint64_t tick;
+    int i, seen = 0, has_rssi = 0, idx;
+    int16_t rssi = 0;
+    uint32_t hash;
+    static int full_logged = 0;
+
+    if (!__atomic_load_n(&g_running, __ATOMIC_RELAXED) || !array || !array->head)
+        return;
+    for (i = 0; i < array->num; i++) {
+        value = &array->head[i];
+        if (value->type == DBUS_TYPE_INT16 && !strcmp(value->name, "RSSI")) {
+            rssi = (int16_t)value->val.int_val;
+            has_rssi = seen = 1;
+        } else if (value->type == DBUS_TYPE_DICT_ENTRY &&
+                   (!strcmp(value->name, "ManufacturerData") ||
+                    !strcmp(value->name, "ServiceData"))) {
+            seen = 1;
+        }
+    }
+    if (!seen || strlen(device_path) >= DEVICE_PATH_SIZE)
+        return;
+
+    hash = path_hash(device_path);
+    pthread_mutex_lock(&g_presence_lock);
+    if (!g_running)
+        goto done;
+    tick = now_tick();
+    g_stats.sightings++;
+    idx = find_index(device_path, hash);
+    if (g_index[idx]) {
+        d = &g_devices[g_index[idx] - 1];
+    } else {
+        if (g_free < 0) {
+            if (!full_logged++)
+                printf("%s: device table full\n", __FUNCTION__);
+            goto done;
+        }
+        d = &g_devices[g_free];
+        g_free = d->next_free;
+        memset(d, 0, sizeof(*d));
+        d->hash = hash;
+        d->rssi = PRESENCE_RSSI_UNSET;
+        strcpy(d->path, device_path);
+        g_index[idx] = d - g_devices + 1;
+        g_stats.tracked++;
+        timerWheelAdd(&g_wheel, &d->timer, tick + g_timeout_ticks);
+        rearm();
+    }
+    /* the timer is left alone, it catches up when it fires */
+    d->last_seen = tick;
+    if (has_rssi)
+        d->rssi = rssi;
+
+    if (!d->present) {
+        if (g_config.enter_rssi == PRESENCE_RSSI_UNSET ||
+            (d->rssi != PRESENCE_RSSI_UNSET && d->rssi >= g_config.enter_rssi)) {
+            d->present = 1;
+            publish(d, tick);
+        }
+    } else if (has_rssi && g_config.leave_rssi != PRESENCE_RSSI_UNSET &&
+               rssi < g_config.leave_rssi) {
+        d->present = 0;
+        publish(d, tick);
+    }
+done:
+    pthread_mutex_unlock(&g_presence_lock);
+}
+
+void presenceDeviceRemoved(const char *device_path) {
+    tPresenceDevice *d;
+    int idx;
+
+    if (!__atomic_load_n(&g_running, __ATOMIC_RELAXED))
+        return;
+    pthread_mutex_lock(&g_presence_lock);
+    idx = find_index(device_path, path_hash(device_path));
+    if (g_running && g_index[idx]) {
+        d = &g_devices[g_index[idx] - 1];
+        timerWheelRemove(&g_wheel, &d->timer);
+        if (d->present) {
+            d->present = 0;
+            publish(d, now_tick());
+        }
+        forget(d);
+    }
+    pthread_mutex_unlock(&g_presence_lock);
+}
+
+static void reset_devices(void) {
+    int i;
+
+    memset(g_index, 0, sizeof(g_index));
+    for (i = 0; i < PRESENCE_MAX_DEVICES; i++)
+        g_devices[i].next_free = i + 1 < PRESENCE_MAX_DEVICES ? i + 1 : -1;
+    g_free = 0;
+}
+
+int presenceStart(const tPresenceConfig *config) {
+    int ret = 0;
+
+    if (!config || (config->enter_rssi != PRESENCE_RSSI_UNSET &&
+                    config->leave_rssi != PRESENCE_RSSI_UNSET &&
+                    config->leave_rssi > config->enter_rssi))
+        return -1;
+
+    pthread_mutex_lock(&g_presence_lock);
+    g_config = *config;
+    if (!g_config.timeout_ms)
+        g_config.timeout_ms = PRESENCE_DEFAULT_TIMEOUT_MS;
+    /* devices already scheduled pick it up when their timer fires */
+    g_timeout_ticks = (g_config.timeout_ms + PRESENCE_TICK_MS - 1) / PRESENCE_TICK_MS;
+    if (g_timeout_ticks > TIMER_WHEEL_MAX_DELAY)
+        g_timeout_ticks = TIMER_WHEEL_MAX_DELAY;
+    if (g_running)
+        goto done;
+
+    g_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (g_timer_fd < 0 || addEventLoopFd(g_timer_fd, POLLIN, on_timer, NULL) < 0) {
+        printf("%s: no timer: %s\n", __FUNCTION__, strerror(errno));
+        if (g_timer_fd >= 0) close(g_timer_fd);
+        g_timer_fd = -1;
+        ret = -1;
+        goto done;
+    }
+    g_start_us = monotonic_us();
+    g_armed = UINT64_MAX;
+    timerWheelInit(&g_wheel, 0);
+    reset_devices();
+    memset(&g_stats, 0, sizeof(g_stats));
+    __atomic_store_n(&g_running, 1, __ATOMIC_RELAXED);
+done:
+    pthread_mutex_unlock(&g_presence_lock);
+    return ret;
+}
+
+int presenceDevicePresent(const char *device_path) {
+    int idx, present = 0;
+
+    if (!device_path)
+        return 0;
+    pthread_mutex_lock(&g_presence_lock);
+    idx = find_index(device_path, path_hash(device_path));
+    if (g_running && g_index[idx])
+        present = g_devices[g_index[idx] - 1].present;
+    pthread_mutex_unlock(&g_presence_lock);
+    return present;
+}
+
+void presenceStats(tPresenceStats *stats) {
+    if (!stats) return;
+    pthread_mutex_lock(&g_presence_lock);
+    *stats = g_stats;
+    pthread_mutex_unlock(&g_presence_lock);
+}
+
+void presenceCleanup() {
+    pthread_mutex_lock(&g_presence_lock);
+    if (g_timer_fd >= 0) {
+        closeEventLoopFd(g_timer_fd);
+        g_timer_fd = -1;
+    }
+    __atomic_store_n(&g_running, 0, __ATOMIC_RELAXED);
+    reset_devices();
+    memset(&g_stats, 0, sizeof(g_stats));
+    metricSet(METRIC_PRESENCE_DEVICES, 0);
+    pthread_mutex_unlock(&g_presence_lock);
+}
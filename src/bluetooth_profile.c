@@ -0,0 +1,583 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "bluetooth_profile.h"
+#include "bluetooth_common.h"
+#include "bluetooth_metrics.h"
+
+#define PROFILE_PATH_SIZE    128
+#define PROFILE_WAKE_ID      UINT64_MAX
+
+/* ids are generation << 8 | slot, kept positive */
+#define CONN_ID(slot, gen)   ((int)(((gen) << 8) | (slot)))
+#define CONN_SLOT(id)        ((id) & 0xff)
+#define CONN_GEN(id)         ((uint32_t)(id) >> 8)
+
+typedef struct {
+    int used;
+    int released;           /* bluez called Release */
+    char path[PROFILE_PATH_SIZE];
+    tProfileHandler handler;
+} tProfileObject;
+
+typedef struct {
+    pthread_mutex_t lock;   /* everything below against profileSend */
+    int used;
+    uint32_t generation;
+    int fd;
+    int worker;
+    int object;
+    char device[PROFILE_PATH_SIZE];
+    tProfileHandler handler;    /* copied, the object may go first */
+    uint8_t *rx;
+    struct iovec rx_iov[PROFILE_RX_BUFS];
+    uint8_t *tx;            /* PROFILE_TX_SIZE ring */
+    uint32_t tx_head;
+    uint32_t tx_tail;
+    uint64_t tx_oldest_us;  /* when the ring last went non-empty */
+    int want_out;           /* EPOLLOUT armed */
+    tProfileConnStats stats;    /* rx by the worker (atomics), tx under lock */
+} tProfileConn;
+
+typedef struct {
+    int epfd;
+    int wake_fd;
+    int running;
+    pthread_t thread;
+} tProfileWorker;
+
+/* guards the object table and slot allocation, taken before a conn lock */
+static pthread_mutex_t g_profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+static tProfileObject g_objects[PROFILE_MAX_OBJECTS];
+static tProfileConn g_conns[PROFILE_MAX_CONNECTIONS];
+static tProfileWorker g_workers[PROFILE_WORKERS];
+static int g_workers_started = 0;
+static int g_locks_ready = 0;
+static uint32_t g_conn_generation = 0;
+static unsigned int g_next_worker = 0;
+
+static uint64_t monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* locked and valid, or NULL */
+static tProfileConn * lock_conn(int id) {
+    tProfileConn *c;
+
+    if (id < 0 || CONN_SLOT(id) >= PROFILE_MAX_CONNECTIONS || !g_locks_ready)
+        return NULL;
+    c = &g_conns[CONN_SLOT(id)];
+    pthread_mutex_lock(&c->lock);
+    if (!c->used || c->generation != CONN_GEN(id)) {
+        pthread_mutex_unlock(&c->lock);
+        return NULL;
+    }
+    return c;
+}
+
+static void set_events(tProfileConn *c, int out) {
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLRDHUP | (out ? EPOLLOUT : 0);
+    ev.data.u64 = CONN_ID(c - g_conns, c->generation);
+    epoll_ctl(g_workers[c->worker].epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->want_out = out;
+}
+
+static void release_connection(tProfileConn *c) {
+    tProfileHandler handler;
+    int id;
+
+    pthread_mutex_lock(&c->lock);
+    id = CONN_ID(c - g_conns, c->generation);
+    handler = c->handler;
+    epoll_ctl(g_workers[c->worker].epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c->rx);
+    free(c->tx);
+    c->fd = -1;
+    c->rx = c->tx = NULL;
+    c->used = 0;
+    pthread_mutex_unlock(&c->lock);
+
+    metricAdd(METRIC_PROFILE_CONNECTIONS, (uint64_t)-1);
+    if (handler.disconnected)
+        handler.disconnected(id, handler.user);
+}
+
+static int add_connection(int object, const char *device, int fd) {
+    tProfileConn *c = NULL;
+    struct epoll_event ev;
+    uint8_t *rx, *tx;
+    int i, id, ret;
+
+    rx = malloc(PROFILE_RX_BUFS * PROFILE_RX_BUF_SIZE);
+    tx = malloc(PROFILE_TX_SIZE);
+    if (!rx || !tx)
+        goto fail;
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+        goto fail;
+
+    pthread_mutex_lock(&g_profile_mutex);
+    for (i = 0; g_workers_started && i < PROFILE_MAX_CONNECTIONS; i++) {
+        if (!g_conns[i].used) {
+            c = &g_conns[i];
+            break;
+        }
+    }
+    if (!c) {
+        pthread_mutex_unlock(&g_profile_mutex);
+        printf("%s: no room for %s\n", __FUNCTION__, device);
+        goto fail;
+    }
+    pthread_mutex_lock(&c->lock);
+    c->used = 1;
+    g_conn_generation = (g_conn_generation + 1) & 0x7fffff;
+    if (!g_conn_generation) g_conn_generation = 1;
+    c->generation = g_conn_generation;
+    c->fd = fd;
+    c->worker = g_next_worker++ % PROFILE_WORKERS;
+    c->object = object;
+    snprintf(c->device, sizeof(c->device), "%s", device);
+    c->handler = g_objects[object].handler;
+    c->rx = rx;
+    c->tx = tx;
+    for (i = 0; i < PROFILE_RX_BUFS; i++) {
+        c->rx_iov[i].iov_base = rx + i * PROFILE_RX_BUF_SIZE;
+        c->rx_iov[i].iov_len = PROFILE_RX_BUF_SIZE;
+    }
+    c->tx_head = c->tx_tail = 0;
+    /* the fd isn't in epoll yet, profileSend only marks it */
+    c->want_out = 0;
+    memset(&c->stats, 0, sizeof(c->stats));
+    id = CONN_ID(c - g_conns, c->generation);
+    pthread_mutex_unlock(&c->lock);
+    pthread_mutex_unlock(&g_profile_mutex);
+
+    metricAdd(METRIC_PROFILE_CONNECTIONS, 1);
+    if (c->handler.connected)
+        c->handler.connected(id, device, c->handler.user);
+
+    /* from here on the worker owns the fd; the handler may have queued data */
+    pthread_mutex_lock(&c->lock);
+    ev.events = EPOLLIN | EPOLLRDHUP | (c->want_out ? EPOLLOUT : 0);
+    ev.data.u64 = id;
+    ret = epoll_ctl(g_workers[c->worker].epfd, EPOLL_CTL_ADD, fd, &ev);
+    pthread_mutex_unlock(&c->lock);
+    if (ret < 0) {
+        printf("%s: epoll_ctl: %s\n", __FUNCTION__, strerror(errno));
+        release_connection(c);
+        return -1;
+    }
+    printf("%s: %s fd %d on worker %d\n", __FUNCTION__, device, fd, c->worker);
+    return id;
+
+fail:
+    free(rx);
+    free(tx);
+    close(fd);
+    return -1;
+}
+
+/* drain what the socket has, in PROFILE_RX_BUFS sized batches; -1 to close */
+static int do_read(tProfileConn *c, int id) {
+    struct iovec iov[PROFILE_RX_BUFS];
+    ssize_t n, left;
+    int i, cnt;
+
+    for (i = 0; i < PROFILE_RX_BUDGET; i++) {
+        n = readv(c->fd, c->rx_iov, PROFILE_RX_BUFS);
+        if (n < 0)
+            return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+        if (n == 0)
+            return -1;
+        __atomic_add_fetch(&c->stats.rx_bytes, n, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&c->stats.rx_calls, 1, __ATOMIC_RELAXED);
+        metricAdd(METRIC_PROFILE_RX_BYTES, n);
+
+        if (c->handler.data) {
+            for (cnt = 0, left = n; left > 0; cnt++) {
+                iov[cnt].iov_base = c->rx_iov[cnt].iov_base;
+                iov[cnt].iov_len = left < PROFILE_RX_BUF_SIZE ? left : PROFILE_RX_BUF_SIZE;
+                left -= iov[cnt].iov_len;
+            }
+            c->handler.data(id, iov, cnt, n, c->handler.user);
+        }
+        if (n < PROFILE_RX_BUFS * PROFILE_RX_BUF_SIZE)
+            break;
+    }
+    /* level triggered, anything left brings us back */
+    return 0;
+}
+
+/* one writev of whatever is queued; -1 to close */
+static int do_write(tProfileConn *c) {
+    struct iovec iov[2];
+    uint32_t pending, pos, first;
+    uint64_t latency;
+    ssize_t n;
+    int cnt = 0;
+
+    pthread_mutex_lock(&c->lock);
+    pending = c->tx_head - c->tx_tail;
+    if (!pending) {
+        if (c->want_out) set_events(c, 0);
+        pthread_mutex_unlock(&c->lock);
+        return 0;
+    }
+    pos = c->tx_tail & (PROFILE_TX_SIZE - 1);
+    first = PROFILE_TX_SIZE - pos;
+    if (first > pending) first = pending;
+    iov[cnt].iov_base = c->tx + pos;
+    iov[cnt++].iov_len = first;
+    if (pending > first) {
+        iov[cnt].iov_base = c->tx;
+        iov[cnt++].iov_len = pending - first;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    /* senders only append, the queued bytes stay put without the lock */
+    n = writev(c->fd, iov, cnt);
+    if (n < 0)
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+
+    pthread_mutex_lock(&c->lock);
+    c->tx_tail += n;
+    c->stats.tx_bytes += n;
+    c->stats.tx_calls++;
+    if (c->tx_tail == c->tx_head) {
+        latency = monotonic_us() - c->tx_oldest_us;
+        if (latency > c->stats.tx_latency_max_us)
+            c->stats.tx_latency_max_us = latency;
+        c->stats.tx_latency_sum_us += latency;
+        c->stats.tx_latency_count++;
+        set_events(c, 0);
+    }
+    pthread_mutex_unlock(&c->lock);
+    metricAdd(METRIC_PROFILE_TX_BYTES, n);
+    return 0;
+}
+
+static void * worker_thread(void *arg) {
+    tProfileWorker *w = arg;
+    struct epoll_event events[PROFILE_EPOLL_BATCH];
+    tProfileConn *c;
+    uint32_t ev;
+    int i, n, id, valid;
+
+    while (__atomic_load_n(&w->running, __ATOMIC_ACQUIRE)) {
+        n = epoll_wait(w->epfd, events, PROFILE_EPOLL_BATCH, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            printf("%s: epoll_wait: %s\n", __FUNCTION__, strerror(errno));
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            if (events[i].data.u64 == PROFILE_WAKE_ID)
+                continue;
+            id = (int)events[i].data.u64;
+            ev = events[i].events;
+
+            /* closed earlier in this batch, maybe even reused since */
+            c = lock_conn(id);
+            if (!c) continue;
+            valid = c->fd >= 0;
+            pthread_mutex_unlock(&c->lock);
+            if (!valid) continue;
+
+            if (ev & EPOLLERR) {
+                release_connection(c);
+                continue;
+            }
+            if ((ev & EPOLLIN) && do_read(c, id) < 0) {
+                release_connection(c);
+                continue;
+            }
+            if ((ev & EPOLLOUT) && do_write(c) < 0) {
+                release_connection(c);
+                continue;
+            }
+            /* peer is gone and everything it sent has been read */
+            if ((ev & (EPOLLHUP | EPOLLRDHUP)) && !(ev & EPOLLIN))
+                release_connection(c);
+        }
+    }
+    return NULL;
+}
+
+int startProfileWorkers() {
+    struct epoll_event ev;
+    tProfileWorker *w;
+    int i;
+
+    pthread_mutex_lock(&g_profile_mutex);
+    if (g_workers_started) {
+        pthread_mutex_unlock(&g_profile_mutex);
+        return 0;
+    }
+    if (!g_locks_ready) {
+        for (i = 0; i < PROFILE_MAX_CONNECTIONS; i++) {
+            pthread_mutex_init(&g_conns[i].lock, NULL);
+            g_conns[i].fd = -1;
+        }
+        g_locks_ready = 1;
+    }
+    for (i = 0; i < PROFILE_WORKERS; i++) {
+        w = &g_workers[i];
+        w->epfd = epoll_create1(EPOLL_CLOEXEC);
+        w->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (w->epfd < 0 || w->wake_fd < 0)
+            goto fail;
+        ev.events = EPOLLIN;
+        ev.data.u64 = PROFILE_WAKE_ID;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->wake_fd, &ev) < 0)
+            goto fail;
+        w->running = 1;
+        if (pthread_create(&w->thread, NULL, worker_thread, w)) {
+            w->running = 0;
+            goto fail;
+        }
+    }
+    g_workers_started = 1;
+    pthread_mutex_unlock(&g_profile_mutex);
+    return 0;
+
+fail:
+    printf("%s: failed to start worker %d\n", __FUNCTION__, i);
+    for (; i >= 0; i--) {
+        w = &g_workers[i];
+        if (w->running) {
+            __atomic_store_n(&w->running, 0, __ATOMIC_RELEASE);
+            eventfd_write(w->wake_fd, 1);
+            pthread_join(w->thread, NULL);
+        }
+        if (w->epfd >= 0) close(w->epfd);
+        if (w->wake_fd >= 0) close(w->wake_fd);
+        w->epfd = w->wake_fd = -1;
+    }
+    pthread_mutex_unlock(&g_profile_mutex);
+    return -1;
+}
+
+void stopProfileWorkers() {
+    tProfileWorker *w;
+    int i;
+
+    pthread_mutex_lock(&g_profile_mutex);
+    if (!g_workers_started) {
+        pthread_mutex_unlock(&g_profile_mutex);
+        return;
+    }
+    g_workers_started = 0;
+    pthread_mutex_unlock(&g_profile_mutex);
+
+    for (i = 0; i < PROFILE_WORKERS; i++) {
+        w = &g_workers[i];
+        __atomic_store_n(&w->running, 0, __ATOMIC_RELEASE);
+        eventfd_write(w->wake_fd, 1);
+        pthread_join(w->thread, NULL);
+    }
+    /* no worker left, so nobody else closes these */
+    for (i = 0; i < PROFILE_MAX_CONNECTIONS; i++) {
+        if (g_conns[i].used)
+            release_connection(&g_conns[i]);
+    }
+    for (i = 0; i < PROFILE_WORKERS; i++) {
+        close(g_workers[i].epfd);
+        close(g_workers[i].wake_fd);
+        g_workers[i].epfd = g_workers[i].wake_fd = -1;
+    }
+}
+
+/* the worker sees the hangup and does the actual close */
+static int shutdown_connections(int object, const char *device) {
+    tProfileConn *c;
+    int i, count = 0;
+
+    for (i = 0; i < PROFILE_MAX_CONNECTIONS; i++) {
+        c = &g_conns[i];
+        pthread_mutex_lock(&c->lock);
+        if (c->used && c->object == object &&
+            (!device || !strcmp(c->device, device))) {
+            shutdown(c->fd, SHUT_RDWR);
+            count++;
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
+    return count;
+}
+
+static DBusHandlerResult send_reply(DBusConnection *conn, DBusMessage *msg,
+                                    const char *error, const char *text) {
+    DBusMessage *reply;
+
+    reply = error ? dbus_message_new_error(msg, error, text) :
+                    dbus_message_new_method_return(msg);
+    if (!reply) {
+        printf("%s: Cannot create message reply\n", __FUNCTION__);
+        return DBUS_HANDLER_RESULT_NEED_MEMORY;
+    }
+    dbus_connection_send(conn, reply, NULL);
+    dbus_message_unref(reply);
+    return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static DBusHandlerResult profile_event_filter(DBusConnection *conn,
+                                              DBusMessage *msg, void *data) {
+    int object = (int)(long)data;
+    const char *device = NULL;
+    DBusError err;
+    int fd = -1;
+
+    if (dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_METHOD_CALL)
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+    dbus_error_init(&err);
+    if (dbus_message_is_method_call(msg, PROFILE_IFC, "NewConnection")) {
+        /* the fd properties dict that follows is of no use to us */
+        if (!dbus_message_get_args(msg, &err, DBUS_TYPE_OBJECT_PATH, &device,
+                                   DBUS_TYPE_UNIX_FD, &fd, DBUS_TYPE_INVALID)) {
+            LOG_AND_FREE_DBUS_ERROR(&err);
+            return send_reply(conn, msg, BLUEZ_ERROR_IFC ".InvalidArguments",
+                              "Invalid arguments");
+        }
+        printf("%s: NewConnection %s fd %d\n", __FUNCTION__, device, fd);
+        if (add_connection(object, device, fd) < 0)
+            return send_reply(conn, msg, BLUEZ_ERROR_IFC ".Rejected",
+                              "No room for the connection");
+        return send_reply(conn, msg, NULL, NULL);
+    } else if (dbus_message_is_method_call(msg, PROFILE_IFC, "RequestDisconnection")) {
+        if (!dbus_message_get_args(msg, &err, DBUS_TYPE_OBJECT_PATH, &device,
+                                   DBUS_TYPE_INVALID)) {
+            LOG_AND_FREE_DBUS_ERROR(&err);
+            return send_reply(conn, msg, BLUEZ_ERROR_IFC ".InvalidArguments",
+                              "Invalid arguments");
+        }
+        printf("%s: RequestDisconnection %s\n", __FUNCTION__, device);
+        shutdown_connections(object, device);
+        return send_reply(conn, msg, NULL, NULL);
+    } else if (dbus_message_is_method_call(msg, PROFILE_IFC, "Release")) {
+        printf("%s: Release %s\n", __FUNCTION__, g_objects[object].path);
+        pthread_mutex_lock(&g_profile_mutex);
+        g_objects[object].released = 1;
+        pthread_mutex_unlock(&g_profile_mutex);
+        shutdown_connections(object, NULL);
+        return send_reply(conn, msg, NULL, NULL);
+    }
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+static const DBusObjectPathVTable profile_vtable = {
+    NULL, profile_event_filter, NULL, NULL, NULL, NULL
+};
+
+static int find_object(const char *path) {
+    int i;
+    for (i = 0; i < PROFILE_MAX_OBJECTS; i++) {
+        if (g_objects[i].used && !strcmp(g_objects[i].path, path))
+            return i;
+    }
+    return -1;
+}
+
+int registerProfileObject(DBusConnection *conn, const char *path,
+                          const tProfileHandler *handler) {
+    int i;
+
+    if (!conn || !path || strlen(path) >= PROFILE_PATH_SIZE)
+        return -1;
+    pthread_mutex_lock(&g_profile_mutex);
+    i = find_object(path);
+    if (i < 0) {
+        for (i = 0; i < PROFILE_MAX_OBJECTS && g_objects[i].used; i++);
+        if (i == PROFILE_MAX_OBJECTS ||
+            !dbus_connection_register_object_path(conn, path, &profile_vtable,
+                                                  (void *)(long)i)) {
+            pthread_mutex_unlock(&g_profile_mutex);
+            printf("%s: Can't register object path %s for profile!\n",
+                   __FUNCTION__, path);
+            return -1;
+        }
+        g_objects[i].used = 1;
+        snprintf(g_objects[i].path, sizeof(g_objects[i].path), "%s", path);
+    }
+    /* new connections pick up the handler, open ones keep theirs */
+    g_objects[i].released = 0;
+    if (handler)
+        g_objects[i].handler = *handler;
+    else
+        memset(&g_objects[i].handler, 0, sizeof(g_objects[i].handler));
+    pthread_mutex_unlock(&g_profile_mutex);
+    return 0;
+}
+
+void unregisterProfileObject(DBusConnection *conn, const char *path) {
+    int i;
+
+    pthread_mutex_lock(&g_profile_mutex);
+    i = find_object(path);
+    if (i >= 0) {
+        dbus_connection_unregister_object_path(conn, path);
+        g_objects[i].used = 0;
+    }
+    pthread_mutex_unlock(&g_profile_mutex);
+    if (i >= 0 && g_locks_ready)
+        shutdown_connections(i, NULL);
+}
+
+int profileSend(int id, const void *data, size_t len) {
+    tProfileConn *c = lock_conn(id);
+    uint32_t pos, first;
+
+    if (!c) return -1;
+    if (len > PROFILE_TX_SIZE - (c->tx_head - c->tx_tail)) {
+        c->stats.tx_dropped += len;
+        pthread_mutex_unlock(&c->lock);
+        return -1;
+    }
+    if (c->tx_head == c->tx_tail)
+        c->tx_oldest_us = monotonic_us();
+    pos = c->tx_head & (PROFILE_TX_SIZE - 1);
+    first = PROFILE_TX_SIZE - pos;
+    if (first > len) first = len;
+    memcpy(c->tx + pos, data, first);
+    memcpy(c->tx, (const uint8_t *)data + first, len - first);
+    c->tx_head += len;
+    /* the worker writes once the socket can take it */
+    if (!c->want_out)
+        set_events(c, 1);
+    pthread_mutex_unlock(&c->lock);
+    return len;
+}
+
+int profileDisconnect(int id) {
+    tProfileConn *c = lock_conn(id);
+
+    if (!c) return -1;
+    shutdown(c->fd, SHUT_RDWR);
+    pthread_mutex_unlock(&c->lock);
+    return 0;
+}
+
+int profileConnStats(int id, tProfileConnStats *stats) {
+    tProfileConn *c = lock_conn(id);
+
+    if (!c) return -1;
+    *stats = c->stats;
+    stats->rx_bytes = __atomic_load_n(&c->stats.rx_bytes, __ATOMIC_RELAXED);
+    stats->rx_calls = __atomic_load_n(&c->stats.rx_calls, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&c->lock);
+    return 0;
+}
@@ -0,0 +1,422 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "bluetooth_sbc.h"
+
+/* subband samples carry two fractional bits through dequantization */
+#define SBC_EXTRA_BITS   2
+/* 20 * M of history plus room to slide before it has to be moved */
+#define SBC_V_SIZE       (20 * SBC_MAX_SUBBANDS + 16 * SBC_MAX_SUBBANDS)
+
+struct sbc_decoder {
+    const tSbcKernels *kernels;
+    int subbands;                   /* of the previous frame, 0 after reset */
+    int offset[SBC_MAX_CHANNELS];
+    int32_t v[SBC_MAX_CHANNELS][SBC_V_SIZE];
+    int32_t sb_sample[SBC_MAX_BLOCKS][SBC_MAX_CHANNELS][SBC_MAX_SUBBANDS];
+};
+
+static const int sbc_frequencies[4] = { 16000, 32000, 44100, 48000 };
+
+/* bit allocation offsets for the loudness method, by frequency */
+static const int sbc_offset4[4][4] = {
+    { -1, 0, 0, 0 }, { -2, 0, 0, 1 }, { -2, 0, 0, 1 }, { -2, 0, 0, 1 }
+};
+static const int sbc_offset8[4][8] = {
+    { -2, 0, 0, 0, 0, 0, 0, 1 }, { -3, 0, 0, 0, 0, 0, 1, 2 },
+    { -4, 0, 0, 0, 0, 0, 1, 2 }, { -4, 0, 0, 0, 0, 0, 1, 2 }
+};
+
+/* first half of the 10M tap prototype filter C, A2DP spec tables 12.22/12.23 */
+static const double sbc_proto_4[21] = {
+     0.00000000E+00,  5.36548976E-04,  1.49188357E-03,  2.73370904E-03,
+     3.83720193E-03,  3.89205149E-03,  1.86581691E-03, -3.06012286E-03,
+     1.09137620E-02,  2.04385087E-02,  2.88757392E-02,  3.21939290E-02,
+     2.58767811E-02,  6.13245186E-03, -2.88217274E-02, -7.76463494E-02,
+     1.35593274E-01,  1.94987841E-01,  2.46636662E-01,  2.81828203E-01,
+     2.94315332E-01
+};
+static const double sbc_proto_8[41] = {
+     0.00000000E+00,  1.56575398E-04,  3.43256425E-04,  5.54620202E-04,
+     8.23919506E-04,  1.13992507E-03,  1.47640169E-03,  1.78371725E-03,
+     2.01182542E-03,  2.10371989E-03,  1.99454554E-03,  1.61656283E-03,
+     9.02154502E-04, -1.78805361E-04, -1.64973098E-03, -3.49717454E-03,
+     5.65949473E-03,  8.02941163E-03,  1.04584443E-02,  1.27472335E-02,
+     1.46525263E-02,  1.59045603E-02,  1.62208471E-02,  1.53184106E-02,
+     1.29371806E-02,  8.85757540E-03,  2.92408442E-03, -4.91578024E-03,
+    -1.46404076E-02, -2.61098752E-02, -3.90751381E-02, -5.31873032E-02,
+     6.79989431E-02,  8.29847578E-02,  9.75753918E-02,  1.11196689E-01,
+     1.23264548E-01,  1.33264415E-01,  1.40753505E-01,  1.45389847E-01,
+     1.46955068E-01
+};
+
+/* fixed-point synthesis tables, n in Q30 laid out [i][k], d = -M * C in Q28 */
+static int32_t sbc_n4[4 * 8], sbc_n8[8 * 16];
+static int32_t sbc_d4[40], sbc_d8[80];
+static pthread_once_t sbc_tables_once = PTHREAD_ONCE_INIT;
+
+static void build_tables(int m, const double *proto, int32_t *n, int32_t *d) {
+    int len = 10 * m, i, k;
+    double c;
+
+    /* C is symmetric once the sign flip every 2M taps is taken out */
+    for (i = 0; i < len; i++) {
+        if (i <= len / 2)
+            c = proto[i];
+        else
+            c = proto[len - i] * (((len - i) / (2 * m)) & 1 ? -1 : 1) *
+                ((i / (2 * m)) & 1 ? -1 : 1);
+        d[i] = (int32_t)lrint(-m * c * (1 << 28));
+    }
+    for (i = 0; i < m; i++)
+        for (k = 0; k < 2 * m; k++)
+            n[i * 2 * m + k] = (int32_t)lrint(cos((i + 0.5) * (k + m / 2.0) * M_PI / m) *
+                                              (1 << 30));
+}
+
+static void init_tables(void) {
+    build_tables(4, sbc_proto_4, sbc_n4, sbc_d4);
+    build_tables(8, sbc_proto_8, sbc_n8, sbc_d8);
+}
+
+/******************************* scalar kernels *********************************/
+static void matrix_scalar(const int32_t *n, const int32_t *s, int32_t *v, int m) {
+    int i, k;
+    int64_t acc;
+
+    for (k = 0; k < 2 * m; k++) {
+        acc = (int64_t)1 << (SBC_MATRIX_SHIFT - 1);
+        for (i = 0; i < m; i++)
+            acc += (int64_t)n[i * 2 * m + k] * s[i];
+        v[k] = (int32_t)(acc >> SBC_MATRIX_SHIFT);
+    }
+}
+
+static void window_scalar(const int32_t *d, const int32_t *v, int16_t *pcm,
+                          int stride, int m) {
+    int j, t;
+    int64_t acc;
+    int32_t out;
+
+    for (j = 0; j < m; j++) {
+        acc = (int64_t)1 << 31;
+        for (t = 0; t < 10; t++)
+            acc += (int64_t)d[t * m + j] * v[(t >> 1) * 4 * m + (t & 1) * 3 * m + j];
+        out = (int32_t)(acc >> 32);
+        pcm[j * stride] = out > 32767 ? 32767 : out < -32768 ? -32768 : out;
+    }
+}
+
+const tSbcKernels sbc_kernels_scalar = {
+    "scalar", matrix_scalar, window_scalar
+};
+
+/********************************* bitstream ************************************/
+typedef struct {
+    const uint8_t *data;
+    int bits;       /* available */
+    int pos;
+} tBitReader;
+
+static uint32_t read_bits(tBitReader *br, int n) {
+    uint32_t val = 0;
+    while (n--) {
+        val = (val << 1) | ((br->data[br->pos >> 3] >> (7 - (br->pos & 7))) & 1);
+        br->pos++;
+    }
+    return val;
+}
+
+/* CRC-8, x^8 + x^4 + x^3 + x^2 + 1, seeded with 0x0f */
+static uint8_t sbc_crc8(const uint8_t *data, int bits) {
+    uint8_t crc = 0x0f;
+    int i, bit;
+
+    for (i = 0; i < bits; i++) {
+        bit = (data[i >> 3] >> (7 - (i & 7))) & 1;
+        if (((crc >> 7) ^ bit) & 1)
+            crc = (crc << 1) ^ 0x1d;
+        else
+            crc <<= 1;
+    }
+    return crc;
+}
+
+int sbcParseHeader(const uint8_t *data, int len, tSbcFrameInfo *info) {
+    int join_bits;
+
+    if (len < 4 || data[0] != SBC_SYNCWORD)
+        return -1;
+    info->frequency = sbc_frequencies[data[1] >> 6];
+    info->blocks = 4 * (((data[1] >> 4) & 3) + 1);
+    info->mode = (data[1] >> 2) & 3;
+    info->channels = info->mode == SBC_MODE_MONO ? 1 : 2;
+    info->allocation = (data[1] >> 1) & 1;
+    info->subbands = data[1] & 1 ? 8 : 4;
+    info->bitpool = data[2];
+
+    if (info->bitpool < 2 ||
+        info->bitpool > (info->mode >= SBC_MODE_STEREO ? 32 : 16) * info->subbands)
+        return -1;
+
+    join_bits = info->mode == SBC_MODE_JOINT_STEREO ? info->subbands : 0;
+    if (info->mode <= SBC_MODE_DUAL_CHANNEL)
+        info->length = 4 + (4 * info->subbands * info->channels) / 8 +
+                       (info->blocks * info->channels * info->bitpool + 7) / 8;
+    else
+        info->length = 4 + (4 * info->subbands * 2) / 8 +
+                       (join_bits + info->blocks * info->bitpool + 7) / 8;
+    return 0;
+}
+
+/* A2DP spec 12.6.3 */
+static void bit_allocation(const tSbcFrameInfo *info, int freq_index,
+                           const int scale_factor[SBC_MAX_CHANNELS][SBC_MAX_SUBBANDS],
+                           int bits[SBC_MAX_CHANNELS][SBC_MAX_SUBBANDS]) {
+    int bitneed[SBC_MAX_CHANNELS][SBC_MAX_SUBBANDS];
+    int nch = info->mode >= SBC_MODE_STEREO ? 2 : 1;   /* channels sharing a pool */
+    int m = info->subbands;
+    int ch, first, sb, loudness, max_bitneed, bitcount, slicecount, bitslice;
+
+    for (first = 0; first < info->channels; first += nch) {
+        max_bitneed = 0;
+        for (ch = first; ch < first + nch; ch++) {
+            for (sb = 0; sb < m; sb++) {
+                if (info->allocation == SBC_ALLOCATION_SNR) {
+                    bitneed[ch][sb] = scale_factor[ch][sb];
+                } else if (scale_factor[ch][sb] == 0) {
+                    bitneed[ch][sb] = -5;
+                } else {
+                    loudness = scale_factor[ch][sb] - (m == 4 ?
+                               sbc_offset4[freq_index][sb] : sbc_offset8[freq_index][sb]);
+                    bitneed[ch][sb] = loudness > 0 ? loudness / 2 : loudness;
+                }
+                if (bitneed[ch][sb] > max_bitneed)
+                    max_bitneed = bitneed[ch][sb];
+            }
+        }
+
+        bitcount = 0;
+        slicecount = 0;
+        bitslice = max_bitneed + 1;
+        do {
+            bitslice--;
+            bitcount += slicecount;
+            slicecount = 0;
+            for (ch = first; ch < first + nch; ch++) {
+                for (sb = 0; sb < m; sb++) {
+                    if (bitneed[ch][sb] > bitslice + 1 && bitneed[ch][sb] < bitslice + 16)
+                        slicecount++;
+                    else if (bitneed[ch][sb] == bitslice + 1)
+                        slicecount += 2;
+                }
+            }
+        } while (bitcount + slicecount < info->bitpool);
+        if (bitcount + slicecount == info->bitpool) {
+            bitcount += slicecount;
+            bitslice--;
+        }
+
+        for (ch = first; ch < first + nch; ch++) {
+            for (sb = 0; sb < m; sb++) {
+                if (bitneed[ch][sb] < bitslice + 2)
+                    bits[ch][sb] = 0;
+                else
+                    bits[ch][sb] = bitneed[ch][sb] - bitslice > 16 ?
+                                   16 : bitneed[ch][sb] - bitslice;
+            }
+        }
+
+        /* hand out what is left, channels interleaved per subband */
+        ch = first;
+        sb = 0;
+        while (bitcount < info->bitpool && sb < m) {
+            if (bits[ch][sb] >= 2 && bits[ch][sb] < 16) {
+                bits[ch][sb]++;
+                bitcount++;
+            } else if (bitneed[ch][sb] == bitslice + 1 && info->bitpool > bitcount + 1) {
+                bits[ch][sb] = 2;
+                bitcount += 2;
+            }
+            if (ch + 1 < first + nch) {
+                ch++;
+            } else {
+                ch = first;
+                sb++;
+            }
+        }
+        ch = first;
+        sb = 0;
+        while (bitcount < info->bitpool && sb < m) {
+            if (bits[ch][sb] < 16) {
+                bits[ch][sb]++;
+                bitcount++;
+            }
+            if (ch + 1 < first + nch) {
+                ch++;
+            } else {
+                ch = first;
+                sb++;
+            }
+        }
+    }
+}
+
+/******************************** synthesis *************************************/
+static void synthesize(tSbcDecoder *dec, const tSbcFrameInfo *info, int16_t *pcm) {
+    const int32_t *n = info->subbands == 4 ? sbc_n4 : sbc_n8;
+    const int32_t *d = info->subbands == 4 ? sbc_d4 : sbc_d8;
+    int m = info->subbands;
+    int blk, ch, off;
+    int32_t *v;
+
+    for (ch = 0; ch < info->channels; ch++) {
+        for (blk = 0; blk < info->blocks; blk++) {
+            /* slide the 20M history window down by 2M */
+            off = dec->offset[ch] - 2 * m;
+            if (off < 0) {
+                memmove(&dec->v[ch][SBC_V_SIZE - 18 * m], &dec->v[ch][dec->offset[ch]],
+                        18 * m * sizeof(int32_t));
+                off = SBC_V_SIZE - 20 * m;
+            }
+            dec->offset[ch] = off;
+            v = &dec->v[ch][off];
+
+            dec->kernels->matrix(n, dec->sb_sample[blk][ch], v, m);
+            dec->kernels->window(d, v, pcm + blk * m * info->channels + ch,
+                                 info->channels, m);
+        }
+    }
+}
+
+int sbcDecodeFrame(tSbcDecoder *dec, const uint8_t *data, int len,
+                   int16_t *pcm, tSbcFrameInfo *info) {
+    tSbcFrameInfo local;
+    tBitReader br;
+    int scale_factor[SBC_MAX_CHANNELS][SBC_MAX_SUBBANDS];
+    int bits[SBC_MAX_CHANNELS][SBC_MAX_SUBBANDS];
+    int32_t levels[SBC_MAX_CHANNELS][SBC_MAX_SUBBANDS];
+    uint32_t join = 0, sample;
+    int ch, sb, blk, shift, crc_bits;
+    int32_t a, b;
+
+    if (!info) info = &local;
+    if (sbcParseHeader(data, len, info) < 0 || info->length > len)
+        return -1;
+
+    br.data = data;
+    br.bits = info->length * 8;
+    br.pos = 32;
+    if (info->mode == SBC_MODE_JOINT_STEREO) {
+        for (sb = 0; sb < info->subbands - 1; sb++)
+            join |= read_bits(&br, 1) << sb;
+        read_bits(&br, 1);  /* RFA */
+    }
+    for (ch = 0; ch < info->channels; ch++)
+        for (sb = 0; sb < info->subbands; sb++)
+            scale_factor[ch][sb] = read_bits(&br, 4);
+
+    /* crc covers bytes 1-2 and the join/scale factor bits after the crc byte */
+    crc_bits = br.pos - 32;
+    {
+        uint8_t crc_data[2 + (SBC_MAX_SUBBANDS + 4 * SBC_MAX_SUBBANDS * SBC_MAX_CHANNELS + 7) / 8];
+        crc_data[0] = data[1];
+        crc_data[1] = data[2];
+        memcpy(crc_data + 2, data + 4, (crc_bits + 7) / 8);
+        if (sbc_crc8(crc_data, 16 + crc_bits) != data[3])
+            return -1;
+    }
+
+    bit_allocation(info, (data[1] >> 6), scale_factor, bits);
+
+    if (dec->subbands != info->subbands) {
+        /* history is meaningless across a change of filter bank */
+        memset(dec->v, 0, sizeof(dec->v));
+        dec->offset[0] = dec->offset[1] = SBC_V_SIZE - 20 * info->subbands;
+        dec->subbands = info->subbands;
+    }
+
+    for (ch = 0; ch < info->channels; ch++)
+        for (sb = 0; sb < info->subbands; sb++)
+            levels[ch][sb] = (1 << bits[ch][sb]) - 1;
+
+    for (blk = 0; blk < info->blocks; blk++) {
+        for (ch = 0; ch < info->channels; ch++) {
+            for (sb = 0; sb < info->subbands; sb++) {
+                if (levels[ch][sb] == 0) {
+                    dec->sb_sample[blk][ch][sb] = 0;
+                    continue;
+                }
+                if (br.pos + bits[ch][sb] > br.bits)
+                    return -1;
+                sample = read_bits(&br, bits[ch][sb]);
+                shift = scale_factor[ch][sb] + 1 + SBC_EXTRA_BITS;
+                dec->sb_sample[blk][ch][sb] = (int32_t)
+                    (((((int64_t)sample << 1) | 1) << shift) / levels[ch][sb]) -
+                    ((int32_t)1 << shift);
+            }
+        }
+    }
+
+    if (info->mode == SBC_MODE_JOINT_STEREO) {
+        for (blk = 0; blk < info->blocks; blk++) {
+            for (sb = 0; sb < info->subbands; sb++) {
+                if (!(join & (1u << sb))) continue;
+                a = dec->sb_sample[blk][0][sb];
+                b = dec->sb_sample[blk][1][sb];
+                dec->sb_sample[blk][0][sb] = a + b;
+                dec->sb_sample[blk][1][sb] = a - b;
+            }
+        }
+    }
+
+    synthesize(dec, info, pcm);
+    return info->length;
+}
+
+/********************************** decoder *************************************/
+static const tSbcKernels * pick_kernels(const char *impl) {
+    const tSbcKernels *k;
+
+    if (impl) {
+        if (!strcmp(impl, "scalar")) return &sbc_kernels_scalar;
+        if (!strcmp(impl, "sse4.1")) return sbcKernelsSse41();
+        if (!strcmp(impl, "avx2")) return sbcKernelsAvx2();
+        if (!strcmp(impl, "neon")) return sbcKernelsNeon();
+        return NULL;
+    }
+    if ((k = sbcKernelsAvx2()) || (k = sbcKernelsSse41()) || (k = sbcKernelsNeon()))
+        return k;
+    return &sbc_kernels_scalar;
+}
+
+tSbcDecoder * createSbcDecoder(const char *impl) {
+    const tSbcKernels *kernels;
+    tSbcDecoder *dec;
+
+    pthread_once(&sbc_tables_once, init_tables);
+    kernels = pick_kernels(impl);
+    if (!kernels) {
+        printf("%s: %s not available\n", __FUNCTION__, impl);
+        return NULL;
+    }
+    dec = calloc(1, sizeof(*dec));
+    if (!dec) return NULL;
+    dec->kernels = kernels;
+    return dec;
+}
+
+void destroySbcDecoder(tSbcDecoder *dec) {
+    free(dec);
+}
+
+const char * sbcDecoderImpl(const tSbcDecoder *dec) {
+    return dec->kernels->name;
+}
+
+void resetSbcDecoder(tSbcDecoder *dec) {
+    dec->subbands = 0;
+}
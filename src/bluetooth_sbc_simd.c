@@ -0,0 +1,201 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "bluetooth_sbc.h"
+
+/*
+* SIMD synthesis kernels. They compute exactly what the scalar ones in
+* bluetooth_sbc.c do: 32x32->64 bit products summed in 64 bits, one rounding
+* shift at the end. Integer sums don't care about order, so the output is
+* bit-identical whatever the lane layout.
+*
+* The x86 kernels are compiled with target attributes and only called after
+* a cpuid check, so the rest of the tree keeps the baseline -march.
+*/
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#define SSE41 __attribute__((target("sse4.1")))
+#define AVX2  __attribute__((target("avx2")))
+
+/* 4 x (int64 acc += int32 a * int32 b), accumulators split even/odd lanes */
+static inline SSE41 void mac4_sse41(__m128i a, __m128i b, __m128i *even, __m128i *odd) {
+    *even = _mm_add_epi64(*even, _mm_mul_epi32(a, b));
+    *odd = _mm_add_epi64(*odd, _mm_mul_epi32(_mm_srli_epi64(a, 32),
+                                             _mm_srli_epi64(b, 32)));
+}
+
+/* bits shift..shift+31 of each 64-bit lane, back in lane order */
+static inline SSE41 __m128i narrow4_sse41(__m128i even, __m128i odd, int shift) {
+    __m128i cnt = _mm_cvtsi32_si128(shift);
+    even = _mm_srl_epi64(even, cnt);
+    odd = _mm_sll_epi64(_mm_srl_epi64(odd, cnt), _mm_cvtsi32_si128(32));
+    return _mm_blend_epi16(even, odd, 0xcc);
+}
+
+static SSE41 void matrix_sse41(const int32_t *n, const int32_t *s, int32_t *v, int m) {
+    const __m128i round = _mm_set1_epi64x((int64_t)1 << (SBC_MATRIX_SHIFT - 1));
+    __m128i even, odd, si;
+    int i, k;
+
+    for (k = 0; k < 2 * m; k += 4) {
+        even = odd = round;
+        for (i = 0; i < m; i++) {
+            si = _mm_set1_epi32(s[i]);
+            mac4_sse41(_mm_loadu_si128((const __m128i *)&n[i * 2 * m + k]), si,
+                       &even, &odd);
+        }
+        _mm_storeu_si128((__m128i *)&v[k], narrow4_sse41(even, odd, SBC_MATRIX_SHIFT));
+    }
+}
+
+static SSE41 void window_sse41(const int32_t *d, const int32_t *v, int16_t *pcm,
+                               int stride, int m) {
+    const __m128i round = _mm_set1_epi64x((int64_t)1 << 31);
+    __m128i even, odd, out;
+    int16_t tmp[8];
+    int j, t, i;
+
+    for (j = 0; j < m; j += 4) {
+        even = odd = round;
+        for (t = 0; t < 10; t++)
+            mac4_sse41(_mm_loadu_si128((const __m128i *)&d[t * m + j]),
+                       _mm_loadu_si128((const __m128i *)
+                                       &v[(t >> 1) * 4 * m + (t & 1) * 3 * m + j]),
+                       &even, &odd);
+        out = _mm_packs_epi32(narrow4_sse41(even, odd, 32), _mm_setzero_si128());
+        _mm_storel_epi64((__m128i *)tmp, out);
+        for (i = 0; i < 4; i++)
+            pcm[(j + i) * stride] = tmp[i];
+    }
+}
+
+static const tSbcKernels sbc_kernels_sse41 = {
+    "sse4.1", matrix_sse41, window_sse41
+};
+
+static inline AVX2 void mac8_avx2(__m256i a, __m256i b, __m256i *even, __m256i *odd) {
+    *even = _mm256_add_epi64(*even, _mm256_mul_epi32(a, b));
+    *odd = _mm256_add_epi64(*odd, _mm256_mul_epi32(_mm256_srli_epi64(a, 32),
+                                                   _mm256_srli_epi64(b, 32)));
+}
+
+static inline AVX2 __m256i narrow8_avx2(__m256i even, __m256i odd, int shift) {
+    __m128i cnt = _mm_cvtsi32_si128(shift);
+    even = _mm256_srl_epi64(even, cnt);
+    odd = _mm256_slli_epi64(_mm256_srl_epi64(odd, cnt), 32);
+    return _mm256_blend_epi32(even, odd, 0xaa);
+}
+
+static AVX2 void matrix_avx2(const int32_t *n, const int32_t *s, int32_t *v, int m) {
+    const __m256i round = _mm256_set1_epi64x((int64_t)1 << (SBC_MATRIX_SHIFT - 1));
+    __m256i even, odd, si;
+    int i, k;
+
+    /* 2M is 8 or 16, whole registers either way */
+    for (k = 0; k < 2 * m; k += 8) {
+        even = odd = round;
+        for (i = 0; i < m; i++) {
+            si = _mm256_set1_epi32(s[i]);
+            mac8_avx2(_mm256_loadu_si256((const __m256i *)&n[i * 2 * m + k]), si,
+                      &even, &odd);
+        }
+        _mm256_storeu_si256((__m256i *)&v[k], narrow8_avx2(even, odd, SBC_MATRIX_SHIFT));
+    }
+}
+
+static AVX2 void window_avx2(const int32_t *d, const int32_t *v, int16_t *pcm,
+                             int stride, int m) {
+    const __m256i round = _mm256_set1_epi64x((int64_t)1 << 31);
+    __m256i even, odd, r;
+    __m128i out;
+    int16_t tmp[8];
+    int t, i;
+
+    if (m == 4) {
+        window_sse41(d, v, pcm, stride, m);
+        return;
+    }
+    even = odd = round;
+    for (t = 0; t < 10; t++)
+        mac8_avx2(_mm256_loadu_si256((const __m256i *)&d[t * 8]),
+                  _mm256_loadu_si256((const __m256i *)&v[(t >> 1) * 32 + (t & 1) * 24]),
+                  &even, &odd);
+    r = narrow8_avx2(even, odd, 32);
+    out = _mm_packs_epi32(_mm256_castsi256_si128(r), _mm256_extracti128_si256(r, 1));
+    _mm_storeu_si128((__m128i *)tmp, out);
+    for (i = 0; i < 8; i++)
+        pcm[i * stride] = tmp[i];
+}
+
+static const tSbcKernels sbc_kernels_avx2 = {
+    "avx2", matrix_avx2, window_avx2
+};
+
+const tSbcKernels * sbcKernelsSse41() {
+    return __builtin_cpu_supports("sse4.1") ? &sbc_kernels_sse41 : NULL;
+}
+
+const tSbcKernels * sbcKernelsAvx2() {
+    return __builtin_cpu_supports("avx2") ? &sbc_kernels_avx2 : NULL;
+}
+#else
+const tSbcKernels * sbcKernelsSse41() { return NULL; }
+const tSbcKernels * sbcKernelsAvx2() { return NULL; }
+#endif
+
+#if defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+
+/* NEON is part of armv8; armv7 builds get here only with -mfpu=neon */
+static void matrix_neon(const int32_t *n, const int32_t *s, int32_t *v, int m) {
+    int64x2_t lo, hi;
+    int32x4_t c;
+    int i, k;
+
+    for (k = 0; k < 2 * m; k += 4) {
+        lo = hi = vdupq_n_s64(0);
+        for (i = 0; i < m; i++) {
+            c = vld1q_s32(&n[i * 2 * m + k]);
+            lo = vmlal_n_s32(lo, vget_low_s32(c), s[i]);
+            hi = vmlal_n_s32(hi, vget_high_s32(c), s[i]);
+        }
+        vst1q_s32(&v[k], vcombine_s32(vrshrn_n_s64(lo, SBC_MATRIX_SHIFT),
+                                      vrshrn_n_s64(hi, SBC_MATRIX_SHIFT)));
+    }
+}
+
+static void window_neon(const int32_t *d, const int32_t *v, int16_t *pcm,
+                        int stride, int m) {
+    int64x2_t lo, hi;
+    int32x4_t a, b;
+    int16x4_t out;
+    int j, t;
+
+    for (j = 0; j < m; j += 4) {
+        lo = hi = vdupq_n_s64(0);
+        for (t = 0; t < 10; t++) {
+            a = vld1q_s32(&d[t * m + j]);
+            b = vld1q_s32(&v[(t >> 1) * 4 * m + (t & 1) * 3 * m + j]);
+            lo = vmlal_s32(lo, vget_low_s32(a), vget_low_s32(b));
+            hi = vmlal_s32(hi, vget_high_s32(a), vget_high_s32(b));
+        }
+        out = vqmovn_s32(vcombine_s32(vrshrn_n_s64(lo, 32), vrshrn_n_s64(hi, 32)));
+        pcm[(j + 0) * stride] = vget_lane_s16(out, 0);
+        pcm[(j + 1) * stride] = vget_lane_s16(out, 1);
+        pcm[(j + 2) * stride] = vget_lane_s16(out, 2);
+        pcm[(j + 3) * stride] = vget_lane_s16(out, 3);
+    }
+}
+
+static const tSbcKernels sbc_kernels_neon = {
+    "neon", matrix_neon, window_neon
+};
+
+const tSbcKernels * sbcKernelsNeon() {
+    return &sbc_kernels_neon;
+}
+#else
+const tSbcKernels * sbcKernelsNeon() { return NULL; }
+#endif
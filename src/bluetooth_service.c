@@ -1,9 +1,26 @@
 #include <stdlib.h>
+#include <pthread.h>
 
 #include "bluetooth_service.h"
 #include "bluetooth_common.h"
+#include "bluetooth_dbus_stubs.h"
+#include "bluetooth_event.h"
+#include "bluetooth_eventloop.h"
+#include "bluetooth_media.h"
+#include "bluetooth_audio.h"
+#include "bluetooth_profile.h"
+#include "bluetooth_hfp.h"
+#include "bluetooth_gatt.h"
+#include "bluetooth_gattread.h"
+#include "bluetooth_presence.h"
+#include "bluetooth_telemetry.h"
+#include "bluetooth_discovery.h"
+#include "bluetooth_devicegc.h"
 
 static DBusConnection * g_dbus_conn = NULL;
+static int g_hfp_started = 0;	/* 1 registering, 2 registered */
+static tServiceResultCb g_hfp_cb = NULL;	/* waiting on the registration */
+static int g_manual_discovery = -1;
 extern DBusHandlerResult agent_event_filter(DBusConnection *conn,
 											DBusMessage *msg,
 											void *data);
@@ -35,10 +52,24 @@ int initServices(){
 	g_dbus_conn = dbus_bus_get(DBUS_BUS_SYSTEM, NULL);
 	if(!g_dbus_conn) return -1;
 	setupRemoteAgent(g_dbus_conn);
+	if (startProfileWorkers() < 0)
+		printf("%s: profile connections will be refused\n", __FUNCTION__);
 	return 0;
 }
 
 int destoryServices(){
+	audioStreamCleanup();
+	advMonitorCleanup();
+	presenceCleanup();
+	telemetryCleanup();
+	discoveryCleanup();
+	deviceGcCleanup();
+	g_manual_discovery = -1;
+	gattReadCleanup();
+	gattCleanup();
+	stopProfileWorkers();
+	g_hfp_started = 0;
+	g_hfp_cb = NULL;
 	if(g_dbus_conn){
 		tearDownRemoteAgent(g_dbus_conn);
 		dbus_connection_unref(g_dbus_conn);
@@ -48,120 +79,64 @@ int destoryServices(){
 }
 
 /*
-* start bluetooth discovery
+* start bluetooth discovery: a continuous demand on the discovery
+* scheduler, which still makes way for audio and paging
 */
 static int _startDiscovery(DBusConnection *conn){
-	DBusMessage *msg = NULL;
-	DBusMessage *reply = NULL;
-	DBusError err;
-	int ret = -1;
-	if (!conn) return ret;
-
-	dbus_error_init(&err);
-	/* Compose the command */
-	msg = dbus_message_new_method_call(BLUEZ_DBUS_BASE_IFC,
-									   ADAPTER_PATH,
-									   ADAPTER_IFC, "StartDiscovery");
-
-	if (msg == NULL) {
-		if (dbus_error_is_set(&err)) {
-			LOG_AND_FREE_DBUS_ERROR_WITH_MSG(&err, msg);
-		}
-		goto done;
-	}
+	const tDiscoveryDemand manual = {
+		DISCOVERY_MANUAL_INTERVAL_MS, DISCOVERY_MANUAL_INTERVAL_MS, DISCOVERY_AUDIO_SHRINK
+	};
 
-	/* Send the command. */
-	reply = dbus_connection_send_with_reply_and_block(conn, msg, -1, &err);
-	if (dbus_error_is_set(&err)) {
-		 LOG_AND_FREE_DBUS_ERROR_WITH_MSG(&err, msg);
-		 goto done;
-	}
-	ret = 0;
-done:
-	if (reply) dbus_message_unref(reply);
-	if (msg) dbus_message_unref(msg);
-	return ret;
+	if (g_manual_discovery >= 0) return 0;
+	g_manual_discovery = discoveryRequest(conn, &manual);
+	return g_manual_discovery < 0 ? -1 : 0;
 }
 
 static int _stopDiscovery(DBusConnection *conn){
-	DBusMessage *msg = NULL;
-	DBusMessage *reply = NULL;
-	DBusError err;
-	int ret = -1;
-
-	dbus_error_init(&err);
-	if (!conn) return ret;
-	/* Compose the command */
-	msg = dbus_message_new_method_call(BLUEZ_DBUS_BASE_IFC,
-									   ADAPTER_PATH,
-									   ADAPTER_IFC, "StopDiscovery");
-	if (msg == NULL) {
-		if (dbus_error_is_set(&err))
-			LOG_AND_FREE_DBUS_ERROR_WITH_MSG(&err, msg);
-		goto done;
-	}
-
-	/* Send the command. */
-	reply = dbus_connection_send_with_reply_and_block(conn, msg, -1, &err);
-	if (dbus_error_is_set(&err)) {
-		if(strncmp(err.name, BLUEZ_DBUS_BASE_IFC ".Error.NotAuthorized",
-				   strlen(BLUEZ_DBUS_BASE_IFC ".Error.NotAuthorized")) == 0) {
-			// hcid sends this if there is no active discovery to cancel
-			printf("%s: There was no active discovery to cancel", __FUNCTION__);
-			dbus_error_free(&err);
-		} else {
-			LOG_AND_FREE_DBUS_ERROR_WITH_MSG(&err, msg);
-		}
-		goto done;
+	if (g_manual_discovery < 0) {
+		printf("%s: There was no active discovery to cancel\n", __FUNCTION__);
+		return -1;
 	}
-
-	ret = 0;
-done:
-	if (msg) dbus_message_unref(msg);
-	if (reply) dbus_message_unref(reply);
-	return ret;
+	discoveryRelease(g_manual_discovery);
+	g_manual_discovery = -1;
+	return 0;
 }
 
-struct disc_filter {
-	char uuids[64][8];
-	int16_t rssi;
-	uint16_t path_loss;
-	char transport[64];
-	uint8_t dup;
-};
-
-/* This method sets the device discovery filter for the
- * caller. When this method is called with no filter
- * parameter, filter is removed.
+/* SetDiscoveryFilter with the given filter, an empty one
+ * (filter NULL) removes it.
  */
 static int _setDiscoveryFilter(DBusConnection *conn, struct disc_filter *filter)
 {
-#if 0
-	DBusMessage *msg = NULL;
-	DBusMessage *reply = NULL;
-	DBusError err;
-	int ret = -1;
-
-	dbus_error_init(&err);
-	/* Compose the command */
-	msg = dbus_message_new_method_call(BLUEZ_DBUS_BASE_IFC,
-									   ADAPTER_PATH,
-									   ADAPTER_IFC, "SetDiscoveryFilter");
-
-	if (msg == NULL) {
-		if (dbus_error_is_set(&err)) {
-			LOG_AND_FREE_DBUS_ERROR_WITH_MSG(&err, msg);
+	char uuid_buf[DISC_FILTER_MAX_UUIDS][BT_UUID_STR_SIZE];
+	const char *uuids[DISC_FILTER_MAX_UUIDS];
+	const char *transport;
+	dbus_bool_t dup;
+	t_dict_entry entries[5];
+	int i, n = 0, num_uuids;
+
+	if (!conn) return -1;
+	if (filter) {
+		num_uuids = filter->num_uuids < DISC_FILTER_MAX_UUIDS ?
+					filter->num_uuids : DISC_FILTER_MAX_UUIDS;
+		for (i = 0; i < num_uuids; i++) {
+			bt_uuid_format(&filter->uuids[i], uuid_buf[i]);
+			uuids[i] = uuid_buf[i];
 		}
-		goto done;
+		if (num_uuids > 0)
+			entries[n++] = (t_dict_entry){ "UUIDs", DBUS_TYPE_ARRAY, uuids, num_uuids };
+		/* bluez takes one of RSSI and Pathloss */
+		if (filter->rssi)
+			entries[n++] = (t_dict_entry){ "RSSI", DBUS_TYPE_INT16, &filter->rssi, 0 };
+		else if (filter->path_loss)
+			entries[n++] = (t_dict_entry){ "Pathloss", DBUS_TYPE_UINT16, &filter->path_loss, 0 };
+		if (filter->transport[0]) {
+			transport = filter->transport;
+			entries[n++] = (t_dict_entry){ "Transport", DBUS_TYPE_STRING, &transport, 0 };
+		}
+		dup = filter->dup ? TRUE : FALSE;
+		entries[n++] = (t_dict_entry){ "DuplicateData", DBUS_TYPE_BOOLEAN, &dup, 0 };
 	}
-	append_dict_args(msg,
-				 "UUIDs", DBUS_TYPE_ARRAY, &uuids,
-				 "RSSI", DBUS_TYPE_INT16, &rssi,
-				 "Pathloss", DBUS_TYPE_UINT16, &path_loss,
-				 "Transport", DBUS_TYPE_STRING, &transport,/* bredr le auto */
-				 "DuplicateData", DBUS_TYPE_BOOLEAN, &dup,
-				 DBUS_TYPE_INVALID);
-#endif
+	return bluez_adapter1_set_discovery_filter(conn, ADAPTER_PATH, entries, n, NULL);
 }
 
 
@@ -171,6 +146,7 @@ void onStartPairDeviceResult(DBusMessage *msg, void *user, void *n) {
 	DBusError err;
 	dbus_error_init(&err);
 
+	discoveryPaging(0);
 	if (dbus_set_error_from_message(&err, msg)) {
 		if (!strcmp(err.name, BLUEZ_DBUS_BASE_IFC ".Error.AuthenticationFailed")) {
 			// Pins did not match, or remote device did not respond to pin
@@ -215,6 +191,7 @@ void onStartPairDeviceResult(DBusMessage *msg, void *user, void *n) {
 		LOG_AND_FREE_DBUS_ERROR(&err);
 	}
 	printf("user <%s> result <%d>\n", address, result);
+	publishPairingResult(address, result);
 done:
 	if(user) free(user);
 }
@@ -223,156 +200,142 @@ done:
 static int _startPaireDevice(DBusConnection *conn, const char *device_path) {
 	int len = strlen(device_path) + 1;
 	char * context_path = (char*)calloc(len,sizeof(char));
-	const char *capabilities = "DisplayYesNo";
+	DBusMessage *msg;
+	dbus_bool_t ret;
 	printf("dev_paht = %s\n", device_path);
 	//const char *agent_path = REMOTE_AGENT_PATH;
 	snprintf(context_path,len,"%s",device_path);
-	int ret = dbus_func_args_async(conn, (int)5000,
+	msg = bluez_device1_pair_new(device_path);
+	discoveryPaging(1);
+	ret = msg && dbus_message_send_async(conn, msg, (int)5000,
 										onStartPairDeviceResult, // callback
 										context_path,
-										NULL,
-										device_path,
-										DEVICE_IFC,
-										"Pair",
-										DBUS_TYPE_INVALID);
+										NULL);
+	if (msg) dbus_message_unref(msg);
+	if (!ret) {
+		discoveryPaging(0);
+		free(context_path);
+	}
 
 	return ret ? 0 : -1;
 }
 
+/* discovery is held off while we page */
 static int _connectDevice(DBusConnection *conn, const char *device_path) {
-	DBusMessage *msg = NULL;
-	DBusMessage *reply = NULL;
-	DBusError err;
-	int ret = -1;
-	if (!conn) return ret;
+	int ret;
 
-	dbus_error_init(&err);
-	/* Compose the command */
-	msg = dbus_message_new_method_call(BLUEZ_DBUS_BASE_IFC,
-									   device_path,
-									   DEVICE_IFC, "Connect");
-
-	if (msg == NULL) {
-		if (dbus_error_is_set(&err)) {
-			LOG_AND_FREE_DBUS_ERROR_WITH_MSG(&err, msg);
-		}
-		goto done;
-	}
-
-	/* Send the command. */
-	reply = dbus_connection_send_with_reply_and_block(conn, msg, -1, &err);
-	if (dbus_error_is_set(&err)) {
-		 LOG_AND_FREE_DBUS_ERROR_WITH_MSG(&err, msg);
-		 goto done;
-	}
-	ret = 0;
-done:
-	if (reply) dbus_message_unref(reply);
-	if (msg) dbus_message_unref(msg);
+	discoveryPaging(1);
+	ret = bluez_device1_connect(conn, device_path, NULL);
+	discoveryPaging(0);
 	return ret;
 }
 
 static int _connectProfile(DBusConnection *conn, const char *device_path, char *profile) {
-	DBusMessage *msg = NULL;
-	DBusMessage *reply = NULL;
-	DBusError err;
-	int ret = -1;
-	if (!conn) return ret;
-
-	dbus_error_init(&err);
-	/* Compose the command */
-	msg = dbus_message_new_method_call(BLUEZ_DBUS_BASE_IFC,
-									   device_path,
-									   DEVICE_IFC, "ConnectProfile");
-
-	if (msg == NULL) {
-		if (dbus_error_is_set(&err)) {
-			LOG_AND_FREE_DBUS_ERROR_WITH_MSG(&err, msg);
-		}
-		goto done;
-	}
-
-	dbus_message_append_args(msg, DBUS_TYPE_STRING, &profile, DBUS_TYPE_INVALID);
+	int ret;
 
-	/* Send the command. */
-	reply = dbus_connection_send_with_reply_and_block(conn, msg, -1, &err);
-	if (dbus_error_is_set(&err)) {
-		 LOG_AND_FREE_DBUS_ERROR_WITH_MSG(&err, msg);
-		 goto done;
-	}
-	ret = 0;
-done:
-	if (reply) dbus_message_unref(reply);
-	if (msg) dbus_message_unref(msg);
+	discoveryPaging(1);
+	ret = bluez_device1_connect_profile(conn, device_path, profile, NULL);
+	discoveryPaging(0);
 	return ret;
 }
 
-/* "/org/bluez", "org.bluez.ProfileManager1", RegisterProfile */
-static int _addProfile(DBusConnection *conn, char *path, char *uuid, char *name, int auto_connect) {
-	DBusMessage *msg = NULL;
-	DBusMessage *reply = NULL;
-	DBusError err;
-	int ret = -1;
-	if (!conn) return ret;
+typedef struct {
+	tServiceResultCb cb;
+	void *user;
+	int paging;
+} tServiceAsyncCall;
 
+static void onServiceAsyncResult(DBusMessage *msg, void *user, void *n) {
+	tServiceAsyncCall *call = (tServiceAsyncCall *)user;
+	int result = 0;
+	DBusError err;
 	dbus_error_init(&err);
-	/* Compose the command */
-	msg = dbus_message_new_method_call(BLUEZ_DBUS_BASE_IFC,
-									   BLUEZ_DBUS_BASE_PATH,
-									   PROFILE_MANAGER_IFC, "RegisterProfile");
-
-	if (msg == NULL) {
-		if (dbus_error_is_set(&err)) {
-			LOG_AND_FREE_DBUS_ERROR_WITH_MSG(&err, msg);
-		}
-		goto done;
-	}
-
-	dbus_message_append_args(msg, DBUS_TYPE_OBJECT_PATH, &path, DBUS_TYPE_INVALID);
-	dbus_message_append_args(msg, DBUS_TYPE_STRING, &uuid, DBUS_TYPE_INVALID);
-
-	/* append arguments */
-	append_dict_args(msg,
-					 "Name", DBUS_TYPE_STRING, &name,
-					 "AutoConnect", DBUS_TYPE_BOOLEAN, &auto_connect,
-					 DBUS_TYPE_INVALID);
 
+	if (dbus_set_error_from_message(&err, msg)) {
+		LOG_AND_FREE_DBUS_ERROR(&err);
+		result = -1;
+	}
+	if (call->paging) discoveryPaging(0);
+	if (call->cb) call->cb(result, call->user);
+	free(call);
+}
 
-	/* Send the command. */
-	reply = dbus_connection_send_with_reply_and_block(conn, msg, -1, &err);
-	if (dbus_error_is_set(&err)) {
-		 LOG_AND_FREE_DBUS_ERROR_WITH_MSG(&err, msg);
-		 goto done;
+/* method call without reply data, consumes msg;
+ * cb gets 0 or -1 once bluez answers;
+ * paging holds discovery off until then
+ */
+static int _methodAsync(DBusConnection *conn, DBusMessage *msg, int paging,
+						tServiceResultCb cb, void *user) {
+	tServiceAsyncCall *call;
+	dbus_bool_t ret = FALSE;
+
+	call = (tServiceAsyncCall *)malloc(sizeof(tServiceAsyncCall));
+	if (conn && msg && call) {
+		call->cb = cb;
+		call->user = user;
+		call->paging = paging;
+		if (paging) discoveryPaging(1);
+		ret = dbus_message_send_async(conn, msg, -1, onServiceAsyncResult, call, NULL);
+		if (!ret && paging) discoveryPaging(0);
 	}
-	ret = 0;
-done:
-	if (reply) dbus_message_unref(reply);
 	if (msg) dbus_message_unref(msg);
-	return ret;
+	if (!ret) {
+		free(call);
+		return -1;
+	}
+	return 0;
 }
 
-typedef enum {
-	PLAYER_CTR_PLAY,
-	PLAYER_CTR_PAUSE,
-	PLAYER_CTR_STOP,
-	PLAYER_CTR_NEXT,
-	PLAYER_CTR_PREVIOUS,
-	PLAYER_CTR_FASTFORWARD,
-	PLAYER_CTR_INVALID,
-}PlayerCtlOpt;
+/* RegisterProfile in flight, the object is dropped again if bluez refuses it */
+typedef struct {
+	DBusConnection *conn;
+	char path[128];
+	tServiceResultCb cb;
+	void *user;
+} tProfileCall;
 
-static int _mediaPlayerControl(DBusConnection *conn, const char *dev, const char *func)
-{
-	DBusMessage *reply = NULL;
-	char path[128] = { 0 };
+static void onProfileRegistered(int result, void *user) {
+	tProfileCall *call = (tProfileCall *)user;
 
-	/* eg:/org/bluez/hciX/dev_XX_XX_XX_XX_XX_XX/player0 */
-	snprintf(path, sizeof(path), "%s/%s/player0", ADAPTER_PATH, dev);
-	reply = dbus_func_args(conn, path,
-								 MEDIA_PLAYER_IFC,
-								 func, 
-								 DBUS_TYPE_INVALID);
-	return reply ? 0 : -1;
+	if (result) unregisterProfileObject(call->conn, call->path);
+	if (call->cb) call->cb(result, call->user);
+	free(call);
+}
+
+/* "/org/bluez", "org.bluez.ProfileManager1", RegisterProfile
+ * the Profile1 object is exported first, bluez may call it right away;
+ * sent async, cb gets the outcome unless this returns -1
+ */
+static int _addProfile(DBusConnection *conn, char *path, char *uuid, char *name,
+					   int auto_connect, const tProfileHandler *handler,
+					   tServiceResultCb cb, void *user) {
+	dbus_bool_t autoconn = auto_connect ? TRUE : FALSE;
+	const t_dict_entry options[] = {
+		{ "Name", DBUS_TYPE_STRING, &name, 0 },
+		{ "AutoConnect", DBUS_TYPE_BOOLEAN, &autoconn, 0 },
+	};
+	tProfileCall *call;
+
+	if (!conn) return -1;
+	call = (tProfileCall *)malloc(sizeof(tProfileCall));
+	if (!call) return -1;
+	if (snprintf(call->path, sizeof(call->path), "%s", path) >= (int)sizeof(call->path) ||
+		registerProfileObject(conn, path, handler) < 0) {
+		free(call);
+		return -1;
+	}
+	call->conn = conn;
+	call->cb = cb;
+	call->user = user;
+	if (_methodAsync(conn,
+					 bluez_profile_manager1_register_profile_new(BLUEZ_DBUS_BASE_PATH,
+							path, uuid, options, sizeof(options) / sizeof(options[0])),
+					 0, onProfileRegistered, call) < 0) {
+		unregisterProfileObject(conn, path);
+		free(call);
+		return -1;
+	}
+	return 0;
 }
 
 /*************************************** adapter methods *************************/
@@ -396,9 +359,51 @@ int getDiscoveryFilter()
 	
 }
 
-int removeDevice()
+/* found events only for devices advertising one of uuids; count 0 for all */
+int setDeviceFilter(const char **uuids, int count)
+{
+	t_bt_uuid_set *set;
+	t_bt_uuid uuid;
+	int i, ret = 0;
+
+	if (count <= 0)
+		return setDeviceUuidFilter(NULL);
+	/* the short uuid bitset is 8k, too big for the stack */
+	set = (t_bt_uuid_set *)malloc(sizeof(t_bt_uuid_set));
+	if (!set) return -1;
+	bt_uuid_set_init(set);
+	for (i = 0; i < count && ret == 0; i++) {
+		if (bt_uuid_parse(uuids[i], &uuid) < 0 || bt_uuid_set_add(set, &uuid) < 0)
+			ret = -1;
+	}
+	if (ret == 0)
+		ret = setDeviceUuidFilter(set);
+	free(set);
+	return ret;
+}
+
+/* fire and forget, InterfacesRemoved tells when it is gone */
+int removeDevice(const char *device_path)
+{
+	return _methodAsync(g_dbus_conn,
+						bluez_adapter1_remove_device_new(ADAPTER_PATH, device_path),
+						0, NULL, NULL);
+}
+
+int startDeviceGc(const tDeviceGcConfig *config)
+{
+	return deviceGcStart(g_dbus_conn, config);
+}
+
+/* also changes the config once running */
+int startPresence(const tPresenceConfig *config)
 {
+	return presenceStart(config);
+}
 
+int startTelemetry(const tTelemetryConfig *config)
+{
+	return telemetryStart(config);
 }
 
 /***************************************** device methods ***************************/
@@ -420,6 +425,11 @@ int connectDevice(const char *device_path)
 	return _connectDevice(g_dbus_conn, device_path);
 }
 
+int connectDeviceAsync(const char *device_path, tServiceResultCb cb, void *user)
+{
+	return _methodAsync(g_dbus_conn, bluez_device1_connect_new(device_path), 1, cb, user);
+}
+
 int disconnectDevice()
 {
 
@@ -432,19 +442,234 @@ int connectProfile(const char *device_path, char *profile)
 	return _connectProfile(g_dbus_conn, device_path, profile);
 }
 
+int connectProfileAsync(const char *device_path, char *profile,
+						tServiceResultCb cb, void *user)
+{
+	return _methodAsync(g_dbus_conn,
+						bluez_device1_connect_profile_new(device_path, profile),
+						1, cb, user);
+}
+
 int disconnectProfile()
 {
 
 }
 
 /********************************** profile manager ****************************/
-int addProfile(char *path, char *uuid, char *name, int auto_connect)
+int addProfile(char *path, char *uuid, char *name, int auto_connect,
+			   tServiceResultCb cb, void *user)
+{
+	return _addProfile(g_dbus_conn, path, uuid, name, auto_connect, NULL, cb, user);
+}
+
+int addProfileHandler(char *path, char *uuid, char *name, int auto_connect,
+					  const tProfileHandler *handler, tServiceResultCb cb, void *user)
+{
+	return _addProfile(g_dbus_conn, path, uuid, name, auto_connect, handler, cb, user);
+}
+
+/************************************* hfp **************************************/
+#define HFP_AG_PATH		"/sun/bluetooth/hfp_ag"
+
+/* one engine per profile connection, owned by its worker once connected */
+typedef struct {
+	int conn;		/* -1 when free */
+	tHfp hfp;
+} tHfpLink;
+
+static tHfpLink g_hfp_links[PROFILE_MAX_CONNECTIONS];
+static pthread_mutex_t g_hfp_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static tHfpLink *find_hfp_link(int conn)
+{
+	int i;
+
+	for (i = 0; i < PROFILE_MAX_CONNECTIONS; i++)
+		if (g_hfp_links[i].conn == conn) return &g_hfp_links[i];
+	return NULL;
+}
+
+static int hfp_link_send(void *user, const char *data, size_t len)
+{
+	tHfpLink *link = user;
+
+	return profileSend(link->conn, data, len) < 0 ? -1 : 0;
+}
+
+static void hfp_link_event(void *user, const tHfpEvent *ev)
+{
+	tHfpLink *link = user;
+
+	switch (ev->type) {
+	case HFP_EVENT_SLC_CONNECTED:
+		printf("hfp %d: service level connection up\n", link->conn);
+		break;
+	case HFP_EVENT_VOLUME:
+		printf("hfp %d: %s volume %d\n", link->conn,
+			   ev->index == HFP_VOLUME_SPEAKER ? "speaker" : "mic", ev->value);
+		break;
+	case HFP_EVENT_DIAL:
+		printf("hfp %d: dial '%s'\n", link->conn, ev->number);
+		break;
+	case HFP_EVENT_ANSWER:
+		printf("hfp %d: answer\n", link->conn);
+		break;
+	case HFP_EVENT_HANGUP:
+		printf("hfp %d: hangup\n", link->conn);
+		break;
+	}
+}
+
+static const tHfpCallbacks hfp_link_callbacks = { hfp_link_send, hfp_link_event };
+
+static void hfp_connected(int conn, const char *device, void *user)
+{
+	tHfpLink *link;
+
+	pthread_mutex_lock(&g_hfp_mutex);
+	link = find_hfp_link(-1);
+	if (link) link->conn = conn;
+	pthread_mutex_unlock(&g_hfp_mutex);
+	if (!link) {
+		printf("%s: no free hfp link for %s\n", __FUNCTION__, device);
+		profileDisconnect(conn);
+		return;
+	}
+	initHfp(&link->hfp, HFP_ROLE_AG, 0, &hfp_link_callbacks, link);
+	printf("hfp %d: %s connected\n", conn, device);
+}
+
+static void hfp_data(int conn, const struct iovec *iov, int iovcnt, size_t len,
+					 void *user)
+{
+	tHfpLink *link;
+	int i;
+
+	pthread_mutex_lock(&g_hfp_mutex);
+	link = find_hfp_link(conn);
+	pthread_mutex_unlock(&g_hfp_mutex);
+	if (!link) return;
+	for (i = 0; i < iovcnt && len; i++) {
+		size_t n = iov[i].iov_len < len ? iov[i].iov_len : len;
+
+		if (hfpInput(&link->hfp, iov[i].iov_base, n) < 0) {
+			profileDisconnect(conn);
+			return;
+		}
+		len -= n;
+	}
+}
+
+static void hfp_disconnected(int conn, void *user)
+{
+	tHfpLink *link;
+
+	pthread_mutex_lock(&g_hfp_mutex);
+	link = find_hfp_link(conn);
+	if (link) link->conn = -1;
+	pthread_mutex_unlock(&g_hfp_mutex);
+	printf("hfp %d: disconnected\n", conn);
+}
+
+static const tProfileHandler hfp_handler = {
+	hfp_connected, hfp_data, hfp_disconnected, NULL
+};
+
+static void hfp_registered(int result, void *user)
 {
-	return _addProfile(g_dbus_conn, path, uuid, name, auto_connect);
+	tServiceResultCb cb = g_hfp_cb;
+
+	g_hfp_started = result ? 0 : 2;
+	g_hfp_cb = NULL;
+	if (cb) cb(result, user);
+}
+
+/* register the HFP audio gateway once, headsets then connect to us;
+ * returns 1 without calling cb if it is already registered
+ */
+int startHfpGateway(tServiceResultCb cb, void *user)
+{
+	char uuid[BT_UUID_STR_SIZE];
+	int i;
+
+	if (g_hfp_started == 2) return 1;
+	if (g_hfp_started == 1) return -1;
+	for (i = 0; i < PROFILE_MAX_CONNECTIONS; i++)
+		g_hfp_links[i].conn = -1;
+	bt_uuid16_format(BT_UUID16_HFP_AG, uuid);
+	g_hfp_cb = cb;
+	if (_addProfile(g_dbus_conn, HFP_AG_PATH, uuid, "Hands-Free gateway",
+					1, &hfp_handler, hfp_registered, user) < 0) {
+		g_hfp_cb = NULL;
+		return -1;
+	}
+	g_hfp_started = 1;
+	return 0;
 }
 
 /************************************ media *************************************/
 int mediaPlayerControl(const char *dev, const char *func)
 {
-	return _mediaPlayerControl(g_dbus_conn, dev, func);
+	char path[128] = { 0 };
+
+	/* the player object is looked up from the device, eg: player0 or player1 */
+	snprintf(path, sizeof(path), "%s/%s", ADAPTER_PATH, dev);
+	return mediaPlayerCommand(g_dbus_conn, path, func);
+}
+
+int startAudioSink(const char *device_path, const char *sink_spec)
+{
+	tAudioSink *sink = createAudioSink(sink_spec);
+
+	if (!sink) return -1;
+	return audioStreamStart(g_dbus_conn, device_path, sink);
+}
+
+int stopAudioSink(const char *device_path)
+{
+	return audioStreamStop(device_path);
+}
+
+/************************************ gatt **************************************/
+int subscribeGattNotify(const char *device_path, const char *service_uuid,
+						const char *chr_uuid, tGattNotifyCb cb, void *user)
+{
+	return gattSubscribe(g_dbus_conn, device_path, service_uuid, chr_uuid, cb, user);
+}
+
+int unsubscribeGattNotify(int sub)
+{
+	return gattUnsubscribe(sub);
+}
+
+int openGattWriter(const char *device_path, const char *service_uuid,
+				   const char *chr_uuid, tGattWriteCb drained, void *user)
+{
+	return gattWriterOpen(g_dbus_conn, device_path, service_uuid, chr_uuid, 0, drained, user);
+}
+
+int addGattReadJob(const char *device_path, const char *service_uuid,
+				   const char *chr_uuid, uint32_t period_ms, tGattReadCb cb, void *user)
+{
+	return gattReadAddJob(g_dbus_conn, device_path, service_uuid, chr_uuid, period_ms, cb, user);
+}
+
+/*********************************** advertisement monitors ********************************/
+int addAdvertisementMonitor(const tAdvMonitorSpec *spec, tAdvMonitorCb cb, void *user)
+{
+	return advMonitorAdd(g_dbus_conn, spec, cb, user);
+}
+
+/*********************************** discovery ********************************/
+/* scan on a duty cycle next to whatever else asked for results;
+ * returns an id for releaseDiscovery() or -1
+ */
+int requestDiscovery(const tDiscoveryDemand *demand)
+{
+	return discoveryRequest(g_dbus_conn, demand);
+}
+
+int releaseDiscovery(int demand)
+{
+	return discoveryRelease(demand);
 }
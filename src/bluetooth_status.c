@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bluetooth_status.h"
+#include "bluetooth_common.h"
+
+/* written from the event loop thread only, so there is a single writer */
+static tBtStatusPage * g_status_page = NULL;
+static char g_status_name[64];
+/* statusUpdateBegin() nesting, and whether the write section is open */
+static int g_batch_depth = 0;
+static int g_batch_open = 0;
+
+static uint64_t monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void write_begin(tBtStatusPage *page) {
+    __atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(tBtStatusPage *page) {
+    page->updated_us = monotonic_us();
+    __atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* inside a batch the section opens on the first write and stays open */
+static void update_begin(tBtStatusPage *page) {
+    if (g_batch_open)
+        return;
+    write_begin(page);
+    g_batch_open = g_batch_depth > 0;
+}
+
+static void update_end(tBtStatusPage *page) {
+    if (!g_batch_open)
+        write_end(page);
+}
+
+void statusUpdateBegin() {
+    g_batch_depth++;
+}
+
+void statusUpdateEnd() {
+    if (g_batch_depth == 0 || --g_batch_depth > 0)
+        return;
+    if (g_batch_open && g_status_page)
+        write_end(g_status_page);
+    g_batch_open = 0;
+}
+
+int initStatusPage(const char *name) {
+    int fd;
+    void *mem;
+
+    if (g_status_page) return 0;
+    if (!name) name = BT_STATUS_SHM_NAME;
+
+    fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+        printf("%s: shm_open %s failed\n", __FUNCTION__, name);
+        return -1;
+    }
+    if (ftruncate(fd, sizeof(tBtStatusPage)) < 0) {
+        printf("%s: ftruncate failed\n", __FUNCTION__);
+        close(fd);
+        return -1;
+    }
+    mem = mmap(NULL, sizeof(tBtStatusPage), PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        printf("%s: mmap failed\n", __FUNCTION__);
+        return -1;
+    }
+
+    g_status_page = (tBtStatusPage *)mem;
+    write_begin(g_status_page);
+    memset(&g_status_page->adapter, 0, sizeof(g_status_page->adapter));
+    g_status_page->num_devices = 0;
+    g_status_page->version = BT_STATUS_VERSION;
+    g_status_page->magic = BT_STATUS_MAGIC;
+    write_end(g_status_page);
+    snprintf(g_status_name, sizeof(g_status_name), "%s", name);
+    return 0;
+}
+
+void cleanupStatusPage() {
+    if (!g_status_page) return;
+    if (g_batch_open)
+        write_end(g_status_page);
+    g_batch_open = g_batch_depth = 0;
+    munmap(g_status_page, sizeof(tBtStatusPage));
+    shm_unlink(g_status_name);
+    g_status_page = NULL;
+}
+
+static void copy_string(char *dst, size_t size, const char *src) {
+    snprintf(dst, size, "%s", src ? src : "");
+}
+
+void statusSetAdapterProperty(const char *name, int type, int int_val,
+                              const char *str_val) {
+    tBtStatusPage *page = g_status_page;
+    tBtStatusAdapter *adapter;
+
+    if (!page) return;
+    adapter = &page->adapter;
+
+    update_begin(page);
+    if (!strcmp(name, "Address"))
+        copy_string(adapter->address, sizeof(adapter->address), str_val);
+    else if (!strcmp(name, "Name"))
+        copy_string(adapter->name, sizeof(adapter->name), str_val);
+    else if (!strcmp(name, "Powered"))
+        adapter->powered = int_val;
+    else if (!strcmp(name, "Discovering"))
+        adapter->discovering = int_val;
+    else if (!strcmp(name, "Discoverable"))
+        adapter->discoverable = int_val;
+    else if (!strcmp(name, "Pairable"))
+        adapter->pairable = int_val;
+    update_end(page);
+}
+
+static tBtStatusDevice * find_device(tBtStatusPage *page, const char *path) {
+    uint32_t i;
+    for (i = 0; i < page->num_devices; i++) {
+        if (!strcmp(page->devices[i].path, path))
+            return &page->devices[i];
+    }
+    return NULL;
+}
+
+/* least recently updated device that is neither connected nor paired */
+static tBtStatusDevice * evict_device(tBtStatusPage *page) {
+    tBtStatusDevice *victim = NULL;
+    uint32_t i;
+
+    for (i = 0; i < page->num_devices; i++) {
+        tBtStatusDevice *device = &page->devices[i];
+        if (device->connected || device->paired)
+            continue;
+        if (!victim || device->updated_us < victim->updated_us)
+            victim = device;
+    }
+    return victim;
+}
+
+void statusSetDeviceProperty(const char *path, const char *name, int type,
+                             int int_val, const char *str_val) {
+    tBtStatusPage *page = g_status_page;
+    tBtStatusDevice *device;
+
+    if (!page || !path) return;
+
+    /* only these make it to the page, don't take the lock for others */
+    if (strcmp(name, "Address") && strcmp(name, "Name") &&
+        strcmp(name, "Alias") && strcmp(name, "RSSI") &&
+        strcmp(name, "Connected") && strcmp(name, "Paired") &&
+        strcmp(name, "Trusted") && strcmp(name, "Percentage"))
+        return;
+
+    device = find_device(page, path);
+    update_begin(page);
+    if (!device) {
+        if (page->num_devices < BT_STATUS_MAX_DEVICES) {
+            device = &page->devices[page->num_devices++];
+        } else if (!(device = evict_device(page))) {
+            update_end(page);
+            printf("%s: status page full, dropping %s\n", __FUNCTION__, path);
+            return;
+        }
+        memset(device, 0, sizeof(*device));
+        copy_string(device->path, sizeof(device->path), path);
+        device->rssi = BT_STATUS_RSSI_UNKNOWN;
+        device->battery = BT_STATUS_BATTERY_UNKNOWN;
+    }
+
+    if (!strcmp(name, "Address"))
+        copy_string(device->address, sizeof(device->address), str_val);
+    else if (!strcmp(name, "Name"))
+        copy_string(device->name, sizeof(device->name), str_val);
+    else if (!strcmp(name, "Alias") && device->name[0] == '\0')
+        copy_string(device->name, sizeof(device->name), str_val);
+    else if (!strcmp(name, "RSSI"))
+        device->rssi = (int16_t)int_val;
+    else if (!strcmp(name, "Connected"))
+        device->connected = int_val;
+    else if (!strcmp(name, "Paired"))
+        device->paired = int_val;
+    else if (!strcmp(name, "Trusted"))
+        device->trusted = int_val;
+    else if (!strcmp(name, "Percentage"))
+        device->battery = (int8_t)int_val;
+    device->updated_us = monotonic_us();
+    update_end(page);
+}
+
+void statusRemoveDevice(const char *path) {
+    tBtStatusPage *page = g_status_page;
+    tBtStatusDevice *device;
+
+    if (!page || !path) return;
+    device = find_device(page, path);
+    if (!device) return;
+
+    update_begin(page);
+    page->num_devices--;
+    if (device != &page->devices[page->num_devices])
+        memcpy(device, &page->devices[page->num_devices], sizeof(*device));
+    update_end(page);
+}
@@ -0,0 +1,109 @@
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bluetooth_status.h"
+
+/* a reader racing a busy writer gives up after this many attempts; write
+ * sections are a few stores long, so spinning beats giving up the cpu */
+#define STATUS_READ_RETRIES 1000
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield" ::: "memory");
+#else
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+#endif
+}
+
+const tBtStatusPage * openStatusPage(const char *name) {
+    int fd;
+    void *mem;
+    const tBtStatusPage *page;
+
+    if (!name) name = BT_STATUS_SHM_NAME;
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return NULL;
+    mem = mmap(NULL, sizeof(tBtStatusPage), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+        return NULL;
+
+    page = (const tBtStatusPage *)mem;
+    if (page->magic != BT_STATUS_MAGIC || page->version != BT_STATUS_VERSION) {
+        munmap(mem, sizeof(tBtStatusPage));
+        return NULL;
+    }
+    return page;
+}
+
+void closeStatusPage(const tBtStatusPage *page) {
+    if (page)
+        munmap((void *)page, sizeof(tBtStatusPage));
+}
+
+static uint32_t read_begin(const tBtStatusPage *page) {
+    return __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+}
+
+static int read_retry(const tBtStatusPage *page, uint32_t seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (seq & 1) || __atomic_load_n(&page->seq, __ATOMIC_RELAXED) != seq;
+}
+
+int readStatusPage(const tBtStatusPage *page, tBtStatusPage *snapshot) {
+    uint32_t seq, num;
+    int i;
+
+    if (!page || !snapshot) return -1;
+    for (i = 0; i < STATUS_READ_RETRIES; i++) {
+        seq = read_begin(page);
+        if (seq & 1) {
+            /* a whole InterfacesAdded goes in one section, let it finish */
+            cpu_relax();
+            continue;
+        }
+        num = page->num_devices;
+        if (num > BT_STATUS_MAX_DEVICES)
+            continue;   /* torn, seq will tell */
+        /* header, adapter and the live part of the table only */
+        memcpy(snapshot, page, (size_t)((const char *)&page->devices[num] -
+                                        (const char *)page));
+        if (!read_retry(page, seq))
+            return 0;
+    }
+    return -EAGAIN;
+}
+
+int readStatusDevice(const tBtStatusPage *page, const char *address,
+                     tBtStatusDevice *device) {
+    uint32_t seq, num, j;
+    int i, found;
+
+    if (!page || !address || !device) return -1;
+    for (i = 0; i < STATUS_READ_RETRIES; i++) {
+        seq = read_begin(page);
+        if (seq & 1) {
+            cpu_relax();
+            continue;
+        }
+        num = page->num_devices;
+        found = 0;
+        for (j = 0; j < num && j < BT_STATUS_MAX_DEVICES; j++) {
+            if (!strncmp(page->devices[j].address, address, BT_STATUS_ADDR_SIZE)) {
+                memcpy(device, &page->devices[j], sizeof(*device));
+                found = 1;
+                break;
+            }
+        }
+        if (!read_retry(page, seq))
+            return found ? 0 : -1;
+    }
+    return -EAGAIN;
+}
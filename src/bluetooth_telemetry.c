@@ -0,0 +1,376 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+
+#include "bluetooth_telemetry.h"
+#include "bluetooth_eventloop.h"
+
+#define DEVICE_PATH_SIZE    64
+/* path hash -> slot + 1, 0 is empty; half full at most */
+#define INDEX_SIZE          (TELEMETRY_MAX_DEVICES * 2)
+#define INDEX_MASK          (INDEX_SIZE - 1)
+
+/* handles are generation << 14 | slot, kept positive */
+#define SLOT_BITS           14
+#define HANDLE(slot, gen)   ((int)(((gen) << SLOT_BITS) | (slot)))
+#define HANDLE_SLOT(h)      ((h) & (TELEMETRY_MAX_DEVICES - 1))
+#define HANDLE_GEN(h)       ((uint32_t)(h) >> SLOT_BITS)
+#define GEN_MASK            0x1ffff
+
+#define ALIGNED             __attribute__((aligned(32)))
+
+/* a slot is where a handle points, dense is where its samples are */
+typedef struct {
+    int used;
+    uint32_t hash;
+    uint32_t gen;
+    int dense;
+    char path[DEVICE_PATH_SIZE];
+} tTelemetrySlot;
+
+/* samples come from the event loop, the lock is for the API */
+static pthread_mutex_t g_telemetry_lock = PTHREAD_MUTEX_INITIALIZER;
+static int g_running = 0;
+static tTelemetryParams g_params;
+static uint32_t g_tick_ms;
+static const tTelemetryKernels *g_kernels = &telemetry_kernels_scalar;
+static int g_timer_fd = -1;
+static int g_armed = 0;
+static tTelemetryStats g_stats;
+
+static tTelemetrySlot g_slots[TELEMETRY_MAX_DEVICES];
+static uint16_t g_index[INDEX_SIZE];
+static int g_free_slots[TELEMETRY_MAX_DEVICES];
+static int g_num_free = 0;
+static uint32_t g_generation = 0;
+
+/* dense, g_count of each used */
+static int g_count = 0;
+static float g_raw[TELEMETRY_MAX_DEVICES] ALIGNED;
+static float g_pending[TELEMETRY_MAX_DEVICES] ALIGNED;
+static float g_ema[TELEMETRY_MAX_DEVICES] ALIGNED;
+static float g_x[TELEMETRY_MAX_DEVICES] ALIGNED;
+static float g_p[TELEMETRY_MAX_DEVICES] ALIGNED;
+static uint64_t g_seen_us[TELEMETRY_MAX_DEVICES];
+static int g_slot_of[TELEMETRY_MAX_DEVICES];
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* lock held; periodic while there are devices, off otherwise */
+static void arm_timer(int on) {
+    struct itimerspec its;
+
+    if (g_timer_fd < 0 || on == g_armed)
+        return;
+    g_armed = on;
+    memset(&its, 0, sizeof(its));
+    if (on) {
+        its.it_interval.tv_sec = g_tick_ms / 1000;
+        its.it_interval.tv_nsec = (g_tick_ms % 1000) * 1000000L;
+        its.it_value = its.it_interval;
+    }
+    timerfd_settime(g_timer_fd, 0, &its, NULL);
+}
+
+static uint32_t path_hash(const char *path) {
+    uint32_t h = 2166136261u;
+
+    while (*path)
+        h = (h ^ (uint8_t)*path++) * 16777619u;
+    return h;
+}
+
+/* lock held; index slot of the device, or of the empty slot it would take */
+static int find_index(const char *path, uint32_t hash) {
+    int i = hash & INDEX_MASK;
+    tTelemetrySlot *s;
+
+    while (g_index[i]) {
+        s = &g_slots[g_index[i] - 1];
+        if (s->hash == hash && !strcmp(s->path, path))
+            break;
+        i = (i + 1) & INDEX_MASK;
+    }
+    return i;
+}
+
+/* lock held; backward shift so probes never need tombstones */
+static void drop_index(int i) {
+    int j = i, home;
+
+    for (;;) {
+        j = (j + 1) & INDEX_MASK;
+        if (!g_index[j])
+            break;
+        home = g_slots[g_index[j] - 1].hash & INDEX_MASK;
+        /* j can move to i unless its home lies cyclically in (i, j] */
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+            g_index[i] = g_index[j];
+            i = j;
+        }
+    }
+    g_index[i] = 0;
+}
+
+/* lock held; the slot of a live handle, NULL otherwise */
+static tTelemetrySlot * slot_of(int handle) {
+    tTelemetrySlot *s;
+
+    if (handle < 0)
+        return NULL;
+    s = &g_slots[HANDLE_SLOT(handle)];
+    return s->used && s->gen == HANDLE_GEN(handle) ? s : NULL;
+}
+
+static void on_timer(int fd, short revents, void *data) {
+    uint64_t expirations, start;
+
+    read(fd, &expirations, sizeof(expirations));
+    pthread_mutex_lock(&g_telemetry_lock);
+    if (g_running && g_count) {
+        start = monotonic_ns();
+        g_kernels->smooth(g_raw, g_pending, g_ema, g_x, g_p, g_count, &g_params);
+        g_stats.last_tick_ns = monotonic_ns() - start;
+        g_stats.ticks++;
+    }
+    pthread_mutex_unlock(&g_telemetry_lock);
+}
+
+void telemetryDeviceUpdate(const char *device_path, t_property_value_array *array) {
+    tTelemetrySlot *s;
+    uint32_t hash;
+    float rssi = 0;
+    int i, idx, d, has_rssi = 0;
+    static int full_logged = 0;
+
+    if (!__atomic_load_n(&g_running, __ATOMIC_RELAXED) || !array || !array->head)
+        return;
+    for (i = 0; i < array->num && !has_rssi; i++) {
+        if (array->head[i].type == DBUS_TYPE_INT16 && !strcmp(array->head[i].name, "RSSI")) {
+            rssi = (int16_t)array->head[i].val.int_val;
+            has_rssi = 1;
+        }
+    }
+    if (!has_rssi || strlen(device_path) >= DEVICE_PATH_SIZE)
+        return;
+
+    hash = path_hash(device_path);
+    pthread_mutex_lock(&g_telemetry_lock);
+    if (!g_running)
+        goto done;
+    g_stats.samples++;
+    idx = find_index(device_path, hash);
+    if (g_index[idx]) {
+        d = g_slots[g_index[idx] - 1].dense;
+        g_raw[d] = rssi;
+        g_pending[d] = 1.0f;
+        g_seen_us[d] = monotonic_ns() / 1000;
+        goto done;
+    }
+
+    if (!g_num_free) {
+        if (!full_logged++)
+            printf("%s: device table full\n", __FUNCTION__);
+        goto done;
+    }
+    s = &g_slots[g_free_slots[--g_num_free]];
+    g_generation = (g_generation + 1) & GEN_MASK;
+    if (!g_generation) g_generation = 1;
+    s->used = 1;
+    s->gen = g_generation;
+    s->hash = hash;
+    strcpy(s->path, device_path);
+    g_index[idx] = s - g_slots + 1;
+
+    /* the first sample is the estimate, as uncertain as a measurement */
+    d = s->dense = g_count++;
+    g_slot_of[d] = s - g_slots;
+    g_raw[d] = g_ema[d] = g_x[d] = rssi;
+    g_p[d] = g_params.r;
+    g_pending[d] = 0.0f;
+    g_seen_us[d] = monotonic_ns() / 1000;
+    g_stats.devices = g_count;
+    arm_timer(1);
+done:
+    pthread_mutex_unlock(&g_telemetry_lock);
+}
+
+void telemetryDeviceRemoved(const char *device_path) {
+    tTelemetrySlot *s;
+    int idx, d, last;
+
+    if (!__atomic_load_n(&g_running, __ATOMIC_RELAXED))
+        return;
+    pthread_mutex_lock(&g_telemetry_lock);
+    idx = find_index(device_path, path_hash(device_path));
+    if (!g_running || !g_index[idx])
+        goto done;
+    s = &g_slots[g_index[idx] - 1];
+    drop_index(idx);
+
+    /* the last device moves into the hole, the arrays stay dense */
+    d = s->dense;
+    last = --g_count;
+    if (d != last) {
+        g_raw[d] = g_raw[last];
+        g_pending[d] = g_pending[last];
+        g_ema[d] = g_ema[last];
+        g_x[d] = g_x[last];
+        g_p[d] = g_p[last];
+        g_seen_us[d] = g_seen_us[last];
+        g_slot_of[d] = g_slot_of[last];
+        g_slots[g_slot_of[d]].dense = d;
+    }
+    s->used = 0;
+    g_free_slots[g_num_free++] = s - g_slots;
+    g_stats.devices = g_count;
+    if (!g_count)
+        arm_timer(0);
+done:
+    pthread_mutex_unlock(&g_telemetry_lock);
+}
+
+static void reset_table(void) {
+    int i;
+
+    memset(g_slots, 0, sizeof(g_slots));
+    memset(g_index, 0, sizeof(g_index));
+    for (i = 0; i < TELEMETRY_MAX_DEVICES; i++)
+        g_free_slots[i] = TELEMETRY_MAX_DEVICES - 1 - i;
+    g_num_free = TELEMETRY_MAX_DEVICES;
+    g_count = 0;
+}
+
+int telemetryStart(const tTelemetryConfig *config) {
+    const tTelemetryKernels *k;
+    uint32_t tick_ms;
+    int ret = 0;
+
+    if (!config || config->ema_alpha < 0 || config->ema_alpha > 1 ||
+        config->kalman_q < 0 || config->kalman_r < 0)
+        return -1;
+
+    pthread_mutex_lock(&g_telemetry_lock);
+    g_params.alpha = config->ema_alpha ? config->ema_alpha : TELEMETRY_DEFAULT_ALPHA;
+    g_params.q = config->kalman_q ? config->kalman_q : TELEMETRY_DEFAULT_Q;
+    g_params.r = config->kalman_r ? config->kalman_r : TELEMETRY_DEFAULT_R;
+    tick_ms = config->tick_ms ? config->tick_ms : TELEMETRY_DEFAULT_TICK_MS;
+    if (g_running) {
+        if (tick_ms != g_tick_ms && g_armed) {
+            g_tick_ms = tick_ms;
+            arm_timer(0);
+            arm_timer(1);
+        }
+        g_tick_ms = tick_ms;
+        goto done;
+    }
+    g_tick_ms = tick_ms;
+
+    g_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (g_timer_fd < 0 || addEventLoopFd(g_timer_fd, POLLIN, on_timer, NULL) < 0) {
+        printf("%s: no timer: %s\n", __FUNCTION__, strerror(errno));
+        if (g_timer_fd >= 0) close(g_timer_fd);
+        g_timer_fd = -1;
+        ret = -1;
+        goto done;
+    }
+    g_armed = 0;
+    if (!(k = telemetryKernelsAvx2()) && !(k = telemetryKernelsNeon()))
+        k = &telemetry_kernels_scalar;
+    g_kernels = k;
+    reset_table();
+    memset(&g_stats, 0, sizeof(g_stats));
+    __atomic_store_n(&g_running, 1, __ATOMIC_RELAXED);
+done:
+    pthread_mutex_unlock(&g_telemetry_lock);
+    return ret;
+}
+
+int telemetryHandle(const char *device_path) {
+    int idx, handle = -1;
+    tTelemetrySlot *s;
+
+    if (!device_path)
+        return -1;
+    pthread_mutex_lock(&g_telemetry_lock);
+    idx = find_index(device_path, path_hash(device_path));
+    if (g_running && g_index[idx]) {
+        s = &g_slots[g_index[idx] - 1];
+        handle = HANDLE(s - g_slots, s->gen);
+    }
+    pthread_mutex_unlock(&g_telemetry_lock);
+    return handle;
+}
+
+int telemetryGet(int handle, tTelemetrySample *sample) {
+    tTelemetrySlot *s;
+    int d;
+
+    if (!sample) return -1;
+    pthread_mutex_lock(&g_telemetry_lock);
+    s = slot_of(handle);
+    if (!s) {
+        pthread_mutex_unlock(&g_telemetry_lock);
+        return -1;
+    }
+    d = s->dense;
+    sample->rssi = g_raw[d];
+    sample->ema = g_ema[d];
+    sample->kalman = g_x[d];
+    sample->variance = g_p[d];
+    sample->age_ms = (uint32_t)((monotonic_ns() / 1000 - g_seen_us[d]) / 1000);
+    pthread_mutex_unlock(&g_telemetry_lock);
+    return 0;
+}
+
+int telemetryNearest(tTelemetryNearest *nearest, int k) {
+    int out[TELEMETRY_MAX_NEAREST], i, n;
+    tTelemetrySlot *s;
+
+    if (!nearest || k <= 0)
+        return 0;
+    if (k > TELEMETRY_MAX_NEAREST)
+        k = TELEMETRY_MAX_NEAREST;
+    pthread_mutex_lock(&g_telemetry_lock);
+    n = g_kernels->select(g_x, g_count, k, out);
+    for (i = 0; i < n; i++) {
+        s = &g_slots[g_slot_of[out[i]]];
+        nearest[i].handle = HANDLE(s - g_slots, s->gen);
+        nearest[i].rssi = g_x[out[i]];
+        snprintf(nearest[i].path, sizeof(nearest[i].path), "%s", s->path);
+    }
+    pthread_mutex_unlock(&g_telemetry_lock);
+    return n;
+}
+
+void telemetryStats(tTelemetryStats *stats) {
+    if (!stats) return;
+    pthread_mutex_lock(&g_telemetry_lock);
+    *stats = g_stats;
+    stats->kernels = g_kernels->name;
+    pthread_mutex_unlock(&g_telemetry_lock);
+}
+
+void telemetryCleanup() {
+    pthread_mutex_lock(&g_telemetry_lock);
+    if (g_timer_fd >= 0) {
+        closeEventLoopFd(g_timer_fd);
+        g_timer_fd = -1;
+    }
+    g_armed = 0;
+    __atomic_store_n(&g_running, 0, __ATOMIC_RELAXED);
+    reset_table();
+    memset(&g_stats, 0, sizeof(g_stats));
+    pthread_mutex_unlock(&g_telemetry_lock);
+}
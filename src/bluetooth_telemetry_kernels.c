@@ -0,0 +1,244 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "bluetooth_telemetry.h"
+
+/*
+* Smoothing and nearest-K kernels over the telemetry arrays.
+*
+* Smoothing is branch free: pending[i] is 0 or 1 and scales the update, so
+* every lane does the same arithmetic. Selection keeps a min-heap of the k
+* best; the SIMD versions compare a whole register against the heap's
+* minimum and only touch the heap for the lanes that beat it, which after
+* the first few blocks is almost none.
+*
+* The x86 kernels are compiled with target attributes and only called after
+* a cpuid check, so the rest of the tree keeps the baseline -march.
+*/
+
+/*following functions are the scalar reference*/
+static void smooth_scalar(const float *raw, float *pending, float *ema, float *x, float *p,
+                          int n, const tTelemetryParams *params) {
+    float m, pp, k;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        m = pending[i];
+        ema[i] += params->alpha * m * (raw[i] - ema[i]);
+        pp = p[i] + params->q;
+        k = m * pp / (pp + params->r);
+        x[i] += k * (raw[i] - x[i]);
+        p[i] = pp - k * pp;
+        pending[i] = 0.0f;
+    }
+}
+
+/* min-heap on hv, indices alongside */
+static void heap_push(float *hv, int *hi, int *size, int k, float v, int idx) {
+    int i, c;
+
+    if (*size < k) {
+        i = (*size)++;
+        while (i > 0 && hv[(i - 1) / 2] > v) {
+            hv[i] = hv[(i - 1) / 2];
+            hi[i] = hi[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        hv[i] = v;
+        hi[i] = idx;
+        return;
+    }
+    if (v <= hv[0])
+        return;
+    i = 0;
+    for (;;) {
+        c = 2 * i + 1;
+        if (c >= k)
+            break;
+        if (c + 1 < k && hv[c + 1] < hv[c])
+            c++;
+        if (hv[c] >= v)
+            break;
+        hv[i] = hv[c];
+        hi[i] = hi[c];
+        i = c;
+    }
+    hv[i] = v;
+    hi[i] = idx;
+}
+
+/* heap -> out, largest first */
+static int heap_drain(float *hv, int *hi, int size, int *out) {
+    float v;
+    int i, j, idx;
+
+    for (i = 1; i < size; i++) {
+        v = hv[i];
+        idx = hi[i];
+        for (j = i; j > 0 && hv[j - 1] < v; j--) {
+            hv[j] = hv[j - 1];
+            hi[j] = hi[j - 1];
+        }
+        hv[j] = v;
+        hi[j] = idx;
+    }
+    for (i = 0; i < size; i++)
+        out[i] = hi[i];
+    return size;
+}
+
+static int select_scalar(const float *value, int n, int k, int *out) {
+    float hv[TELEMETRY_MAX_NEAREST];
+    int hi[TELEMETRY_MAX_NEAREST], size = 0, i;
+
+    if (k > TELEMETRY_MAX_NEAREST) k = TELEMETRY_MAX_NEAREST;
+    if (k <= 0) return 0;
+    for (i = 0; i < n; i++)
+        heap_push(hv, hi, &size, k, value[i], i);
+    return heap_drain(hv, hi, size, out);
+}
+
+const tTelemetryKernels telemetry_kernels_scalar = {
+    "scalar", smooth_scalar, select_scalar
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#define AVX2  __attribute__((target("avx2")))
+
+static AVX2 void smooth_avx2(const float *raw, float *pending, float *ema, float *x, float *p,
+                             int n, const tTelemetryParams *params) {
+    const __m256 alpha = _mm256_set1_ps(params->alpha);
+    const __m256 q = _mm256_set1_ps(params->q);
+    const __m256 r = _mm256_set1_ps(params->r);
+    __m256 m, v, e, xv, pp, k;
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        m = _mm256_loadu_ps(&pending[i]);
+        v = _mm256_loadu_ps(&raw[i]);
+        e = _mm256_loadu_ps(&ema[i]);
+        xv = _mm256_loadu_ps(&x[i]);
+        pp = _mm256_add_ps(_mm256_loadu_ps(&p[i]), q);
+        /* same operation order as the scalar kernel */
+        e = _mm256_add_ps(e, _mm256_mul_ps(_mm256_mul_ps(alpha, m), _mm256_sub_ps(v, e)));
+        k = _mm256_div_ps(_mm256_mul_ps(m, pp), _mm256_add_ps(pp, r));
+        xv = _mm256_add_ps(xv, _mm256_mul_ps(k, _mm256_sub_ps(v, xv)));
+        pp = _mm256_sub_ps(pp, _mm256_mul_ps(k, pp));
+        _mm256_storeu_ps(&ema[i], e);
+        _mm256_storeu_ps(&x[i], xv);
+        _mm256_storeu_ps(&p[i], pp);
+        _mm256_storeu_ps(&pending[i], _mm256_setzero_ps());
+    }
+    _mm256_zeroupper();
+    smooth_scalar(raw + i, pending + i, ema + i, x + i, p + i, n - i, params);
+}
+
+static AVX2 int select_avx2(const float *value, int n, int k, int *out) {
+    float hv[TELEMETRY_MAX_NEAREST];
+    int hi[TELEMETRY_MAX_NEAREST], size = 0, i = 0, j;
+    unsigned int mask;
+    __m256 thr;
+
+    if (k > TELEMETRY_MAX_NEAREST) k = TELEMETRY_MAX_NEAREST;
+    if (k <= 0) return 0;
+    for (; i < n && size < k; i++)
+        heap_push(hv, hi, &size, k, value[i], i);
+    if (size < k)
+        return heap_drain(hv, hi, size, out);
+    thr = _mm256_set1_ps(hv[0]);
+    for (; i + 8 <= n; i += 8) {
+        mask = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(&value[i]), thr, _CMP_GT_OQ));
+        if (!mask)
+            continue;
+        /* heap_push is SSE code, don't pay the AVX transition per instruction */
+        _mm256_zeroupper();
+        while (mask) {
+            j = __builtin_ctz(mask);
+            heap_push(hv, hi, &size, k, value[i + j], i + j);
+            mask &= mask - 1;
+        }
+        thr = _mm256_set1_ps(hv[0]);
+    }
+    _mm256_zeroupper();
+    for (; i < n; i++)
+        heap_push(hv, hi, &size, k, value[i], i);
+    return heap_drain(hv, hi, size, out);
+}
+
+static const tTelemetryKernels telemetry_kernels_avx2 = {
+    "avx2", smooth_avx2, select_avx2
+};
+
+const tTelemetryKernels * telemetryKernelsAvx2() {
+    return __builtin_cpu_supports("avx2") ? &telemetry_kernels_avx2 : NULL;
+}
+#else
+const tTelemetryKernels * telemetryKernelsAvx2() { return NULL; }
+#endif
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+
+/* vdivq_f32 and vmaxvq_u32 are armv8 only */
+static void smooth_neon(const float *raw, float *pending, float *ema, float *x, float *p,
+                        int n, const tTelemetryParams *params) {
+    const float32x4_t alpha = vdupq_n_f32(params->alpha);
+    const float32x4_t q = vdupq_n_f32(params->q);
+    const float32x4_t r = vdupq_n_f32(params->r);
+    float32x4_t m, v, e, xv, pp, k;
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        m = vld1q_f32(&pending[i]);
+        v = vld1q_f32(&raw[i]);
+        e = vld1q_f32(&ema[i]);
+        xv = vld1q_f32(&x[i]);
+        pp = vaddq_f32(vld1q_f32(&p[i]), q);
+        e = vaddq_f32(e, vmulq_f32(vmulq_f32(alpha, m), vsubq_f32(v, e)));
+        k = vdivq_f32(vmulq_f32(m, pp), vaddq_f32(pp, r));
+        xv = vaddq_f32(xv, vmulq_f32(k, vsubq_f32(v, xv)));
+        pp = vsubq_f32(pp, vmulq_f32(k, pp));
+        vst1q_f32(&ema[i], e);
+        vst1q_f32(&x[i], xv);
+        vst1q_f32(&p[i], pp);
+        vst1q_f32(&pending[i], vdupq_n_f32(0.0f));
+    }
+    smooth_scalar(raw + i, pending + i, ema + i, x + i, p + i, n - i, params);
+}
+
+static int select_neon(const float *value, int n, int k, int *out) {
+    float hv[TELEMETRY_MAX_NEAREST];
+    int hi[TELEMETRY_MAX_NEAREST], size = 0, i = 0, j;
+    float32x4_t thr;
+
+    if (k > TELEMETRY_MAX_NEAREST) k = TELEMETRY_MAX_NEAREST;
+    if (k <= 0) return 0;
+    for (; i < n && size < k; i++)
+        heap_push(hv, hi, &size, k, value[i], i);
+    if (size < k)
+        return heap_drain(hv, hi, size, out);
+    thr = vdupq_n_f32(hv[0]);
+    for (; i + 4 <= n; i += 4) {
+        if (!vmaxvq_u32(vcgtq_f32(vld1q_f32(&value[i]), thr)))
+            continue;
+        for (j = 0; j < 4; j++)
+            heap_push(hv, hi, &size, k, value[i + j], i + j);
+        thr = vdupq_n_f32(hv[0]);
+    }
+    for (; i < n; i++)
+        heap_push(hv, hi, &size, k, value[i], i);
+    return heap_drain(hv, hi, size, out);
+}
+
+static const tTelemetryKernels telemetry_kernels_neon = {
+    "neon", smooth_neon, select_neon
+};
+
+const tTelemetryKernels * telemetryKernelsNeon() {
+    return &telemetry_kernels_neon;
+}
+#else
+const tTelemetryKernels * telemetryKernelsNeon() { return NULL; }
+#endif
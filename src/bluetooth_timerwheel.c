@@ -0,0 +1,146 @@
+#include <string.h>
+
+#include "bluetooth_timerwheel.h"
+
+#define SLOT_MASK       (TIMER_WHEEL_SLOTS - 1)
+#define LEVEL_SHIFT(l)  (TIMER_WHEEL_BITS * (l))
+
+void timerWheelInit(tTimerWheel *w, uint64_t now) {
+    int l, s;
+
+    memset(w, 0, sizeof(*w));
+    w->now = now;
+    for (l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+        for (s = 0; s < TIMER_WHEEL_SLOTS; s++)
+            w->slots[l][s].next = w->slots[l][s].prev = &w->slots[l][s];
+    }
+}
+
+/* into the finest ring the delay fits */
+static void place(tTimerWheel *w, tTimerNode *node) {
+    uint64_t delta;
+    tTimerNode *head;
+    int level = 0, slot;
+
+    if (node->expires < w->now)
+        node->expires = w->now;
+    delta = node->expires - w->now;
+    if (delta > TIMER_WHEEL_MAX_DELAY) {
+        delta = TIMER_WHEEL_MAX_DELAY;
+        node->expires = w->now + delta;
+    }
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >> LEVEL_SHIFT(level + 1))
+        level++;
+    slot = (node->expires >> LEVEL_SHIFT(level)) & SLOT_MASK;
+    head = &w->slots[level][slot];
+    node->next = head->next;
+    node->prev = head;
+    head->next->prev = node;
+    head->next = node;
+    w->occupied[level] |= 1ULL << slot;
+}
+
+/* the bit of an emptied slot is cleared once time gets there */
+static void unlink_node(tTimerNode *node) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->next = node->prev = NULL;
+}
+
+void timerWheelAdd(tTimerWheel *w, tTimerNode *node, uint64_t expires) {
+    if (timerWheelPending(node))
+        unlink_node(node);
+    else
+        w->count++;
+    node->expires = expires;
+    place(w, node);
+}
+
+void timerWheelRemove(tTimerWheel *w, tTimerNode *node) {
+    if (!timerWheelPending(node))
+        return;
+    unlink_node(node);
+    w->count--;
+}
+
+/* take the list of a slot, returns its first node or NULL */
+static tTimerNode * detach(tTimerWheel *w, int level, int slot) {
+    tTimerNode *head = &w->slots[level][slot], *first = head->next;
+
+    w->occupied[level] &= ~(1ULL << slot);
+    if (first == head)
+        return NULL;
+    head->prev->next = NULL;
+    head->next = head->prev = head;
+    return first;
+}
+
+static void cascade(tTimerWheel *w) {
+    tTimerNode *node, *next;
+    int l;
+
+    for (l = TIMER_WHEEL_LEVELS - 1; l > 0; l--) {
+        if (w->now & ((1ULL << LEVEL_SHIFT(l)) - 1))
+            continue;
+        node = detach(w, l, (w->now >> LEVEL_SHIFT(l)) & SLOT_MASK);
+        for (; node; node = next) {
+            next = node->next;
+            place(w, node);
+        }
+    }
+}
+
+uint64_t timerWheelNextTick(const tTimerWheel *w) {
+    uint64_t best = UINT64_MAX, span, base, tick, bits;
+    int l, cur;
+
+    if (!w->count)
+        return UINT64_MAX;
+    for (l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+        if (!w->occupied[l])
+            continue;
+        /* slots of a level are visited at multiples of its span */
+        span = 1ULL << LEVEL_SHIFT(l);
+        base = (w->now + span - 1) & ~(span - 1);
+        cur = (base >> LEVEL_SHIFT(l)) & SLOT_MASK;
+        /* rotate so the slot visited at base is bit 0 */
+        bits = cur ? (w->occupied[l] >> cur) | (w->occupied[l] << (TIMER_WHEEL_SLOTS - cur)) :
+                     w->occupied[l];
+        tick = base + (uint64_t)__builtin_ctzll(bits) * span;
+        if (tick < best)
+            best = tick;
+    }
+    return best;
+}
+
+int timerWheelAdvance(tTimerWheel *w, uint64_t now, tTimerExpired expired, void *user) {
+    tTimerNode *node, *next;
+    uint64_t tick;
+    int fired = 0, slot;
+
+    while (w->now <= now && w->count) {
+        if (!(w->now & SLOT_MASK))
+            cascade(w);
+        slot = w->now & SLOT_MASK;
+        if (w->occupied[0] & (1ULL << slot)) {
+            node = detach(w, 0, slot);
+            /* a timer added from the callback lands after this tick */
+            w->now++;
+            for (; node; node = next) {
+                next = node->next;
+                node->next = node->prev = NULL;
+                w->count--;
+                fired++;
+                expired(node, user);
+            }
+            continue;
+        }
+        tick = timerWheelNextTick(w);
+        if (tick > now)
+            break;
+        w->now = tick > w->now ? tick : w->now + 1;
+    }
+    if (w->now <= now)
+        w->now = now + 1;
+    return fired;
+}
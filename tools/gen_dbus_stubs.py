@@ -0,0 +1,350 @@
+#!/usr/bin/env python3
+"""Generate typed D-Bus call stubs from introspection XML.
+
+    gen_dbus_stubs.py -o bluetooth_dbus_stubs interfaces/org.bluez.xml
+
+writes bluetooth_dbus_stubs.h and bluetooth_dbus_stubs.c. For every method
+of every interface the output has
+
+    DBusMessage *<prefix>_<ifc>_<method>_new(const char *path, in args...)
+    int <prefix>_<ifc>_<method>_parse(DBusMessage *reply, out args..., DBusError *err)
+    int <prefix>_<ifc>_<method>(DBusConnection *conn, const char *path,
+                                in args..., out args..., DBusError *err)
+
+Arguments are appended one by one with their type known at generation time
+and replies are checked with a single comparison against the precomputed
+signature, so nothing walks a va_list or switches on types at runtime. The
+blocking variant is only emitted when every out argument is a plain value;
+strings and arrays point into the reply and need the _new/_parse pair.
+"""
+
+import argparse
+import os
+import re
+import sys
+import xml.etree.ElementTree as ET
+
+BASIC = {
+    "y": ("uint8_t", "DBUS_TYPE_BYTE"),
+    "b": ("dbus_bool_t", "DBUS_TYPE_BOOLEAN"),
+    "n": ("int16_t", "DBUS_TYPE_INT16"),
+    "q": ("uint16_t", "DBUS_TYPE_UINT16"),
+    "i": ("int32_t", "DBUS_TYPE_INT32"),
+    "u": ("uint32_t", "DBUS_TYPE_UINT32"),
+    "x": ("int64_t", "DBUS_TYPE_INT64"),
+    "t": ("uint64_t", "DBUS_TYPE_UINT64"),
+    "d": ("double", "DBUS_TYPE_DOUBLE"),
+    "h": ("int", "DBUS_TYPE_UNIX_FD"),
+    "s": ("const char *", "DBUS_TYPE_STRING"),
+    "o": ("const char *", "DBUS_TYPE_OBJECT_PATH"),
+    "g": ("const char *", "DBUS_TYPE_SIGNATURE"),
+}
+STRINGS = "sog"
+
+
+def snake(name):
+    name = re.sub(r"([a-z0-9])([A-Z])", r"\1_\2", name)
+    name = re.sub(r"([A-Z]+)([A-Z][a-z])", r"\1_\2", name)
+    return name.lower()
+
+
+class Arg:
+    def __init__(self, name, sig, index):
+        self.name = snake(name) if name else "arg%d" % index
+        self.sig = sig
+        if sig not in BASIC and sig not in ("ay", "as", "ao", "a{sv}") and \
+                not sig.startswith(("a", "(", "v")):
+            raise ValueError("unsupported type '%s'" % sig)
+
+    # in arguments
+    def in_params(self):
+        if self.sig in BASIC:
+            ctype = BASIC[self.sig][0]
+            return ["%s%s%s" % (ctype, "" if ctype.endswith("*") else " ", self.name)]
+        if self.sig == "ay":
+            return ["const uint8_t *%s" % self.name, "int %s_len" % self.name]
+        if self.sig in ("as", "ao"):
+            return ["const char *const *%s" % self.name, "int %s_count" % self.name]
+        if self.sig == "a{sv}":
+            return ["const t_dict_entry *%s" % self.name, "int %s_count" % self.name]
+        raise ValueError("unsupported in type '%s'" % self.sig)
+
+    def append(self):
+        n = self.name
+        if self.sig in BASIC:
+            return ["if (!dbus_message_iter_append_basic(&iter, %s, &%s)) goto fail;"
+                    % (BASIC[self.sig][1], n)]
+        if self.sig == "ay":
+            return ["if (!dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, \"y\", &sub) ||",
+                    "    !dbus_message_iter_append_fixed_array(&sub, DBUS_TYPE_BYTE, &%s, %s_len) ||" % (n, n),
+                    "    !dbus_message_iter_close_container(&iter, &sub)) goto fail;"]
+        if self.sig in ("as", "ao"):
+            return ["if (!dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, \"%s\", &sub)) goto fail;" % self.sig[1],
+                    "for (i = 0; i < %s_count; i++)" % n,
+                    "    if (!dbus_message_iter_append_basic(&sub, %s, &%s[i])) goto fail;"
+                    % (BASIC[self.sig[1]][1], n),
+                    "if (!dbus_message_iter_close_container(&iter, &sub)) goto fail;"]
+        return ["if (!append_dict_entries(&iter, %s, %s_count)) goto fail;" % (n, n)]
+
+    # out arguments
+    def plain(self):
+        return self.sig in BASIC and self.sig not in STRINGS
+
+    def out_params(self):
+        if self.sig in BASIC:
+            return ["%s*%s" % (BASIC[self.sig][0] + ("" if self.sig in STRINGS else " "), self.name)]
+        if self.sig == "ay":
+            return ["const uint8_t **%s" % self.name, "int *%s_len" % self.name]
+        return ["DBusMessageIter *%s" % self.name]
+
+    def unpack(self, last):
+        n = self.name
+        if self.sig in BASIC:
+            lines = ["if (%s) dbus_message_iter_get_basic(&iter, %s);" % (n, n)]
+        elif self.sig == "ay":
+            lines = ["if (%s) {" % n,
+                     "    dbus_message_iter_recurse(&iter, &sub);",
+                     "    dbus_message_iter_get_fixed_array(&sub, (void *)%s, %s_len);" % (n, n),
+                     "}"]
+        else:
+            lines = ["if (%s) *%s = iter;" % (n, n)]
+        if not last:
+            lines.append("dbus_message_iter_next(&iter);")
+        return lines
+
+
+class Method:
+    def __init__(self, ifc, node):
+        self.ifc = ifc
+        self.name = node.get("name")
+        self.ins, self.outs = [], []
+        for i, a in enumerate(node.findall("arg")):
+            arg = Arg(a.get("name"), a.get("type"), i)
+            (self.outs if a.get("direction") == "out" else self.ins).append(arg)
+        self.func = "%s_%s" % (ifc.func, snake(self.name))
+        self.in_sig = "".join(a.sig for a in self.ins)
+        self.out_sig = "".join(a.sig for a in self.outs)
+
+    def new_proto(self):
+        params = ["const char *path"] + [p for a in self.ins for p in a.in_params()]
+        return "DBusMessage *%s_new(%s)" % (self.func, ", ".join(params))
+
+    def parse_proto(self):
+        params = ["DBusMessage *reply"] + [p for a in self.outs for p in a.out_params()]
+        return "int %s_parse(%s, DBusError *err)" % (self.func, ", ".join(params))
+
+    def has_call(self):
+        return all(a.plain() for a in self.outs)
+
+    def call_proto(self):
+        params = ["DBusConnection *conn", "const char *path"]
+        params += [p for a in self.ins for p in a.in_params()]
+        params += [p for a in self.outs for p in a.out_params()]
+        return "int %s(%s, DBusError *err)" % (self.func, ", ".join(params))
+
+
+class Interface:
+    def __init__(self, prefix, node):
+        self.name = node.get("name")
+        self.service, _, short = self.name.rpartition(".")
+        self.func = "%s_%s" % (prefix, snake(short))
+        self.macro = self.func.upper() + "_IFC"
+        self.methods = [Method(self, m) for m in node.findall("method")]
+
+
+def wrap(proto, indent=0):
+    """Break a prototype after commas to stay under 90 columns."""
+    if len(proto) + indent <= 90:
+        return proto
+    head, _, rest = proto.partition("(")
+    pad = " " * (len(head) + 1)
+    out, line = [], head + "("
+    for part in rest.split(", "):
+        if len(line) + len(part) + 2 > 90 - indent and not line.endswith("("):
+            out.append(line.rstrip())
+            line = pad
+        line += part + ", "
+    out.append(line[:-2])
+    return "\n".join(out)
+
+
+def header(ifcs, guard, sources):
+    h = ["/* generated by tools/gen_dbus_stubs.py from %s, do not edit */" % ", ".join(sources),
+         "#ifndef %s" % guard,
+         "#define %s" % guard,
+         "",
+         "#include <stdint.h>",
+         "#include <dbus/dbus.h>",
+         "",
+         "#include \"bluetooth_common.h\"",
+         "",
+         "/*",
+         "* _new() builds the method call for path, _parse() checks a reply against the",
+         "* method's signature and unpacks it (strings and arrays point into the reply,",
+         "* NULL outputs are skipped) and the plain name is a blocking call for methods",
+         "* that only return values. Errors go to err, or are printed when it is NULL.",
+         "*/",
+         ""]
+    for ifc in ifcs:
+        h.append("/*following functions are for %s*/" % ifc.name)
+        h.append("#define %s \"%s\"" % (ifc.macro, ifc.name))
+        for m in ifc.methods:
+            h.append("#define %s_SIG \"%s\"" % (m.func.upper(), m.in_sig))
+            h.append("#define %s_REPLY_SIG \"%s\"" % (m.func.upper(), m.out_sig))
+            h.append(wrap(m.new_proto()) + ";")
+            h.append(wrap(m.parse_proto()) + ";")
+            if m.has_call():
+                h.append(wrap(m.call_proto()) + ";")
+        h.append("")
+    h.append("#endif")
+    return "\n".join(h) + "\n"
+
+
+def source(ifcs, header_name, sources):
+    c = ["/* generated by tools/gen_dbus_stubs.py from %s, do not edit */" % ", ".join(sources),
+         "#include <stdio.h>",
+         "#include <string.h>",
+         "",
+         "#include \"%s\"" % header_name,
+         "",
+         "static int check_reply(DBusMessage *reply, const char *sig, DBusError *err,",
+         "                       const char *func) {",
+         "    DBusError local;",
+         "",
+         "    if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR) {",
+         "        if (err) {",
+         "            dbus_set_error_from_message(err, reply);",
+         "            return -1;",
+         "        }",
+         "        dbus_error_init(&local);",
+         "        dbus_set_error_from_message(&local, reply);",
+         "        printf(\"%s: D-Bus error: %s (%s)\\n\", func, local.name, local.message);",
+         "        dbus_error_free(&local);",
+         "        return -1;",
+         "    }",
+         "    if (strcmp(dbus_message_get_signature(reply), sig)) {",
+         "        if (err)",
+         "            dbus_set_error(err, DBUS_ERROR_INVALID_SIGNATURE, \"reply is (%s), expected (%s)\",",
+         "                           dbus_message_get_signature(reply), sig);",
+         "        else",
+         "            printf(\"%s: reply is (%s), expected (%s)\\n\", func,",
+         "                   dbus_message_get_signature(reply), sig);",
+         "        return -1;",
+         "    }",
+         "    return 0;",
+         "}",
+         "",
+         "/* consumes msg */",
+         "static DBusMessage *call(DBusConnection *conn, DBusMessage *msg, DBusError *err,",
+         "                         const char *func) {",
+         "    DBusMessage *reply;",
+         "    DBusError local;",
+         "",
+         "    if (!msg) return NULL;",
+         "    dbus_error_init(&local);",
+         "    reply = dbus_connection_send_with_reply_and_block(conn, msg, -1, err ? err : &local);",
+         "    dbus_message_unref(msg);",
+         "    if (!reply && !err) {",
+         "        printf(\"%s: D-Bus error: %s (%s)\\n\", func, local.name, local.message);",
+         "        dbus_error_free(&local);",
+         "    }",
+         "    return reply;",
+         "}",
+         ""]
+    for ifc in ifcs:
+        c.append("/" + "*" * 20 + " %s " % ifc.name + "*" * 20 + "/")
+        for m in ifc.methods:
+            ind = "    "
+            # marshal
+            c.append(wrap(m.new_proto()) + " {")
+            call_new = "dbus_message_new_method_call(\"%s\", path, %s, \"%s\");" \
+                % (ifc.service, ifc.macro, m.name)
+            if not m.ins:
+                c.append(ind + "return " + call_new)
+            else:
+                c.append(ind + "DBusMessage *msg;")
+                c.append(ind + "DBusMessageIter iter;")
+                if any(a.sig.startswith("a") and a.sig != "a{sv}" for a in m.ins):
+                    c.append(ind + "DBusMessageIter sub;")
+                if any(a.sig in ("as", "ao") for a in m.ins):
+                    c.append(ind + "int i;")
+                c.append("")
+                c.append(ind + "msg = " + call_new)
+                c.append(ind + "if (!msg) return NULL;")
+                c.append(ind + "dbus_message_iter_init_append(msg, &iter);")
+                for a in m.ins:
+                    c += [ind + l for l in a.append()]
+                c.append(ind + "return msg;")
+                c.append("fail:")
+                c.append(ind + "dbus_message_unref(msg);")
+                c.append(ind + "return NULL;")
+            c.append("}")
+            c.append("")
+            # unmarshal
+            c.append(wrap(m.parse_proto()) + " {")
+            if m.outs:
+                c.append(ind + "DBusMessageIter iter;")
+            if any(a.sig == "ay" for a in m.outs):
+                c.append(ind + "DBusMessageIter sub;")
+            if m.outs:
+                c.append("")
+            c.append(ind + "if (check_reply(reply, %s_REPLY_SIG, err, __FUNCTION__) < 0) return -1;"
+                     % m.func.upper())
+            if m.outs:
+                c.append(ind + "dbus_message_iter_init(reply, &iter);")
+                for i, a in enumerate(m.outs):
+                    c += [ind + l for l in a.unpack(i == len(m.outs) - 1)]
+            c.append(ind + "return 0;")
+            c.append("}")
+            c.append("")
+            if not m.has_call():
+                continue
+            # blocking call
+            args = ["path"]
+            for a in m.ins:
+                args.append(a.name)
+                if not a.sig in BASIC:
+                    args.append(a.name + ("_len" if a.sig == "ay" else "_count"))
+            outs = ["reply"] + [a.name for a in m.outs] + ["err"]
+            c.append(wrap(m.call_proto()) + " {")
+            c.append(ind + "DBusMessage *reply;")
+            c.append(ind + "int ret;")
+            c.append("")
+            c.append(ind + "if (!conn) return -1;")
+            c.append(ind + "reply = call(conn, %s_new(%s), err, __FUNCTION__);"
+                     % (m.func, ", ".join(args)))
+            c.append(ind + "if (!reply) return -1;")
+            c.append(ind + "ret = %s_parse(%s);" % (m.func, ", ".join(outs)))
+            c.append(ind + "dbus_message_unref(reply);")
+            c.append(ind + "return ret;")
+            c.append("}")
+            c.append("")
+    return "\n".join(c)
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("-o", "--output", required=True, help="output path without .c/.h")
+    ap.add_argument("-p", "--prefix", default="bluez", help="function name prefix")
+    ap.add_argument("xml", nargs="+")
+    opts = ap.parse_args()
+
+    ifcs = []
+    for path in opts.xml:
+        try:
+            for node in ET.parse(path).getroot().iter("interface"):
+                ifcs.append(Interface(opts.prefix, node))
+        except (ET.ParseError, ValueError) as e:
+            sys.exit("%s: %s" % (path, e))
+
+    base = os.path.basename(opts.output)
+    sources = [os.path.basename(p) for p in opts.xml]
+    guard = re.sub(r"\W", "_", base).upper() + "_H"
+    with open(opts.output + ".h", "w") as f:
+        f.write(header(ifcs, guard, sources))
+    with open(opts.output + ".c", "w") as f:
+        f.write(source(ifcs, base + ".h", sources))
+
+
+if __name__ == "__main__":
+    main()